@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "db.h"
+
+// Micro-benchmark for in-node key search: per-lookup cost of btree_search
+// with each search kernel, on a tree whose nodes all fit in the buffer pool.
+// Also compares the read paths and row-at-a-time inserts with bulk_load,
+// measures how lookups through the public API scale with threads, and what
+// parsing costs a statement compared with a prepared one, and how the batch
+// query executor compares with filtering and summing row by row.
+// Build: gcc -O2 -o bench_db db.c bench_db.c
+
+#define NUM_LOOKUPS 2000000
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Time NUM_LOOKUPS random point lookups against a tree of num_keys keys
+static void run(int num_keys)
+{
+    remove("bench.db");
+    DbOptions options = {16384}; // 64 MB: the whole index stays in the buffer pool
+    Database db = init_db_with_options("bench.db", &options);
+    for (int id = 1; id <= num_keys; id++)
+    {
+        RecordId rid = {(unsigned int)id, 0};
+        btree_insert(&db, id, rid);
+    }
+    printf("\n%d keys, height %d\n", num_keys, btree_height(&db));
+
+    int *ids = malloc(NUM_LOOKUPS * sizeof(int));
+    srand(42);
+    for (int i = 0; i < NUM_LOOKUPS; i++)
+    {
+        ids[i] = rand() % num_keys + 1;
+    }
+
+    const char *names[] = {"auto", "linear (before)", "binary", "sse2", "avx2"};
+    SearchKernel kernels[] = {SEARCH_LINEAR, SEARCH_BINARY, SEARCH_SSE2, SEARCH_AVX2};
+    for (int k = 0; k < 4; k++)
+    {
+        SearchKernel installed = set_search_kernel(kernels[k]);
+        if (installed != kernels[k])
+        {
+            printf("%-16s not supported on this CPU\n", names[kernels[k]]);
+            continue;
+        }
+        RecordId rid;
+        long long checksum = 0;
+        double start = now_ns();
+        for (int i = 0; i < NUM_LOOKUPS; i++)
+        {
+            btree_search(&db, ids[i], &rid);
+            checksum += rid.page;
+        }
+        double elapsed = now_ns() - start;
+        printf("%-16s %7.1f ns/lookup (checksum %lld)\n", names[kernels[k]], elapsed / NUM_LOOKUPS, checksum);
+    }
+    printf("auto selects: %s\n", names[set_search_kernel(SEARCH_AUTO)]);
+
+    free(ids);
+    close_db(&db);
+    remove("bench.db");
+}
+
+// Compare lookups through a small buffer pool (pread + copy on every miss)
+// with lookups served in place from the mmap read path
+static void run_read_paths(int num_keys)
+{
+    remove("bench.db");
+    DbOptions build = {16384};
+    Database db = init_db_with_options("bench.db", &build);
+    for (int id = 1; id <= num_keys; id++)
+    {
+        RecordId rid = {(unsigned int)id, 0};
+        btree_insert(&db, id, rid);
+    }
+    close_db(&db); // Checkpoint everything into bench.db
+    printf("\n%d keys, 64-frame pool\n", num_keys);
+
+    int *ids = malloc(NUM_LOOKUPS * sizeof(int));
+    srand(7);
+    for (int i = 0; i < NUM_LOOKUPS; i++)
+    {
+        ids[i] = rand() % num_keys + 1;
+    }
+    const char *names[] = {"pool (pread)", "mmap"};
+    for (int use_mmap = 0; use_mmap <= 1; use_mmap++)
+    {
+        DbOptions options = {64, 0, 0, use_mmap};
+        db = init_db_with_options("bench.db", &options);
+        RecordId rid;
+        long long checksum = 0;
+        double start = now_ns();
+        for (int i = 0; i < NUM_LOOKUPS; i++)
+        {
+            btree_search(&db, ids[i], &rid);
+            checksum += rid.page;
+        }
+        double elapsed = now_ns() - start;
+        printf("%-16s %7.1f ns/lookup (checksum %lld)\n", names[use_mmap], elapsed / NUM_LOOKUPS, checksum);
+        close_db(&db);
+    }
+    free(ids);
+    remove("bench.db");
+}
+
+// Compare loading num_rows shuffled rows one insert at a time (in one
+// transaction) with bulk_load building the pages and tree bottom-up
+static void run_bulk_load(int num_rows)
+{
+    int *ids = malloc(num_rows * sizeof(int));
+    Value *values = calloc(num_rows, sizeof(Value));
+    char (*names)[16] = malloc(num_rows * sizeof(*names));
+    for (int i = 0; i < num_rows; i++)
+    {
+        ids[i] = (int)((i * 7919L) % num_rows) + 1;
+        values[i].length = snprintf(names[i], sizeof(names[i]), "Row%d", ids[i]);
+        values[i].data = names[i];
+    }
+    printf("\n%d rows, 64-frame pool\n", num_rows);
+
+    // Row-at-a-time inserts print a line each; send those to /dev/null
+    int saved_stdout = dup(STDOUT_FILENO);
+    const char *names_of[] = {"insert_values", "bulk_load"};
+    double elapsed[2];
+    for (int bulk = 0; bulk <= 1; bulk++)
+    {
+        remove("bench.db");
+        remove("bench.db-wal");
+        DbOptions options = {64};
+        Database db = init_db_with_options("bench.db", &options);
+        fflush(stdout);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+        double start = now_ns();
+        if (bulk)
+        {
+            bulk_load(&db, num_rows, ids, values, 100);
+        }
+        else
+        {
+            begin_txn(&db);
+            for (int i = 0; i < num_rows; i++)
+            {
+                insert_values(&db, ids[i], &values[i]);
+            }
+            commit_txn(&db);
+        }
+        elapsed[bulk] = now_ns() - start;
+        close_db(&db);
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+    }
+    close(saved_stdout);
+    for (int bulk = 0; bulk <= 1; bulk++)
+    {
+        printf("%-16s %7.3f s (%.0f rows/s)\n", names_of[bulk], elapsed[bulk] / 1e9, num_rows / (elapsed[bulk] / 1e9));
+    }
+    free(ids);
+    free(values);
+    free(names);
+    remove("bench.db");
+}
+
+typedef struct
+{
+    Database *db;
+    int num_rows;
+    unsigned int seed;
+    long long checksum;
+} LookupThread;
+
+static void *run_lookup_thread(void *arg)
+{
+    LookupThread *thread = arg;
+    char buf[16];
+    for (int i = 0; i < NUM_LOOKUPS / 4; i++)
+    {
+        Value value;
+        int id = rand_r(&thread->seed) % thread->num_rows + 1;
+        select_column(thread->db, id, 0, &value, buf, sizeof(buf));
+        thread->checksum += value.length;
+    }
+    return NULL;
+}
+
+// Aggregate select_column throughput of 1, 2, 4, ... threads sharing one
+// handle (each thread does the same number of lookups)
+static void run_parallel_lookups(int num_rows)
+{
+    int *ids = malloc(num_rows * sizeof(int));
+    Value *values = calloc(num_rows, sizeof(Value));
+    char (*names)[16] = malloc(num_rows * sizeof(*names));
+    for (int i = 0; i < num_rows; i++)
+    {
+        ids[i] = i + 1;
+        values[i].length = snprintf(names[i], sizeof(names[i]), "Row%d", ids[i]);
+        values[i].data = names[i];
+    }
+    remove("bench.db");
+    remove("bench.db-wal");
+    DbOptions options = {16384}; // Every page stays resident
+    Database db = init_db_with_options("bench.db", &options);
+    bulk_load(&db, num_rows, ids, values, 100);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("\n%d rows, %ld cores\n", num_rows, cores);
+
+    for (int num_threads = 1; num_threads <= (cores > 2 ? cores : 2); num_threads *= 2)
+    {
+        pthread_t threads[64];
+        LookupThread work[64];
+        double start = now_ns();
+        for (int t = 0; t < num_threads && t < 64; t++)
+        {
+            work[t] = (LookupThread){&db, num_rows, 99 + t, 0};
+            pthread_create(&threads[t], NULL, run_lookup_thread, &work[t]);
+        }
+        for (int t = 0; t < num_threads && t < 64; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+        double elapsed = now_ns() - start;
+        double total = (double)(NUM_LOOKUPS / 4) * num_threads;
+        printf("%2d threads %12.0f lookups/s\n", num_threads, total / (elapsed / 1e9));
+    }
+    close_db(&db);
+    free(ids);
+    free(values);
+    free(names);
+    remove("bench.db");
+}
+
+static int count_row(void *arg, int id, const Value *values)
+{
+    (void)values;
+    *(long *)arg += id;
+    return 1;
+}
+
+// Point SELECTs by id three ways: the id written into the text (nearly every
+// statement parsed), "SELECT ?" prepared for every lookup (served by the
+// plan cache), and "SELECT ?" prepared once with each id bound
+static void run_prepared(int num_rows)
+{
+    int *ids = malloc(num_rows * sizeof(int));
+    Value *values = calloc(num_rows, sizeof(Value));
+    char (*names)[16] = malloc(num_rows * sizeof(*names));
+    for (int i = 0; i < num_rows; i++)
+    {
+        ids[i] = i + 1;
+        values[i].length = snprintf(names[i], sizeof(names[i]), "Row%d", ids[i]);
+        values[i].data = names[i];
+    }
+    remove("bench.db");
+    remove("bench.db-wal");
+    DbOptions options = {16384};
+    Database db = init_db_with_options("bench.db", &options);
+    bulk_load(&db, num_rows, ids, values, 100);
+    printf("\n%d rows, point SELECTs\n", num_rows);
+
+    int lookups = NUM_LOOKUPS / 4;
+    const char *names_of[] = {"parse each", "plan cache", "prepared + bind"};
+    for (int mode = 0; mode < 3; mode++)
+    {
+        long checksum = 0;
+        Statement *prepared = prepare_statement(&db, "SELECT ?");
+        srand(11);
+        double start = now_ns();
+        for (int i = 0; i < lookups; i++)
+        {
+            Value key = {0, rand() % num_rows + 1};
+            Statement *stmt = prepared;
+            if (mode == 0)
+            {
+                char sql[32];
+                snprintf(sql, sizeof(sql), "SELECT %lld", key.int64);
+                stmt = prepare_statement(&db, sql);
+            }
+            else if (mode == 1)
+            {
+                stmt = prepare_statement(&db, "SELECT ?");
+            }
+            if (mode > 0)
+            {
+                bind_value(stmt, 1, &key);
+            }
+            execute_statement(stmt, count_row, &checksum);
+            if (stmt != prepared)
+            {
+                free_statement(stmt);
+            }
+        }
+        double elapsed = now_ns() - start;
+        printf("%-16s %7.1f ns/statement (checksum %ld)\n", names_of[mode], elapsed / lookups, checksum);
+        free_statement(prepared);
+    }
+    close_db(&db);
+    free(ids);
+    free(values);
+    free(names);
+    remove("bench.db");
+}
+
+// Row-at-a-time COUNT(*) and SUM(price) WHERE qty < 50, for comparison
+typedef struct
+{
+    long long count;
+    double sum;
+} FilterSum;
+
+static int filter_sum_row(void *arg, int id, const Value *values)
+{
+    FilterSum *total = arg;
+    (void)id;
+    if (!values[0].is_null && values[0].int64 < 50)
+    {
+        total->count++;
+        total->sum += values[1].real;
+    }
+    return 1;
+}
+
+static int keep_totals(void *arg, int id, const Value *values)
+{
+    (void)id;
+    memcpy(arg, values, 2 * sizeof(Value));
+    return 1;
+}
+
+// A filtered COUNT and SUM over num_rows rows with select_each and with the
+// batch executor, and a GROUP BY with 100 groups
+static void run_queries(int num_rows)
+{
+    int *ids = malloc(num_rows * sizeof(int));
+    Value *values = calloc((size_t)num_rows * 3, sizeof(Value));
+    char (*names)[16] = malloc(num_rows * sizeof(*names));
+    for (int i = 0; i < num_rows; i++)
+    {
+        Value *row = values + (size_t)i * 3;
+        ids[i] = i + 1;
+        row[0].int64 = (long long)i * 7919 % 100;
+        row[1].real = i * 0.25;
+        row[2].length = snprintf(names[i], sizeof(names[i]), "Row%d", ids[i]);
+        row[2].data = names[i];
+    }
+    remove("bench.db");
+    remove("bench.db-wal");
+    DbOptions options = {16384};
+    Database db = init_db_with_options("bench.db", &options);
+    Column columns[] = {{"qty", COL_INT64}, {"price", COL_DOUBLE}, {"name", COL_TEXT}};
+    create_table(&db, "orders", columns, 3);
+    use_table(&db, "orders");
+    bulk_load(&db, num_rows, ids, values, 100);
+    printf("\n%d rows, COUNT(*), SUM(price) WHERE qty < 50\n", num_rows);
+
+    FilterSum total = {0, 0};
+    double start = now_ns();
+    select_each(&db, filter_sum_row, &total);
+    double elapsed = now_ns() - start;
+    printf("%-16s %7.2f ns/row (count %lld, sum %.0f)\n", "select_each", elapsed / num_rows, total.count, total.sum);
+
+    Statement *stmt = prepare_statement(&db, "SELECT COUNT(*), SUM(price) WHERE qty < 50");
+    Value result[2];
+    start = now_ns();
+    execute_statement(stmt, keep_totals, result);
+    elapsed = now_ns() - start;
+    printf("%-16s %7.2f ns/row (count %lld, sum %.0f)\n", "batch executor", elapsed / num_rows, result[0].int64, result[1].real);
+    free_statement(stmt);
+
+    stmt = prepare_statement(&db, "SELECT qty, COUNT(*), AVG(price) GROUP BY qty");
+    start = now_ns();
+    int groups = execute_statement(stmt, NULL, NULL);
+    elapsed = now_ns() - start;
+    printf("%-16s %7.2f ns/row (%d groups)\n", "GROUP BY", elapsed / num_rows, groups);
+    free_statement(stmt);
+    close_db(&db);
+    free(ids);
+    free(values);
+    free(names);
+    remove("bench.db");
+}
+
+// Aggregate queries over cached pages with 1 to 8 scan threads
+static void run_parallel_scans(int num_rows)
+{
+    int *ids = malloc(num_rows * sizeof(int));
+    Value *values = calloc((size_t)num_rows * 3, sizeof(Value));
+    char (*names)[16] = malloc(num_rows * sizeof(*names));
+    for (int i = 0; i < num_rows; i++)
+    {
+        Value *row = values + (size_t)i * 3;
+        ids[i] = i + 1;
+        row[0].int64 = (long long)i * 7919 % 100;
+        row[1].real = i * 0.25;
+        row[2].length = snprintf(names[i], sizeof(names[i]), "Row%d", ids[i]);
+        row[2].data = names[i];
+    }
+    remove("bench.db");
+    remove("bench.db-wal");
+    DbOptions options = {16384, 0, 0, 0, 1};
+    Database db = init_db_with_options("bench.db", &options);
+    Column columns[] = {{"qty", COL_INT64}, {"price", COL_DOUBLE}, {"name", COL_TEXT}};
+    create_table(&db, "orders", columns, 3);
+    use_table(&db, "orders");
+    bulk_load(&db, num_rows, ids, values, 100);
+    close_db(&db);
+    printf("\n%d rows, parallel scans (%ld CPUs)\n", num_rows, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int threads = 1; threads <= 8; threads *= 2)
+    {
+        options.scan_threads = threads;
+        db = init_db_with_options("bench.db", &options);
+        use_table(&db, "orders");
+        Statement *filtered = prepare_statement(&db, "SELECT COUNT(*), SUM(price) WHERE qty < 50");
+        Statement *grouped = prepare_statement(&db, "SELECT qty, COUNT(*), AVG(price) GROUP BY qty");
+        Value result[2];
+        execute_statement(filtered, keep_totals, result); // Load the pages into the pool
+        double start = now_ns();
+        execute_statement(filtered, keep_totals, result);
+        double filter_elapsed = now_ns() - start;
+        start = now_ns();
+        int groups = execute_statement(grouped, NULL, NULL);
+        double group_elapsed = now_ns() - start;
+        printf("%d thread%s  filter %6.2f ns/row (count %lld)  GROUP BY %6.2f ns/row (%d groups)\n", threads, threads == 1 ? " " : "s",
+               filter_elapsed / num_rows, result[0].int64, group_elapsed / num_rows, groups);
+        free_statement(filtered);
+        free_statement(grouped);
+        close_db(&db);
+    }
+    free(ids);
+    free(values);
+    free(names);
+    remove("bench.db");
+}
+
+int main(void)
+{
+    run(20000);   // Index fits in the CPU cache: in-node search dominates
+    run(1000000); // Index exceeds the CPU cache: memory latency dominates
+    run_read_paths(1000000);
+    run_bulk_load(1000000);
+    run_parallel_lookups(1000000);
+    run_prepared(1000000);
+    run_queries(1000000);
+    run_parallel_scans(1000000);
+    return 0;
+}
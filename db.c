@@ -1,28 +1,108 @@
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "db.h"
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
-#define PAGE_SIZE 4096
-#define MAX_ROWS ((PAGE_SIZE - sizeof(int)) / sizeof(struct Row))
-#define MAX_PAGES 10
-#define INDEX_PAGES 5                               // Reserve 5 pages for B-Tree nodes
-#define DATA_START_OFFSET (INDEX_PAGES * PAGE_SIZE) // Data pages start at 20480
+#define MAX_ROWS ((PAGE_SIZE - sizeof(DataPageHeader)) / (sizeof(Slot) + MIN_CELL_SIZE)) // Most rows one page can hold
+#define DB_MAGIC "SMALLDB7"                         // Identifies the file format in the header page
+#define HEADER_PAGE 0                               // Page 0 holds the FileHeader
 #define MAX_KEYS 340                                // Maximum keys per B-Tree node (m - 1)
 #define MAX_CHILDREN 341                            // Maximum children (m)
+#define MAX_LEAF_KEYS 339                           // Maximum entries per leaf node: (4096 - 8 - 16) / 12
+#define MIN_KEYS ((MAX_KEYS - 1) / 2)               // Minimum keys in a non-root internal node
+#define MIN_LEAF_KEYS (MAX_LEAF_KEYS / 2)           // Minimum entries in a non-root leaf
+#define DEFAULT_POOL_PAGES 64                       // Buffer pool capacity used by init_db
+#define DEFAULT_CHECKPOINT_PAGES 1000               // WAL frames that trigger a checkpoint
+#define WAL_MAGIC 0x314c4157                        // "WAL1"
+#define CHECKPOINT_RUN_PAGES 64                     // Most pages a checkpoint writes with one call
+#define FSM_INTERVAL PAGE_SIZE                      // Pages covered by one free-space map page (1 byte each)
+#define FSM_GRANULE 16                              // Free bytes per free-space map unit
+#define FSM_MAX_PROBES 8                            // Other tables' pages a free-space search may look at
+#define MIN_CELL_SIZE 3                             // 1-byte id, 1-byte length and a 1-byte null bitmap
+#define OVERFLOW_THRESHOLD (PAGE_SIZE / 4)          // Longer records spill to overflow pages
+#define MAX_CELL_SIZE (10 + OVERFLOW_THRESHOLD)     // Two varints plus the largest inline record
+#define MAX_IX_KEYS 145                             // Keys per internal node of a secondary index
+#define MAX_IX_LEAF_KEYS 204                        // Entries per leaf of a secondary index
+#define MIN_IX_KEYS ((MAX_IX_KEYS - 1) / 2)         // Minimum keys in a non-root internal node of a secondary index
+#define MIN_IX_LEAF_KEYS (MAX_IX_LEAF_KEYS / 2)     // Minimum entries in a non-root leaf of a secondary index
+#define DEFAULT_FILL_PERCENT 90                     // How full .import packs pages, leaving room for later updates
+#define MORSEL_PAGES 16                             // Data pages a parallel scan hands a thread at a time
+#define MAX_SCAN_THREADS 64                         // Most threads one query scans with
 
-struct Row
+// File header stored in page 0
+typedef struct
 {
-    int id;
-    char name[60];
-};
+    char magic[8];       // DB_MAGIC
+    off_t root_offset;   // File offset of the catalog's B-Tree root node
+    int page_count;      // Pages in the file, including the header page
+    int freelist_head;   // First free page (0 = freelist empty)
+    int free_pages;      // Number of pages on the freelist
+    int num_data_pages;  // Length of the catalog's data page chain
+    int first_data_page; // First data page of the catalog
+    int last_data_page;  // Last data page of the catalog
+} FileHeader;
+
+// Header at the start of every data page. The slot directory follows it and
+// grows up; cells grow down from the end of the page.
+typedef struct
+{
+    int num_rows;              // Live rows in the page
+    int prev_page;             // Previous data page in the chain (0 = none)
+    int next_page;             // Next data page in the chain (0 = none)
+    unsigned short num_slots;  // Slot directory entries, live or tombstoned
+    unsigned short cell_start; // Offset of the lowest cell
+    unsigned short free_bytes; // Free bytes, counting holes left by deletes
+    unsigned short table_id;   // Table owning the page
+} DataPageHeader; // 20 bytes
+
+// Header of an overflow page; the rest of the page holds part of a long record
+typedef struct
+{
+    int next_page; // Next page of the chain (0 = last)
+    int length;    // Bytes of the record stored in this page
+} OverflowPageHeader;
+
+#define OVERFLOW_CAPACITY ((int)(PAGE_SIZE - sizeof(OverflowPageHeader)))
+
+// Slot directory entry; a row keeps its slot for life, so record IDs stay valid
+typedef struct
+{
+    unsigned short offset; // Cell offset in the page (0 = tombstone)
+    unsigned short length; // Cell length in bytes
+} Slot;
 
 // B-Tree entry for leaf nodes
 typedef struct
 {
-    int id;        // 4 bytes
-    off_t address; // 8 bytes
-} IndexEntry;      // 12 bytes
+    int id;       // 4 bytes
+    RecordId rid; // 8 bytes
+} IndexEntry;     // 12 bytes
 
 // B-Tree node structure: fits in 4096 bytes
 typedef struct
@@ -32,8 +112,10 @@ typedef struct
     union
     {
         struct
-        {                                 // Leaf node
-            IndexEntry entries[MAX_KEYS]; // 340 * 12 = 4080 bytes
+        {                                      // Leaf node
+            IndexEntry entries[MAX_LEAF_KEYS]; // 339 * 12 = 4068 bytes (+ 4 padding)
+            off_t prev;                        // Previous leaf in id order (0 = first)
+            off_t next;                        // Next leaf in id order (0 = last)
         } leaf;
         struct
         {                                 // Internal node
@@ -41,691 +123,7901 @@ typedef struct
             off_t children[MAX_CHILDREN]; // 341 * 8 = 2728 bytes
         } internal;
     } data;
-} BTreeNode; // Total: 8 + 4080 = 4088 bytes
+} BTreeNode; // Total: 8 + 4088 = 4096 bytes
+
+// The catalog page holds a Schema
+_Static_assert(sizeof(Schema) <= PAGE_SIZE, "Schema must fit in a page");
+
+// Order-preserving image of a column value in a secondary index (see index_key)
+typedef struct
+{
+    unsigned long long high; // 8 bytes
+    unsigned long long low;  // 8 bytes
+} IndexKey;                  // 16 bytes
+
+// Secondary index B+Tree node. Entries are (key, id) pairs in order; the id
+// makes every entry unique. Leaves are chained left to right.
+typedef struct
+{
+    int num_keys; // 4 bytes
+    int is_leaf;  // 4 bytes
+    union
+    {
+        struct
+        {                                    // Leaf node
+            IndexKey keys[MAX_IX_LEAF_KEYS]; // 204 * 16 = 3264 bytes
+            int ids[MAX_IX_LEAF_KEYS];       // 204 * 4 = 816 bytes
+            off_t next;                      // Next leaf (0 = last)
+        } leaf;
+        struct
+        {                                    // Internal node
+            IndexKey keys[MAX_IX_KEYS];      // 145 * 16 = 2320 bytes
+            int ids[MAX_IX_KEYS];            // 145 * 4 = 580 bytes
+            off_t children[MAX_IX_KEYS + 1]; // 146 * 8 = 1168 bytes
+        } internal;
+    } data;
+} IndexNode; // Total: 8 + 4088 = 4096 bytes
+
+_Static_assert(sizeof(IndexNode) <= PAGE_SIZE, "IndexNode must fit in a page");
+
+// Nodes are cached in PAGE_SIZE buffer pool frames
+_Static_assert(sizeof(BTreeNode) <= PAGE_SIZE, "BTreeNode must fit in a page");
+
+// Buffer pool frame: one cached B-Tree node or data page
+typedef struct
+{
+    off_t offset;   // File offset of the cached page (-1 if the frame is free)
+    int pin_count;  // Frames with pin_count > 0 are never evicted
+    int dirty;      // Frame must be written back before it is reused
+    int loading;    // Its page is being read in; data is not valid until it clears
+    int lru_prev;   // Neighbour towards the most recently used end
+    int lru_next;   // Neighbour towards the least recently used end
+    int hash_next;  // Next frame in the same hash bucket
+    char *data;     // PAGE_SIZE bytes
+} Frame;
+
+// Fixed-capacity page cache shared by B-Tree nodes and data pages
+typedef struct BufferPool
+{
+    Frame *frames;
+    int capacity;
+    char *memory;   // capacity * PAGE_SIZE bytes backing the frames
+    int *buckets;   // Hash table: offset -> first frame index (-1 if empty)
+    int lru_head;   // Most recently used frame
+    int lru_tail;   // Least recently used frame
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;
+    long mapped;    // Reads served from the mapping instead of a frame
+    pthread_mutex_t latch; // Guards everything above but the page contents,
+                           // which the database lock and pin counts protect.
+                           // No file I/O happens while it is held.
+    pthread_cond_t loaded; // Signalled when a frame finishes loading or writing back
+} BufferPool;
+
+// WAL file header
+typedef struct
+{
+    unsigned int magic;     // WAL_MAGIC
+    unsigned int page_size; // PAGE_SIZE of the database that wrote the log
+    unsigned int salt;      // Changes at every checkpoint so stale frames fail their checksum
+    unsigned int reserved;
+} WalHeader;
+
+// Header in front of every page image in the WAL
+typedef struct
+{
+    int page_no;           // Page the image belongs to
+    int commit;            // Nonzero on the last frame of a transaction
+    unsigned int salt;     // Copy of WalHeader.salt
+    unsigned int checksum; // Running checksum over every frame since the WAL header
+} WalFrameHeader;
 
+// Open-addressing map from page number to the WAL offset of its newest frame
 typedef struct
 {
-    FILE *file;                // File pointer for the database file
-    void **pages;              // Array of page buffers
-    int num_pages;             // Number of pages in use
-    int max_pages;             // Maximum number of pages allowed
-    off_t root_offset;         // File offset of the root node
-    int page_dirty[MAX_PAGES]; // Dirty flags for data pages
-} Database;
-
-// function prototypes
-Database init_db(const char *filename);
-void write_buffer(Database *db);
-int insert_row(Database *db, int id, const char *name);
-int select_rows(Database *db, struct Row *rows, int max_rows);
-int select_by_id(Database *db, int id, struct Row *row);
-int delete_row(Database *db, int id);
-void close_db(Database *db);
-int update_row(Database *db, int id, const char *name);
-
-// B-Tree helper functions
+    int *keys;     // Page numbers, -1 for an empty slot
+    off_t *values; // Frame offsets in the WAL file
+    int capacity;  // Power of two
+    int count;
+} PageMap;
+
+// Write-ahead log: committed page images live here until a checkpoint copies
+// them into the database file
+typedef struct Wal
+{
+    int fd;
+    char *path;                   // "<database file>-wal"
+    unsigned int salt;
+    unsigned int checksum;        // Running checksum after the last frame written
+    off_t end;                    // Offset of the next frame
+    off_t commit_end;             // end after the last commit frame
+    unsigned int commit_checksum; // checksum after the last commit frame
+    int frames;                   // Frames since the last checkpoint
+    PageMap committed;            // Newest committed frame of each page
+    PageMap pending;              // Frames written by the open transaction
+    off_t *older;                 // Per committed frame: the page's previous frame (-1 = none)
+    int older_capacity;
+    int snapshots;                // Open snapshots; checkpoints wait for them
+    pthread_mutex_t latch;        // Guards committed, older, commit_end and snapshots
+                                  // against snapshot readers, who hold no database lock
+    int group_commit;             // Commits that share one fsync
+    int unsynced_commits;         // Commits written since the last fsync
+    int checkpoint_pages;         // Checkpoint once the WAL holds this many frames
+    long commits;
+    long syncs;
+    long checkpoints;
+    long pages_written;
+    long write_calls;
+} Wal;
+
+// Buffer pool functions
+BufferPool *pool_create(int capacity);
+void pool_destroy(BufferPool *pool);
+char *pool_fetch(Database *db, off_t offset, int load);
+void pool_unpin(Database *db, char *data, int dirty);
+void pool_flush(Database *db);
+void pool_discard(Database *db);
+const char *pool_view(Database *db, off_t offset);
+void pool_release_view(Database *db, const char *data);
+void db_remap(Database *db);
+
+// Write-ahead log functions
+Wal *wal_open(const char *db_filename, const DbOptions *options);
+void wal_close(Wal *wal);
+void wal_append(Database *db, int count, const int *page_nos, char *const *pages, int commit);
+int wal_read_page(Database *db, int page_no, char *data);
+static off_t wal_reserve(Wal *wal, int count, const int *page_nos, char *const *pages, int commit,
+                         WalFrameHeader *headers, struct iovec *iov);
+static off_t wal_page_offset(Database *db, int page_no);
+void wal_commit(Database *db);
+void wal_rollback(Database *db);
+void wal_sync(Database *db);
+void wal_recover(Database *db);
+void wal_checkpoint(Database *db);
+
+// Page allocator functions
+int allocate_page(Database *db);
+void free_page(Database *db, int page_no);
+
+// B-Tree node I/O
 void read_node(Database *db, off_t offset, BTreeNode *node);
 void write_node(Database *db, off_t offset, BTreeNode *node);
 off_t allocate_node(Database *db);
-void btree_search(Database *db, int id, off_t *address);
-void btree_insert(Database *db, int id, off_t address);
-void btree_delete(Database *db, int id);
 
-// Read a B-Tree node from disk
-void read_node(Database *db, off_t offset, BTreeNode *node)
+static off_t page_offset(int page_no)
+{
+    return (off_t)page_no * PAGE_SIZE;
+}
+
+// Read len bytes at offset; returns 0 if the file ends first
+static int read_at(int fd, void *data, size_t len, off_t offset)
 {
-    fseek(db->file, offset, SEEK_SET);
-    size_t bytes_read = fread(node, 1, PAGE_SIZE, db->file);
-    if (bytes_read != PAGE_SIZE)
+    size_t done = 0;
+    while (done < len)
     {
-        printf("Error: Failed to read node at offset %lld\n", (long long)offset);
-        exit(1);
+        ssize_t n = pread(fd, (char *)data + done, len - done, offset + done);
+        if (n < 0)
+        {
+            perror("Error: Read failed\n");
+            exit(1);
+        }
+        if (n == 0)
+        {
+            return 0;
+        }
+        done += n;
     }
+    return 1;
 }
 
-// Write a B-Tree node to disk
-void write_node(Database *db, off_t offset, BTreeNode *node)
+// Write the buffers in iov back to back starting at offset, IOV_MAX at a time
+// and resuming after short writes. iov is consumed. Returns the syscall count.
+static int write_at(int fd, struct iovec *iov, int iovcnt, off_t offset)
 {
-    fseek(db->file, offset, SEEK_SET);
-    size_t bytes_written = fwrite(node, 1, PAGE_SIZE, db->file);
-    if (bytes_written != PAGE_SIZE)
+    int calls = 0;
+    while (iovcnt > 0)
     {
-        printf("Error: Failed to write node at offset %lld\n", (long long)offset);
-        exit(1);
+        ssize_t n = pwritev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX, offset);
+        if (n < 0)
+        {
+            perror("Error: Write failed\n");
+            exit(1);
+        }
+        calls++;
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
-    fflush(db->file);
+    return calls;
 }
 
-// Allocate a new node (find a free page in the index section)
-off_t allocate_node(Database *db)
+// Lock nesting of the calling thread. Public functions lock on entry and call
+// each other freely, so only a thread's outermost call takes the lock.
+static __thread pthread_rwlock_t *held_lock;
+static __thread int held_depth;
+static __thread int held_write; // The outermost call took the write lock
+
+// Returns 1 with the lock held, or 0 after printing why the thread cannot
+// take it: it already holds another database's lock, or it holds this one's
+// read lock (e.g. inside its own scan or select_each) and wants to write
+static int db_lock(Database *db, int write)
 {
-    // Simple allocation: find the next free offset in the index section
-    static off_t next_offset = 8; // Start after root_offset
-    off_t new_offset = next_offset;
-    next_offset += PAGE_SIZE;
-    if (next_offset >= DATA_START_OFFSET)
+    if (held_depth > 0)
     {
-        printf("Error: Index section full\n");
-        exit(1);
+        if (held_lock != db->lock)
+        {
+            printf("Error: This thread is already using another database\n");
+            return 0;
+        }
+        if (write && !held_write)
+        {
+            printf("Error: Cannot write while this thread is reading the database\n");
+            return 0;
+        }
+        held_depth++;
+        return 1;
+    }
+    if (write)
+    {
+        pthread_rwlock_wrlock(db->lock);
     }
-    return new_offset;
+    else
+    {
+        pthread_rwlock_rdlock(db->lock);
+    }
+    held_lock = db->lock;
+    held_depth = 1;
+    held_write = write;
+    return 1;
 }
 
-// Search the B-Tree for an ID, return its address
-void btree_search(Database *db, int id, off_t *address)
+// Share the database with other readers. Lookups, scans and cursors read;
+// row and schema changes write, and a transaction keeps the write lock from
+// begin_txn to commit_txn or rollback_txn. Work a thread does while it holds
+// either lock runs under it, so a write from inside its own scan is refused.
+static int db_read_lock(Database *db)
 {
-    BTreeNode node;
-    off_t current_offset = db->root_offset;
+    return db_lock(db, 0);
+}
 
-    while (1)
+static int db_write_lock(Database *db)
+{
+    return db_lock(db, 1);
+}
+
+static void db_unlock(Database *db)
+{
+    assert(held_depth > 0 && held_lock == db->lock);
+    if (--held_depth == 0)
+    {
+        held_lock = NULL;
+        pthread_rwlock_unlock(db->lock);
+    }
+}
+
+// A thread's current table on one database handle. use_table changes only
+// the calling thread's choice, so threads sharing a handle never redirect
+// each other's row operations. The choice is kept by table id; the Table it
+// resolves to is cached until the handle reloads its tables.
+typedef struct
+{
+    long handle_id;       // Database.handle_id (0 = unused slot)
+    long catalog_version; // Database.catalog_version when table was looked up
+    int table_id;         // Table the thread chose (-1 = none yet)
+    Table *table;
+} TableChoice;
+
+#define MAX_THREAD_HANDLES 8 // Handles a thread remembers its current table on
+
+static __thread TableChoice table_choices[MAX_THREAD_HANDLES];
+static __thread int next_table_choice;
+static long next_handle_id; // Last Database.handle_id given out
+
+static TableChoice *table_choice(Database *db)
+{
+    for (int i = 0; i < MAX_THREAD_HANDLES; i++)
     {
-        read_node(db, current_offset, &node);
-        if (node.is_leaf)
+        if (table_choices[i].handle_id == db->handle_id)
         {
-            // Search in leaf node
-            for (int i = 0; i < node.num_keys; i++)
-            {
-                if (node.data.leaf.entries[i].id == id)
-                {
-                    *address = node.data.leaf.entries[i].address;
-                    return;
-                }
-            }
-            *address = -1; // Not found
-            return;
+            return &table_choices[i];
         }
-        else
+    }
+    TableChoice *choice = &table_choices[next_table_choice];
+    next_table_choice = (next_table_choice + 1) % MAX_THREAD_HANDLES;
+    choice->handle_id = db->handle_id;
+    choice->catalog_version = -1;
+    choice->table_id = -1;
+    return choice;
+}
+
+// The table row operations of the calling thread act on: the one it last
+// chose with use_table, else (or once a rollback dropped it) the first table
+static Table *thread_table(Database *db)
+{
+    TableChoice *choice = table_choice(db);
+    if (choice->catalog_version != db->catalog_version)
+    {
+        choice->table = db->num_tables > 1 ? db->tables[1] : db->tables[0];
+        for (int i = 1; i < db->num_tables; i++)
         {
-            // Search in internal node
-            int i;
-            for (i = 0; i < node.num_keys; i++)
+            if (db->tables[i]->table_id == choice->table_id)
             {
-                if (id < node.data.internal.keys[i])
-                {
-                    break;
-                }
+                choice->table = db->tables[i];
             }
-            current_offset = node.data.internal.children[i];
         }
+        choice->table_id = choice->table->table_id;
+        choice->catalog_version = db->catalog_version;
     }
+    return choice->table;
 }
 
-// Insert into the B-Tree
-void btree_insert(Database *db, int id, off_t address)
+static void set_thread_table(Database *db, Table *table)
 {
-    BTreeNode root;
-    read_node(db, db->root_offset, &root);
+    TableChoice *choice = table_choice(db);
+    choice->table = table;
+    choice->table_id = table->table_id;
+    choice->catalog_version = db->catalog_version;
+}
 
-    // If root is full, split it and create a new root
-    if (root.num_keys >= MAX_KEYS)
+#define STATEMENT_CACHE_SIZE 256 // Plans kept by the statement cache
+
+// A cached plan and the text it was compiled from
+typedef struct
+{
+    char *text;      // NULL = empty slot
+    int table_id;
+    Statement *plan;
+} CachedStatement;
+
+// Plans compiled by prepare_statement, looked up by statement text and table.
+// Direct-mapped: a new plan replaces whatever shares its slot.
+struct StatementCache
+{
+    CachedStatement entries[STATEMENT_CACHE_SIZE];
+    long version; // Bumped when the catalog rolls back, invalidating older plans
+    long hits;
+    long misses;
+    long parallel_queries;
+    pthread_mutex_t latch;
+};
+
+static StatementCache *statement_cache_create(void)
+{
+    StatementCache *cache = calloc(1, sizeof(StatementCache));
+    if (cache == NULL)
     {
-        off_t old_root_offset = db->root_offset;
-        off_t new_root_offset = allocate_node(db);
-        off_t right_offset = allocate_node(db);
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    pthread_mutex_init(&cache->latch, NULL);
+    return cache;
+}
 
-        BTreeNode new_root, right;
-        new_root.num_keys = 0;
-        new_root.is_leaf = 0;
-        right.num_keys = 0;
-        right.is_leaf = root.is_leaf;
+static void statement_cache_destroy(StatementCache *cache)
+{
+    for (int i = 0; i < STATEMENT_CACHE_SIZE; i++)
+    {
+        free(cache->entries[i].text);
+        free(cache->entries[i].plan);
+    }
+    pthread_mutex_destroy(&cache->latch);
+    free(cache);
+}
 
-        // Split the old root
-        int mid = MAX_KEYS / 2;
-        int mid_key = root.is_leaf ? root.data.leaf.entries[mid].id : root.data.internal.keys[mid];
+// Threads that help run parallel scans. They sleep until workers_run hands
+// them a job, which all of them and the calling thread then run at once.
+struct WorkerPool
+{
+    int num_threads;
+    pthread_t *threads;
+    pthread_mutex_t latch; // Guards everything below
+    pthread_cond_t wake;   // A job started or the pool is stopping
+    pthread_cond_t done;   // The last worker finished the job
+    void (*job)(void *arg, int thread);
+    void *arg;
+    long jobs;             // Jobs started so far
+    int next_thread;       // Number the next worker to join the job runs as
+    int running;           // Workers still in the job
+    int busy;              // A job is running; the pool takes one at a time
+    int stopping;
+};
 
-        // Move second half to right node
-        for (int i = mid + (root.is_leaf ? 0 : 1); i < root.num_keys; i++)
+static void *worker_main(void *arg)
+{
+    WorkerPool *pool = arg;
+    long seen = 0;
+    pthread_mutex_lock(&pool->latch);
+    for (;;)
+    {
+        while (!pool->stopping && pool->jobs == seen)
         {
-            if (root.is_leaf)
-            {
-                right.data.leaf.entries[right.num_keys] = root.data.leaf.entries[i];
-            }
-            else
+            pthread_cond_wait(&pool->wake, &pool->latch);
+        }
+        if (pool->stopping)
+        {
+            break;
+        }
+        seen = pool->jobs;
+        void (*job)(void *arg, int thread) = pool->job;
+        void *job_arg = pool->arg;
+        int thread = pool->next_thread++;
+        pthread_mutex_unlock(&pool->latch);
+        job(job_arg, thread);
+        pthread_mutex_lock(&pool->latch);
+        if (--pool->running == 0)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->latch);
+    return NULL;
+}
+
+// Start a pool of threads workers
+static WorkerPool *workers_start(int threads)
+{
+    WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+    if (pool == NULL || (pool->threads = malloc(threads * sizeof(pthread_t))) == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->latch, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (; pool->num_threads < threads; pool->num_threads++)
+    {
+        if (pthread_create(&pool->threads[pool->num_threads], NULL, worker_main, pool) != 0)
+        {
+            printf("Error: Could not start a worker thread\n");
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+// Stop the workers once they finish any job they are running and free the pool
+static void workers_stop(WorkerPool *pool)
+{
+    pthread_mutex_lock(&pool->latch);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->latch);
+    for (int i = 0; i < pool->num_threads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->latch);
+    free(pool->threads);
+    free(pool);
+}
+
+// Run job(arg, thread) on the calling thread as thread 0 and on every worker
+// as threads 1 to num_threads, returning once all of them are done. Returns
+// 0 without running it if another thread's job holds the pool.
+static int workers_run(WorkerPool *pool, void (*job)(void *arg, int thread), void *arg)
+{
+    pthread_mutex_lock(&pool->latch);
+    if (pool->busy)
+    {
+        pthread_mutex_unlock(&pool->latch);
+        return 0;
+    }
+    pool->busy = 1;
+    pool->job = job;
+    pool->arg = arg;
+    pool->next_thread = 1;
+    pool->running = pool->num_threads;
+    pool->jobs++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->latch);
+    job(arg, 0);
+    pthread_mutex_lock(&pool->latch);
+    while (pool->running > 0)
+    {
+        pthread_cond_wait(&pool->done, &pool->latch);
+    }
+    pool->busy = 0;
+    pthread_mutex_unlock(&pool->latch);
+    return 1;
+}
+
+// Create a buffer pool with room for capacity pages
+BufferPool *pool_create(int capacity)
+{
+    if (capacity < 1)
+    {
+        capacity = 1;
+    }
+    BufferPool *pool = malloc(sizeof(BufferPool));
+    if (pool == NULL)
+    {
+        perror("Error: Could not allocate buffer pool\n");
+        exit(1);
+    }
+    pool->capacity = capacity;
+    pool->frames = malloc(capacity * sizeof(Frame));
+    pool->buckets = malloc(capacity * sizeof(int));
+    pool->memory = malloc((size_t)capacity * PAGE_SIZE);
+    if (pool->frames == NULL || pool->buckets == NULL || pool->memory == NULL)
+    {
+        perror("Error: Could not allocate buffer pool frames\n");
+        exit(1);
+    }
+    for (int i = 0; i < capacity; i++)
+    {
+        Frame *frame = &pool->frames[i];
+        frame->offset = -1;
+        frame->pin_count = 0;
+        frame->dirty = 0;
+        frame->loading = 0;
+        frame->lru_prev = i - 1;
+        frame->lru_next = (i + 1 < capacity) ? i + 1 : -1;
+        frame->hash_next = -1;
+        frame->data = pool->memory + (size_t)i * PAGE_SIZE;
+        pool->buckets[i] = -1;
+    }
+    pool->lru_head = 0;
+    pool->lru_tail = capacity - 1;
+    pool->hits = 0;
+    pool->misses = 0;
+    pool->evictions = 0;
+    pool->writebacks = 0;
+    pool->mapped = 0;
+    pthread_mutex_init(&pool->latch, NULL);
+    pthread_cond_init(&pool->loaded, NULL);
+    return pool;
+}
+
+// Free the buffer pool (dirty frames must already be flushed)
+void pool_destroy(BufferPool *pool)
+{
+    pthread_cond_destroy(&pool->loaded);
+    pthread_mutex_destroy(&pool->latch);
+    free(pool->memory);
+    free(pool->frames);
+    free(pool->buckets);
+    free(pool);
+}
+
+static int pool_bucket(BufferPool *pool, off_t offset)
+{
+    return (int)(((unsigned long long)offset / PAGE_SIZE) % (unsigned long long)pool->capacity);
+}
+
+// Move a frame to the most recently used end of the LRU list
+static void pool_touch(BufferPool *pool, int index)
+{
+    Frame *frame = &pool->frames[index];
+    if (pool->lru_head == index)
+    {
+        return;
+    }
+    // Unlink
+    pool->frames[frame->lru_prev].lru_next = frame->lru_next;
+    if (frame->lru_next != -1)
+    {
+        pool->frames[frame->lru_next].lru_prev = frame->lru_prev;
+    }
+    else
+    {
+        pool->lru_tail = frame->lru_prev;
+    }
+    // Relink at head
+    frame->lru_prev = -1;
+    frame->lru_next = pool->lru_head;
+    pool->frames[pool->lru_head].lru_prev = index;
+    pool->lru_head = index;
+}
+
+static void pool_hash_remove(BufferPool *pool, int index)
+{
+    int *link = &pool->buckets[pool_bucket(pool, pool->frames[index].offset)];
+    while (*link != -1)
+    {
+        if (*link == index)
+        {
+            *link = pool->frames[index].hash_next;
+            return;
+        }
+        link = &pool->frames[*link].hash_next;
+    }
+}
+
+// Write a dirty frame to the WAL; the database file only changes at
+// checkpoints. Called and returns with the latch held, but drops it for the
+// write. The frame stays pinned and in the page table meanwhile, so other
+// threads keep reading it from memory and nobody else evicts it.
+static void pool_write_back(Database *db, Frame *frame)
+{
+    BufferPool *pool = db->pool;
+    Wal *wal = db->wal;
+    int page_no = (int)(frame->offset / PAGE_SIZE);
+    WalFrameHeader header;
+    struct iovec iov[2];
+    frame->pin_count++;
+    off_t at = wal_reserve(wal, 1, &page_no, &frame->data, 0, &header, iov);
+    pthread_mutex_unlock(&pool->latch);
+    int calls = write_at(wal->fd, iov, 2, at);
+    pthread_mutex_lock(&pool->latch);
+    wal->write_calls += calls;
+    frame->dirty = 0;
+    frame->pin_count--;
+    pool->writebacks++;
+    pthread_cond_broadcast(&pool->loaded);
+}
+
+// Pin the page at offset and return its frame data. If load is 0 the caller
+// is about to overwrite the whole page, so a miss does not read the file.
+// A miss claims a frame under the latch and reads the page after releasing
+// it; other threads that want the page meanwhile wait for the frame to load.
+char *pool_fetch(Database *db, off_t offset, int load)
+{
+    BufferPool *pool = db->pool;
+    pthread_mutex_lock(&pool->latch);
+    int bucket = pool_bucket(pool, offset);
+    while (1)
+    {
+        for (int i = pool->buckets[bucket]; i != -1; i = pool->frames[i].hash_next)
+        {
+            Frame *frame = &pool->frames[i];
+            if (frame->offset == offset)
             {
-                right.data.internal.keys[right.num_keys] = root.data.internal.keys[i];
-                right.data.internal.children[right.num_keys] = root.data.internal.children[i];
+                pool->hits++;
+                frame->pin_count++;
+                pool_touch(pool, i);
+                while (frame->loading)
+                {
+                    pthread_cond_wait(&pool->loaded, &pool->latch);
+                }
+                pthread_mutex_unlock(&pool->latch);
+                return frame->data;
             }
-            right.num_keys++;
         }
-        if (!root.is_leaf)
+
+        // Pick the least recently used unpinned frame
+        int victim = pool->lru_tail;
+        while (victim != -1 && pool->frames[victim].pin_count > 0)
+        {
+            victim = pool->frames[victim].lru_prev;
+        }
+        if (victim == -1)
+        {
+            printf("Error: All buffer pool frames are pinned\n");
+            exit(1);
+        }
+        Frame *frame = &pool->frames[victim];
+        if (frame->offset != -1 && frame->dirty)
+        {
+            // The latch was dropped for the write: look for the page again
+            pool_write_back(db, frame);
+            continue;
+        }
+        pool->misses++;
+        if (frame->offset != -1)
         {
-            right.data.internal.children[right.num_keys] = root.data.internal.children[root.num_keys];
+            pool_hash_remove(pool, victim);
+            pool->evictions++;
         }
-        root.num_keys = mid;
 
-        // Update new root
-        new_root.data.internal.keys[0] = mid_key;
-        new_root.data.internal.children[0] = old_root_offset;
-        new_root.data.internal.children[1] = right_offset;
-        new_root.num_keys = 1;
+        frame->offset = offset;
+        frame->dirty = 0;
+        frame->pin_count = 1;
+        frame->loading = load;
+        frame->hash_next = pool->buckets[bucket];
+        pool->buckets[bucket] = victim;
+        pool_touch(pool, victim);
+        if (!load)
+        {
+            pthread_mutex_unlock(&pool->latch);
+            return frame->data;
+        }
 
-        // Write nodes
-        write_node(db, old_root_offset, &root);
-        write_node(db, right_offset, &right);
-        write_node(db, new_root_offset, &new_root);
-        db->root_offset = new_root_offset;
+        // Where the newest image lives is looked up under the latch, which
+        // also guards the WAL's page maps against eviction write-backs
+        off_t wal_offset = wal_page_offset(db, (int)(offset / PAGE_SIZE));
+        pthread_mutex_unlock(&pool->latch);
+        int read = wal_offset != -1 ? read_at(db->wal->fd, frame->data, PAGE_SIZE, wal_offset + sizeof(WalFrameHeader))
+                                    : read_at(db->fd, frame->data, PAGE_SIZE, offset);
+        if (!read)
+        {
+            printf("Error: Failed to read node at offset %lld\n", (long long)offset);
+            exit(1);
+        }
+        pthread_mutex_lock(&pool->latch);
+        frame->loading = 0;
+        pthread_cond_broadcast(&pool->loaded);
+        pthread_mutex_unlock(&pool->latch);
+        return frame->data;
+    }
+}
+
+// Release a pin taken by pool_fetch, marking the frame dirty if it was modified
+void pool_unpin(Database *db, char *data, int dirty)
+{
+    BufferPool *pool = db->pool;
+    Frame *frame = &pool->frames[(data - pool->memory) / PAGE_SIZE];
+    pthread_mutex_lock(&pool->latch);
+    assert(frame->data == data && frame->pin_count > 0);
+    frame->pin_count--;
+    frame->dirty |= dirty;
+    pthread_mutex_unlock(&pool->latch);
+}
+
+static int compare_frame_offsets(const void *a, const void *b)
+{
+    off_t x = (*(Frame *const *)a)->offset, y = (*(Frame *const *)b)->offset;
+    return (x > y) - (x < y);
+}
+
+// Write all dirty frames, and only those, to the WAL in page order with one
+// vectored write
+void pool_flush(Database *db)
+{
+    BufferPool *pool = db->pool;
+    Frame **dirty = malloc(pool->capacity * sizeof(Frame *));
+    int *page_nos = malloc(pool->capacity * sizeof(int));
+    char **pages = malloc(pool->capacity * sizeof(char *));
+    if (dirty == NULL || page_nos == NULL || pages == NULL)
+    {
+        perror("Error: Could not allocate flush list\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&pool->latch);
+    int count = 0;
+    for (int i = 0; i < pool->capacity; i++)
+    {
+        if (pool->frames[i].offset != -1 && pool->frames[i].dirty)
+        {
+            dirty[count++] = &pool->frames[i];
+        }
+    }
+    qsort(dirty, count, sizeof(Frame *), compare_frame_offsets);
+    for (int i = 0; i < count; i++)
+    {
+        page_nos[i] = (int)(dirty[i]->offset / PAGE_SIZE);
+        pages[i] = dirty[i]->data;
+        dirty[i]->dirty = 0;
+    }
+    pool->writebacks += count;
+    pthread_mutex_unlock(&pool->latch);
+    // Flushes run under the write lock, so no other thread uses the pool now
+    if (count > 0)
+    {
+        wal_append(db, count, page_nos, pages, 0);
     }
+    free(pages);
+    free(page_nos);
+    free(dirty);
+}
+
+// Drop every cached page without writing it; the next fetch rereads the
+// committed image. No frame may be pinned.
+void pool_discard(Database *db)
+{
+    BufferPool *pool = db->pool;
+    pthread_mutex_lock(&pool->latch);
+    for (int i = 0; i < pool->capacity; i++)
+    {
+        assert(pool->frames[i].pin_count == 0);
+        pool->frames[i].offset = -1;
+        pool->frames[i].dirty = 0;
+        pool->frames[i].hash_next = -1;
+        pool->buckets[i] = -1;
+    }
+    pthread_mutex_unlock(&pool->latch);
+}
+
+// Report buffer pool hit/miss counters
+void get_pool_stats(Database *db, PoolStats *stats)
+{
+    pthread_mutex_lock(&db->pool->latch);
+    stats->hits = db->pool->hits;
+    stats->misses = db->pool->misses;
+    stats->evictions = db->pool->evictions;
+    stats->writebacks = db->pool->writebacks;
+    stats->mapped = db->pool->mapped;
+    pthread_mutex_unlock(&db->pool->latch);
+}
+
+static void encode_header(Database *db, char *page);
+static void save_catalog(Database *db);
+
+// FNV-1a over 32-bit words, continuing from sum
+static unsigned int wal_checksum(unsigned int sum, const void *data, size_t len)
+{
+    const unsigned int *words = data;
+    for (size_t i = 0; i < len / sizeof(unsigned int); i++)
+    {
+        sum = (sum ^ words[i]) * 16777619u;
+    }
+    return sum;
+}
+
+static void pagemap_init(PageMap *map, int capacity)
+{
+    map->capacity = capacity;
+    map->count = 0;
+    map->keys = malloc(capacity * sizeof(int));
+    map->values = malloc(capacity * sizeof(off_t));
+    if (map->keys == NULL || map->values == NULL)
+    {
+        perror("Error: Could not allocate WAL index\n");
+        exit(1);
+    }
+    memset(map->keys, -1, capacity * sizeof(int));
+}
+
+static void pagemap_free(PageMap *map)
+{
+    free(map->keys);
+    free(map->values);
+}
+
+static void pagemap_clear(PageMap *map)
+{
+    memset(map->keys, -1, map->capacity * sizeof(int));
+    map->count = 0;
+}
+
+static int pagemap_slot(PageMap *map, int page_no)
+{
+    int slot = (int)(((unsigned int)page_no * 2654435761u) & (unsigned int)(map->capacity - 1));
+    while (map->keys[slot] != -1 && map->keys[slot] != page_no)
+    {
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    return slot;
+}
+
+// WAL offset of the newest frame for page_no, or -1
+static off_t pagemap_get(PageMap *map, int page_no)
+{
+    int slot = pagemap_slot(map, page_no);
+    return map->keys[slot] == -1 ? -1 : map->values[slot];
+}
+
+static void pagemap_put(PageMap *map, int page_no, off_t value)
+{
+    if ((map->count + 1) * 2 > map->capacity)
+    {
+        PageMap bigger;
+        pagemap_init(&bigger, map->capacity * 2);
+        for (int i = 0; i < map->capacity; i++)
+        {
+            if (map->keys[i] != -1)
+            {
+                pagemap_put(&bigger, map->keys[i], map->values[i]);
+            }
+        }
+        pagemap_free(map);
+        *map = bigger;
+    }
+    int slot = pagemap_slot(map, page_no);
+    if (map->keys[slot] == -1)
+    {
+        map->keys[slot] = page_no;
+        map->count++;
+    }
+    map->values[slot] = value;
+}
+
+// Start an empty log generation with a new salt
+static void wal_reset(Wal *wal)
+{
+    WalHeader header = {WAL_MAGIC, PAGE_SIZE, wal->salt + 1, 0};
+    if (ftruncate(wal->fd, 0) != 0)
+    {
+        perror("Error: Could not truncate WAL\n");
+        exit(1);
+    }
+    struct iovec iov = {&header, sizeof(WalHeader)};
+    write_at(wal->fd, &iov, 1, 0);
+    wal->write_calls++;
+    wal->salt = header.salt;
+    wal->checksum = wal->salt ^ 2166136261u;
+    wal->end = sizeof(WalHeader);
+    wal->commit_end = wal->end;
+    wal->commit_checksum = wal->checksum;
+    wal->frames = 0;
+    pagemap_clear(&wal->committed);
+    pagemap_clear(&wal->pending);
+}
+
+// Open (or create) the WAL next to the database file; wal_recover replays it
+Wal *wal_open(const char *db_filename, const DbOptions *options)
+{
+    Wal *wal = calloc(1, sizeof(Wal));
+    if (wal == NULL)
+    {
+        perror("Error: Could not allocate WAL\n");
+        exit(1);
+    }
+    wal->path = malloc(strlen(db_filename) + 5);
+    sprintf(wal->path, "%s-wal", db_filename);
+    wal->fd = open(wal->path, O_RDWR | O_CREAT, 0644);
+    if (wal->fd == -1)
+    {
+        perror("Error: Could not open WAL file\n");
+        exit(1);
+    }
+    wal->group_commit = options->group_commit > 0 ? options->group_commit : 1;
+    wal->checkpoint_pages = options->checkpoint_pages > 0 ? options->checkpoint_pages : DEFAULT_CHECKPOINT_PAGES;
+    pagemap_init(&wal->committed, 64);
+    pagemap_init(&wal->pending, 64);
+    pthread_mutex_init(&wal->latch, NULL);
+
+    WalHeader header;
+    if (read_at(wal->fd, &header, sizeof(WalHeader), 0) && header.magic == WAL_MAGIC && header.page_size == PAGE_SIZE)
+    {
+        wal->salt = header.salt;
+        wal->checksum = wal->salt ^ 2166136261u;
+        wal->end = sizeof(WalHeader);
+        wal->commit_end = wal->end;
+        wal->commit_checksum = wal->checksum;
+    }
+    else
+    {
+        wal_reset(wal);
+    }
+    return wal;
+}
+
+// Close the WAL and delete it (the caller has checkpointed)
+void wal_close(Wal *wal)
+{
+    close(wal->fd);
+    remove(wal->path);
+    pagemap_free(&wal->committed);
+    pagemap_free(&wal->pending);
+    pthread_mutex_destroy(&wal->latch);
+    free(wal->older);
+    free(wal->path);
+    free(wal);
+}
+
+// Lay out count page images at the end of the WAL: fill in their headers
+// and iov, advance the running checksum and end, and index them as pending.
+// Returns the offset to write them at. Pool eviction reserves under the pool
+// latch and writes after releasing it.
+static off_t wal_reserve(Wal *wal, int count, const int *page_nos, char *const *pages, int commit,
+                         WalFrameHeader *headers, struct iovec *iov)
+{
+    off_t offset = wal->end;
+    for (int i = 0; i < count; i++)
+    {
+        WalFrameHeader *header = &headers[i];
+        header->page_no = page_nos[i];
+        header->commit = commit && i == count - 1;
+        header->salt = wal->salt;
+        wal->checksum = wal_checksum(wal->checksum, header, offsetof(WalFrameHeader, checksum));
+        wal->checksum = wal_checksum(wal->checksum, pages[i], PAGE_SIZE);
+        header->checksum = wal->checksum;
+        iov[2 * i].iov_base = header;
+        iov[2 * i].iov_len = sizeof(WalFrameHeader);
+        iov[2 * i + 1].iov_base = pages[i];
+        iov[2 * i + 1].iov_len = PAGE_SIZE;
+        pagemap_put(&wal->pending, page_nos[i], wal->end);
+        wal->end += sizeof(WalFrameHeader) + PAGE_SIZE;
+    }
+    wal->frames += count;
+    wal->pages_written += count;
+    return offset;
+}
+
+// Append count page images with one vectored write; they belong to the open
+// transaction until wal_commit. commit marks the last frame as a commit frame.
+void wal_append(Database *db, int count, const int *page_nos, char *const *pages, int commit)
+{
+    Wal *wal = db->wal;
+    WalFrameHeader *headers = malloc(count * sizeof(WalFrameHeader));
+    struct iovec *iov = malloc(2 * count * sizeof(struct iovec));
+    if (headers == NULL || iov == NULL)
+    {
+        perror("Error: Could not allocate WAL frames\n");
+        exit(1);
+    }
+    off_t offset = wal_reserve(wal, count, page_nos, pages, commit, headers, iov);
+    wal->write_calls += write_at(wal->fd, iov, 2 * count, offset);
+    free(iov);
+    free(headers);
+}
+
+// Offset of the newest logged image of page_no, or -1 if the page is not in the WAL
+static off_t wal_page_offset(Database *db, int page_no)
+{
+    Wal *wal = db->wal;
+    off_t offset = pagemap_get(&wal->pending, page_no);
+    return offset != -1 ? offset : pagemap_get(&wal->committed, page_no);
+}
+
+// Copy the newest logged image of page_no into data; returns 0 if the page is not in the WAL
+int wal_read_page(Database *db, int page_no, char *data)
+{
+    off_t offset = wal_page_offset(db, page_no);
+    if (offset == -1)
+    {
+        return 0;
+    }
+    if (!read_at(db->wal->fd, data, PAGE_SIZE, offset + sizeof(WalFrameHeader)))
+    {
+        printf("Error: Failed to read page %d from WAL\n", page_no);
+        exit(1);
+    }
+    return 1;
+}
+
+// Position of the frame at offset among the frames of the WAL
+static int wal_frame_index(off_t offset)
+{
+    return (int)((offset - (off_t)sizeof(WalHeader)) / (off_t)(sizeof(WalFrameHeader) + PAGE_SIZE));
+}
+
+// Frames of the open transaction become part of the committed state. Each
+// one links to the page's previous committed frame, which open snapshots may
+// still read.
+static void wal_publish(Wal *wal)
+{
+    pthread_mutex_lock(&wal->latch);
+    int frames = wal_frame_index(wal->end);
+    if (frames > wal->older_capacity)
+    {
+        int capacity = wal->older_capacity > 0 ? wal->older_capacity : 64;
+        while (capacity < frames)
+        {
+            capacity *= 2;
+        }
+        off_t *older = realloc(wal->older, capacity * sizeof(off_t));
+        if (older == NULL)
+        {
+            perror("Error: Could not allocate WAL index\n");
+            exit(1);
+        }
+        wal->older = older;
+        wal->older_capacity = capacity;
+    }
+    for (int i = 0; i < wal->pending.capacity; i++)
+    {
+        if (wal->pending.keys[i] != -1)
+        {
+            off_t offset = wal->pending.values[i];
+            wal->older[wal_frame_index(offset)] = pagemap_get(&wal->committed, wal->pending.keys[i]);
+            pagemap_put(&wal->committed, wal->pending.keys[i], offset);
+        }
+    }
+    pagemap_clear(&wal->pending);
+    wal->commit_end = wal->end;
+    wal->commit_checksum = wal->checksum;
+    pthread_mutex_unlock(&wal->latch);
+}
+
+// Force every written commit to stable storage
+void wal_sync(Database *db)
+{
+    Wal *wal = db->wal;
+    if (wal->unsynced_commits > 0)
+    {
+        if (fsync(wal->fd) != 0)
+        {
+            perror("Error: Could not sync WAL\n");
+            exit(1);
+        }
+        wal->syncs++;
+        wal->unsynced_commits = 0;
+    }
+}
+
+// Commit the open transaction: bring the catalog up to date, log dirty pages,
+// then the header page as the commit frame. Every group_commit commits share
+// one fsync, whichever tables they touched.
+void wal_commit(Database *db)
+{
+    Wal *wal = db->wal;
+    save_catalog(db);
+    pool_flush(db);
+    if (wal->pending.count == 0)
+    {
+        return; // Nothing changed
+    }
+    char header_page[PAGE_SIZE];
+    char *pages[] = {header_page};
+    int page_nos[] = {HEADER_PAGE};
+    encode_header(db, header_page);
+    wal_append(db, 1, page_nos, pages, 1);
+    wal_publish(wal);
+    wal->commits++;
+    wal->unsynced_commits++;
+    if (wal->unsynced_commits >= wal->group_commit)
+    {
+        wal_sync(db);
+    }
+    if (wal->frames >= wal->checkpoint_pages)
+    {
+        wal_checkpoint(db);
+    }
+}
+
+// Forget every frame written since the last commit
+void wal_rollback(Database *db)
+{
+    Wal *wal = db->wal;
+    if (ftruncate(wal->fd, wal->commit_end) != 0)
+    {
+        perror("Error: Could not truncate WAL\n");
+        exit(1);
+    }
+    wal->frames -= (int)((wal->end - wal->commit_end) / (off_t)(sizeof(WalFrameHeader) + PAGE_SIZE));
+    wal->end = wal->commit_end;
+    wal->checksum = wal->commit_checksum;
+    pagemap_clear(&wal->pending);
+}
+
+static int compare_page_numbers(const void *a, const void *b)
+{
+    return (*(const int *)a > *(const int *)b) - (*(const int *)a < *(const int *)b);
+}
+
+// Copy the newest committed image of every logged page into the database
+// file, one positioned write per run of consecutive pages, sync it, and start
+// a new log generation. While a snapshot is open the older page versions it
+// reads must survive, so the checkpoint is put off until a commit after the
+// last snapshot closes.
+void wal_checkpoint(Database *db)
+{
+    Wal *wal = db->wal;
+    assert(wal->pending.count == 0);
+    pthread_mutex_lock(&wal->latch); // Also keeps new snapshots out until the reset
+    if (wal->snapshots > 0)
+    {
+        pthread_mutex_unlock(&wal->latch);
+        return;
+    }
+    wal_sync(db); // The log must be durable before the database file changes
+
+    int *pages = malloc((wal->committed.count + 1) * sizeof(int));
+    char *run = malloc((size_t)CHECKPOINT_RUN_PAGES * PAGE_SIZE);
+    if (pages == NULL || run == NULL)
+    {
+        perror("Error: Could not allocate checkpoint buffers\n");
+        exit(1);
+    }
+    int count = 0;
+    for (int i = 0; i < wal->committed.capacity; i++)
+    {
+        if (wal->committed.keys[i] != -1)
+        {
+            pages[count++] = wal->committed.keys[i];
+        }
+    }
+    qsort(pages, count, sizeof(int), compare_page_numbers);
+
+    int start = 0;
+    while (start < count)
+    {
+        int length = 0;
+        while (start + length < count && length < CHECKPOINT_RUN_PAGES && pages[start + length] == pages[start] + length)
+        {
+            wal_read_page(db, pages[start + length], run + (size_t)length * PAGE_SIZE);
+            length++;
+        }
+        struct iovec iov = {run, (size_t)length * PAGE_SIZE};
+        write_at(db->fd, &iov, 1, page_offset(pages[start]));
+        start += length;
+    }
+    free(run);
+    free(pages);
+    if (count > 0 && fsync(db->fd) != 0)
+    {
+        perror("Error: Could not sync database file\n");
+        exit(1);
+    }
+    wal_reset(wal);
+    wal->checkpoints++;
+    pthread_mutex_unlock(&wal->latch);
+    db_remap(db); // The checkpoint may have grown the file
+}
+
+// Replay the WAL after a crash: keep every transaction whose commit frame is
+// intact and checkpoint it; drop a torn or uncommitted tail
+void wal_recover(Database *db)
+{
+    Wal *wal = db->wal;
+    WalFrameHeader header;
+    char page[PAGE_SIZE];
+    while (read_at(wal->fd, &header, sizeof(WalFrameHeader), wal->end) && read_at(wal->fd, page, PAGE_SIZE, wal->end + sizeof(WalFrameHeader)))
+    {
+        unsigned int checksum = wal_checksum(wal->checksum, &header, offsetof(WalFrameHeader, checksum));
+        checksum = wal_checksum(checksum, page, PAGE_SIZE);
+        if (header.salt != wal->salt || header.checksum != checksum)
+        {
+            break;
+        }
+        wal->checksum = checksum;
+        pagemap_put(&wal->pending, header.page_no, wal->end);
+        wal->end += sizeof(WalFrameHeader) + PAGE_SIZE;
+        wal->frames++;
+        if (header.commit)
+        {
+            wal_publish(wal);
+        }
+    }
+    pagemap_clear(&wal->pending);
+    if (wal->committed.count > 0)
+    {
+        printf("Recovered %d pages from the WAL\n", wal->committed.count);
+        wal->unsynced_commits = 1; // A crash may have left the frames only in the OS cache
+        wal_checkpoint(db);
+    }
+    else
+    {
+        wal_reset(wal);
+    }
+}
+
+// Report WAL counters
+static void get_wal_stats_locked(Database *db, WalStats *stats)
+{
+    stats->commits = db->wal->commits;
+    stats->syncs = db->wal->syncs;
+    stats->checkpoints = db->wal->checkpoints;
+    stats->frames = db->wal->frames;
+    stats->pages_written = db->wal->pages_written;
+    stats->write_calls = db->wal->write_calls;
+}
+
+void get_wal_stats(Database *db, WalStats *stats)
+{
+    if (!db_read_lock(db))
+    {
+        memset(stats, 0, sizeof(WalStats));
+        return;
+    }
+    get_wal_stats_locked(db, stats);
+    db_unlock(db);
+}
+
+// Take a snapshot of the last committed state. It costs one latch and no
+// I/O; the WAL keeps every version it needs until snapshot_close.
+void snapshot_open(Database *db, Snapshot *snapshot)
+{
+    Wal *wal = db->wal;
+    pthread_mutex_lock(&wal->latch);
+    snapshot->db = db;
+    snapshot->wal_end = wal->commit_end;
+    wal->snapshots++;
+    pthread_mutex_unlock(&wal->latch);
+}
+
+// Release a snapshot; once none is open the next commit that reaches the
+// checkpoint threshold drops the versions they kept
+void snapshot_close(Snapshot *snapshot)
+{
+    Wal *wal = snapshot->db->wal;
+    pthread_mutex_lock(&wal->latch);
+    assert(wal->snapshots > 0);
+    wal->snapshots--;
+    pthread_mutex_unlock(&wal->latch);
+}
+
+// Copy page_no as it was when the snapshot was taken: its newest frame
+// committed before the snapshot, else the database file's image
+static void snapshot_read_page(const Snapshot *snapshot, int page_no, char *data)
+{
+    Database *db = snapshot->db;
+    Wal *wal = db->wal;
+    pthread_mutex_lock(&wal->latch);
+    off_t offset = pagemap_get(&wal->committed, page_no);
+    while (offset >= snapshot->wal_end)
+    {
+        offset = wal->older[wal_frame_index(offset)];
+    }
+    pthread_mutex_unlock(&wal->latch);
+    // Frames before wal_end and the file itself stay unchanged while the snapshot is open
+    int read = offset != -1 ? read_at(wal->fd, data, PAGE_SIZE, offset + sizeof(WalFrameHeader))
+                            : read_at(db->fd, data, PAGE_SIZE, page_offset(page_no));
+    if (!read)
+    {
+        printf("Error: Failed to read page %d of a snapshot\n", page_no);
+        exit(1);
+    }
+}
+
+// Pin the page at offset for reading only. In mmap mode a page that is neither
+// cached nor newer in the WAL is returned in place from the mapping, with no
+// syscall or copy. Release with pool_release_view.
+const char *pool_view(Database *db, off_t offset)
+{
+    if (db->map != NULL && offset + PAGE_SIZE <= (off_t)db->map_size)
+    {
+        BufferPool *pool = db->pool;
+        pthread_mutex_lock(&pool->latch);
+        int cached = 0;
+        for (int i = pool->buckets[pool_bucket(pool, offset)]; i != -1 && !cached; i = pool->frames[i].hash_next)
+        {
+            cached = pool->frames[i].offset == offset;
+        }
+        int page_no = (int)(offset / PAGE_SIZE);
+        if (!cached && pagemap_get(&db->wal->pending, page_no) == -1 && pagemap_get(&db->wal->committed, page_no) == -1)
+        {
+            pool->mapped++;
+            pthread_mutex_unlock(&pool->latch);
+            return db->map + offset;
+        }
+        pthread_mutex_unlock(&pool->latch);
+    }
+    return pool_fetch(db, offset, 1);
+}
+
+void pool_release_view(Database *db, const char *data)
+{
+    if (db->map != NULL && data >= db->map && data < db->map + db->map_size)
+    {
+        return; // Mapped pages are not pinned
+    }
+    pool_unpin(db, (char *)data, 0);
+}
+
+// Map the whole database file again after it grew; no view may be held
+void db_remap(Database *db)
+{
+    if (!db->use_mmap)
+    {
+        return;
+    }
+    off_t size = lseek(db->fd, 0, SEEK_END);
+    if (size == 0 || db->map_size == (size_t)size)
+    {
+        return;
+    }
+    if (db->map != NULL)
+    {
+        munmap(db->map, db->map_size);
+    }
+    db->map = mmap(NULL, size, PROT_READ, MAP_SHARED, db->fd, 0);
+    if (db->map == MAP_FAILED)
+    {
+        perror("Error: Could not map database file\n");
+        exit(1);
+    }
+    db->map_size = size;
+    madvise(db->map, db->map_size, MADV_RANDOM); // Point lookups dominate
+}
+
+// Hint the kernel about the coming access pattern of mapped pages
+static void map_advise(Database *db, int advice)
+{
+    if (db->map != NULL)
+    {
+        madvise(db->map, db->map_size, advice);
+    }
+}
+
+static Slot *page_slots(const void *page)
+{
+    return (Slot *)((char *)page + sizeof(DataPageHeader));
+}
+
+// Cell stored in slot, or NULL for a tombstone
+static char *slot_cell(const void *page, int slot)
+{
+    const DataPageHeader *header = page;
+    Slot *slots = page_slots(page);
+    if (slot >= header->num_slots || slots[slot].offset == 0)
+    {
+        return NULL;
+    }
+    return (char *)page + slots[slot].offset;
+}
+
+// Format an empty slotted page (the page must already be zeroed)
+static void init_data_page(void *page)
+{
+    DataPageHeader *header = page;
+    header->cell_start = PAGE_SIZE;
+    header->free_bytes = PAGE_SIZE - sizeof(DataPageHeader);
+}
+
+// Move every live cell to the end of the page so the holes left by deletes
+// become one free gap. Slot numbers do not change.
+static void compact_page(void *page)
+{
+    char copy[PAGE_SIZE];
+    memcpy(copy, page, PAGE_SIZE);
+    DataPageHeader *header = page;
+    Slot *slots = page_slots(page);
+    int end = PAGE_SIZE;
+    for (int i = 0; i < header->num_slots; i++)
+    {
+        if (slots[i].offset != 0)
+        {
+            end -= slots[i].length;
+            memcpy((char *)page + end, copy + slots[i].offset, slots[i].length);
+            slots[i].offset = end;
+        }
+    }
+    header->cell_start = end;
+}
+
+// Copy a cell into the free gap and point slot at it, compacting the page
+// first if the holes left by deletes have to be merged to make room
+static void place_cell(void *page, int slot, const void *cell, int length)
+{
+    DataPageHeader *header = page;
+    Slot *slots = page_slots(page);
+    if (sizeof(DataPageHeader) + header->num_slots * sizeof(Slot) + length > header->cell_start)
+    {
+        compact_page(page); // Lazy compaction: only when the free gap is too small
+    }
+    header->cell_start -= length;
+    memcpy((char *)page + header->cell_start, cell, length);
+    slots[slot].offset = header->cell_start;
+    slots[slot].length = length;
+}
+
+// Store a cell in the page, returning its slot or -1 if it does not fit. A
+// tombstone is reused when there is one, so the slot directory does not grow
+// under insert/delete churn; otherwise a new slot is appended.
+static int page_insert(void *page, const void *cell, int length)
+{
+    DataPageHeader *header = page;
+    Slot *slots = page_slots(page);
+    int slot = header->num_slots;
+    if (header->num_rows < header->num_slots) // Some slot is a tombstone
+    {
+        for (slot = 0; slots[slot].offset != 0; slot++)
+        {
+        }
+    }
+    int needed = slot == header->num_slots ? length + (int)sizeof(Slot) : length;
+    if (header->free_bytes < needed)
+    {
+        return -1;
+    }
+    if (slot == header->num_slots)
+    {
+        slots[slot].offset = 0; // Not a live cell while the page is compacted
+        header->num_slots++;
+    }
+    place_cell(page, slot, cell, length);
+    header->free_bytes -= needed;
+    header->num_rows++;
+    return slot;
+}
+
+// Replace the cell in slot, keeping the slot number; returns 0 if the new
+// cell does not fit in this page
+static int page_update(void *page, int slot, const void *cell, int length)
+{
+    DataPageHeader *header = page;
+    Slot *slots = page_slots(page);
+    if (length <= slots[slot].length)
+    {
+        memcpy((char *)page + slots[slot].offset, cell, length);
+        header->free_bytes += slots[slot].length - length;
+        slots[slot].length = length;
+        return 1;
+    }
+    if (header->free_bytes + slots[slot].length < length)
+    {
+        return 0;
+    }
+    if (slots[slot].offset == header->cell_start)
+    {
+        header->cell_start += slots[slot].length;
+    }
+    header->free_bytes += slots[slot].length;
+    slots[slot].offset = 0;
+    place_cell(page, slot, cell, length);
+    header->free_bytes -= length;
+    return 1;
+}
+
+// Tombstone a slot in O(1); other rows do not move
+static void page_delete(void *page, int slot)
+{
+    DataPageHeader *header = page;
+    Slot *slots = page_slots(page);
+    assert(slot < header->num_slots && slots[slot].offset != 0);
+    if (slots[slot].offset == header->cell_start)
+    {
+        header->cell_start += slots[slot].length;
+    }
+    header->free_bytes += slots[slot].length;
+    slots[slot].offset = 0;
+    slots[slot].length = 0;
+    header->num_rows--;
+    // Trailing tombstones give their directory space back
+    while (header->num_slots > 0 && slots[header->num_slots - 1].offset == 0)
+    {
+        header->num_slots--;
+        header->free_bytes += sizeof(Slot);
+    }
+}
+
+// Free-space map pages sit at fixed page numbers 1, 1 + FSM_INTERVAL, ...
+// Each holds one byte per page it covers: the page's free bytes / FSM_GRANULE.
+static int is_fsm_page(int page_no)
+{
+    return page_no % FSM_INTERVAL == 1;
+}
+
+static int fsm_page_for(int page_no)
+{
+    return page_no - (page_no - 1) % FSM_INTERVAL;
+}
+
+// Record how much room a data page has (0 for pages that take no rows)
+static void fsm_set(Database *db, int page_no, int free_bytes)
+{
+    int category = free_bytes / FSM_GRANULE;
+    int base = fsm_page_for(page_no);
+    unsigned char *map = (unsigned char *)pool_fetch(db, page_offset(base), 1);
+    int changed = map[page_no - base] != category;
+    map[page_no - base] = (unsigned char)category;
+    pool_unpin(db, (char *)map, changed);
+}
+
+// First page in [from, to) with at least category units free, or 0
+static int fsm_scan(Database *db, int from, int to, int category)
+{
+    for (int base = fsm_page_for(from); base < to; base += FSM_INTERVAL)
+    {
+        unsigned char *map = (unsigned char *)pool_fetch(db, page_offset(base), 1);
+        int first = from > base ? from - base : 0;
+        int last = to - base < FSM_INTERVAL ? to - base : FSM_INTERVAL;
+        for (int i = first; i < last; i++)
+        {
+            if (map[i] >= category)
+            {
+                pool_unpin(db, (char *)map, 0);
+                return base + i;
+            }
+        }
+        pool_unpin(db, (char *)map, 0);
+    }
+    return 0;
+}
+
+// Find a page of the current table with room for bytes more, starting where
+// the table's last search succeeded (next-fit) and wrapping around. Pages of
+// other tables share the map and are skipped; after FSM_MAX_PROBES of them
+// the search gives up. Returns 0 if no page was found.
+static int fsm_find(Database *db, int bytes)
+{
+    Table *table = thread_table(db);
+    int category = (bytes + FSM_GRANULE - 1) / FSM_GRANULE;
+    if (table->fsm_hint < 2 || table->fsm_hint >= db->page_count)
+    {
+        table->fsm_hint = 2;
+    }
+    int ranges[2][2] = {{table->fsm_hint, db->page_count}, {2, table->fsm_hint}};
+    int probes = 0;
+    for (int r = 0; r < 2; r++)
+    {
+        int page_no = ranges[r][0];
+        while ((page_no = fsm_scan(db, page_no, ranges[r][1], category)) != 0)
+        {
+            const char *page = pool_view(db, page_offset(page_no));
+            int owner = ((const DataPageHeader *)page)->table_id;
+            pool_release_view(db, page);
+            if (owner == table->table_id)
+            {
+                table->fsm_hint = page_no;
+                return page_no;
+            }
+            if (++probes == FSM_MAX_PROBES)
+            {
+                return 0;
+            }
+            page_no++;
+        }
+    }
+    return 0;
+}
+
+// LEB128 varint: 7 bits per byte, high bit set on all but the last
+static int put_varint(unsigned char *out, unsigned int value)
+{
+    int n = 0;
+    while (value >= 0x80)
+    {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+static int get_varint(const unsigned char *in, unsigned int *value)
+{
+    int n = 0;
+    int shift = 0;
+    *value = 0;
+    do
+    {
+        *value |= (unsigned int)(in[n] & 0x7f) << shift;
+        shift += 7;
+    } while (in[n++] & 0x80);
+    return n;
+}
+
+// Write data to a new chain of overflow pages, returning the first page
+static int write_overflow(Database *db, const char *data, int length)
+{
+    int first = 0;
+    char *prev = NULL;
+    while (length > 0)
+    {
+        int page_no = allocate_page(db);
+        char *page = pool_fetch(db, page_offset(page_no), 0);
+        memset(page, 0, PAGE_SIZE);
+        OverflowPageHeader *header = (OverflowPageHeader *)page;
+        header->length = length < OVERFLOW_CAPACITY ? length : OVERFLOW_CAPACITY;
+        memcpy(page + sizeof(OverflowPageHeader), data, header->length);
+        data += header->length;
+        length -= header->length;
+        if (prev == NULL)
+        {
+            first = page_no;
+        }
+        else
+        {
+            ((OverflowPageHeader *)prev)->next_page = page_no;
+            pool_unpin(db, prev, 1);
+        }
+        prev = page;
+    }
+    pool_unpin(db, prev, 1);
+    return first;
+}
+
+// Copy the first size bytes of an overflow chain into out
+static void read_overflow(Database *db, const Snapshot *snapshot, int page_no, char *out, int size)
+{
+    char copy[PAGE_SIZE];
+    while (page_no != 0 && size > 0)
+    {
+        const char *page = copy;
+        if (snapshot != NULL)
+        {
+            snapshot_read_page(snapshot, page_no, copy);
+        }
+        else
+        {
+            page = pool_view(db, page_offset(page_no));
+        }
+        const OverflowPageHeader *header = (const OverflowPageHeader *)page;
+        int n = header->length < size ? header->length : size;
+        memcpy(out, page + sizeof(OverflowPageHeader), n);
+        out += n;
+        size -= n;
+        page_no = header->next_page;
+        if (snapshot == NULL)
+        {
+            pool_release_view(db, page);
+        }
+    }
+}
+
+// Return every page of an overflow chain to the freelist
+static void free_overflow(Database *db, int page_no)
+{
+    while (page_no != 0)
+    {
+        const char *page = pool_view(db, page_offset(page_no));
+        int next_page = ((const OverflowPageHeader *)page)->next_page;
+        pool_release_view(db, page);
+        free_page(db, page_no);
+        page_no = next_page;
+    }
+}
+
+// Compute a schema's record layout from its columns
+static void schema_layout(Schema *schema)
+{
+    int offset = (schema->num_columns + 7) / 8; // Null bitmap
+    int prev_end = -1;
+    schema->last_varlen = -1;
+    schema->name_column = -1;
+    for (int i = 0; i < schema->num_columns; i++)
+    {
+        int type = schema->columns[i].type;
+        if (type == COL_TEXT || type == COL_BLOB)
+        {
+            schema->last_varlen = i;
+        }
+    }
+    for (int i = 0; i < schema->num_columns; i++)
+    {
+        int type = schema->columns[i].type;
+        schema->offsets[i] = -1;
+        schema->prev_end[i] = -1;
+        if (type == COL_INT64 || type == COL_DOUBLE)
+        {
+            schema->offsets[i] = offset;
+            offset += 8;
+            continue;
+        }
+        schema->prev_end[i] = prev_end;
+        if (i != schema->last_varlen)
+        {
+            schema->offsets[i] = offset;
+            prev_end = offset;
+            offset += sizeof(unsigned int);
+        }
+        if (type == COL_TEXT && schema->name_column < 0)
+        {
+            schema->name_column = i;
+        }
+    }
+    schema->tail_start = offset;
+}
+
+// Bytes encode_record needs for values
+static int record_size(const Schema *schema, const Value *values)
+{
+    int size = schema->tail_start;
+    for (int i = 0; i < schema->num_columns; i++)
+    {
+        int type = schema->columns[i].type;
+        if ((type == COL_TEXT || type == COL_BLOB) && !values[i].is_null)
+        {
+            size += values[i].length;
+        }
+    }
+    return size;
+}
+
+// Encode one value per column into record; returns the record length
+static int encode_record(const Schema *schema, const Value *values, unsigned char *record)
+{
+    unsigned int end = 0; // Tail bytes written so far
+    memset(record, 0, schema->tail_start);
+    for (int i = 0; i < schema->num_columns; i++)
+    {
+        const Value *value = &values[i];
+        int type = schema->columns[i].type;
+        if (value->is_null)
+        {
+            record[i / 8] |= 1 << (i % 8);
+        }
+        else if (type == COL_INT64)
+        {
+            memcpy(record + schema->offsets[i], &value->int64, 8);
+        }
+        else if (type == COL_DOUBLE)
+        {
+            memcpy(record + schema->offsets[i], &value->real, 8);
+        }
+        else
+        {
+            memcpy(record + schema->tail_start + end, value->data, value->length);
+            end += value->length;
+        }
+        if (type != COL_INT64 && type != COL_DOUBLE && schema->offsets[i] >= 0)
+        {
+            memcpy(record + schema->offsets[i], &end, sizeof(unsigned int)); // A NULL ends where it starts
+        }
+    }
+    return schema->tail_start + end;
+}
+
+// Decode one column of a record without looking at the others. TEXT and
+// BLOB values point into the record.
+static void record_column(const Schema *schema, const unsigned char *record, int length, int column, Value *value)
+{
+    memset(value, 0, sizeof(Value));
+    if (record[column / 8] & (1 << (column % 8)))
+    {
+        value->is_null = 1;
+        return;
+    }
+    int type = schema->columns[column].type;
+    if (type == COL_INT64)
+    {
+        memcpy(&value->int64, record + schema->offsets[column], 8);
+        return;
+    }
+    if (type == COL_DOUBLE)
+    {
+        memcpy(&value->real, record + schema->offsets[column], 8);
+        return;
+    }
+    unsigned int start = 0;
+    unsigned int end = length - schema->tail_start;
+    if (schema->prev_end[column] >= 0)
+    {
+        memcpy(&start, record + schema->prev_end[column], sizeof(unsigned int));
+    }
+    if (schema->offsets[column] >= 0)
+    {
+        memcpy(&end, record + schema->offsets[column], sizeof(unsigned int));
+    }
+    value->data = (const char *)record + schema->tail_start + start;
+    value->length = end - start;
+}
+
+// Copy a record's name column (at most size - 1 bytes, NUL-terminated);
+// returns its full length, 0 if it is NULL or the table has none
+static int record_name(const Schema *schema, const unsigned char *record, int length, char *name, int size)
+{
+    Value value = {0};
+    if (schema->name_column >= 0)
+    {
+        record_column(schema, record, length, schema->name_column, &value);
+    }
+    int copy = value.length < size - 1 ? value.length : size - 1;
+    if (copy > 0)
+    {
+        memcpy(name, value.data, copy);
+    }
+    name[copy] = '\0';
+    return value.length;
+}
+
+// Wrap a record in a cell: varint id, varint (record length << 1 | spilled),
+// then the record, or for records over OVERFLOW_THRESHOLD the 4-byte first
+// page of an overflow chain. cell must hold MAX_CELL_SIZE bytes; returns its
+// length.
+static int encode_cell(Database *db, int id, const unsigned char *record, int length, unsigned char *cell)
+{
+    int spilled = length > OVERFLOW_THRESHOLD;
+    int n = put_varint(cell, (unsigned int)id);
+    n += put_varint(cell + n, ((unsigned int)length << 1) | spilled);
+    if (spilled)
+    {
+        int first = write_overflow(db, (const char *)record, length);
+        memcpy(cell + n, &first, sizeof(int));
+        return n + sizeof(int);
+    }
+    memcpy(cell + n, record, length);
+    return n + length;
+}
+
+// Find the record of a cell, setting *id and *length. An inline record is
+// returned in place; a spilled one is read (as of snapshot, unless NULL) into
+// a malloc'd copy that is also stored in *spill for the caller to free
+// (*spill is NULL otherwise).
+static const unsigned char *cell_record(Database *db, const Snapshot *snapshot, const unsigned char *cell, int *id, int *length, unsigned char **spill)
+{
+    unsigned int value;
+    int n = get_varint(cell, &value);
+    *id = (int)value;
+    n += get_varint(cell + n, &value);
+    *length = (int)(value >> 1);
+    *spill = NULL;
+    if (!(value & 1))
+    {
+        return cell + n;
+    }
+    int first;
+    memcpy(&first, cell + n, sizeof(int));
+    *spill = malloc(*length);
+    if (*spill == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    read_overflow(db, snapshot, first, (char *)*spill, *length);
+    return *spill;
+}
+
+// First overflow page of a cell, or 0 if the record is stored inline
+static int cell_overflow(const unsigned char *cell)
+{
+    unsigned int value;
+    int n = get_varint(cell, &value);
+    n += get_varint(cell + n, &value);
+    int first = 0;
+    if (value & 1)
+    {
+        memcpy(&first, cell + n, sizeof(int));
+    }
+    return first;
+}
+
+// Take a page from the freelist, or grow the file by one page
+int allocate_page(Database *db)
+{
+    if (db->freelist_head != 0)
+    {
+        int page_no = db->freelist_head;
+        char *page = pool_fetch(db, page_offset(page_no), 1);
+        memcpy(&db->freelist_head, page, sizeof(int)); // Free pages store the next free page first
+        pool_unpin(db, page, 0);
+        db->free_pages--;
+        return page_no;
+    }
+    int page_no = db->page_count++;
+    if (is_fsm_page(page_no))
+    {
+        // Growing into a free-space map position: format it and take the next page
+        char *map = pool_fetch(db, page_offset(page_no), 0);
+        memset(map, 0, PAGE_SIZE);
+        pool_unpin(db, map, 1);
+        page_no = db->page_count++;
+    }
+    return page_no;
+}
+
+// Return a page to the freelist so a later allocation can reuse it
+void free_page(Database *db, int page_no)
+{
+    assert(page_no != HEADER_PAGE && page_no < db->page_count);
+    char *page = pool_fetch(db, page_offset(page_no), 0);
+    memset(page, 0, PAGE_SIZE);
+    memcpy(page, &db->freelist_head, sizeof(int));
+    pool_unpin(db, page, 1);
+    db->freelist_head = page_no;
+    db->free_pages++;
+}
+
+// Pin data page page_no, reading it from the file on a miss
+void *get_page(Database *db, int page_no)
+{
+    assert(page_no != HEADER_PAGE && page_no < db->page_count);
+    return pool_fetch(db, page_offset(page_no), 1);
+}
+
+// Allocate an empty data page, link it at the end of the chain and return it pinned
+void *append_page(Database *db)
+{
+    Table *table = thread_table(db);
+    int page_no = allocate_page(db);
+    void *page = pool_fetch(db, page_offset(page_no), 0);
+    memset(page, 0, PAGE_SIZE);
+    init_data_page(page);
+    DataPageHeader *header = page;
+    header->table_id = (unsigned short)table->table_id;
+    header->prev_page = table->last_data_page;
+    if (table->last_data_page != 0)
+    {
+        DataPageHeader *last = get_page(db, table->last_data_page);
+        last->next_page = page_no;
+        release_page(db, last, 1);
+    }
+    else
+    {
+        table->first_data_page = page_no;
+    }
+    table->last_data_page = page_no;
+    table->num_pages++;
+    table->dirty = 1;
+    fsm_set(db, page_no, header->free_bytes);
+    return page;
+}
+
+// Unlink an empty data page from the chain and free it
+static void remove_page(Database *db, int page_no)
+{
+    Table *table = thread_table(db);
+    DataPageHeader *header = get_page(db, page_no);
+    int prev_page = header->prev_page;
+    int next_page = header->next_page;
+    release_page(db, header, 0);
+
+    if (prev_page != 0)
+    {
+        DataPageHeader *prev = get_page(db, prev_page);
+        prev->next_page = next_page;
+        release_page(db, prev, 1);
+    }
+    else
+    {
+        table->first_data_page = next_page;
+    }
+    if (next_page != 0)
+    {
+        DataPageHeader *next = get_page(db, next_page);
+        next->prev_page = prev_page;
+        release_page(db, next, 1);
+    }
+    else
+    {
+        table->last_data_page = prev_page;
+    }
+    table->num_pages--;
+    table->dirty = 1;
+    fsm_set(db, page_no, 0);
+    free_page(db, page_no);
+}
+
+// Unpin a data page returned by get_page or append_page
+void release_page(Database *db, void *page, int dirty)
+{
+    pool_unpin(db, page, dirty);
+}
+
+// Read a B-Tree node through the buffer pool
+void read_node(Database *db, off_t offset, BTreeNode *node)
+{
+    char *data = pool_fetch(db, offset, 1);
+    memcpy(node, data, PAGE_SIZE);
+    pool_unpin(db, data, 0);
+}
+
+// Write a B-Tree node into the buffer pool; it reaches disk on eviction or flush
+void write_node(Database *db, off_t offset, BTreeNode *node)
+{
+    char *data = pool_fetch(db, offset, 0);
+    memcpy(data, node, PAGE_SIZE);
+    pool_unpin(db, data, 1);
+}
+
+// Allocate a new node from the shared page space
+off_t allocate_node(Database *db)
+{
+    return page_offset(allocate_page(db));
+}
+
+// Point the leaf at offset (if any) back at prev, in place in the pool
+static void set_leaf_prev(Database *db, off_t offset, off_t prev)
+{
+    if (offset != 0)
+    {
+        BTreeNode *node = (BTreeNode *)pool_fetch(db, offset, 1);
+        node->data.leaf.prev = prev;
+        pool_unpin(db, (char *)node, 1);
+    }
+}
+
+// Internal nodes: number of keys <= id, i.e. the child to descend into.
+// Leaves: first entry with entries[i].id >= id.
+
+static int keys_upper_bound_linear(const int *keys, int n, int id)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        if (id < keys[i])
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+static int entries_lower_bound_linear(const IndexEntry *entries, int n, int id)
+{
+    int i;
+    for (i = 0; i < n && entries[i].id < id; i++)
+    {
+    }
+    return i;
+}
+
+// The loop body compiles to a conditional move, so the only branch is the loop
+// itself. Both possible next probes are prefetched because a node that is not in
+// the CPU cache would otherwise pay one full memory latency per step.
+static int keys_upper_bound_binary(const int *keys, int n, int id)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    const int *base = keys;
+    while (n > 1)
+    {
+        int half = n / 2;
+        __builtin_prefetch(&base[half / 2]);
+        __builtin_prefetch(&base[half + half / 2]);
+        base = (base[half] <= id) ? base + half : base;
+        n -= half;
+    }
+    return (int)(base - keys) + (*base <= id);
+}
+
+static int entries_lower_bound_binary(const IndexEntry *entries, int n, int id)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    const IndexEntry *base = entries;
+    while (n > 1)
+    {
+        int half = n / 2;
+        __builtin_prefetch(&base[half / 2]);
+        __builtin_prefetch(&base[half + half / 2]);
+        base = (base[half].id < id) ? base + half : base;
+        n -= half;
+    }
+    return (int)(base - entries) + (base->id < id);
+}
+
+#ifdef HAVE_X86_SIMD
+// Compare 4 keys at a time; the first lane with key > id is the answer
+__attribute__((target("sse2"))) static int keys_upper_bound_sse2(const int *keys, int n, int id)
+{
+    __m128i needle = _mm_set1_epi32(id);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(keys + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(block, needle)));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + keys_upper_bound_linear(keys + i, n - i, id);
+}
+
+// Compare 8 keys at a time; the first lane with key > id is the answer
+__attribute__((target("avx2"))) static int keys_upper_bound_avx2(const int *keys, int n, int id)
+{
+    __m256i needle = _mm256_set1_epi32(id);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(keys + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(block, needle)));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + keys_upper_bound_linear(keys + i, n - i, id);
+}
+#endif
+
+// Kernels in use. set_search_kernel may swap them while other threads search:
+// the pointers are atomic, so a search calls either the old kernel or the
+// new one, and any mix of the two answers the same.
+static _Atomic int search_kernel_chosen = 0;
+static int (*_Atomic keys_upper_bound)(const int *keys, int n, int id) = keys_upper_bound_binary;
+static int (*_Atomic entries_lower_bound)(const IndexEntry *entries, int n, int id) = entries_lower_bound_binary;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+// Pick the in-node search kernel; returns the kernel actually installed
+SearchKernel set_search_kernel(SearchKernel kernel)
+{
+    if (kernel == SEARCH_AUTO)
+    {
+        kernel = SEARCH_BINARY;
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            kernel = SEARCH_AVX2;
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            kernel = SEARCH_SSE2;
+        }
+#endif
+    }
+#ifdef HAVE_X86_SIMD
+    if ((kernel == SEARCH_AVX2 && !__builtin_cpu_supports("avx2")) ||
+        (kernel == SEARCH_SSE2 && !__builtin_cpu_supports("sse2")))
+    {
+        kernel = SEARCH_BINARY;
+    }
+#else
+    if (kernel == SEARCH_SSE2 || kernel == SEARCH_AVX2)
+    {
+        kernel = SEARCH_BINARY;
+    }
+#endif
+
+    search_kernel_chosen = 1;
+    int (*keys)(const int *keys, int n, int id) = keys_upper_bound_binary;
+    int (*entries)(const IndexEntry *entries, int n, int id) = entries_lower_bound_binary;
+    switch (kernel)
+    {
+    case SEARCH_LINEAR:
+        keys = keys_upper_bound_linear;
+        entries = entries_lower_bound_linear;
+        break;
+#ifdef HAVE_X86_SIMD
+    case SEARCH_SSE2:
+        keys = keys_upper_bound_sse2;
+        break;
+    case SEARCH_AVX2:
+        keys = keys_upper_bound_avx2;
+        break;
+#endif
+    default:
+        break;
+    }
+    keys_upper_bound = keys;
+    entries_lower_bound = entries;
+    return kernel;
+}
+
+static void choose_batch_kernels(void);
+
+// Install the best kernels for the CPU the first time a database opens,
+// unless the caller already picked a search kernel
+static void choose_kernels(void)
+{
+    if (!search_kernel_chosen)
+    {
+        set_search_kernel(SEARCH_AUTO);
+    }
+    choose_batch_kernels();
+}
+
+// Search the B-Tree for an ID; returns 1 and sets rid if found
+int btree_search(Database *db, int id, RecordId *rid)
+{
+    off_t current_offset = thread_table(db)->root_offset;
+
+    while (1)
+    {
+        // Search the pinned frame (or mapped page) in place instead of copying the node out
+        const BTreeNode *node = (const BTreeNode *)pool_view(db, current_offset);
+        if (node->is_leaf)
+        {
+            int i = entries_lower_bound(node->data.leaf.entries, node->num_keys, id);
+            int found = i < node->num_keys && node->data.leaf.entries[i].id == id;
+            if (found)
+            {
+                *rid = node->data.leaf.entries[i].rid;
+            }
+            pool_release_view(db, (const char *)node);
+            return found;
+        }
+        current_offset = node->data.internal.children[keys_upper_bound(node->data.internal.keys, node->num_keys, id)];
+        pool_release_view(db, (const char *)node);
+    }
+}
+
+// Maximum number of keys a node can hold
+static int node_capacity(BTreeNode *node)
+{
+    return node->is_leaf ? MAX_LEAF_KEYS : MAX_KEYS;
+}
+
+// Index of the child to descend into for id
+static int child_index(BTreeNode *node, int id)
+{
+    return keys_upper_bound(node->data.internal.keys, node->num_keys, id);
+}
+
+// Move the upper half of a full node into right, returning the separator key
+static int split_node(BTreeNode *node, BTreeNode *right)
+{
+    int mid = node_capacity(node) / 2;
+    int mid_key = node->is_leaf ? node->data.leaf.entries[mid].id : node->data.internal.keys[mid];
+    right->num_keys = 0;
+    right->is_leaf = node->is_leaf;
+
+    // Leaves keep the separator in the right half; internal nodes move it up
+    for (int i = mid + (node->is_leaf ? 0 : 1); i < node->num_keys; i++)
+    {
+        if (node->is_leaf)
+        {
+            right->data.leaf.entries[right->num_keys] = node->data.leaf.entries[i];
+        }
+        else
+        {
+            right->data.internal.keys[right->num_keys] = node->data.internal.keys[i];
+            right->data.internal.children[right->num_keys] = node->data.internal.children[i];
+        }
+        right->num_keys++;
+    }
+    if (!node->is_leaf)
+    {
+        right->data.internal.children[right->num_keys] = node->data.internal.children[node->num_keys];
+    }
+    node->num_keys = mid;
+    return mid_key;
+}
+
+// Split the full child at children[index] of parent; parent must have room for one more key
+static void split_child(Database *db, BTreeNode *parent, int index, BTreeNode *child)
+{
+    off_t child_offset = parent->data.internal.children[index];
+    off_t right_offset = allocate_node(db);
+    BTreeNode right = {0};
+    int separator = split_node(child, &right);
+    if (child->is_leaf)
+    {
+        // Link the new leaf in between child and its old successor
+        right.data.leaf.prev = child_offset;
+        right.data.leaf.next = child->data.leaf.next;
+        set_leaf_prev(db, right.data.leaf.next, right_offset);
+        child->data.leaf.next = right_offset;
+    }
+
+    for (int i = parent->num_keys; i > index; i--)
+    {
+        parent->data.internal.keys[i] = parent->data.internal.keys[i - 1];
+        parent->data.internal.children[i + 1] = parent->data.internal.children[i];
+    }
+    parent->data.internal.keys[index] = separator;
+    parent->data.internal.children[index + 1] = right_offset;
+    parent->num_keys++;
+
+    write_node(db, child_offset, child);
+    write_node(db, right_offset, &right);
+}
+
+// Insert into the B-Tree, splitting full nodes on the way down
+void btree_insert(Database *db, int id, RecordId rid)
+{
+    Table *table = thread_table(db);
+    BTreeNode node;
+    read_node(db, table->root_offset, &node);
+
+    // If root is full, split it and create a new root
+    if (node.num_keys >= node_capacity(&node))
+    {
+        off_t old_root_offset = table->root_offset;
+        off_t new_root_offset = allocate_node(db);
+        BTreeNode new_root = {0};
+        new_root.data.internal.children[0] = old_root_offset;
+        split_child(db, &new_root, 0, &node);
+        write_node(db, new_root_offset, &new_root);
+        table->root_offset = new_root_offset;
+        table->dirty = 1;
+        node = new_root;
+    }
+
+    // Descend, splitting any full child before entering it so the parent always has room
+    off_t current_offset = table->root_offset;
+    while (!node.is_leaf)
+    {
+        int i = child_index(&node, id);
+        BTreeNode child;
+        read_node(db, node.data.internal.children[i], &child);
+        if (child.num_keys >= node_capacity(&child))
+        {
+            split_child(db, &node, i, &child);
+            write_node(db, current_offset, &node);
+            if (id >= node.data.internal.keys[i])
+            {
+                i++;
+                read_node(db, node.data.internal.children[i], &child);
+            }
+        }
+        current_offset = node.data.internal.children[i];
+        node = child;
+    }
+
+    // Insert into leaf
+    int i = entries_lower_bound(node.data.leaf.entries, node.num_keys, id);
+    memmove(&node.data.leaf.entries[i + 1], &node.data.leaf.entries[i], (node.num_keys - i) * sizeof(IndexEntry));
+    node.data.leaf.entries[i].id = id;
+    node.data.leaf.entries[i].rid = rid;
+    node.num_keys++;
+    write_node(db, current_offset, &node);
+}
+
+// Point the entry of id at a new record ID, in place in its leaf. A row that
+// moves to another page keeps its place in the tree, so nothing splits or merges.
+static void btree_update_rid(Database *db, int id, RecordId rid)
+{
+    off_t offset = thread_table(db)->root_offset;
+    while (1)
+    {
+        BTreeNode *node = (BTreeNode *)pool_fetch(db, offset, 1);
+        if (node->is_leaf)
+        {
+            int i = entries_lower_bound(node->data.leaf.entries, node->num_keys, id);
+            assert(i < node->num_keys && node->data.leaf.entries[i].id == id);
+            node->data.leaf.entries[i].rid = rid;
+            pool_unpin(db, (char *)node, 1);
+            return;
+        }
+        off_t child = node->data.internal.children[keys_upper_bound(node->data.internal.keys, node->num_keys, id)];
+        pool_unpin(db, (char *)node, 0);
+        offset = child;
+    }
+}
+
+// Number of levels from the root to the leaves
+int btree_height(Database *db)
+{
+    BTreeNode node;
+    int height = 1;
+    read_node(db, thread_table(db)->root_offset, &node);
+    while (!node.is_leaf)
+    {
+        read_node(db, node.data.internal.children[0], &node);
+        height++;
+    }
+    return height;
+}
+
+// Minimum number of keys a non-root node may hold
+static int node_min_keys(BTreeNode *node)
+{
+    return node->is_leaf ? MIN_LEAF_KEYS : MIN_KEYS;
+}
+
+// Move the last key of left into the front of child (child is parent's child index)
+static void borrow_from_left(BTreeNode *parent, int index, BTreeNode *left, BTreeNode *child)
+{
+    if (child->is_leaf)
+    {
+        memmove(&child->data.leaf.entries[1], &child->data.leaf.entries[0], child->num_keys * sizeof(IndexEntry));
+        child->data.leaf.entries[0] = left->data.leaf.entries[left->num_keys - 1];
+        parent->data.internal.keys[index - 1] = child->data.leaf.entries[0].id;
+    }
+    else
+    {
+        memmove(&child->data.internal.keys[1], &child->data.internal.keys[0], child->num_keys * sizeof(int));
+        memmove(&child->data.internal.children[1], &child->data.internal.children[0], (child->num_keys + 1) * sizeof(off_t));
+        child->data.internal.keys[0] = parent->data.internal.keys[index - 1];
+        child->data.internal.children[0] = left->data.internal.children[left->num_keys];
+        parent->data.internal.keys[index - 1] = left->data.internal.keys[left->num_keys - 1];
+    }
+    child->num_keys++;
+    left->num_keys--;
+}
+
+// Move the first key of right onto the end of child (child is parent's child index)
+static void borrow_from_right(BTreeNode *parent, int index, BTreeNode *child, BTreeNode *right)
+{
+    if (child->is_leaf)
+    {
+        child->data.leaf.entries[child->num_keys] = right->data.leaf.entries[0];
+        memmove(&right->data.leaf.entries[0], &right->data.leaf.entries[1], (right->num_keys - 1) * sizeof(IndexEntry));
+        parent->data.internal.keys[index] = right->data.leaf.entries[0].id;
+    }
+    else
+    {
+        child->data.internal.keys[child->num_keys] = parent->data.internal.keys[index];
+        child->data.internal.children[child->num_keys + 1] = right->data.internal.children[0];
+        parent->data.internal.keys[index] = right->data.internal.keys[0];
+        memmove(&right->data.internal.keys[0], &right->data.internal.keys[1], (right->num_keys - 1) * sizeof(int));
+        memmove(&right->data.internal.children[0], &right->data.internal.children[1], right->num_keys * sizeof(off_t));
+    }
+    child->num_keys++;
+    right->num_keys--;
+}
+
+// Append right to left and drop the separator keys[index] and children[index + 1] from parent
+static void merge_nodes(BTreeNode *parent, int index, BTreeNode *left, BTreeNode *right)
+{
+    if (left->is_leaf)
+    {
+        memcpy(&left->data.leaf.entries[left->num_keys], &right->data.leaf.entries[0], right->num_keys * sizeof(IndexEntry));
+        left->num_keys += right->num_keys;
+    }
+    else
+    {
+        left->data.internal.keys[left->num_keys] = parent->data.internal.keys[index];
+        memcpy(&left->data.internal.keys[left->num_keys + 1], &right->data.internal.keys[0], right->num_keys * sizeof(int));
+        memcpy(&left->data.internal.children[left->num_keys + 1], &right->data.internal.children[0], (right->num_keys + 1) * sizeof(off_t));
+        left->num_keys += right->num_keys + 1;
+    }
+    memmove(&parent->data.internal.keys[index], &parent->data.internal.keys[index + 1], (parent->num_keys - index - 1) * sizeof(int));
+    memmove(&parent->data.internal.children[index + 1], &parent->data.internal.children[index + 2], (parent->num_keys - index - 1) * sizeof(off_t));
+    parent->num_keys--;
+}
+
+// Give the child at index more than the minimum number of keys, so deleting
+// below it cannot underflow, by borrowing from a sibling or merging with one.
+// Returns the child index to descend into and leaves that node in child.
+static int fill_child(Database *db, BTreeNode *parent, int index, BTreeNode *child)
+{
+    off_t child_offset = parent->data.internal.children[index];
+    BTreeNode left, right;
+
+    if (index > 0)
+    {
+        off_t left_offset = parent->data.internal.children[index - 1];
+        read_node(db, left_offset, &left);
+        if (left.num_keys > node_min_keys(&left))
+        {
+            borrow_from_left(parent, index, &left, child);
+            write_node(db, left_offset, &left);
+            write_node(db, child_offset, child);
+            return index;
+        }
+    }
+    if (index < parent->num_keys)
+    {
+        off_t right_offset = parent->data.internal.children[index + 1];
+        read_node(db, right_offset, &right);
+        if (right.num_keys > node_min_keys(&right))
+        {
+            borrow_from_right(parent, index, child, &right);
+            write_node(db, right_offset, &right);
+            write_node(db, child_offset, child);
+            return index;
+        }
+        merge_nodes(parent, index, child, &right);
+        if (child->is_leaf)
+        {
+            child->data.leaf.next = right.data.leaf.next;
+            set_leaf_prev(db, child->data.leaf.next, child_offset);
+        }
+        write_node(db, child_offset, child);
+        free_page(db, (int)(right_offset / PAGE_SIZE));
+        return index;
+    }
+
+    // Rightmost child with a minimal left sibling: merge into the sibling
+    off_t left_offset = parent->data.internal.children[index - 1];
+    merge_nodes(parent, index - 1, &left, child);
+    if (left.is_leaf)
+    {
+        left.data.leaf.next = child->data.leaf.next;
+        set_leaf_prev(db, left.data.leaf.next, left_offset);
+    }
+    write_node(db, left_offset, &left);
+    free_page(db, (int)(child_offset / PAGE_SIZE));
+    *child = left;
+    return index - 1;
+}
+
+// Delete from the B-Tree, rebalancing on the way down so no node underflows
+void btree_delete(Database *db, int id)
+{
+    Table *table = thread_table(db);
+    BTreeNode node;
+    off_t current_offset = table->root_offset;
+    read_node(db, current_offset, &node);
+
+    while (!node.is_leaf)
+    {
+        int i = child_index(&node, id);
+        BTreeNode child;
+        read_node(db, node.data.internal.children[i], &child);
+        if (child.num_keys <= node_min_keys(&child))
+        {
+            i = fill_child(db, &node, i, &child);
+            if (node.num_keys == 0)
+            {
+                // The root lost its last separator: its only child becomes the root
+                assert(current_offset == table->root_offset);
+                free_page(db, (int)(current_offset / PAGE_SIZE));
+                table->root_offset = node.data.internal.children[0];
+                table->dirty = 1;
+                current_offset = table->root_offset;
+                node = child;
+                continue;
+            }
+            write_node(db, current_offset, &node);
+        }
+        current_offset = node.data.internal.children[i];
+        node = child;
+    }
+
+    // Delete from leaf
+    int i = entries_lower_bound(node.data.leaf.entries, node.num_keys, id);
+    if (i == node.num_keys || node.data.leaf.entries[i].id != id)
+    {
+        return; // Not found
+    }
+    memmove(&node.data.leaf.entries[i], &node.data.leaf.entries[i + 1], (node.num_keys - i - 1) * sizeof(IndexEntry));
+    node.num_keys--;
+    write_node(db, current_offset, &node);
+}
+
+// The cursor's table, or NULL if a rollback dropped it
+static Table *cursor_table(Cursor *cursor)
+{
+    for (int i = 1; i < cursor->db->num_tables; i++)
+    {
+        if (cursor->db->tables[i]->table_id == cursor->table_id)
+        {
+            return cursor->db->tables[i];
+        }
+    }
+    return NULL;
+}
+
+// Point the cursor at the leaf entry where id belongs: the first entry not
+// below id, or with after set the first one above it
+static int cursor_descend(Cursor *cursor, int id, int after)
+{
+    Database *db = cursor->db;
+    Table *table = cursor_table(cursor);
+    if (table == NULL)
+    {
+        cursor->state = CURSOR_AFTER_LAST;
+        return 0;
+    }
+    off_t offset = table->root_offset;
+    while (1)
+    {
+        const BTreeNode *node = (const BTreeNode *)pool_view(db, offset);
+        if (node->is_leaf)
+        {
+            int i = entries_lower_bound(node->data.leaf.entries, node->num_keys, id);
+            if (after && i < node->num_keys && node->data.leaf.entries[i].id == id)
+            {
+                i++;
+            }
+            cursor->leaf = offset;
+            cursor->index = i;
+            pool_release_view(db, (const char *)node);
+            return 1;
+        }
+        off_t child = node->data.internal.children[keys_upper_bound(node->data.internal.keys, node->num_keys, id)];
+        pool_release_view(db, (const char *)node);
+        offset = child;
+    }
+}
+
+// Load the entry at the cursor, following next links while the index is
+// past the end of its leaf (returns 1 if on a row)
+static int cursor_forward(Cursor *cursor)
+{
+    while (1)
+    {
+        const BTreeNode *node = (const BTreeNode *)pool_view(cursor->db, cursor->leaf);
+        if (cursor->index < node->num_keys)
+        {
+            cursor->id = node->data.leaf.entries[cursor->index].id;
+            cursor->rid = node->data.leaf.entries[cursor->index].rid;
+            cursor->state = CURSOR_ON_ROW;
+            pool_release_view(cursor->db, (const char *)node);
+            return 1;
+        }
+        off_t next = node->data.leaf.next;
+        pool_release_view(cursor->db, (const char *)node);
+        if (next == 0)
+        {
+            cursor->state = CURSOR_AFTER_LAST;
+            return 0;
+        }
+        cursor->leaf = next;
+        cursor->index = 0;
+    }
+}
+
+// Load the entry at the cursor, following prev links while the index is
+// before the start of its leaf (returns 1 if on a row)
+static int cursor_backward(Cursor *cursor)
+{
+    while (1)
+    {
+        const BTreeNode *node = (const BTreeNode *)pool_view(cursor->db, cursor->leaf);
+        if (cursor->index >= node->num_keys)
+        {
+            cursor->index = node->num_keys - 1; // Entered from the right
+        }
+        if (cursor->index >= 0)
+        {
+            cursor->id = node->data.leaf.entries[cursor->index].id;
+            cursor->rid = node->data.leaf.entries[cursor->index].rid;
+            cursor->state = CURSOR_ON_ROW;
+            pool_release_view(cursor->db, (const char *)node);
+            return 1;
+        }
+        off_t prev = node->data.leaf.prev;
+        pool_release_view(cursor->db, (const char *)node);
+        if (prev == 0)
+        {
+            cursor->state = CURSOR_BEFORE_FIRST;
+            return 0;
+        }
+        cursor->leaf = prev;
+        cursor->index = MAX_LEAF_KEYS;
+    }
+}
+
+// Whether the cursor's leaf still holds its row at the same index, so it
+// can step without searching from the root; refreshes the record ID
+static int cursor_in_place(Cursor *cursor)
+{
+    if (cursor_table(cursor) == NULL)
+    {
+        return 0;
+    }
+    const BTreeNode *node = (const BTreeNode *)pool_view(cursor->db, cursor->leaf);
+    int in_place = node->is_leaf && cursor->index < node->num_keys && node->data.leaf.entries[cursor->index].id == cursor->id;
+    if (in_place)
+    {
+        cursor->rid = node->data.leaf.entries[cursor->index].rid;
+    }
+    pool_release_view(cursor->db, (const char *)node);
+    return in_place;
+}
+
+// Find the cursor's row again if its entry moved (returns 0 if the row was
+// deleted, leaving the cursor as it was)
+static int cursor_refresh(Cursor *cursor)
+{
+    if (cursor_in_place(cursor))
+    {
+        return 1;
+    }
+    Cursor found = *cursor;
+    if (!cursor_descend(&found, cursor->id, 0) || !cursor_forward(&found) || found.id != cursor->id)
+    {
+        return 0;
+    }
+    *cursor = found;
+    return 1;
+}
+
+// Position a cursor on the current table's first row with an id >= id
+// (returns 1 if there is one, 0 if the cursor is past the last row)
+static int cursor_seek_locked(Database *db, Cursor *cursor, int id)
+{
+    memset(cursor, 0, sizeof(Cursor));
+    cursor->db = db;
+    cursor->table_id = thread_table(db)->table_id;
+    return cursor_descend(cursor, id, 0) && cursor_forward(cursor);
+}
+
+int cursor_seek(Database *db, Cursor *cursor, int id)
+{
+    if (!db_read_lock(db))
+    {
+        memset(cursor, 0, sizeof(Cursor));
+        cursor->db = db;
+        cursor->state = CURSOR_AFTER_LAST;
+        return 0;
+    }
+    int result = cursor_seek_locked(db, cursor, id);
+    db_unlock(db);
+    return result;
+}
+
+// Move to the next row in id order (returns 1 if there is one)
+static int cursor_next_locked(Cursor *cursor)
+{
+    if (cursor->state == CURSOR_AFTER_LAST)
+    {
+        return 0;
+    }
+    if (cursor->state == CURSOR_BEFORE_FIRST)
+    {
+        return cursor_descend(cursor, 0, 0) && cursor_forward(cursor);
+    }
+    if (!cursor_in_place(cursor))
+    {
+        return cursor_descend(cursor, cursor->id, 1) && cursor_forward(cursor);
+    }
+    cursor->index++;
+    return cursor_forward(cursor);
+}
+
+int cursor_next(Cursor *cursor)
+{
+    if (!db_read_lock(cursor->db))
+    {
+        return 0;
+    }
+    int result = cursor_next_locked(cursor);
+    db_unlock(cursor->db);
+    return result;
+}
+
+// Move to the previous row in id order (returns 1 if there is one)
+static int cursor_prev_locked(Cursor *cursor)
+{
+    if (cursor->state == CURSOR_BEFORE_FIRST)
+    {
+        return 0;
+    }
+    if (cursor->state == CURSOR_AFTER_LAST || !cursor_in_place(cursor))
+    {
+        // Step back from where the current id would go (after every row at the end)
+        int after = cursor->state == CURSOR_AFTER_LAST;
+        if (!cursor_descend(cursor, after ? INT_MAX : cursor->id, after))
+        {
+            return 0;
+        }
+    }
+    cursor->index--;
+    return cursor_backward(cursor);
+}
+
+int cursor_prev(Cursor *cursor)
+{
+    if (!db_read_lock(cursor->db))
+    {
+        return 0;
+    }
+    int result = cursor_prev_locked(cursor);
+    db_unlock(cursor->db);
+    return result;
+}
+
+// Order-preserving image of a value for a secondary index: integers with
+// the sign bit flipped, doubles by their IEEE bits (negatives inverted), TEXT
+// and BLOB by their first 16 bytes. Values sharing a longer prefix share a
+// key and are told apart by reading the row.
+static IndexKey index_key(int type, const Value *value)
+{
+    IndexKey key = {0, 0};
+    if (type == COL_INT64)
+    {
+        key.high = (unsigned long long)value->int64 ^ (1ULL << 63);
+    }
+    else if (type == COL_DOUBLE)
+    {
+        double real = value->real == 0 ? 0 : value->real; // -0.0 and 0.0 are equal
+        memcpy(&key.high, &real, 8);
+        key.high = (key.high & (1ULL << 63)) ? ~key.high : key.high | (1ULL << 63);
+    }
+    else
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            unsigned long long byte = i < value->length ? (unsigned char)value->data[i] : 0;
+            if (i < 8)
+            {
+                key.high = key.high << 8 | byte;
+            }
+            else
+            {
+                key.low = key.low << 8 | byte;
+            }
+        }
+    }
+    return key;
+}
+
+static int key_compare(const IndexKey *a, const IndexKey *b)
+{
+    if (a->high != b->high)
+    {
+        return a->high < b->high ? -1 : 1;
+    }
+    return (a->low > b->low) - (a->low < b->low);
+}
+
+// Order index entries by key, then id
+static int ix_compare(const IndexKey *key1, int id1, const IndexKey *key2, int id2)
+{
+    int cmp = key_compare(key1, key2);
+    return cmp != 0 ? cmp : (id1 > id2) - (id1 < id2);
+}
+
+// First of n entries not below (key, id)
+static int ix_lower_bound(const IndexKey *keys, const int *ids, int n, const IndexKey *key, int id)
+{
+    int low = 0;
+    int high = n;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (ix_compare(&keys[mid], ids[mid], key, id) < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Child of an internal node to descend into for (key, id): the number of
+// separators not above it
+static int ix_child(const IndexNode *node, const IndexKey *key, int id)
+{
+    int low = 0;
+    int high = node->num_keys;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (ix_compare(&node->data.internal.keys[mid], node->data.internal.ids[mid], key, id) <= 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int ix_full(const IndexNode *node)
+{
+    return node->num_keys >= (node->is_leaf ? MAX_IX_LEAF_KEYS : MAX_IX_KEYS);
+}
+
+static void ix_read(Database *db, off_t offset, IndexNode *node)
+{
+    char *data = pool_fetch(db, offset, 1);
+    memcpy(node, data, PAGE_SIZE);
+    pool_unpin(db, data, 0);
+}
+
+static void ix_write(Database *db, off_t offset, const IndexNode *node)
+{
+    char *data = pool_fetch(db, offset, 0);
+    memcpy(data, node, PAGE_SIZE);
+    pool_unpin(db, data, 1);
+}
+
+// Split the full child at children[index] of parent, which must have room
+// for one more key. Leaves copy their first upper entry up as the separator
+// and link to the new right leaf; internal nodes move their middle key up.
+static void ix_split_child(Database *db, IndexNode *parent, int index, IndexNode *child)
+{
+    off_t child_offset = parent->data.internal.children[index];
+    off_t right_offset = allocate_node(db);
+    IndexNode right = {0};
+    int mid = (child->is_leaf ? MAX_IX_LEAF_KEYS : MAX_IX_KEYS) / 2;
+    IndexKey key;
+    int id;
+    right.is_leaf = child->is_leaf;
+    if (child->is_leaf)
+    {
+        right.num_keys = child->num_keys - mid;
+        memcpy(right.data.leaf.keys, child->data.leaf.keys + mid, right.num_keys * sizeof(IndexKey));
+        memcpy(right.data.leaf.ids, child->data.leaf.ids + mid, right.num_keys * sizeof(int));
+        right.data.leaf.next = child->data.leaf.next;
+        child->data.leaf.next = right_offset;
+        key = right.data.leaf.keys[0];
+        id = right.data.leaf.ids[0];
+    }
+    else
+    {
+        right.num_keys = child->num_keys - mid - 1;
+        memcpy(right.data.internal.keys, child->data.internal.keys + mid + 1, right.num_keys * sizeof(IndexKey));
+        memcpy(right.data.internal.ids, child->data.internal.ids + mid + 1, right.num_keys * sizeof(int));
+        memcpy(right.data.internal.children, child->data.internal.children + mid + 1, (right.num_keys + 1) * sizeof(off_t));
+        key = child->data.internal.keys[mid];
+        id = child->data.internal.ids[mid];
+    }
+    child->num_keys = mid;
+
+    int n = parent->num_keys - index;
+    memmove(&parent->data.internal.keys[index + 1], &parent->data.internal.keys[index], n * sizeof(IndexKey));
+    memmove(&parent->data.internal.ids[index + 1], &parent->data.internal.ids[index], n * sizeof(int));
+    memmove(&parent->data.internal.children[index + 2], &parent->data.internal.children[index + 1], n * sizeof(off_t));
+    parent->data.internal.keys[index] = key;
+    parent->data.internal.ids[index] = id;
+    parent->data.internal.children[index + 1] = right_offset;
+    parent->num_keys++;
+
+    ix_write(db, child_offset, child);
+    ix_write(db, right_offset, &right);
+}
+
+// Add (key, id) to a secondary index, splitting full nodes on the way down
+static void ix_insert(Database *db, Table *table, SecondaryIndex *index, const IndexKey *key, int id)
+{
+    IndexNode node;
+    ix_read(db, index->root_offset, &node);
+    if (ix_full(&node))
+    {
+        off_t new_root_offset = allocate_node(db);
+        IndexNode new_root = {0};
+        new_root.data.internal.children[0] = index->root_offset;
+        ix_split_child(db, &new_root, 0, &node);
+        ix_write(db, new_root_offset, &new_root);
+        index->root_offset = new_root_offset;
+        table->dirty = 1;
+        node = new_root;
+    }
+
+    off_t current_offset = index->root_offset;
+    while (!node.is_leaf)
+    {
+        int i = ix_child(&node, key, id);
+        IndexNode child;
+        ix_read(db, node.data.internal.children[i], &child);
+        if (ix_full(&child))
+        {
+            ix_split_child(db, &node, i, &child);
+            ix_write(db, current_offset, &node);
+            if (ix_compare(key, id, &node.data.internal.keys[i], node.data.internal.ids[i]) >= 0)
+            {
+                i++;
+                ix_read(db, node.data.internal.children[i], &child);
+            }
+        }
+        current_offset = node.data.internal.children[i];
+        node = child;
+    }
+
+    int i = ix_lower_bound(node.data.leaf.keys, node.data.leaf.ids, node.num_keys, key, id);
+    memmove(&node.data.leaf.keys[i + 1], &node.data.leaf.keys[i], (node.num_keys - i) * sizeof(IndexKey));
+    memmove(&node.data.leaf.ids[i + 1], &node.data.leaf.ids[i], (node.num_keys - i) * sizeof(int));
+    node.data.leaf.keys[i] = *key;
+    node.data.leaf.ids[i] = id;
+    node.num_keys++;
+    ix_write(db, current_offset, &node);
+}
+
+// Minimum number of entries a non-root secondary index node may hold
+static int ix_min_keys(const IndexNode *node)
+{
+    return node->is_leaf ? MIN_IX_LEAF_KEYS : MIN_IX_KEYS;
+}
+
+// Move the last entry of left into the front of child (child is parent's child index)
+static void ix_borrow_from_left(IndexNode *parent, int index, IndexNode *left, IndexNode *child)
+{
+    if (child->is_leaf)
+    {
+        memmove(&child->data.leaf.keys[1], &child->data.leaf.keys[0], child->num_keys * sizeof(IndexKey));
+        memmove(&child->data.leaf.ids[1], &child->data.leaf.ids[0], child->num_keys * sizeof(int));
+        child->data.leaf.keys[0] = left->data.leaf.keys[left->num_keys - 1];
+        child->data.leaf.ids[0] = left->data.leaf.ids[left->num_keys - 1];
+        parent->data.internal.keys[index - 1] = child->data.leaf.keys[0];
+        parent->data.internal.ids[index - 1] = child->data.leaf.ids[0];
+    }
+    else
+    {
+        memmove(&child->data.internal.keys[1], &child->data.internal.keys[0], child->num_keys * sizeof(IndexKey));
+        memmove(&child->data.internal.ids[1], &child->data.internal.ids[0], child->num_keys * sizeof(int));
+        memmove(&child->data.internal.children[1], &child->data.internal.children[0], (child->num_keys + 1) * sizeof(off_t));
+        child->data.internal.keys[0] = parent->data.internal.keys[index - 1];
+        child->data.internal.ids[0] = parent->data.internal.ids[index - 1];
+        child->data.internal.children[0] = left->data.internal.children[left->num_keys];
+        parent->data.internal.keys[index - 1] = left->data.internal.keys[left->num_keys - 1];
+        parent->data.internal.ids[index - 1] = left->data.internal.ids[left->num_keys - 1];
+    }
+    child->num_keys++;
+    left->num_keys--;
+}
+
+// Move the first entry of right onto the end of child (child is parent's child index)
+static void ix_borrow_from_right(IndexNode *parent, int index, IndexNode *child, IndexNode *right)
+{
+    if (child->is_leaf)
+    {
+        child->data.leaf.keys[child->num_keys] = right->data.leaf.keys[0];
+        child->data.leaf.ids[child->num_keys] = right->data.leaf.ids[0];
+        memmove(&right->data.leaf.keys[0], &right->data.leaf.keys[1], (right->num_keys - 1) * sizeof(IndexKey));
+        memmove(&right->data.leaf.ids[0], &right->data.leaf.ids[1], (right->num_keys - 1) * sizeof(int));
+        parent->data.internal.keys[index] = right->data.leaf.keys[0];
+        parent->data.internal.ids[index] = right->data.leaf.ids[0];
+    }
+    else
+    {
+        child->data.internal.keys[child->num_keys] = parent->data.internal.keys[index];
+        child->data.internal.ids[child->num_keys] = parent->data.internal.ids[index];
+        child->data.internal.children[child->num_keys + 1] = right->data.internal.children[0];
+        parent->data.internal.keys[index] = right->data.internal.keys[0];
+        parent->data.internal.ids[index] = right->data.internal.ids[0];
+        memmove(&right->data.internal.keys[0], &right->data.internal.keys[1], (right->num_keys - 1) * sizeof(IndexKey));
+        memmove(&right->data.internal.ids[0], &right->data.internal.ids[1], (right->num_keys - 1) * sizeof(int));
+        memmove(&right->data.internal.children[0], &right->data.internal.children[1], right->num_keys * sizeof(off_t));
+    }
+    child->num_keys++;
+    right->num_keys--;
+}
+
+// Append right to left, unlink right from the leaf chain and drop the
+// separator keys[index] and children[index + 1] from parent
+static void ix_merge_nodes(IndexNode *parent, int index, IndexNode *left, IndexNode *right)
+{
+    if (left->is_leaf)
+    {
+        memcpy(&left->data.leaf.keys[left->num_keys], &right->data.leaf.keys[0], right->num_keys * sizeof(IndexKey));
+        memcpy(&left->data.leaf.ids[left->num_keys], &right->data.leaf.ids[0], right->num_keys * sizeof(int));
+        left->num_keys += right->num_keys;
+        left->data.leaf.next = right->data.leaf.next;
+    }
+    else
+    {
+        left->data.internal.keys[left->num_keys] = parent->data.internal.keys[index];
+        left->data.internal.ids[left->num_keys] = parent->data.internal.ids[index];
+        memcpy(&left->data.internal.keys[left->num_keys + 1], &right->data.internal.keys[0], right->num_keys * sizeof(IndexKey));
+        memcpy(&left->data.internal.ids[left->num_keys + 1], &right->data.internal.ids[0], right->num_keys * sizeof(int));
+        memcpy(&left->data.internal.children[left->num_keys + 1], &right->data.internal.children[0], (right->num_keys + 1) * sizeof(off_t));
+        left->num_keys += right->num_keys + 1;
+    }
+    int n = parent->num_keys - index - 1;
+    memmove(&parent->data.internal.keys[index], &parent->data.internal.keys[index + 1], n * sizeof(IndexKey));
+    memmove(&parent->data.internal.ids[index], &parent->data.internal.ids[index + 1], n * sizeof(int));
+    memmove(&parent->data.internal.children[index + 1], &parent->data.internal.children[index + 2], n * sizeof(off_t));
+    parent->num_keys--;
+}
+
+// Secondary index counterpart of fill_child: give the child at index more
+// than the minimum number of entries by borrowing from a sibling or merging
+// with one. Returns the child index to descend into and leaves that node in child.
+static int ix_fill_child(Database *db, IndexNode *parent, int index, IndexNode *child)
+{
+    off_t child_offset = parent->data.internal.children[index];
+    IndexNode left, right;
+
+    if (index > 0)
+    {
+        off_t left_offset = parent->data.internal.children[index - 1];
+        ix_read(db, left_offset, &left);
+        if (left.num_keys > ix_min_keys(&left))
+        {
+            ix_borrow_from_left(parent, index, &left, child);
+            ix_write(db, left_offset, &left);
+            ix_write(db, child_offset, child);
+            return index;
+        }
+    }
+    if (index < parent->num_keys)
+    {
+        off_t right_offset = parent->data.internal.children[index + 1];
+        ix_read(db, right_offset, &right);
+        if (right.num_keys > ix_min_keys(&right))
+        {
+            ix_borrow_from_right(parent, index, child, &right);
+            ix_write(db, right_offset, &right);
+            ix_write(db, child_offset, child);
+            return index;
+        }
+        ix_merge_nodes(parent, index, child, &right);
+        ix_write(db, child_offset, child);
+        free_page(db, (int)(right_offset / PAGE_SIZE));
+        return index;
+    }
+
+    // Rightmost child with a minimal left sibling: merge into the sibling
+    off_t left_offset = parent->data.internal.children[index - 1];
+    ix_merge_nodes(parent, index - 1, &left, child);
+    ix_write(db, left_offset, &left);
+    free_page(db, (int)(child_offset / PAGE_SIZE));
+    *child = left;
+    return index - 1;
+}
+
+// Remove (key, id) from a secondary index, rebalancing on the way down like
+// btree_delete so leaves stay at least half full and emptied pages go back
+// to the freelist
+static void ix_delete(Database *db, Table *table, SecondaryIndex *index, const IndexKey *key, int id)
+{
+    IndexNode node;
+    off_t current_offset = index->root_offset;
+    ix_read(db, current_offset, &node);
+    while (!node.is_leaf)
+    {
+        int i = ix_child(&node, key, id);
+        IndexNode child;
+        ix_read(db, node.data.internal.children[i], &child);
+        if (child.num_keys <= ix_min_keys(&child))
+        {
+            i = ix_fill_child(db, &node, i, &child);
+            if (node.num_keys == 0)
+            {
+                // The root lost its last separator: its only child becomes the root
+                assert(current_offset == index->root_offset);
+                free_page(db, (int)(current_offset / PAGE_SIZE));
+                index->root_offset = node.data.internal.children[0];
+                table->dirty = 1;
+                current_offset = index->root_offset;
+                node = child;
+                continue;
+            }
+            ix_write(db, current_offset, &node);
+        }
+        current_offset = node.data.internal.children[i];
+        node = child;
+    }
+
+    int i = ix_lower_bound(node.data.leaf.keys, node.data.leaf.ids, node.num_keys, key, id);
+    if (i == node.num_keys || ix_compare(&node.data.leaf.keys[i], node.data.leaf.ids[i], key, id) != 0)
+    {
+        return; // Not found
+    }
+    memmove(&node.data.leaf.keys[i], &node.data.leaf.keys[i + 1], (node.num_keys - i - 1) * sizeof(IndexKey));
+    memmove(&node.data.leaf.ids[i], &node.data.leaf.ids[i + 1], (node.num_keys - i - 1) * sizeof(int));
+    node.num_keys--;
+    ix_write(db, current_offset, &node);
+}
+
+// Leaf of a secondary index where entries with keys >= key start
+static off_t ix_seek(Database *db, const SecondaryIndex *index, const IndexKey *key)
+{
+    off_t offset = index->root_offset;
+    while (1)
+    {
+        const IndexNode *node = (const IndexNode *)pool_view(db, offset);
+        if (node->is_leaf)
+        {
+            pool_release_view(db, (const char *)node);
+            return offset;
+        }
+        off_t child = node->data.internal.children[ix_child(node, key, 0)]; // Ids are positive
+        pool_release_view(db, (const char *)node);
+        offset = child;
+    }
+}
+
+// Index keys of a record: present[i] is 0 where index i's column is NULL,
+// which is left out of the index
+static void record_index_keys(const Table *table, const unsigned char *record, int length, IndexKey *keys, int *present)
+{
+    for (int i = 0; i < table->num_indexes; i++)
+    {
+        int column = table->indexes[i].column;
+        Value value;
+        record_column(&table->schema, record, length, column, &value);
+        present[i] = !value.is_null;
+        if (present[i])
+        {
+            keys[i] = index_key(table->schema.columns[column].type, &value);
+        }
+        else
+        {
+            memset(&keys[i], 0, sizeof(IndexKey));
+        }
+    }
+}
+
+// Move a row of the current table from its old index keys to its new ones,
+// touching only the indexes whose key changed
+static void update_index_keys(Database *db, int id, const IndexKey *old_keys, const int *old_present,
+                              const IndexKey *new_keys, const int *new_present)
+{
+    Table *table = thread_table(db);
+    for (int i = 0; i < table->num_indexes; i++)
+    {
+        if (old_present[i] == new_present[i] && key_compare(&old_keys[i], &new_keys[i]) == 0)
+        {
+            continue;
+        }
+        if (old_present[i])
+        {
+            ix_delete(db, table, &table->indexes[i], &old_keys[i], id);
+        }
+        if (new_present[i])
+        {
+            ix_insert(db, table, &table->indexes[i], &new_keys[i], id);
+        }
+    }
+}
+
+// Initialize the database with the default options
+Database init_db(const char *filename)
+{
+    DbOptions options = {DEFAULT_POOL_PAGES};
+    return init_db_with_options(filename, &options);
+}
+
+// Read the file header from page 0 into the catalog table
+static void read_header(Database *db)
+{
+    char page[PAGE_SIZE];
+    FileHeader *header = (FileHeader *)page;
+    if (!wal_read_page(db, HEADER_PAGE, page))
+    {
+        if (!read_at(db->fd, page, PAGE_SIZE, 0))
+        {
+            printf("Error: Not a database file (short header)\n");
+            exit(1);
+        }
+    }
+    if (memcmp(header->magic, DB_MAGIC, 8) != 0)
+    {
+        printf("Error: Not a database file (bad header)\n");
+        exit(1);
+    }
+    Table *catalog = db->tables[0];
+    catalog->root_offset = header->root_offset;
+    db->page_count = header->page_count;
+    db->freelist_head = header->freelist_head;
+    db->free_pages = header->free_pages;
+    catalog->num_pages = header->num_data_pages;
+    catalog->first_data_page = header->first_data_page;
+    catalog->last_data_page = header->last_data_page;
+}
+
+// Build the page 0 image holding the file header
+static void encode_header(Database *db, char *page)
+{
+    memset(page, 0, PAGE_SIZE);
+    FileHeader *header = (FileHeader *)page;
+    const Table *catalog = db->tables[0];
+    memcpy(header->magic, DB_MAGIC, 8);
+    header->root_offset = catalog->root_offset;
+    header->page_count = db->page_count;
+    header->freelist_head = db->freelist_head;
+    header->free_pages = db->free_pages;
+    header->num_data_pages = catalog->num_pages;
+    header->first_data_page = catalog->first_data_page;
+    header->last_data_page = catalog->last_data_page;
+}
+
+// Columns of the catalog, which has one row per table keyed by table id
+enum
+{
+    CATALOG_NAME,
+    CATALOG_ROOT,
+    CATALOG_PAGES,
+    CATALOG_FIRST_PAGE,
+    CATALOG_LAST_PAGE,
+    CATALOG_COLUMNS, // The table's Column array
+    CATALOG_INDEXES, // The table's SecondaryIndex array
+    CATALOG_NUM_COLUMNS
+};
+
+static const Column catalog_columns[CATALOG_NUM_COLUMNS] = {
+    {"name", COL_TEXT},
+    {"root", COL_INT64},
+    {"num_pages", COL_INT64},
+    {"first_page", COL_INT64},
+    {"last_page", COL_INT64},
+    {"columns", COL_BLOB},
+    {"indexes", COL_BLOB},
+};
+
+// Allocate a table with the given columns and no pages yet
+static Table *new_table(int table_id, const char *name, const Column *columns, int num_columns)
+{
+    Table *table = calloc(1, sizeof(Table));
+    if (table == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    table->table_id = table_id;
+    strcpy(table->schema.name, name);
+    memcpy(table->schema.columns, columns, num_columns * sizeof(Column));
+    table->schema.num_columns = num_columns;
+    schema_layout(&table->schema);
+    return table;
+}
+
+static void add_table(Database *db, Table *table)
+{
+    Table **tables = realloc(db->tables, (db->num_tables + 1) * sizeof(Table *));
+    if (tables == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    tables[db->num_tables++] = table;
+    db->tables = tables;
+}
+
+static void free_tables(Database *db)
+{
+    for (int i = 0; i < db->num_tables; i++)
+    {
+        free(db->tables[i]);
+    }
+    free(db->tables);
+    db->tables = NULL;
+    db->num_tables = 0;
+    db->catalog_version++; // Every thread looks its table up again
+}
+
+// Table with the given name, or NULL (the catalog itself is not visible)
+static Table *find_table(Database *db, const char *name)
+{
+    for (int i = 1; i < db->num_tables; i++)
+    {
+        if (strcmp(db->tables[i]->schema.name, name) == 0)
+        {
+            return db->tables[i];
+        }
+    }
+    return NULL;
+}
+
+// A table's catalog row; the name and columns point into table
+static void catalog_values(const Table *table, Value *values)
+{
+    memset(values, 0, CATALOG_NUM_COLUMNS * sizeof(Value));
+    values[CATALOG_NAME].data = table->schema.name;
+    values[CATALOG_NAME].length = (int)strlen(table->schema.name);
+    values[CATALOG_ROOT].int64 = table->root_offset;
+    values[CATALOG_PAGES].int64 = table->num_pages;
+    values[CATALOG_FIRST_PAGE].int64 = table->first_data_page;
+    values[CATALOG_LAST_PAGE].int64 = table->last_data_page;
+    values[CATALOG_COLUMNS].data = (const char *)table->schema.columns;
+    values[CATALOG_COLUMNS].length = table->schema.num_columns * sizeof(Column);
+    values[CATALOG_INDEXES].data = (const char *)table->indexes;
+    values[CATALOG_INDEXES].length = table->num_indexes * sizeof(SecondaryIndex);
+}
+
+// Allocate the table a catalog record describes (schema is the catalog's)
+static Table *catalog_table(const Schema *schema, int table_id, const unsigned char *record, int length)
+{
+    Value values[CATALOG_NUM_COLUMNS];
+    for (int c = 0; c < CATALOG_NUM_COLUMNS; c++)
+    {
+        record_column(schema, record, length, c, &values[c]);
+    }
+    char name[MAX_NAME_LENGTH] = {0};
+    memcpy(name, values[CATALOG_NAME].data, values[CATALOG_NAME].length);
+    Column columns[MAX_COLUMNS];
+    memcpy(columns, values[CATALOG_COLUMNS].data, values[CATALOG_COLUMNS].length);
+    Table *table = new_table(table_id, name, columns, values[CATALOG_COLUMNS].length / sizeof(Column));
+    table->root_offset = values[CATALOG_ROOT].int64;
+    table->num_pages = (int)values[CATALOG_PAGES].int64;
+    table->first_data_page = (int)values[CATALOG_FIRST_PAGE].int64;
+    table->last_data_page = (int)values[CATALOG_LAST_PAGE].int64;
+    table->num_indexes = values[CATALOG_INDEXES].length / sizeof(SecondaryIndex);
+    if (table->num_indexes > 0)
+    {
+        memcpy(table->indexes, values[CATALOG_INDEXES].data, values[CATALOG_INDEXES].length);
+    }
+    return table;
+}
+
+// Rebuild the tables from the header and the catalog rows. Each thread keeps
+// its current table if it still exists (else it gets the first one); see
+// thread_table.
+static void load_catalog(Database *db)
+{
+    free_tables(db);
+    add_table(db, new_table(0, "catalog", catalog_columns, CATALOG_NUM_COLUMNS));
+    read_header(db);
+
+    const Schema *schema = &db->tables[0]->schema;
+    int page_no = db->tables[0]->first_data_page;
+    while (page_no != 0)
+    {
+        const char *page = pool_view(db, page_offset(page_no));
+        const DataPageHeader *header = (const DataPageHeader *)page;
+        for (int i = 0; i < header->num_slots; i++)
+        {
+            const char *cell = slot_cell(page, i);
+            if (cell == NULL)
+            {
+                continue;
+            }
+            int table_id, length;
+            unsigned char *spill;
+            const unsigned char *record = cell_record(db, NULL, (const unsigned char *)cell, &table_id, &length, &spill);
+            add_table(db, catalog_table(schema, table_id, record, length));
+            free(spill);
+        }
+        page_no = header->next_page;
+        pool_release_view(db, page);
+    }
+}
+
+// The named table as of a snapshot, read from the snapshot's own header and
+// catalog pages, or NULL if it did not exist then. The caller frees it.
+static Table *snapshot_table(const Snapshot *snapshot, const char *name)
+{
+    Table *catalog = new_table(0, "catalog", catalog_columns, CATALOG_NUM_COLUMNS);
+    Table *found = NULL;
+    char page[PAGE_SIZE];
+    snapshot_read_page(snapshot, HEADER_PAGE, page);
+    int page_no = ((const FileHeader *)page)->first_data_page;
+    while (page_no != 0 && found == NULL)
+    {
+        snapshot_read_page(snapshot, page_no, page);
+        const DataPageHeader *header = (const DataPageHeader *)page;
+        for (int i = 0; i < header->num_slots && found == NULL; i++)
+        {
+            const char *cell = slot_cell(page, i);
+            if (cell == NULL)
+            {
+                continue;
+            }
+            int table_id, length;
+            unsigned char *spill;
+            const unsigned char *record = cell_record(snapshot->db, snapshot, (const unsigned char *)cell, &table_id, &length, &spill);
+            Value value;
+            record_column(&catalog->schema, record, length, CATALOG_NAME, &value);
+            if (value.length == (int)strlen(name) && memcmp(value.data, name, value.length) == 0)
+            {
+                found = catalog_table(&catalog->schema, table_id, record, length);
+            }
+            free(spill);
+        }
+        page_no = header->next_page;
+    }
+    free(catalog);
+    return found;
+}
+
+static void insert_record(Database *db, int id, const Value *values);
+static void write_values(Database *db, int id, RecordId rid, const Value *values);
+
+// Rewrite the catalog rows of tables whose root or page chain moved; runs
+// as part of every commit
+static void save_catalog(Database *db)
+{
+    Table *current = thread_table(db);
+    set_thread_table(db, db->tables[0]);
+    for (int i = 1; i < db->num_tables; i++)
+    {
+        Table *table = db->tables[i];
+        if (!table->dirty)
+        {
+            continue;
+        }
+        Value values[CATALOG_NUM_COLUMNS];
+        RecordId rid;
+        catalog_values(table, values);
+        int found = btree_search(db, table->table_id, &rid);
+        assert(found); // Every table has a catalog row
+        (void)found;
+        write_values(db, table->table_id, rid, values);
+        table->dirty = 0;
+    }
+    set_thread_table(db, current);
+}
+
+// Initialize the database, sizing the buffer pool and WAL from options
+Database init_db_with_options(const char *filename, const DbOptions *options)
+{
+    Database db;
+    pthread_once(&kernels_once, choose_kernels);
+    db.fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (db.fd == -1)
+    {
+        perror("Error: Could not open file\n");
+        exit(1);
+    }
+    db.in_txn = 0;
+    db.use_mmap = options->use_mmap;
+    db.map = NULL;
+    db.map_size = 0;
+    db.handle_id = __atomic_add_fetch(&next_handle_id, 1, __ATOMIC_RELAXED);
+    db.catalog_version = 0;
+    db.tables = NULL;
+    db.num_tables = 0;
+    db.lock = malloc(sizeof(pthread_rwlock_t));
+    if (db.lock == NULL)
+    {
+        perror("Error: Could not allocate database lock\n");
+        exit(1);
+    }
+    // Prefer the writer, or a steady stream of lookups would starve it
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(db.lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    db.statements = statement_cache_create();
+    db.pool = pool_create(options->pool_pages > 0 ? options->pool_pages : DEFAULT_POOL_PAGES);
+    int scan_threads = options->scan_threads > 0 ? options->scan_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    scan_threads = scan_threads < MAX_SCAN_THREADS ? scan_threads : MAX_SCAN_THREADS;
+    // A scanning thread pins up to two frames, so more could never all run
+    scan_threads = scan_threads < db.pool->capacity / 2 ? scan_threads : db.pool->capacity / 2;
+    db.workers = scan_threads > 1 ? workers_start(scan_threads - 1) : NULL;
+    db.wal = wal_open(filename, options);
+    wal_recover(&db);
+
+    if (lseek(db.fd, 0, SEEK_END) == 0)
+    {
+        db.page_count = 1; // Header page
+        db.freelist_head = 0;
+        db.free_pages = 0;
+
+        // Initialize the catalog's B-Tree with an empty root node
+        add_table(&db, new_table(0, "catalog", catalog_columns, CATALOG_NUM_COLUMNS));
+        db.tables[0]->root_offset = allocate_node(&db);
+        BTreeNode root = {0};
+        root.is_leaf = 1;
+        write_node(&db, db.tables[0]->root_offset, &root);
+
+        void *page = append_page(&db);
+        release_page(&db, page, 1);
+        printf("Allocated first page\n");
+
+        // A new file holds a table "main" with one TEXT column, "name"
+        Column name = {"name", COL_TEXT};
+        create_table(&db, "main", &name, 1);
+        set_thread_table(&db, db.tables[1]);
+        wal_checkpoint(&db);
+    }
+    else
+    {
+        load_catalog(&db);
+    }
+    db_remap(&db);
+    printf("File opened successfully (fd %d)\n", db.fd);
+    printf("Found %d tables in %d file pages\n", db.num_tables - 1, db.page_count);
+    return db;
+}
+
+// Commit every change since the last call through the WAL; inside an
+// explicit transaction the changes wait for commit_txn
+static void write_buffer_locked(Database *db)
+{
+    if (db->in_txn)
+    {
+        return;
+    }
+    wal_commit(db);
+}
+
+void write_buffer(Database *db)
+{
+    if (!db_write_lock(db))
+    {
+        return;
+    }
+    write_buffer_locked(db);
+    db_unlock(db);
+}
+
+// Start a transaction: row operations stay in the buffer pool (spilling to
+// the WAL uncommitted) until commit_txn or rollback_txn
+int begin_txn(Database *db)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    if (db->in_txn)
+    {
+        printf("Error: A transaction is already open\n");
+        db_unlock(db);
+        return 0;
+    }
+    db->in_txn = 1;
+    return 1; // Still locked; other threads wait for the commit
+}
+
+// Commit the open transaction with a single WAL append and fsync
+int commit_txn(Database *db)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    if (!db->in_txn)
+    {
+        printf("Error: No transaction is open\n");
+        db_unlock(db);
+        return 0;
+    }
+    db->in_txn = 0;
+    wal_commit(db);
+    db_unlock(db);
+    db_unlock(db); // Taken by begin_txn
+    return 1;
+}
+
+// Undo the open transaction: drop its pages from the pool and the WAL and
+// reload the committed header
+int rollback_txn(Database *db)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    if (!db->in_txn)
+    {
+        printf("Error: No transaction is open\n");
+        db_unlock(db);
+        return 0;
+    }
+    db->in_txn = 0;
+    pool_discard(db);
+    wal_rollback(db);
+    int num_tables = db->num_tables;
+    load_catalog(db);
+    if (db->num_tables != num_tables)
+    {
+        // A rolled-back table's id goes to the next table created, so plans
+        // compiled for it must not run against that one
+        db->statements->version++;
+    }
+    db_unlock(db);
+    db_unlock(db); // Taken by begin_txn
+    return 1;
+}
+
+// Create an empty table. The id key is implicit; columns lists the rest.
+// Returns 1 if created, 0 if the name is taken or the definition is invalid.
+static int create_table_locked(Database *db, const char *name, const Column *columns, int num_columns)
+{
+    if (strlen(name) == 0 || strlen(name) >= MAX_NAME_LENGTH)
+    {
+        printf("Error: Table name must have 1 to %d characters\n", MAX_NAME_LENGTH - 1);
+        return 0;
+    }
+    if (find_table(db, name) != NULL || strcmp(name, "catalog") == 0)
+    {
+        printf("Error: Table %s already exists\n", name);
+        return 0;
+    }
+    if (num_columns < 1 || num_columns > MAX_COLUMNS)
+    {
+        printf("Error: A table needs 1 to %d columns (got %d)\n", MAX_COLUMNS, num_columns);
+        return 0;
+    }
+    for (int i = 0; i < num_columns; i++)
+    {
+        const Column *column = &columns[i];
+        if (strlen(column->name) == 0 || strlen(column->name) >= MAX_NAME_LENGTH || strcmp(column->name, "id") == 0)
+        {
+            printf("Error: Invalid column name '%s'\n", column->name);
+            return 0;
+        }
+        if (column->type < COL_INT64 || column->type > COL_BLOB)
+        {
+            printf("Error: Column %s has an unknown type\n", column->name);
+            return 0;
+        }
+        for (int j = 0; j < i; j++)
+        {
+            if (strcmp(columns[j].name, column->name) == 0)
+            {
+                printf("Error: Duplicate column name '%s'\n", column->name);
+                return 0;
+            }
+        }
+    }
+    int table_id = db->tables[db->num_tables - 1]->table_id + 1; // Ids only grow
+    if (table_id > USHRT_MAX)
+    {
+        printf("Error: Too many tables\n");
+        return 0;
+    }
+
+    // Give the table an empty root and a first data page
+    Table *current = thread_table(db);
+    Table *table = new_table(table_id, name, columns, num_columns);
+    set_thread_table(db, table);
+    table->root_offset = allocate_node(db);
+    BTreeNode root = {0};
+    root.is_leaf = 1;
+    write_node(db, table->root_offset, &root);
+    release_page(db, append_page(db), 1);
+
+    Value values[CATALOG_NUM_COLUMNS];
+    catalog_values(table, values);
+    set_thread_table(db, db->tables[0]);
+    insert_record(db, table_id, values);
+    table->dirty = 0;
+    add_table(db, table);
+    set_thread_table(db, current);
+    printf("Created table %s with %d columns\n", name, num_columns);
+    write_buffer(db);
+    return 1;
+}
+
+int create_table(Database *db, const char *name, const Column *columns, int num_columns)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    int result = create_table_locked(db, name, columns, num_columns);
+    db_unlock(db);
+    return result;
+}
+
+// Make the named table the one the calling thread's row operations act on
+// (returns 1 if found)
+static int use_table_locked(Database *db, const char *name)
+{
+    Table *table = find_table(db, name);
+    if (table == NULL)
+    {
+        printf("Error: No table named %s\n", name);
+        return 0;
+    }
+    set_thread_table(db, table);
+    return 1;
+}
+
+int use_table(Database *db, const char *name)
+{
+    if (!db_read_lock(db)) // Only the calling thread's choice changes
+    {
+        return 0;
+    }
+    int result = use_table_locked(db, name);
+    db_unlock(db);
+    return result;
+}
+
+// The table the calling thread's row operations act on (see use_table)
+Table *current_table(Database *db)
+{
+    if (!db_read_lock(db))
+    {
+        return NULL;
+    }
+    Table *table = thread_table(db);
+    db_unlock(db);
+    return table;
+}
+
+// Position of the named column in a schema (-1 = none)
+static int column_index(const Schema *schema, const char *name)
+{
+    for (int i = 0; i < schema->num_columns; i++)
+    {
+        if (strcmp(schema->columns[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A table's secondary index on a column, or NULL
+static SecondaryIndex *column_secondary_index(Table *table, int column)
+{
+    for (int i = 0; i < table->num_indexes; i++)
+    {
+        if (table->indexes[i].column == column)
+        {
+            return &table->indexes[i];
+        }
+    }
+    return NULL;
+}
+
+// Build a secondary index on a column of a table from the rows it already
+// has; inserts, updates and deletes keep it current from then on. Returns 1
+// if created, 0 if the name is taken or the table or column is missing.
+static int create_index_locked(Database *db, const char *name, const char *table_name, const char *column_name)
+{
+    if (strlen(name) == 0 || strlen(name) >= MAX_NAME_LENGTH)
+    {
+        printf("Error: Index name must have 1 to %d characters\n", MAX_NAME_LENGTH - 1);
+        return 0;
+    }
+    for (int i = 1; i < db->num_tables; i++)
+    {
+        for (int j = 0; j < db->tables[i]->num_indexes; j++)
+        {
+            if (strcmp(db->tables[i]->indexes[j].name, name) == 0)
+            {
+                printf("Error: Index %s already exists\n", name);
+                return 0;
+            }
+        }
+    }
+    Table *table = find_table(db, table_name);
+    if (table == NULL)
+    {
+        printf("Error: No table named %s\n", table_name);
+        return 0;
+    }
+    int column = column_index(&table->schema, column_name);
+    if (column < 0)
+    {
+        printf("Error: Table %s has no column %s\n", table_name, column_name);
+        return 0;
+    }
+    if (table->num_indexes == MAX_INDEXES)
+    {
+        printf("Error: Table %s already has %d indexes\n", table_name, MAX_INDEXES);
+        return 0;
+    }
+
+    SecondaryIndex *index = &table->indexes[table->num_indexes++];
+    memset(index, 0, sizeof(SecondaryIndex));
+    strcpy(index->name, name);
+    index->column = column;
+    index->root_offset = allocate_node(db);
+    IndexNode root = {0};
+    root.is_leaf = 1;
+    ix_write(db, index->root_offset, &root);
+    table->dirty = 1;
+
+    // Index the existing rows a page at a time, reading each page before
+    // the inserts below can evict it
+    int type = table->schema.columns[column].type;
+    int page_no = table->first_data_page;
+    int indexed = 0;
+    while (page_no != 0)
+    {
+        const char *page = pool_view(db, page_offset(page_no));
+        const DataPageHeader *header = (const DataPageHeader *)page;
+        IndexKey keys[MAX_ROWS];
+        int ids[MAX_ROWS];
+        int n = 0;
+        for (int i = 0; i < header->num_slots; i++)
+        {
+            const char *cell = slot_cell(page, i);
+            if (cell == NULL)
+            {
+                continue;
+            }
+            int length;
+            unsigned char *spill;
+            const unsigned char *record = cell_record(db, NULL, (const unsigned char *)cell, &ids[n], &length, &spill);
+            Value value;
+            record_column(&table->schema, record, length, column, &value);
+            if (!value.is_null)
+            {
+                keys[n++] = index_key(type, &value);
+            }
+            free(spill);
+        }
+        page_no = header->next_page;
+        pool_release_view(db, page);
+        for (int i = 0; i < n; i++)
+        {
+            ix_insert(db, table, index, &keys[i], ids[i]);
+        }
+        indexed += n;
+    }
+    printf("Created index %s on %s (%s) with %d entries\n", name, table_name, column_name, indexed);
+    write_buffer(db);
+    return 1;
+}
+
+int create_index(Database *db, const char *name, const char *table_name, const char *column_name)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    int result = create_index_locked(db, name, table_name, column_name);
+    db_unlock(db);
+    return result;
+}
+
+// Store an encoded row in a page with room, growing the table only if the
+// free-space map has none, and return where it went
+static RecordId store_cell(Database *db, const unsigned char *cell, int length)
+{
+    RecordId rid;
+    int current_page = fsm_find(db, length + sizeof(Slot));
+    void *page;
+    if (current_page != 0)
+    {
+        page = get_page(db, current_page);
+    }
+    else
+    {
+        page = append_page(db);
+        current_page = thread_table(db)->last_data_page;
+        thread_table(db)->fsm_hint = current_page; // Search the new page first next time
+        printf("Allocated new page %d\n", current_page);
+    }
+    int slot = page_insert(page, cell, length);
+    assert(slot >= 0);
+    fsm_set(db, current_page, ((DataPageHeader *)page)->free_bytes);
+    release_page(db, page, 1);
+    rid.page = current_page;
+    rid.slot = slot;
+    return rid;
+}
+
+// Buffer for a record of length bytes: scratch when it fits, else malloc'd
+static unsigned char *record_buffer(unsigned char *scratch, int length)
+{
+    if (length <= OVERFLOW_THRESHOLD)
+    {
+        return scratch;
+    }
+    unsigned char *record = malloc(length);
+    if (record == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    return record;
+}
+
+// Store a new row in the current table and index it
+static void insert_record(Database *db, int id, const Value *values)
+{
+    unsigned char scratch[OVERFLOW_THRESHOLD];
+    unsigned char *record = record_buffer(scratch, record_size(&thread_table(db)->schema, values));
+    unsigned char cell[MAX_CELL_SIZE];
+    int record_length = encode_record(&thread_table(db)->schema, values, record);
+    int length = encode_cell(db, id, record, record_length, cell);
+    IndexKey keys[MAX_INDEXES], no_keys[MAX_INDEXES] = {{0}};
+    int present[MAX_INDEXES], absent[MAX_INDEXES] = {0};
+    record_index_keys(thread_table(db), record, record_length, keys, present);
+    if (record != scratch)
+    {
+        free(record);
+    }
+    RecordId rid = store_cell(db, cell, length);
+    printf("Inserted row in slot %d of page %d: id=%d\n", rid.slot, rid.page, id);
+
+    // Insert into B-Tree and the secondary indexes
+    btree_insert(db, id, rid);
+    update_index_keys(db, id, no_keys, absent, keys, present);
+}
+
+// Insert a row with one value per column (returns 1 if inserted, 0 if failed
+// due to duplicate ID)
+static int insert_values_locked(Database *db, int id, const Value *values)
+{
+    if (id <= 0)
+    {
+        printf("Error: ID must be a positive integer (got %d)\n", id);
+        return 0;
+    }
+
+    // Check for duplicate ID
+    RecordId rid;
+    if (btree_search(db, id, &rid))
+    {
+        printf("Error: Row with id=%d already exists\n", id);
+        return 0;
+    }
+
+    insert_record(db, id, values);
+    write_buffer(db);
+    return 1;
+}
+
+int insert_values(Database *db, int id, const Value *values)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    int result = insert_values_locked(db, id, values);
+    db_unlock(db);
+    return result;
+}
+
+// Insert a row whose name column is name and whose other columns are NULL
+static int insert_row_locked(Database *db, int id, const char *name)
+{
+    Table *table = thread_table(db);
+    Value values[MAX_COLUMNS] = {{0}};
+    for (int i = 0; i < table->schema.num_columns; i++)
+    {
+        values[i].is_null = 1;
+    }
+    if (table->schema.name_column < 0)
+    {
+        printf("Error: Table %s has no TEXT column\n", table->schema.name);
+        return 0;
+    }
+    Value *value = &values[table->schema.name_column];
+    value->is_null = 0;
+    value->data = name;
+    value->length = (int)strlen(name);
+    return insert_values(db, id, values);
+}
+
+int insert_row(Database *db, int id, const char *name)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    int result = insert_row_locked(db, id, name);
+    db_unlock(db);
+    return result;
+}
+
+// Start a scan of the current table; scan_next moves to the first row
+void scan_open(Database *db, Scan *scan)
+{
+    memset(scan, 0, sizeof(Scan));
+    scan->db = db;
+    scan->table = thread_table(db);
+    if (!db_read_lock(db))
+    {
+        return; // page_no 0: the scan is already over
+    }
+    scan->locked = 1;
+    scan->page_no = thread_table(db)->first_data_page;
+    map_advise(db, MADV_SEQUENTIAL);
+}
+
+// Start a scan of the pages of the current table from first up to, but not
+// including, stop (0 = the end of the chain). The scan takes no lock: the
+// caller holds the database lock for it. Parallel scans split a table into
+// such ranges, one per thread.
+static void scan_open_pages(Database *db, Scan *scan, int first, int stop)
+{
+    memset(scan, 0, sizeof(Scan));
+    scan->db = db;
+    scan->table = thread_table(db);
+    scan->page_no = first;
+    scan->stop_page = stop;
+}
+
+// Start a scan of a table as it was when the snapshot was taken. The scan
+// holds no lock, so writers carry on while it runs; it reads each page into
+// a private copy. Returns 0 if the table did not exist at the snapshot.
+int scan_open_snapshot(Snapshot *snapshot, const char *table, Scan *scan)
+{
+    memset(scan, 0, sizeof(Scan));
+    scan->db = snapshot->db;
+    scan->snapshot = snapshot;
+    scan->table = snapshot_table(snapshot, table);
+    if (scan->table == NULL)
+    {
+        printf("Error: No table named %s in the snapshot\n", table);
+        return 0;
+    }
+    scan->buffer = malloc(PAGE_SIZE);
+    if (scan->buffer == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    scan->page_no = scan->table->first_data_page;
+    return 1;
+}
+
+// Move to the next row (returns 1 if there is one, 0 at the end)
+int scan_next(Scan *scan)
+{
+    free(scan->spill);
+    scan->spill = NULL;
+    while (scan->page_no != 0 && scan->page_no != scan->stop_page)
+    {
+        if (scan->page == NULL && scan->snapshot != NULL)
+        {
+            snapshot_read_page(scan->snapshot, scan->page_no, scan->buffer);
+            scan->page = scan->buffer;
+            scan->slot = 0;
+        }
+        else if (scan->page == NULL)
+        {
+            scan->page = pool_view(scan->db, page_offset(scan->page_no));
+            scan->slot = 0;
+        }
+        const DataPageHeader *header = (const DataPageHeader *)scan->page;
+        while (scan->slot < header->num_slots)
+        {
+            const char *cell = slot_cell(scan->page, scan->slot++);
+            if (cell != NULL) // Skip tombstones
+            {
+                scan->record = cell_record(scan->db, scan->snapshot, (const unsigned char *)cell, &scan->id, &scan->length, &scan->spill);
+                return 1;
+            }
+        }
+        scan->page_no = header->next_page;
+        if (scan->snapshot == NULL)
+        {
+            pool_release_view(scan->db, scan->page);
+        }
+        scan->page = NULL;
+    }
+    if (scan->locked)
+    {
+        scan->locked = 0;
+        db_unlock(scan->db);
+    }
+    return 0;
+}
+
+// Decode one column of the current row; TEXT and BLOB values point into
+// the page frame
+void scan_column(const Scan *scan, int column, Value *value)
+{
+    record_column(&scan->table->schema, scan->record, scan->length, column, value);
+}
+
+// Release the page a scan holds; needed only when it stops before the end,
+// or for a snapshot scan, which always needs it
+void scan_close(Scan *scan)
+{
+    free(scan->spill);
+    scan->spill = NULL;
+    if (scan->snapshot != NULL)
+    {
+        free(scan->buffer);
+        free(scan->table);
+        scan->buffer = NULL;
+        scan->table = NULL;
+        scan->snapshot = NULL;
+    }
+    else if (scan->page != NULL)
+    {
+        pool_release_view(scan->db, scan->page);
+    }
+    scan->page = NULL;
+    scan->page_no = 0;
+    map_advise(scan->db, MADV_RANDOM);
+    if (scan->locked)
+    {
+        scan->locked = 0;
+        db_unlock(scan->db);
+    }
+}
+
+// Call visit with every row of the current table, decoded in place, until
+// it returns 0. Runs in constant memory; returns the number of rows visited.
+static int select_each_locked(Database *db, int (*visit)(void *arg, int id, const Value *values), void *arg)
+{
+    Scan scan;
+    Value values[MAX_COLUMNS];
+    int count = 0;
+    scan_open(db, &scan);
+    while (scan_next(&scan))
+    {
+        for (int i = 0; i < scan.table->schema.num_columns; i++)
+        {
+            scan_column(&scan, i, &values[i]);
+        }
+        count++;
+        if (!visit(arg, scan.id, values))
+        {
+            break;
+        }
+    }
+    scan_close(&scan);
+    return count;
+}
+
+int select_each(Database *db, int (*visit)(void *arg, int id, const Value *values), void *arg)
+{
+    if (!db_read_lock(db))
+    {
+        return 0;
+    }
+    int result = select_each_locked(db, visit, arg);
+    db_unlock(db);
+    return result;
+}
+
+// A bulk-loaded row: its id and its position in the caller's arrays
+typedef struct
+{
+    int id;
+    int row;
+} LoadOrder;
+
+static int compare_load_order(const void *a, const void *b)
+{
+    int id1 = ((const LoadOrder *)a)->id;
+    int id2 = ((const LoadOrder *)b)->id;
+    return (id1 > id2) - (id1 < id2);
+}
+
+// Nodes that n entries fill at per to a node. Only the last two nodes may
+// hold fewer, and they must not drop below min (per >= min; the root, a
+// lone node, is exempt): when what is left for them is short of 2 * min it
+// goes to one node less.
+static int group_count(int n, int per, int min)
+{
+    int nodes = (n + per - 1) / per;
+    if (nodes > 1 && n - (nodes - 2) * per < 2 * min)
+    {
+        nodes--;
+    }
+    return nodes;
+}
+
+// Size of node i of the nodes given by group_count: per, except that the
+// last two split what is left between them
+static int group_size(int n, int per, int nodes, int i)
+{
+    if (nodes == 1)
+    {
+        return n;
+    }
+    int rest = n - (nodes - 2) * per;
+    return i < nodes - 2 ? per : i == nodes - 2 ? rest - rest / 2 : rest / 2;
+}
+
+// A secondary index entry gathered by a bulk load
+typedef struct
+{
+    IndexKey key;
+    int id;
+} IndexPair;
+
+static int compare_index_pair(const void *a, const void *b)
+{
+    const IndexPair *pair1 = a;
+    const IndexPair *pair2 = b;
+    return ix_compare(&pair1->key, pair1->id, &pair2->key, pair2->id);
+}
+
+// Build an empty secondary index bottom-up from n entries sorted by (key,
+// id), the way bulk_load_locked builds the id tree: leaves filled to
+// fill_percent and chained left to right, then each internal level from the
+// one below, each separator the first entry under its child.
+static void ix_build(Database *db, Table *table, SecondaryIndex *index, const IndexPair *entries, int n, int fill_percent)
+{
+    if (n == 0)
+    {
+        return; // Keep the empty root leaf
+    }
+    int per_leaf = MAX_IX_LEAF_KEYS * fill_percent / 100;
+    int leaves = group_count(n, per_leaf, MIN_IX_LEAF_KEYS);
+    off_t *level = malloc(leaves * sizeof(off_t)); // Nodes of the level being built
+    IndexPair *level_keys = malloc(leaves * sizeof(IndexPair)); // First entry under each
+    if (level == NULL || level_keys == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    off_t leaf_offset = allocate_node(db);
+    for (int j = 0, entry = 0; j < leaves; j++)
+    {
+        IndexNode leaf = {0};
+        leaf.is_leaf = 1;
+        leaf.num_keys = group_size(n, per_leaf, leaves, j);
+        level[j] = leaf_offset;
+        level_keys[j] = entries[entry];
+        for (int e = 0; e < leaf.num_keys; e++, entry++)
+        {
+            leaf.data.leaf.keys[e] = entries[entry].key;
+            leaf.data.leaf.ids[e] = entries[entry].id;
+        }
+        leaf_offset = j + 1 < leaves ? allocate_node(db) : 0;
+        leaf.data.leaf.next = leaf_offset;
+        ix_write(db, level[j], &leaf);
+    }
+
+    int per_node = (MAX_IX_KEYS + 1) * fill_percent / 100;
+    for (int m = leaves; m > 1;)
+    {
+        int nodes = group_count(m, per_node, MIN_IX_KEYS + 1);
+        int child = 0;
+        for (int j = 0; j < nodes; j++)
+        {
+            IndexNode node = {0};
+            int size = group_size(m, per_node, nodes, j);
+            IndexPair first = level_keys[child];
+            for (int c = 0; c < size; c++, child++)
+            {
+                node.data.internal.children[c] = level[child];
+                if (c > 0)
+                {
+                    node.data.internal.keys[c - 1] = level_keys[child].key;
+                    node.data.internal.ids[c - 1] = level_keys[child].id;
+                }
+            }
+            node.num_keys = size - 1;
+            off_t offset = allocate_node(db);
+            ix_write(db, offset, &node);
+            level[j] = offset; // Entries below child are no longer needed
+            level_keys[j] = first;
+        }
+        m = nodes;
+    }
+    free_page(db, (int)(index->root_offset / PAGE_SIZE)); // The empty root leaf
+    index->root_offset = level[0];
+    table->dirty = 1;
+    free(level);
+    free(level_keys);
+}
+
+// Load count rows into the current table, which must be empty. Row i has id
+// ids[i] and one value per column at values[i * num_columns]. The rows are
+// sorted by id, packed into data pages in that order, and the B-Tree is
+// built bottom-up: full leaves written left to right, then each internal
+// level from the one below. Pages and nodes are filled to fill_percent
+// (50 to 100) to leave room for later updates and inserts; the last two of
+// a level may share fewer, but never below the minimum a delete keeps.
+// Secondary indexes are built the same way from their sorted entries.
+// Returns 1 if loaded, 0 on a bad or duplicate id.
+static int bulk_load_locked(Database *db, int count, const int *ids, const Value *values, int fill_percent)
+{
+    Table *table = thread_table(db);
+    if (fill_percent < 50 || fill_percent > 100)
+    {
+        printf("Error: Fill factor must be 50 to 100 percent (got %d)\n", fill_percent);
+        return 0;
+    }
+    BTreeNode root;
+    read_node(db, table->root_offset, &root);
+    if (!root.is_leaf || root.num_keys > 0)
+    {
+        printf("Error: Bulk loading needs an empty table (%s has rows)\n", table->schema.name);
+        return 0;
+    }
+    if (count == 0)
+    {
+        return 1;
+    }
+
+    LoadOrder *order = malloc(count * sizeof(LoadOrder));
+    if (order == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        order[i].id = ids[i];
+        order[i].row = i;
+    }
+    qsort(order, count, sizeof(LoadOrder), compare_load_order);
+    for (int i = 0; i < count; i++)
+    {
+        if (order[i].id <= 0 || (i > 0 && order[i].id == order[i - 1].id))
+        {
+            printf("Error: %s id %d in bulk load\n", order[i].id <= 0 ? "Invalid" : "Duplicate", order[i].id);
+            free(order);
+            return 0;
+        }
+    }
+
+    // One pass in id order fills data pages and leaves together. Each leaf
+    // is written once its successor's page is known, so the links need no
+    // second visit.
+    int reserve = PAGE_SIZE * (100 - fill_percent) / 100;
+    int per_leaf = MAX_LEAF_KEYS * fill_percent / 100;
+    int leaves = group_count(count, per_leaf, MIN_LEAF_KEYS);
+    off_t *level = malloc(leaves * sizeof(off_t)); // Nodes of the level being built
+    int *level_keys = malloc(leaves * sizeof(int)); // Smallest id under each
+    if (level == NULL || level_keys == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    IndexKey keys[MAX_INDEXES];
+    int present[MAX_INDEXES];
+    IndexPair *pairs[MAX_INDEXES]; // Entries of each secondary index
+    int num_pairs[MAX_INDEXES] = {0};
+    for (int i = 0; i < table->num_indexes; i++)
+    {
+        pairs[i] = malloc(count * sizeof(IndexPair));
+        if (pairs[i] == NULL)
+        {
+            printf("Error: Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    BTreeNode leaf = {0};
+    leaf.is_leaf = 1;
+    off_t leaf_offset = allocate_node(db);
+    int leaf_no = 0;
+    int page_no = table->last_data_page; // An empty table keeps one empty page
+    DataPageHeader *page = get_page(db, page_no);
+    for (int i = 0; i < count; i++)
+    {
+        const Value *row = values + (size_t)order[i].row * table->schema.num_columns;
+        unsigned char scratch[OVERFLOW_THRESHOLD];
+        unsigned char *record = record_buffer(scratch, record_size(&table->schema, row));
+        unsigned char cell[MAX_CELL_SIZE];
+        int record_length = encode_record(&table->schema, row, record);
+        int length = encode_cell(db, order[i].id, record, record_length, cell);
+        record_index_keys(table, record, record_length, keys, present);
+        if (record != scratch)
+        {
+            free(record);
+        }
+
+        int slot = -1;
+        if (page->num_rows == 0 || (int)page->free_bytes - length - (int)sizeof(Slot) >= reserve)
+        {
+            slot = page_insert(page, cell, length);
+        }
+        if (slot < 0)
+        {
+            fsm_set(db, page_no, page->free_bytes);
+            release_page(db, page, 1);
+            page = append_page(db);
+            page_no = table->last_data_page;
+            slot = page_insert(page, cell, length);
+            assert(slot >= 0);
+        }
+        for (int j = 0; j < table->num_indexes; j++)
+        {
+            if (present[j])
+            {
+                pairs[j][num_pairs[j]++] = (IndexPair){keys[j], order[i].id};
+            }
+        }
+
+        IndexEntry *entry = &leaf.data.leaf.entries[leaf.num_keys++];
+        entry->id = order[i].id;
+        entry->rid.page = page_no;
+        entry->rid.slot = slot;
+        if (leaf.num_keys == group_size(count, per_leaf, leaves, leaf_no))
+        {
+            level[leaf_no] = leaf_offset;
+            level_keys[leaf_no] = leaf.data.leaf.entries[0].id;
+            off_t next = leaf_no + 1 < leaves ? allocate_node(db) : 0;
+            leaf.data.leaf.next = next;
+            write_node(db, leaf_offset, &leaf);
+            memset(&leaf, 0, sizeof(BTreeNode));
+            leaf.is_leaf = 1;
+            leaf.data.leaf.prev = leaf_offset;
+            leaf_offset = next;
+            leaf_no++;
+        }
+    }
+    fsm_set(db, page_no, page->free_bytes);
+    release_page(db, page, 1);
+    free(order);
+
+    // Internal levels, bottom-up, until one node is left
+    int per_node = MAX_CHILDREN * fill_percent / 100;
+    for (int n = leaves; n > 1;)
+    {
+        int nodes = group_count(n, per_node, MIN_KEYS + 1);
+        int child = 0;
+        for (int j = 0; j < nodes; j++)
+        {
+            BTreeNode node = {0};
+            int size = group_size(n, per_node, nodes, j);
+            int first_key = level_keys[child];
+            for (int c = 0; c < size; c++, child++)
+            {
+                node.data.internal.children[c] = level[child];
+                if (c > 0)
+                {
+                    node.data.internal.keys[c - 1] = level_keys[child];
+                }
+            }
+            node.num_keys = size - 1;
+            off_t offset = allocate_node(db);
+            write_node(db, offset, &node);
+            level[j] = offset; // Entries below child are no longer needed
+            level_keys[j] = first_key;
+        }
+        n = nodes;
+    }
+    free_page(db, (int)(table->root_offset / PAGE_SIZE)); // The empty root leaf
+    table->root_offset = level[0];
+    table->dirty = 1;
+    free(level);
+    free(level_keys);
+    for (int i = 0; i < table->num_indexes; i++)
+    {
+        qsort(pairs[i], num_pairs[i], sizeof(IndexPair), compare_index_pair);
+        ix_build(db, table, &table->indexes[i], pairs[i], num_pairs[i], fill_percent);
+        free(pairs[i]);
+    }
+    printf("Loaded %d rows into %s (%d data pages, B-Tree height %d)\n", count, table->schema.name, table->num_pages, btree_height(db));
+    write_buffer(db);
+    return 1;
+}
+
+int bulk_load(Database *db, int count, const int *ids, const Value *values, int fill_percent)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    int result = bulk_load_locked(db, count, ids, values, fill_percent);
+    db_unlock(db);
+    return result;
+}
+
+// select all rows, returns count of non-deleted rows
+static int select_rows_locked(Database *db, struct Row *rows, int max_rows)
+{
+    Scan scan;
+    int count = 0;
+    scan_open(db, &scan);
+    while (count < max_rows && scan_next(&scan))
+    {
+        struct Row *row = &rows[count++];
+        row->id = scan.id;
+        record_name(&scan.table->schema, scan.record, scan.length, row->name, sizeof(row->name));
+    }
+    scan_close(&scan);
+    return count;
+}
+
+int select_rows(Database *db, struct Row *rows, int max_rows)
+{
+    if (!db_read_lock(db))
+    {
+        return 0;
+    }
+    int result = select_rows_locked(db, rows, max_rows);
+    db_unlock(db);
+    return result;
+}
+
+// Copy the name column of the row a record ID points at; returns its full
+// length
+static int read_row(Database *db, const Schema *schema, RecordId rid, int *id, char *name, int size)
+{
+    const char *page = pool_view(db, page_offset(rid.page));
+    int length;
+    unsigned char *spill;
+    const unsigned char *record = cell_record(db, NULL, (const unsigned char *)slot_cell(page, rid.slot), id, &length, &spill);
+    int name_length = record_name(schema, record, length, name, size);
+    free(spill);
+    pool_release_view(db, page);
+    return name_length;
+}
+
+// Select a row by ID (returns 1 if found, 0 if not)
+static int select_by_id_locked(Database *db, int id, struct Row *row)
+{
+    if (id <= 0)
+    {
+        printf("Error: ID must be a positive integer (got %d)\n", id);
+        return 0;
+    }
+
+    RecordId rid;
+    if (!btree_search(db, id, &rid))
+    {
+        printf("Error: Row with id=%d not found\n", id);
+        return 0;
+    }
+
+    read_row(db, &thread_table(db)->schema, rid, &row->id, row->name, sizeof(row->name));
+    return 1;
+}
+
+int select_by_id(Database *db, int id, struct Row *row)
+{
+    if (!db_read_lock(db))
+    {
+        return 0;
+    }
+    int result = select_by_id_locked(db, id, row);
+    db_unlock(db);
+    return result;
+}
+
+// Copy a row's full name (at most size - 1 bytes, NUL-terminated); returns
+// the name's length, or -1 if there is no row with that ID
+static int select_name_locked(Database *db, int id, char *name, int size)
+{
+    RecordId rid;
+    if (id <= 0 || !btree_search(db, id, &rid))
+    {
+        return -1;
+    }
+    int row_id;
+    return read_row(db, &thread_table(db)->schema, rid, &row_id, name, size);
+}
+
+int select_name(Database *db, int id, char *name, int size)
+{
+    if (!db_read_lock(db))
+    {
+        return 0;
+    }
+    int result = select_name_locked(db, id, name, size);
+    db_unlock(db);
+    return result;
+}
+
+// Copy the cursor's current row (returns 1 if it is on one that still exists)
+static int cursor_row_locked(Cursor *cursor, struct Row *row)
+{
+    if (cursor->state != CURSOR_ON_ROW || !cursor_refresh(cursor))
+    {
+        return 0;
+    }
+    read_row(cursor->db, &cursor_table(cursor)->schema, cursor->rid, &row->id, row->name, sizeof(row->name));
+    return 1;
+}
+
+int cursor_row(Cursor *cursor, struct Row *row)
+{
+    if (!db_read_lock(cursor->db))
+    {
+        return 0;
+    }
+    int result = cursor_row_locked(cursor, row);
+    db_unlock(cursor->db);
+    return result;
+}
+
+// Decode columns [first, first + count) of a row into values, copying TEXT
+// and BLOB bytes into buf (returns 1 if found, 0 if not or buf is too small)
+static int read_values(Database *db, int id, int first, int count, Value *values, char *buf, int size)
+{
+    if (id <= 0)
+    {
+        printf("Error: ID must be a positive integer (got %d)\n", id);
+        return 0;
+    }
+
+    RecordId rid;
+    if (!btree_search(db, id, &rid))
+    {
+        printf("Error: Row with id=%d not found\n", id);
+        return 0;
+    }
+
+    const char *page = pool_view(db, page_offset(rid.page));
+    int row_id, length;
+    unsigned char *spill;
+    const unsigned char *record = cell_record(db, NULL, (const unsigned char *)slot_cell(page, rid.slot), &row_id, &length, &spill);
+    int used = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Value *value = &values[i];
+        record_column(&thread_table(db)->schema, record, length, first + i, value);
+        if (value->data == NULL)
+        {
+            continue;
+        }
+        if (value->length > size - used)
+        {
+            printf("Error: Row with id=%d does not fit in a %d-byte buffer\n", id, size);
+            used = -1;
+            break;
+        }
+        memcpy(buf + used, value->data, value->length);
+        value->data = buf + used;
+        used += value->length;
+    }
+    free(spill);
+    pool_release_view(db, page);
+    return used >= 0;
+}
+
+// Select every column of a row; TEXT and BLOB values point into buf
+static int select_values_locked(Database *db, int id, Value *values, char *buf, int size)
+{
+    return read_values(db, id, 0, thread_table(db)->schema.num_columns, values, buf, size);
+}
+
+int select_values(Database *db, int id, Value *values, char *buf, int size)
+{
+    if (!db_read_lock(db))
+    {
+        return 0;
+    }
+    int result = select_values_locked(db, id, values, buf, size);
+    db_unlock(db);
+    return result;
+}
+
+// Select one column of a row, decoding only that column
+static int select_column_locked(Database *db, int id, int column, Value *value, char *buf, int size)
+{
+    if (column < 0 || column >= thread_table(db)->schema.num_columns)
+    {
+        printf("Error: Table %s has no column %d\n", thread_table(db)->schema.name, column);
+        return 0;
+    }
+    return read_values(db, id, column, 1, value, buf, size);
+}
+
+int select_column(Database *db, int id, int column, Value *value, char *buf, int size)
+{
+    if (!db_read_lock(db))
+    {
+        return 0;
+    }
+    int result = select_column_locked(db, id, column, value, buf, size);
+    db_unlock(db);
+    return result;
+}
+
+// Order two non-NULL values of a column type; TEXT and BLOB compare bytewise,
+// a prefix sorting first
+static int compare_values(int type, const Value *a, const Value *b)
+{
+    if (type == COL_INT64)
+    {
+        return (a->int64 > b->int64) - (a->int64 < b->int64);
+    }
+    if (type == COL_DOUBLE)
+    {
+        return (a->real > b->real) - (a->real < b->real);
+    }
+    int n = a->length < b->length ? a->length : b->length;
+    int cmp = n > 0 ? memcmp(a->data, b->data, n) : 0;
+    return cmp != 0 ? cmp : (a->length > b->length) - (a->length < b->length);
+}
+
+// Whether a record's column is non-NULL and lies in [low, high]
+static int record_in_range(const Schema *schema, const unsigned char *record, int length, int column,
+                           const Value *low, const Value *high)
+{
+    Value value;
+    int type = schema->columns[column].type;
+    record_column(schema, record, length, column, &value);
+    return !value.is_null && compare_values(type, &value, low) >= 0 && compare_values(type, &value, high) <= 0;
+}
+
+// Pass the row at rid to visit, counting it in *count, if its column lies in
+// [low, high] (any row if column is -1). Returns 0 once visit asks to stop.
+static int visit_record(Database *db, RecordId rid, int column, const Value *low, const Value *high,
+                        int (*visit)(void *arg, int id, const unsigned char *record, int length), void *arg, int *count)
+{
+    const char *page = pool_view(db, page_offset(rid.page));
+    int id, length;
+    unsigned char *spill;
+    const unsigned char *record = cell_record(db, NULL, (const unsigned char *)slot_cell(page, rid.slot), &id, &length, &spill);
+    int more = 1;
+    if (column < 0 || record_in_range(&thread_table(db)->schema, record, length, column, low, high))
+    {
+        (*count)++;
+        more = visit(arg, id, record, length);
+    }
+    free(spill);
+    pool_release_view(db, page);
+    return more;
+}
+
+// Call visit with the id and record of each row of the current table whose
+// column lies in [low, high] (pass the same value twice for equality) until
+// it returns 0; NULLs never match. The column "id" (with INT64 values)
+// selects by key through the B-Tree, in id order. With an index on the
+// column only the matching index range and its rows are read, in column
+// order; without one every page is scanned, in storage order. Returns the
+// number of rows visited.
+static int where_each(Database *db, const char *column_name, const Value *low, const Value *high,
+                      int (*visit)(void *arg, int id, const unsigned char *record, int length), void *arg)
+{
+    int count = 0;
+    int more = 1;
+    if (strcmp(column_name, "id") == 0)
+    {
+        // A B-Tree descent, then a walk along the leaves
+        if (low->int64 > INT_MAX || high->int64 < 1 || low->int64 > high->int64)
+        {
+            return 0;
+        }
+        Cursor cursor;
+        int found = cursor_seek(db, &cursor, low->int64 < 1 ? 1 : (int)low->int64);
+        while (found && more && cursor.id <= high->int64)
+        {
+            more = visit_record(db, cursor.rid, -1, NULL, NULL, visit, arg, &count);
+            found = cursor_next(&cursor);
+        }
+        return count;
+    }
+    const Schema *schema = &thread_table(db)->schema;
+    int column = column_index(schema, column_name);
+    if (column < 0)
+    {
+        printf("Error: Table %s has no column %s\n", schema->name, column_name);
+        return 0;
+    }
+
+    const SecondaryIndex *index = column_secondary_index(thread_table(db), column);
+    if (index == NULL)
+    {
+        Scan scan;
+        scan_open(db, &scan);
+        while (more && scan_next(&scan))
+        {
+            if (record_in_range(schema, scan.record, scan.length, column, low, high))
+            {
+                count++;
+                more = visit(arg, scan.id, scan.record, scan.length);
+            }
+        }
+        scan_close(&scan);
+        return count;
+    }
+
+    // Walk the leaves from the low key, copying out each leaf's ids before
+    // fetching their rows. Keys only bound the range: every row is checked,
+    // since TEXT and BLOB keys hold just a prefix.
+    int type = schema->columns[column].type;
+    IndexKey low_key = index_key(type, low);
+    IndexKey high_key = index_key(type, high);
+    off_t leaf_offset = ix_seek(db, index, &low_key);
+    int done = 0;
+    while (leaf_offset != 0 && !done && more)
+    {
+        const IndexNode *leaf = (const IndexNode *)pool_view(db, leaf_offset);
+        int ids[MAX_IX_LEAF_KEYS];
+        int n = 0;
+        int i = ix_lower_bound(leaf->data.leaf.keys, leaf->data.leaf.ids, leaf->num_keys, &low_key, 0);
+        for (; i < leaf->num_keys; i++)
+        {
+            if (key_compare(&leaf->data.leaf.keys[i], &high_key) > 0)
+            {
+                done = 1;
+                break;
+            }
+            ids[n++] = leaf->data.leaf.ids[i];
+        }
+        leaf_offset = leaf->data.leaf.next;
+        pool_release_view(db, (const char *)leaf);
+
+        for (i = 0; i < n && more; i++)
+        {
+            RecordId rid;
+            int found = btree_search(db, ids[i], &rid);
+            assert(found); // Indexes only hold live rows
+            (void)found;
+            more = visit_record(db, rid, column, low, high, visit, arg, &count);
+        }
+    }
+    return count;
+}
+
+// Rows collected by select_where
+typedef struct
+{
+    const Schema *schema;
+    struct Row *rows;
+    int max_rows;
+    int count;
+} RowCollector;
+
+static int collect_row(void *arg, int id, const unsigned char *record, int length)
+{
+    RowCollector *collector = arg;
+    struct Row *row = &collector->rows[collector->count++];
+    row->id = id;
+    record_name(collector->schema, record, length, row->name, sizeof(row->name));
+    return collector->count < collector->max_rows;
+}
+
+// Select the rows of the current table whose column lies in [low, high], in
+// the order where_each visits them. Returns the number of rows copied into
+// rows, at most max_rows.
+static int select_where_locked(Database *db, const char *column_name, const Value *low, const Value *high, struct Row *rows, int max_rows)
+{
+    if (max_rows <= 0)
+    {
+        return 0;
+    }
+    RowCollector collector = {&thread_table(db)->schema, rows, max_rows, 0};
+    where_each(db, column_name, low, high, collect_row, &collector);
+    return collector.count;
+}
+
+int select_where(Database *db, const char *column_name, const Value *low, const Value *high, struct Row *rows, int max_rows)
+{
+    if (!db_read_lock(db))
+    {
+        return 0;
+    }
+    int result = select_where_locked(db, column_name, low, high, rows, max_rows);
+    db_unlock(db);
+    return result;
+}
+
+// Replace the record of the row at rid, whose page the caller has pinned;
+// releases the page and returns where the row is now
+static RecordId replace_record(Database *db, int id, RecordId rid, void *page, const unsigned char *record, int record_length)
+{
+    Table *table = thread_table(db);
+    unsigned char cell[MAX_CELL_SIZE];
+    int length = encode_cell(db, id, record, record_length, cell);
+
+    // The record ID names the page and slot, so update the cached page in place
+    DataPageHeader *header = page;
+    const char *old_cell = slot_cell(page, rid.slot);
+    assert(old_cell != NULL); // The index never points at a tombstone
+    IndexKey old_keys[MAX_INDEXES], new_keys[MAX_INDEXES];
+    int old_present[MAX_INDEXES], new_present[MAX_INDEXES];
+    if (table->num_indexes > 0)
+    {
+        int row_id, old_length;
+        unsigned char *spill;
+        const unsigned char *old_record = cell_record(db, NULL, (const unsigned char *)old_cell, &row_id, &old_length, &spill);
+        record_index_keys(table, old_record, old_length, old_keys, old_present);
+        record_index_keys(table, record, record_length, new_keys, new_present);
+        free(spill);
+    }
+    int old_overflow = cell_overflow((const unsigned char *)old_cell);
+    int old_free = header->free_bytes;
+    int updated = page_update(page, rid.slot, cell, length);
+    if (!updated)
+    {
+        page_delete(page, rid.slot);
+    }
+    if (header->free_bytes / FSM_GRANULE != old_free / FSM_GRANULE) // Skip the map page when its entry stays put
+    {
+        fsm_set(db, rid.page, header->free_bytes);
+    }
+    release_page(db, page, 1);
+    free_overflow(db, old_overflow);
+
+    if (!updated)
+    {
+        // The longer row no longer fits in its page: move it and repoint the index
+        rid = store_cell(db, cell, length);
+        btree_update_rid(db, id, rid);
+    }
+    if (table->num_indexes > 0)
+    {
+        update_index_keys(db, id, old_keys, old_present, new_keys, new_present);
+    }
+    return rid;
+}
+
+// Replace every column of the row at rid
+static void write_values(Database *db, int id, RecordId rid, const Value *values)
+{
+    unsigned char scratch[OVERFLOW_THRESHOLD];
+    unsigned char *record = record_buffer(scratch, record_size(&thread_table(db)->schema, values));
+    int length = encode_record(&thread_table(db)->schema, values, record);
+    replace_record(db, id, rid, get_page(db, rid.page), record, length);
+    if (record != scratch)
+    {
+        free(record);
+    }
+}
+
+// Update every column of a row
+static int update_values_locked(Database *db, int id, const Value *values)
+{
+    if (id <= 0)
+    {
+        printf("Error: ID must be a positive integer (got %d)\n", id);
+        return 0;
+    }
+
+    RecordId rid;
+    if (!btree_search(db, id, &rid))
+    {
+        printf("Error: Row with id=%d not found\n", id);
+        return 0;
+    }
+
+    write_values(db, id, rid, values);
+    printf("Updated row: id=%d\n", id);
+    write_buffer(db);
+    return 1;
+}
+
+int update_values(Database *db, int id, const Value *values)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    int result = update_values_locked(db, id, values);
+    db_unlock(db);
+    return result;
+}
+
+// update a row's name column, keeping its other columns
+static int update_row_locked(Database *db, int id, const char *name)
+{
+    Table *table = thread_table(db);
+    if (id <= 0)
+    {
+        printf("Error: ID must be a positive integer (got %d)\n", id);
+        return 0;
+    }
+    if (table->schema.name_column < 0)
+    {
+        printf("Error: Table %s has no TEXT column\n", table->schema.name);
+        return 0;
+    }
+
+    RecordId rid;
+    if (!btree_search(db, id, &rid))
+    {
+        printf("Error: Row with id=%d not found\n", id);
+        return 0;
+    }
+
+    // Re-encode from the old record, which the values point into
+    const Schema *schema = &table->schema;
+    void *page = get_page(db, rid.page);
+    int row_id, length;
+    unsigned char *spill;
+    const unsigned char *old_record = cell_record(db, NULL, (const unsigned char *)slot_cell(page, rid.slot), &row_id, &length, &spill);
+    Value values[MAX_COLUMNS];
+    for (int i = 0; i < schema->num_columns; i++)
+    {
+        record_column(schema, old_record, length, i, &values[i]);
+    }
+    values[schema->name_column].is_null = 0;
+    values[schema->name_column].data = name;
+    values[schema->name_column].length = (int)strlen(name);
+    unsigned char scratch[OVERFLOW_THRESHOLD];
+    unsigned char *record = record_buffer(scratch, record_size(schema, values));
+    length = encode_record(schema, values, record);
+    free(spill);
+
+    rid = replace_record(db, id, rid, page, record, length);
+    if (record != scratch)
+    {
+        free(record);
+    }
+    printf("Updated row at page %u slot %u: id=%d, new name=%.59s\n", rid.page, rid.slot, id, name);
+    write_buffer(db);
+    return 1;
+}
+
+int update_row(Database *db, int id, const char *name)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    int result = update_row_locked(db, id, name);
+    db_unlock(db);
+    return result;
+}
+
+// Delete a row
+static int delete_row_locked(Database *db, int id)
+{
+    if (id <= 0)
+    {
+        printf("Error: ID must be a positive integer (got %d)\n", id);
+        return 0;
+    }
+
+    RecordId rid;
+    if (!btree_search(db, id, &rid))
+    {
+        printf("Error: Row with id=%d not found\n", id);
+        return 0;
+    }
+
+    // Delete from B-Tree
+    btree_delete(db, id);
+
+    // Tombstone the slot; no other row moves, so no index entry changes
+    void *page = get_page(db, rid.page);
+    DataPageHeader *header = page;
+    const unsigned char *cell = (const unsigned char *)slot_cell(page, rid.slot);
+    IndexKey keys[MAX_INDEXES], no_keys[MAX_INDEXES] = {{0}};
+    int present[MAX_INDEXES], absent[MAX_INDEXES] = {0};
+    if (thread_table(db)->num_indexes > 0)
+    {
+        int row_id, length;
+        unsigned char *spill;
+        const unsigned char *record = cell_record(db, NULL, cell, &row_id, &length, &spill);
+        record_index_keys(thread_table(db), record, length, keys, present);
+        free(spill);
+    }
+    int overflow = cell_overflow(cell);
+    page_delete(page, rid.slot);
+    int now_empty = header->num_rows == 0;
+    fsm_set(db, rid.page, header->free_bytes);
+    release_page(db, page, 1);
+    free_overflow(db, overflow);
+    if (thread_table(db)->num_indexes > 0)
+    {
+        update_index_keys(db, id, keys, present, no_keys, absent);
+    }
+
+    // Return an empty page to the freelist; the table keeps at least one page
+    if (now_empty && thread_table(db)->num_pages > 1)
+    {
+        remove_page(db, rid.page);
+    }
+    write_buffer(db);
+    return 1;
+}
+
+int delete_row(Database *db, int id)
+{
+    if (!db_write_lock(db))
+    {
+        return 0;
+    }
+    int result = delete_row_locked(db, id);
+    db_unlock(db);
+    return result;
+}
+
+// cleanup function; no other thread may still be using the handle
+void close_db(Database *db)
+{
+    assert(db->wal->snapshots == 0); // Every snapshot must be closed first
+    if (db->in_txn)
+    {
+        rollback_txn(db); // An unfinished transaction never commits
+    }
+    write_buffer(db);
+    wal_checkpoint(db);
+    pool_destroy(db->pool);
+    wal_close(db->wal);
+    free_tables(db);
+    if (db->map != NULL)
+    {
+        munmap(db->map, db->map_size);
+    }
+    close(db->fd);
+    pthread_rwlock_destroy(db->lock);
+    free(db->lock);
+    statement_cache_destroy(db->statements);
+    if (db->workers != NULL)
+    {
+        workers_stop(db->workers);
+    }
+}
+
+// Column type for a CREATE TABLE type name (-1 = unknown)
+static int parse_column_type(const char *word)
+{
+    static const char *names[] = {"INT64", "DOUBLE", "TEXT", "BLOB"};
+    for (int i = 0; i < 4; i++)
+    {
+        if (strcmp(word, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Parse "CREATE TABLE <name> (<column> <type>, ...)"; returns the number of
+// columns, or -1 if the statement is malformed
+static int parse_create_table(const char *input, char *name, Column *columns)
+{
+    int n = 0;
+    if (sscanf(input, "CREATE TABLE %31[A-Za-z0-9_] (%n", name, &n) != 1 || n == 0)
+    {
+        return -1;
+    }
+    const char *p = input + n;
+    int count = 0;
+    while (count < MAX_COLUMNS)
+    {
+        char type[16];
+        char end[2];
+        int used = 0;
+        if (sscanf(p, " %31[A-Za-z0-9_] %15[A-Z0-9] %1[,)]%n", columns[count].name, type, end, &used) != 3)
+        {
+            return -1;
+        }
+        columns[count].type = parse_column_type(type);
+        if (columns[count].type < 0)
+        {
+            printf("Error: Unknown column type %s (use INT64, DOUBLE, TEXT or BLOB)\n", type);
+            return -1;
+        }
+        count++;
+        p += used;
+        if (end[0] == ')')
+        {
+            return count;
+        }
+    }
+    return -1;
+}
+
+// Parse one value of a column from token, which is modified: TEXT values
+// point into it and BLOB hex digits are decoded in place. NULL stands for a
+// missing value. An empty or out-of-range number is an error rather than 0
+// or a clamped value. Returns 1 on success.
+static int parse_value(const Column *column, char *token, Value *value)
+{
+    memset(value, 0, sizeof(Value));
+    if (strcmp(token, "NULL") == 0)
+    {
+        value->is_null = 1;
+        return 1;
+    }
+    char *end = token;
+    errno = 0;
+    switch (column->type)
+    {
+    case COL_INT64:
+        value->int64 = strtoll(token, &end, 10);
+        break;
+    case COL_DOUBLE:
+        value->real = strtod(token, &end);
+        break;
+    case COL_TEXT:
+        value->data = token;
+        value->length = (int)strlen(token);
+        end = token + value->length;
+        break;
+    default: // COL_BLOB: hex digits
+        value->data = token;
+        while (isxdigit((unsigned char)end[0]) && isxdigit((unsigned char)end[1]))
+        {
+            char byte[3] = {end[0], end[1], '\0'};
+            token[value->length++] = (char)strtol(byte, NULL, 16);
+            end += 2;
+        }
+        break;
+    }
+    int numeric = column->type == COL_INT64 || column->type == COL_DOUBLE;
+    if (*end != '\0' || (numeric && (end == token || errno == ERANGE)))
+    {
+        printf("Error: Bad value '%s' for column %s\n", token, column->name);
+        return 0;
+    }
+    return 1;
+}
+
+// Read the rest of file into a NUL-terminated buffer, in chunks so pipes and
+// other unseekable files work too. Returns NULL on a read error.
+static char *read_file(FILE *file, size_t *size)
+{
+    size_t capacity = 1 << 16;
+    char *text = malloc(capacity);
+    *size = 0;
+    while (text != NULL)
+    {
+        if (*size + 1 == capacity)
+        {
+            capacity *= 2;
+            char *grown = realloc(text, capacity);
+            if (grown == NULL)
+            {
+                free(text);
+                text = NULL;
+                break;
+            }
+            text = grown;
+        }
+        size_t n = fread(text + *size, 1, capacity - *size - 1, file);
+        if (n == 0)
+        {
+            break;
+        }
+        *size += n;
+    }
+    if (text == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    if (ferror(file))
+    {
+        free(text);
+        return NULL;
+    }
+    text[*size] = '\0';
+    return text;
+}
+
+// Parse the CSV text read by import_csv and load it. Runs under the write
+// lock, so the current table cannot change between parsing and loading.
+static int import_csv_locked(Database *db, const char *path, char *text, size_t size, int fill_percent)
+{
+    int lines = 1;
+    for (size_t i = 0; i < size; i++)
+    {
+        lines += text[i] == '\n';
+    }
+    const Schema *schema = &thread_table(db)->schema;
+    int *ids = malloc(lines * sizeof(int));
+    Value *values = malloc((size_t)lines * schema->num_columns * sizeof(Value));
+    if (ids == NULL || values == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+
+    // Values point into text, which stays allocated until the load is done
+    int count = 0;
+    int ok = 1;
+    char *save = NULL;
+    int line_no = 0;
+    for (char *line = strtok_r(text, "\n", &save); line != NULL && ok; line = strtok_r(NULL, "\n", &save))
+    {
+        line_no++;
+        line[strcspn(line, "\r")] = '\0';
+        if (line[0] == '\0')
+        {
+            continue;
+        }
+        char *end;
+        char *field = strsep(&line, ",");
+        long id = strtol(field, &end, 10);
+        ok = *end == '\0' && id > 0 && id <= INT_MAX;
+        ids[count] = (int)id;
+        Value *row = values + (size_t)count * schema->num_columns;
+        for (int c = 0; c < schema->num_columns && ok; c++)
+        {
+            field = strsep(&line, ",");
+            ok = field != NULL && parse_value(&schema->columns[c], field, &row[c]);
+        }
+        ok &= line == NULL; // No fields left over
+        if (!ok)
+        {
+            printf("Error: Bad row on line %d of %s (expected an id and %d values)\n", line_no, path, schema->num_columns);
+        }
+        count++;
+    }
+    ok = ok && bulk_load_locked(db, count, ids, values, fill_percent);
+    free(ids);
+    free(values);
+    return ok;
+}
+
+// Bulk load a CSV file into the current table. Each line is an id and one
+// value per column, separated by commas, in the forms INSERT takes (NULL,
+// numbers, text without commas, hex for BLOBs); an empty INT64 or DOUBLE
+// field is an error, not 0. Returns 1 if loaded.
+int import_csv(Database *db, const char *path, int fill_percent)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        printf("Error: Cannot open %s\n", path);
+        return 0;
+    }
+    size_t size;
+    char *text = read_file(file, &size);
+    fclose(file);
+    if (text == NULL)
+    {
+        printf("Error: Cannot read %s\n", path);
+        return 0;
+    }
+    int ok = db_write_lock(db);
+    if (ok)
+    {
+        ok = import_csv_locked(db, path, text, size, fill_percent);
+        db_unlock(db);
+    }
+    free(text);
+    return ok;
+}
+
+// Print a value of a column type
+static void print_value(int type, const Value *value)
+{
+    if (value->is_null)
+    {
+        printf("NULL");
+    }
+    else if (type == COL_INT64)
+    {
+        printf("%lld", value->int64);
+    }
+    else if (type == COL_DOUBLE)
+    {
+        printf("%g", value->real);
+    }
+    else if (type == COL_TEXT)
+    {
+        printf("%.*s", value->length, value->data);
+    }
+    else
+    {
+        for (int j = 0; j < value->length; j++)
+        {
+            printf("%02x", (unsigned char)value->data[j]);
+        }
+    }
+}
+
+// Print "id=<id>, <column>=<value>, ..."
+static void print_values(const Schema *schema, int id, const Value *values)
+{
+    printf("id=%d", id);
+    for (int i = 0; i < schema->num_columns; i++)
+    {
+        printf(", %s=", schema->columns[i].name);
+        print_value(schema->columns[i].type, &values[i]);
+    }
+    printf("\n");
+}
+
+// Streaming SELECT output: the table's schema and the rows printed so far
+typedef struct
+{
+    const Schema *schema;
+    int printed;
+    const struct Statement *stmt; // SELECT <list> being printed
+} RowPrinter;
+
+// select_each callback printing "Row <n>: id=.., <column>=.."
+static int print_row(void *arg, int id, const Value *values)
+{
+    RowPrinter *printer = arg;
+    printf("Row %d: ", printer->printed++);
+    print_values(printer->schema, id, values);
+    return 1;
+}
+
+// Prepared statements. prepare_statement compiles a row statement once into
+// a plan; execute_statement runs it as often as needed without looking at
+// the text again. Any literal may be replaced by a ? parameter, numbered
+// from 1 in order of appearance and supplied with bind_value. Statements:
+//   INSERT <id> <value> ... | UPDATE <id> <value> ... | DELETE <id>
+//   SELECT | SELECT <id> | SELECT WHERE <column> = <value>
+//   SELECT WHERE <column> BETWEEN <low> AND <high> | BEGIN | COMMIT | ROLLBACK
+//   SELECT <item>, ... [WHERE <condition> AND ...] [GROUP BY <column>]
+// In the last form (see run_query) an item is a column, * for every column,
+// COUNT(*), or COUNT, SUM, MIN, MAX or AVG of a column, and a condition is
+// <column> <op> <value> with op one of = != < <= > >=, or <column> BETWEEN
+// <low> AND <high>. Columns may be id. Words are separated by spaces or
+// tabs, and parentheses and commas stand alone; keywords match in any case.
+// A value is NULL, a number, hex digits for a BLOB, a word for a TEXT, or
+// any text in single quotes ('' for a quote).
+typedef enum
+{
+    STMT_INSERT,
+    STMT_UPDATE,
+    STMT_DELETE,
+    STMT_SELECT_ALL,
+    STMT_SELECT_ID,
+    STMT_SELECT_WHERE,
+    STMT_SELECT_LIST,
+    STMT_BEGIN,
+    STMT_COMMIT,
+    STMT_ROLLBACK
+} StatementKind;
+
+typedef enum
+{
+    TOKEN_END,
+    TOKEN_WORD,   // Run of characters other than spaces, parentheses and commas, or one of those three
+    TOKEN_STRING, // 'quoted text'; start and length cover the text between the quotes
+    TOKEN_PARAM,  // ?
+    TOKEN_BAD     // Quote left open
+} TokenType;
+
+typedef struct
+{
+    int type; // TokenType
+    const char *start;
+    int length;
+} Token;
+
+// One value of a plan: a literal, or a parameter bound at execution
+typedef struct
+{
+    int param;   // Parameter number, or 0 for a literal
+    Value value; // The literal; TEXT and BLOB bytes live in the plan's storage
+} Operand;
+
+#define MAX_QUERY_ITEMS (MAX_COLUMNS + 1) // Items in the list of a SELECT <list>
+#define MAX_PREDICATES 8                   // Conditions in its WHERE (BETWEEN counts as two)
+#define NO_COLUMN -2                       // Column of COUNT(*), or of no GROUP BY
+
+typedef enum
+{
+    AGG_NONE, // The column's value
+    AGG_COUNT,
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX,
+    AGG_AVG
+} Aggregate;
+
+typedef enum
+{
+    CMP_EQ,
+    CMP_NE,
+    CMP_LT,
+    CMP_LE,
+    CMP_GT,
+    CMP_GE
+} Comparison;
+
+// One item of a SELECT <list>
+typedef struct
+{
+    int aggregate; // Aggregate
+    int column;    // Column (-1 = id), or NO_COLUMN for COUNT(*)
+} QueryItem;
+
+// One condition of a SELECT <list>: column <op> operand
+typedef struct
+{
+    int column;  // -1 = id
+    int op;      // Comparison
+    int operand; // Index into the statement's operands
+} Predicate;
+
+// A compiled statement. Operands are the id and then one value per column
+// for INSERT and UPDATE, the id for SELECT <id> and DELETE, the low and high
+// values for SELECT WHERE, and the value of each predicate for SELECT <list>.
+struct Statement
+{
+    Database *db;
+    int kind;                          // StatementKind
+    int table_id;                      // Table the plan was compiled for
+    long version;                      // Catalog version it was compiled against
+    char column[MAX_NAME_LENGTH];      // SELECT WHERE: column compared
+    int num_items;                     // SELECT <list>: the list
+    QueryItem items[MAX_QUERY_ITEMS];
+    int num_predicates;                // SELECT <list>: conditions of its WHERE, all of which must hold
+    Predicate predicates[MAX_PREDICATES];
+    int group_column;                  // SELECT <list>: GROUP BY column (-1 = id), or NO_COLUMN
+    int aggregated;                    // SELECT <list>: some item is an aggregate
+    int num_operands;
+    Operand operands[MAX_COLUMNS + 1];
+    int num_params;
+    Value params[MAX_COLUMNS + 1];     // Bound values, in parameter order
+    char bound[MAX_COLUMNS + 1];       // Which parameters have been bound
+    int storage_used;
+    int storage_size;
+    char storage[];                    // NUL-terminated literal text, decoded in place
+};
+
+// Split the next token off *text
+static Token next_token(const char **text)
+{
+    const char *p = *text;
+    while (*p == ' ' || *p == '\t')
+    {
+        p++;
+    }
+    Token token = {TOKEN_WORD, p, 0};
+    if (*p == '\0')
+    {
+        token.type = TOKEN_END;
+    }
+    else if (*p == '?')
+    {
+        token.type = TOKEN_PARAM;
+        token.length = 1;
+        p++;
+    }
+    else if (*p == '\'')
+    {
+        token.start = ++p;
+        while (*p != '\0' && (*p != '\'' || p[1] == '\''))
+        {
+            p += *p == '\'' ? 2 : 1;
+        }
+        token.length = (int)(p - token.start);
+        token.type = *p == '\0' ? TOKEN_BAD : TOKEN_STRING;
+        p += *p != '\0';
+    }
+    else if (*p == '(' || *p == ')' || *p == ',')
+    {
+        token.length = 1;
+        p++;
+    }
+    else
+    {
+        while (*p != '\0' && strchr(" \t(),", *p) == NULL)
+        {
+            p++;
+        }
+        token.length = (int)(p - token.start);
+    }
+    *text = p;
+    return token;
+}
+
+// Whether token is the keyword word, in any case
+static int is_keyword(const Token *token, const char *word)
+{
+    return token->type == TOKEN_WORD && (int)strlen(word) == token->length &&
+           strncasecmp(token->start, word, token->length) == 0;
+}
+
+// Compile token as an operand of the given column type: a new parameter, or
+// a literal copied into the plan's storage. Like the other compile_ steps it
+// returns 1 on success, 0 if the statement is malformed, or -1 after
+// printing some other error.
+static int compile_operand(Statement *stmt, const Token *token, const Column *type)
+{
+    Operand *operand = &stmt->operands[stmt->num_operands++];
+    memset(operand, 0, sizeof(Operand));
+    if (token->type == TOKEN_PARAM)
+    {
+        operand->param = ++stmt->num_params;
+        return 1;
+    }
+    if (token->type == TOKEN_END || token->type == TOKEN_BAD)
+    {
+        return 0;
+    }
+    char *text = stmt->storage + stmt->storage_used;
+    int length = 0;
+    for (int i = 0; i < token->length; i++)
+    {
+        text[length++] = token->start[i];
+        i += token->type == TOKEN_STRING && token->start[i] == '\''; // '' stands for one quote
+    }
+    text[length] = '\0';
+    stmt->storage_used += length + 1;
+    if (token->type == TOKEN_STRING && type->type == COL_TEXT)
+    {
+        operand->value.data = text; // Quoted, so "NULL" is text here
+        operand->value.length = length;
+        return 1;
+    }
+    return parse_value(type, text, &operand->value) ? 1 : -1;
+}
+
+// Compile the id of INSERT, UPDATE, DELETE or SELECT <id>
+static int compile_id(Statement *stmt, const char **text)
+{
+    static const Column id_column = {"id", COL_INT64};
+    Token token = next_token(text);
+    int ok = compile_operand(stmt, &token, &id_column);
+    const Operand *operand = &stmt->operands[stmt->num_operands - 1];
+    if (ok > 0 && !operand->param && (operand->value.is_null || operand->value.int64 <= 0 || operand->value.int64 > INT_MAX))
+    {
+        printf("Error: ID must be a positive integer (got %.*s)\n", token.length, token.start);
+        return -1;
+    }
+    return ok;
+}
+
+// Compile "<column> = <value>" or "<column> BETWEEN <low> AND <high>", where
+// the column may be id
+static int compile_where(Statement *stmt, const Schema *schema, const char **text)
+{
+    static const Column id_column = {"id", COL_INT64};
+    Token name = next_token(text);
+    Token op = next_token(text);
+    if (name.type != TOKEN_WORD || name.length >= MAX_NAME_LENGTH)
+    {
+        return 0;
+    }
+    memcpy(stmt->column, name.start, name.length);
+    stmt->column[name.length] = '\0';
+    int index = column_index(schema, stmt->column);
+    if (index < 0 && strcmp(stmt->column, "id") != 0)
+    {
+        printf("Error: Table %s has no column %s\n", schema->name, stmt->column);
+        return -1;
+    }
+    const Column *type = index < 0 ? &id_column : &schema->columns[index];
+    Token low = next_token(text);
+    Token high = low;
+    if (is_keyword(&op, "BETWEEN"))
+    {
+        Token and = next_token(text);
+        high = next_token(text);
+        if (!is_keyword(&and, "AND"))
+        {
+            return 0;
+        }
+    }
+    else if (op.type != TOKEN_WORD || op.length != 1 || op.start[0] != '=')
+    {
+        return 0;
+    }
+    int ok = compile_operand(stmt, &low, type);
+    if (ok > 0 && high.start == low.start)
+    {
+        stmt->operands[stmt->num_operands++] = stmt->operands[0]; // = compares against the same value twice
+    }
+    else if (ok > 0)
+    {
+        ok = compile_operand(stmt, &high, type);
+    }
+    if (ok <= 0)
+    {
+        return ok;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (!stmt->operands[i].param && stmt->operands[i].value.is_null)
+        {
+            printf("Error: NULL never matches a WHERE condition\n");
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Type of a column of schema, where -1 is the id
+static int column_type(const Schema *schema, int column)
+{
+    return column < 0 ? COL_INT64 : schema->columns[column].type;
+}
+
+// Column named by token (-1 for the id), or NO_COLUMN after printing that
+// the table has no such column
+static int compile_column(const Schema *schema, const Token *token)
+{
+    char name[MAX_NAME_LENGTH];
+    if (token->type != TOKEN_WORD || token->length >= MAX_NAME_LENGTH)
+    {
+        printf("Error: Expected a column name (got '%.*s')\n", token->length, token->start);
+        return NO_COLUMN;
+    }
+    memcpy(name, token->start, token->length);
+    name[token->length] = '\0';
+    int column = strcmp(name, "id") == 0 ? -1 : column_index(schema, name);
+    if (column == -1 && strcmp(name, "id") != 0)
+    {
+        printf("Error: Table %s has no column %s\n", schema->name, name);
+        return NO_COLUMN;
+    }
+    return column;
+}
+
+static const char *aggregate_names[] = {"", "COUNT", "SUM", "MIN", "MAX", "AVG"};
+
+// Compile one item of a SELECT <list>, starting at token
+static int compile_item(Statement *stmt, const Schema *schema, const Token *token, const char **text)
+{
+    if (is_keyword(token, "*"))
+    {
+        if (stmt->num_items + schema->num_columns > MAX_QUERY_ITEMS)
+        {
+            printf("Error: At most %d items can be selected\n", MAX_QUERY_ITEMS);
+            return -1;
+        }
+        for (int i = 0; i < schema->num_columns; i++)
+        {
+            stmt->items[stmt->num_items++] = (QueryItem){AGG_NONE, i};
+        }
+        return 1;
+    }
+    if (stmt->num_items == MAX_QUERY_ITEMS)
+    {
+        printf("Error: At most %d items can be selected\n", MAX_QUERY_ITEMS);
+        return -1;
+    }
+    QueryItem *item = &stmt->items[stmt->num_items++];
+    item->aggregate = AGG_NONE;
+    for (int a = AGG_COUNT; a <= AGG_AVG; a++)
+    {
+        item->aggregate = is_keyword(token, aggregate_names[a]) ? a : item->aggregate;
+    }
+    if (item->aggregate == AGG_NONE)
+    {
+        item->column = compile_column(schema, token);
+        return item->column == NO_COLUMN ? -1 : 1;
+    }
+    Token open = next_token(text);
+    Token argument = next_token(text);
+    Token close = next_token(text);
+    if (!is_keyword(&open, "(") || !is_keyword(&close, ")"))
+    {
+        return 0;
+    }
+    if (item->aggregate == AGG_COUNT && is_keyword(&argument, "*"))
+    {
+        item->column = NO_COLUMN;
+        return 1;
+    }
+    item->column = compile_column(schema, &argument);
+    if (item->column == NO_COLUMN)
+    {
+        return -1;
+    }
+    int type = column_type(schema, item->column);
+    if (item->aggregate != AGG_COUNT && type != COL_INT64 && type != COL_DOUBLE)
+    {
+        printf("Error: %s needs an INT64 or DOUBLE column\n", aggregate_names[item->aggregate]);
+        return -1;
+    }
+    return 1;
+}
+
+// Add the condition "column <op> token" to a SELECT <list>
+static int compile_predicate(Statement *stmt, const Schema *schema, int column, int op, const Token *token)
+{
+    static const Column id_column = {"id", COL_INT64};
+    if (stmt->num_predicates == MAX_PREDICATES)
+    {
+        printf("Error: At most %d conditions can be combined\n", MAX_PREDICATES);
+        return -1;
+    }
+    int ok = compile_operand(stmt, token, column < 0 ? &id_column : &schema->columns[column]);
+    const Operand *operand = &stmt->operands[stmt->num_operands - 1];
+    if (ok > 0 && !operand->param && operand->value.is_null)
+    {
+        printf("Error: NULL never matches a WHERE condition\n");
+        return -1;
+    }
+    stmt->predicates[stmt->num_predicates++] = (Predicate){column, op, stmt->num_operands - 1};
+    return ok;
+}
+
+// Compile the AND-ed conditions of a WHERE, leaving the token after them in
+// *token
+static int compile_conditions(Statement *stmt, const Schema *schema, const char **text, Token *token)
+{
+    static const char *ops[] = {"=", "!=", "<", "<=", ">", ">="};
+    do
+    {
+        Token name = next_token(text);
+        int column = compile_column(schema, &name);
+        if (column == NO_COLUMN)
+        {
+            return -1;
+        }
+        Token op = next_token(text);
+        Token value = next_token(text);
+        int ok = 0;
+        if (is_keyword(&op, "BETWEEN"))
+        {
+            Token and = next_token(text);
+            Token high = next_token(text);
+            ok = is_keyword(&and, "AND") ? compile_predicate(stmt, schema, column, CMP_GE, &value) : 0;
+            ok = ok > 0 ? compile_predicate(stmt, schema, column, CMP_LE, &high) : ok;
+        }
+        for (int i = 0; i < 6; i++)
+        {
+            if (is_keyword(&op, ops[i]))
+            {
+                ok = compile_predicate(stmt, schema, column, i, &value);
+            }
+        }
+        if (ok <= 0)
+        {
+            return ok;
+        }
+        *token = next_token(text);
+    } while (is_keyword(token, "AND"));
+    return 1;
+}
+
+// Compile "SELECT <item>, ... [WHERE ...] [GROUP BY <column>]" after the
+// SELECT
+static int compile_select_list(Statement *stmt, const Schema *schema, const char **text)
+{
+    Token token;
+    do
+    {
+        token = next_token(text);
+        int ok = compile_item(stmt, schema, &token, text);
+        if (ok <= 0)
+        {
+            return ok;
+        }
+        token = next_token(text);
+    } while (is_keyword(&token, ","));
+    if (is_keyword(&token, "WHERE"))
+    {
+        int ok = compile_conditions(stmt, schema, text, &token);
+        if (ok <= 0)
+        {
+            return ok;
+        }
+    }
+    stmt->group_column = NO_COLUMN;
+    if (is_keyword(&token, "GROUP"))
+    {
+        Token by = next_token(text);
+        token = next_token(text);
+        if (!is_keyword(&by, "BY"))
+        {
+            return 0;
+        }
+        stmt->group_column = compile_column(schema, &token);
+        if (stmt->group_column == NO_COLUMN)
+        {
+            return -1;
+        }
+        token = next_token(text);
+    }
+    if (token.type != TOKEN_END)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < stmt->num_items; i++)
+    {
+        stmt->aggregated |= stmt->items[i].aggregate != AGG_NONE;
+    }
+    if (stmt->group_column != NO_COLUMN && !stmt->aggregated)
+    {
+        printf("Error: GROUP BY needs an aggregate such as COUNT(*)\n");
+        return -1;
+    }
+    for (int i = 0; i < stmt->num_items && stmt->aggregated; i++)
+    {
+        const QueryItem *item = &stmt->items[i];
+        if (item->aggregate == AGG_NONE && item->column != stmt->group_column)
+        {
+            printf("Error: Column %s must be aggregated or be the GROUP BY column\n",
+                   item->column < 0 ? "id" : schema->columns[item->column].name);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Usage printed for a malformed statement of each kind
+static const char *statement_usage(int kind)
+{
+    switch (kind)
+    {
+    case STMT_INSERT:
+        return "Invalid INSERT format. Use: INSERT <id> <value> ...";
+    case STMT_UPDATE:
+        return "Invalid UPDATE format. Use: UPDATE <id> <value> ...";
+    case STMT_DELETE:
+        return "Invalid DELETE format. Use: DELETE <id>";
+    case STMT_SELECT_WHERE:
+        return "Invalid SELECT WHERE format. Use: SELECT WHERE <column> = <value> or\n"
+               "       SELECT WHERE <column> BETWEEN <low> AND <high>";
+    case STMT_SELECT_ID:
+        return "Invalid SELECT format. Use: SELECT <id> or SELECT";
+    case STMT_SELECT_LIST:
+        return "Invalid SELECT format. Use: SELECT <item>, ... [WHERE <column> <op> <value> AND ...]\n"
+               "       [GROUP BY <column>], where an item is a column, *, COUNT(*) or\n"
+               "       COUNT, SUM, MIN, MAX or AVG(<column>)";
+    default:
+        return "Unknown statement (use INSERT, SELECT, UPDATE, DELETE, BEGIN, COMMIT or ROLLBACK)";
+    }
+}
+
+// Compile sql against the current table into a new plan, or print why it
+// cannot be and return NULL
+static Statement *compile_statement(Database *db, const char *sql, long version)
+{
+    // Literals never take more room than their text plus a NUL each
+    int storage_size = (int)strlen(sql) + MAX_COLUMNS + 2;
+    Statement *stmt = calloc(1, sizeof(Statement) + storage_size);
+    if (stmt == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    stmt->db = db;
+    stmt->table_id = thread_table(db)->table_id;
+    stmt->version = version;
+    stmt->storage_size = storage_size;
+
+    const Schema *schema = &thread_table(db)->schema;
+    const char *text = sql;
+    Token verb = next_token(&text);
+    int ok = 1;
+    stmt->kind = -1;
+    if (is_keyword(&verb, "INSERT") || is_keyword(&verb, "UPDATE"))
+    {
+        stmt->kind = is_keyword(&verb, "INSERT") ? STMT_INSERT : STMT_UPDATE;
+        ok = compile_id(stmt, &text);
+        for (int i = 0; i < schema->num_columns && ok > 0; i++)
+        {
+            Token token = next_token(&text);
+            if (token.type == TOKEN_END)
+            {
+                printf("Error: Expected %d values (got %d)\n", schema->num_columns, i);
+                ok = -1;
+                break;
+            }
+            ok = compile_operand(stmt, &token, &schema->columns[i]);
+        }
+        if (ok > 0 && next_token(&text).type != TOKEN_END)
+        {
+            printf("Error: Expected %d values (got more)\n", schema->num_columns);
+            ok = -1;
+        }
+    }
+    else if (is_keyword(&verb, "SELECT"))
+    {
+        const char *rest = text;
+        Token token = next_token(&rest);
+        if (token.type == TOKEN_END)
+        {
+            stmt->kind = STMT_SELECT_ALL;
+        }
+        else if (is_keyword(&token, "WHERE"))
+        {
+            stmt->kind = STMT_SELECT_WHERE;
+            text = rest;
+            ok = compile_where(stmt, schema, &text);
+        }
+        else if (token.type == TOKEN_PARAM || (token.type == TOKEN_WORD && strchr("0123456789+-", token.start[0]) != NULL))
+        {
+            stmt->kind = STMT_SELECT_ID;
+            ok = compile_id(stmt, &text);
+        }
+        else
+        {
+            stmt->kind = STMT_SELECT_LIST;
+            ok = compile_select_list(stmt, schema, &text);
+        }
+    }
+    else if (is_keyword(&verb, "DELETE"))
+    {
+        stmt->kind = STMT_DELETE;
+        ok = compile_id(stmt, &text);
+    }
+    else if (is_keyword(&verb, "BEGIN") || is_keyword(&verb, "COMMIT") || is_keyword(&verb, "ROLLBACK"))
+    {
+        stmt->kind = is_keyword(&verb, "BEGIN") ? STMT_BEGIN : is_keyword(&verb, "COMMIT") ? STMT_COMMIT : STMT_ROLLBACK;
+    }
+    if (ok > 0 && (stmt->kind < 0 || next_token(&text).type != TOKEN_END))
+    {
+        ok = 0; // Unknown statement, or words left over
+    }
+    if (ok == 0)
+    {
+        printf("Error: %s\n", statement_usage(stmt->kind));
+    }
+    if (ok <= 0)
+    {
+        free(stmt);
+        return NULL;
+    }
+    return stmt;
+}
+
+// Copy of a plan with no parameters bound. Literal values point into the
+// plan's own storage, so they are moved along with it.
+static Statement *clone_statement(const Statement *plan)
+{
+    size_t size = sizeof(Statement) + plan->storage_size;
+    Statement *stmt = malloc(size);
+    if (stmt == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(stmt, plan, size);
+    for (int i = 0; i < stmt->num_operands; i++)
+    {
+        Value *value = &stmt->operands[i].value;
+        if (value->data != NULL)
+        {
+            value->data = stmt->storage + (value->data - plan->storage);
+        }
+    }
+    memset(stmt->bound, 0, sizeof(stmt->bound));
+    return stmt;
+}
+
+// FNV-1a hash of a statement's text and table
+static unsigned int statement_hash(const char *sql, int table_id)
+{
+    unsigned int hash = 2166136261u ^ (unsigned int)table_id;
+    for (const char *p = sql; *p != '\0'; p++)
+    {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    return hash;
+}
+
+// Compile sql against the current table. Plans are cached by text, so
+// preparing the same statement again skips parsing. Returns NULL, after
+// printing why, if the statement is malformed. The statement stays valid
+// after the current table changes, but only executes on its own table.
+Statement *prepare_statement(Database *db, const char *sql)
+{
+    StatementCache *cache = db->statements;
+    if (!db_read_lock(db)) // The current table and its schema stay put while compiling
+    {
+        return NULL;
+    }
+    int table_id = thread_table(db)->table_id;
+    CachedStatement *entry = &cache->entries[statement_hash(sql, table_id) % STATEMENT_CACHE_SIZE];
+    pthread_mutex_lock(&cache->latch);
+    if (entry->text != NULL && entry->table_id == table_id && entry->plan->version == cache->version &&
+        strcmp(entry->text, sql) == 0)
+    {
+        Statement *stmt = clone_statement(entry->plan);
+        cache->hits++;
+        pthread_mutex_unlock(&cache->latch);
+        db_unlock(db);
+        return stmt;
+    }
+    long version = cache->version;
+    cache->misses++;
+    pthread_mutex_unlock(&cache->latch);
+
+    Statement *plan = compile_statement(db, sql, version);
+    Statement *stmt = plan != NULL ? clone_statement(plan) : NULL;
+    if (plan != NULL)
+    {
+        char *text = strdup(sql);
+        if (text == NULL)
+        {
+            printf("Error: Memory allocation failed\n");
+            exit(1);
+        }
+        pthread_mutex_lock(&cache->latch);
+        free(entry->text);
+        free(entry->plan);
+        entry->text = text;
+        entry->table_id = table_id;
+        entry->plan = plan;
+        pthread_mutex_unlock(&cache->latch);
+    }
+    db_unlock(db);
+    return stmt;
+}
+
+// Bind value to parameter index (from 1). TEXT and BLOB bytes are not copied:
+// they must stay valid until the statement is executed. Bindings persist
+// across executions. Returns 1 on success.
+int bind_value(Statement *stmt, int index, const Value *value)
+{
+    if (index < 1 || index > stmt->num_params)
+    {
+        printf("Error: Statement has no parameter %d\n", index);
+        return 0;
+    }
+    stmt->params[index - 1] = *value;
+    stmt->bound[index - 1] = 1;
+    return 1;
+}
+
+// Value of a plan's operand, literal or bound
+static const Value *operand_value(const Statement *stmt, int i)
+{
+    const Operand *operand = &stmt->operands[i];
+    return operand->param ? &stmt->params[operand->param - 1] : &operand->value;
+}
+
+// Hands decoded rows to the visit callback of execute_statement
+typedef struct
+{
+    const Schema *schema;
+    int (*visit)(void *arg, int id, const Value *values);
+    void *arg;
+} RowVisitor;
+
+static int decode_row(void *arg, int id, const unsigned char *record, int length)
+{
+    RowVisitor *visitor = arg;
+    Value values[MAX_COLUMNS];
+    for (int i = 0; i < visitor->schema->num_columns; i++)
+    {
+        record_column(visitor->schema, record, length, i, &values[i]);
+    }
+    return visitor->visit(visitor->arg, id, values);
+}
+
+static int visit_all(void *arg, int id, const Value *values)
+{
+    (void)arg, (void)id, (void)values;
+    return 1;
+}
+
+#define BATCH_ROWS 1024 // Rows run_query decodes, filters and aggregates at a time
+
+// One column of a batch: the column's value in each of the batch's rows.
+// TEXT and BLOB bytes are copied into the batch's arena.
+typedef struct
+{
+    int column;                      // Schema column, or -1 for the id
+    int type;                        // ColumnType
+    unsigned char nulls[BATCH_ROWS];
+    long long int64[BATCH_ROWS];     // COL_INT64
+    double real[BATCH_ROWS];         // COL_DOUBLE
+    int offset[BATCH_ROWS];          // COL_TEXT/COL_BLOB: start of the bytes in the arena
+    int length[BATCH_ROWS];
+} ColumnVector;
+
+// Up to BATCH_ROWS rows of a table, stored by column, holding only the
+// columns a query reads
+typedef struct
+{
+    int count;
+    int ids[BATCH_ROWS];
+    unsigned char selected[BATCH_ROWS]; // Rows that meet every condition
+    int num_vectors;
+    ColumnVector *vectors;
+    int vector_of[MAX_COLUMNS + 1];     // Vector holding each column (index + 1, so the id is 0), or -1
+    char *arena;
+    int arena_used;
+    int arena_size;
+} Batch;
+
+// Running state of one aggregate
+typedef struct
+{
+    long long count; // Rows (COUNT(*)) or non-NULL values seen
+    long long int64; // SUM, MIN or MAX of INT64 values
+    double real;     // SUM, MIN or MAX of DOUBLE values
+    int overflow;    // An INT64 SUM went out of range; the query fails
+} Accumulator;
+
+// Groups of a GROUP BY, in the order they were first seen, found by hashing
+// their key into an open-addressed table
+typedef struct
+{
+    int num_groups;
+    int capacity;
+    Value *keys;               // Each group's value of the GROUP BY column; TEXT and BLOB bytes are owned
+    unsigned long long *hashes;
+    long long *positions;      // Where each group's first row is in the table (see QueryState)
+    Accumulator *accumulators; // One per item of the query for each group
+    int *slots;                // Group index + 1 (0 = empty)
+    int num_slots;             // A power of two, more than twice the groups
+} GroupTable;
+
+// Aggregates of a query so far
+typedef struct
+{
+    const Statement *stmt;
+    int num_items;
+    Accumulator totals[MAX_QUERY_ITEMS]; // Without GROUP BY
+    GroupTable groups;                   // With GROUP BY
+    int *order;                          // Groups in the order visit_groups passes them on (NULL = as numbered)
+    long long position;                  // Position of the batch's first row: the index of the first
+                                         // page of its morsel (0 in serial scans) << 32, plus the rows
+                                         // of the morsel before it
+    int group_of[BATCH_ROWS];            // Group of each row of the batch (-1 = not selected)
+} QueryState;
+
+// Batch holding every column the query reads
+static Batch *batch_create(const Statement *stmt, const Schema *schema)
+{
+    Batch *batch = calloc(1, sizeof(Batch));
+    if (batch == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    int needed[MAX_COLUMNS + 1] = {0};
+    for (int i = 0; i < stmt->num_items; i++)
+    {
+        if (stmt->items[i].column != NO_COLUMN)
+        {
+            needed[stmt->items[i].column + 1] = 1;
+        }
+    }
+    for (int i = 0; i < stmt->num_predicates; i++)
+    {
+        needed[stmt->predicates[i].column + 1] = 1;
+    }
+    if (stmt->group_column != NO_COLUMN)
+    {
+        needed[stmt->group_column + 1] = 1;
+    }
+    int count = 0;
+    for (int c = 0; c <= schema->num_columns; c++)
+    {
+        count += needed[c];
+    }
+    batch->vectors = calloc(count > 0 ? count : 1, sizeof(ColumnVector)); // Zeroed: loops read whole vectors
+    batch->arena_size = PAGE_SIZE;
+    batch->arena = malloc(batch->arena_size);
+    if (batch->vectors == NULL || batch->arena == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int c = 0; c <= schema->num_columns; c++)
+    {
+        batch->vector_of[c] = needed[c] ? batch->num_vectors : -1;
+        if (needed[c])
+        {
+            ColumnVector *vector = &batch->vectors[batch->num_vectors++];
+            vector->column = c - 1;
+            vector->type = column_type(schema, c - 1);
+        }
+    }
+    return batch;
+}
+
+static void batch_free(Batch *batch)
+{
+    free(batch->vectors);
+    free(batch->arena);
+    free(batch);
+}
+
+// Vector of a column of the batch (-1 = id)
+static const ColumnVector *batch_vector(const Batch *batch, int column)
+{
+    return &batch->vectors[batch->vector_of[column + 1]];
+}
+
+// Decode the next rows of the scan into the batch, up to BATCH_ROWS;
+// returns how many (0 at the end of the table)
+static int batch_fill(Batch *batch, const Schema *schema, Scan *scan)
+{
+    batch->count = 0;
+    batch->arena_used = 0;
+    while (batch->count < BATCH_ROWS && scan_next(scan))
+    {
+        int row = batch->count++;
+        batch->ids[row] = scan->id;
+        for (int v = 0; v < batch->num_vectors; v++)
+        {
+            ColumnVector *vector = &batch->vectors[v];
+            Value value = {0};
+            if (vector->column < 0)
+            {
+                value.int64 = scan->id;
+            }
+            else
+            {
+                record_column(schema, scan->record, scan->length, vector->column, &value);
+            }
+            vector->nulls[row] = (unsigned char)value.is_null;
+            vector->int64[row] = value.int64;
+            vector->real[row] = value.real;
+            vector->length[row] = value.length;
+            vector->offset[row] = batch->arena_used;
+            if (value.length > 0)
+            {
+                if (batch->arena_used + value.length > batch->arena_size)
+                {
+                    while (batch->arena_used + value.length > batch->arena_size)
+                    {
+                        batch->arena_size *= 2;
+                    }
+                    batch->arena = realloc(batch->arena, batch->arena_size);
+                    if (batch->arena == NULL)
+                    {
+                        printf("Error: Memory allocation failed\n");
+                        exit(1);
+                    }
+                }
+                memcpy(batch->arena + batch->arena_used, value.data, value.length);
+                batch->arena_used += value.length;
+            }
+        }
+    }
+    return batch->count;
+}
+
+// Value of a row of a vector; TEXT and BLOB bytes point into the batch
+static Value vector_value(const Batch *batch, const ColumnVector *vector, int row)
+{
+    Value value = {vector->nulls[row], vector->int64[row], vector->real[row], NULL, vector->length[row]};
+    if (vector->type == COL_TEXT || vector->type == COL_BLOB)
+    {
+        value.data = batch->arena + vector->offset[row];
+    }
+    return value;
+}
+
+// Which orderings of a value against the operand each comparison accepts:
+// bit 0 less, bit 1 equal, bit 2 greater
+static const unsigned char comparison_masks[] = {2, 5, 1, 3, 4, 6};
+
+// The loops below run over a whole batch, past its last row (the rows there
+// are never selected), so their trip count is a constant and they have no
+// branches. The compiler vectorizes them. Each is built twice, for the
+// baseline CPU and for AVX2 (SSE2 cannot compare 64-bit lanes), and
+// choose_batch_kernels picks one copy when the first database opens, as
+// set_search_kernel does for the B-Tree search.
+
+// Clear selected[i] unless values[i] is not NULL and compares to key as
+// mask accepts
+static inline __attribute__((always_inline)) void filter_int64_loop(const long long *restrict values, const unsigned char *restrict nulls, long long key, unsigned char mask, unsigned char *restrict selected)
+{
+    unsigned char less = mask & 1, equal = (mask >> 1) & 1, greater = (mask >> 2) & 1;
+    for (int i = 0; i < BATCH_ROWS; i++)
+    {
+        selected[i] &= (nulls[i] ^ 1) & (((values[i] < key) & less) | ((values[i] == key) & equal) | ((values[i] > key) & greater));
+    }
+}
+
+static inline __attribute__((always_inline)) void filter_double_loop(const double *restrict values, const unsigned char *restrict nulls, double key, unsigned char mask, unsigned char *restrict selected)
+{
+    unsigned char less = mask & 1, equal = (mask >> 1) & 1, greater = (mask >> 2) & 1;
+    for (int i = 0; i < BATCH_ROWS; i++)
+    {
+        selected[i] &= (nulls[i] ^ 1) & (((values[i] < key) & less) | ((values[i] == key) & equal) | ((values[i] > key) & greater));
+    }
+}
+
+// Set keep[i] for the selected rows whose value is not NULL; returns how many
+static inline __attribute__((always_inline)) long long keep_non_null_loop(const unsigned char *restrict selected, const unsigned char *restrict nulls, unsigned char *restrict keep)
+{
+    long long count = 0;
+    for (int i = 0; i < BATCH_ROWS; i++)
+    {
+        keep[i] = selected[i] & (nulls[i] ^ 1);
+        count += keep[i];
+    }
+    return count;
+}
+
+// Sum of the kept values, wrapping instead of overflowing. Sets *large if a
+// kept value is outside +-2^52; otherwise the 1024 values cannot sum past
+// +-2^62 and the result is exact.
+static inline __attribute__((always_inline)) long long sum_int64_loop(const long long *restrict values, const unsigned char *restrict keep, int *large)
+{
+    unsigned long long sum = 0, out_of_range = 0;
+    for (int i = 0; i < BATCH_ROWS; i++)
+    {
+        unsigned long long value = keep[i] ? (unsigned long long)values[i] : 0;
+        sum += value;
+        out_of_range |= (value + (1ull << 52)) >> 53;
+    }
+    *large = out_of_range != 0;
+    return (long long)sum;
+}
+
+static void filter_int64_default(const long long *values, const unsigned char *nulls, long long key, unsigned char mask, unsigned char *selected)
+{
+    filter_int64_loop(values, nulls, key, mask, selected);
+}
+
+static void filter_double_default(const double *values, const unsigned char *nulls, double key, unsigned char mask, unsigned char *selected)
+{
+    filter_double_loop(values, nulls, key, mask, selected);
+}
+
+static long long keep_non_null_default(const unsigned char *selected, const unsigned char *nulls, unsigned char *keep)
+{
+    return keep_non_null_loop(selected, nulls, keep);
+}
+
+static long long sum_int64_default(const long long *values, const unsigned char *keep, int *large)
+{
+    return sum_int64_loop(values, keep, large);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2"))) static void filter_int64_avx2(const long long *values, const unsigned char *nulls, long long key, unsigned char mask, unsigned char *selected)
+{
+    filter_int64_loop(values, nulls, key, mask, selected);
+}
+
+__attribute__((target("avx2"))) static void filter_double_avx2(const double *values, const unsigned char *nulls, double key, unsigned char mask, unsigned char *selected)
+{
+    filter_double_loop(values, nulls, key, mask, selected);
+}
+
+__attribute__((target("avx2"))) static long long keep_non_null_avx2(const unsigned char *selected, const unsigned char *nulls, unsigned char *keep)
+{
+    return keep_non_null_loop(selected, nulls, keep);
+}
+
+__attribute__((target("avx2"))) static long long sum_int64_avx2(const long long *values, const unsigned char *keep, int *large)
+{
+    return sum_int64_loop(values, keep, large);
+}
+#endif
+
+// Batch kernels in use, set once by choose_batch_kernels
+static void (*filter_int64)(const long long *values, const unsigned char *nulls, long long key, unsigned char mask, unsigned char *selected) = filter_int64_default;
+static void (*filter_double)(const double *values, const unsigned char *nulls, double key, unsigned char mask, unsigned char *selected) = filter_double_default;
+static long long (*keep_non_null)(const unsigned char *selected, const unsigned char *nulls, unsigned char *keep) = keep_non_null_default;
+static long long (*sum_int64)(const long long *values, const unsigned char *keep, int *large) = sum_int64_default;
+
+static void choose_batch_kernels(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        filter_int64 = filter_int64_avx2;
+        filter_double = filter_double_avx2;
+        keep_non_null = keep_non_null_avx2;
+        sum_int64 = sum_int64_avx2;
+    }
+#endif
+}
+
+// Clear the selected flag of each row whose value fails "value <op> k"
+static void filter_vector(const Batch *batch, const ColumnVector *vector, int op, const Value *k, unsigned char *selected)
+{
+    unsigned char mask = comparison_masks[op];
+    if (vector->type == COL_INT64)
+    {
+        filter_int64(vector->int64, vector->nulls, k->int64, mask, selected);
+        return;
+    }
+    if (vector->type == COL_DOUBLE)
+    {
+        filter_double(vector->real, vector->nulls, k->real, mask, selected);
+        return;
+    }
+    for (int i = 0; i < batch->count; i++)
+    {
+        if (selected[i] && !vector->nulls[i])
+        {
+            Value value = vector_value(batch, vector, i);
+            int cmp = compare_values(vector->type, &value, k);
+            selected[i] = (mask >> (cmp < 0 ? 0 : cmp == 0 ? 1 : 2)) & 1;
+        }
+        else
+        {
+            selected[i] = 0;
+        }
+    }
+}
+
+// Mark the rows of the batch that meet every condition of the query
+static void filter_batch(const Statement *stmt, Batch *batch)
+{
+    memset(batch->selected, 1, batch->count);
+    memset(batch->selected + batch->count, 0, BATCH_ROWS - batch->count);
+    for (int i = 0; i < stmt->num_predicates; i++)
+    {
+        const Predicate *predicate = &stmt->predicates[i];
+        filter_vector(batch, batch_vector(batch, predicate->column), predicate->op,
+                      operand_value(stmt, predicate->operand), batch->selected);
+    }
+}
+
+// Empty accumulator for an aggregate
+static Accumulator accumulator_init(int aggregate)
+{
+    Accumulator acc = {0, 0, 0, 0};
+    if (aggregate == AGG_MIN)
+    {
+        acc.int64 = LLONG_MAX;
+        acc.real = HUGE_VAL;
+    }
+    else if (aggregate == AGG_MAX)
+    {
+        acc.int64 = LLONG_MIN;
+        acc.real = -HUGE_VAL;
+    }
+    return acc;
+}
+
+// Fold one more value into an accumulator
+static void accumulate_value(int aggregate, Accumulator *acc, long long int64, double real)
+{
+    acc->count++;
+    if (aggregate == AGG_SUM || aggregate == AGG_AVG)
+    {
+        acc->overflow |= __builtin_add_overflow(acc->int64, int64, &acc->int64);
+        acc->real += real;
+    }
+    else if (aggregate == AGG_MIN)
+    {
+        acc->int64 = int64 < acc->int64 ? int64 : acc->int64;
+        acc->real = real < acc->real ? real : acc->real;
+    }
+    else if (aggregate == AGG_MAX)
+    {
+        acc->int64 = int64 > acc->int64 ? int64 : acc->int64;
+        acc->real = real > acc->real ? real : acc->real;
+    }
+}
+
+// Fold the selected, non-NULL values of a vector (or the selected rows, for
+// COUNT(*)) into an accumulator. Counts and INT64 sums vectorize; the other
+// loops are branch-free but scalar (no 64-bit min or max below AVX-512, and
+// DOUBLE sums must keep their order).
+static void accumulate_vector(int aggregate, const Batch *batch, const ColumnVector *vector, Accumulator *acc)
+{
+    unsigned char keep[BATCH_ROWS];
+    if (vector == NULL)
+    {
+        static const unsigned char no_nulls[BATCH_ROWS];
+        acc->count += keep_non_null(batch->selected, no_nulls, keep);
+        return;
+    }
+    acc->count += keep_non_null(batch->selected, vector->nulls, keep);
+    int n = batch->count;
+    if (aggregate == AGG_COUNT)
+    {
+        return;
+    }
+    if (vector->type == COL_INT64 && (aggregate == AGG_SUM || aggregate == AGG_AVG))
+    {
+        int large;
+        long long sum = sum_int64(vector->int64, keep, &large);
+        if (!large)
+        {
+            acc->overflow |= __builtin_add_overflow(acc->int64, sum, &acc->int64);
+        }
+        else // Huge values: add them one by one, checking each
+        {
+            for (int i = 0; i < n; i++)
+            {
+                acc->overflow |= keep[i] && __builtin_add_overflow(acc->int64, vector->int64[i], &acc->int64);
+            }
+        }
+    }
+    else if (vector->type == COL_INT64)
+    {
+        const long long *values = vector->int64;
+        long long result = acc->int64;
+        for (int i = 0; i < n; i++)
+        {
+            long long v = values[i];
+            result = keep[i] && (aggregate == AGG_MIN ? v < result : v > result) ? v : result;
+        }
+        acc->int64 = result;
+    }
+    else
+    {
+        const double *values = vector->real;
+        double result = acc->real;
+        for (int i = 0; i < n; i++)
+        {
+            double v = values[i];
+            if (aggregate == AGG_MIN)
+            {
+                result = keep[i] && v < result ? v : result;
+            }
+            else if (aggregate == AGG_MAX)
+            {
+                result = keep[i] && v > result ? v : result;
+            }
+            else
+            {
+                result += keep[i] ? v : 0;
+            }
+        }
+        acc->real = result;
+    }
+}
+
+// Hash of a GROUP BY value (NULL is a group of its own)
+static unsigned long long group_hash(int type, const Value *value)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    if (value->is_null)
+    {
+        return 0;
+    }
+    if (type == COL_INT64 || type == COL_DOUBLE)
+    {
+        double real = value->real == 0 ? 0 : value->real; // -0.0 groups with 0.0
+        unsigned long long bits = (unsigned long long)value->int64;
+        if (type == COL_DOUBLE)
+        {
+            memcpy(&bits, &real, sizeof(bits));
+        }
+        hash = bits * 0x9e3779b97f4a7c15ull;
+        return hash ^ (hash >> 29);
+    }
+    for (int i = 0; i < value->length; i++)
+    {
+        hash = (hash ^ (unsigned char)value->data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Whether two GROUP BY values fall in the same group
+static int group_equal(int type, const Value *a, const Value *b)
+{
+    if (a->is_null || b->is_null)
+    {
+        return a->is_null && b->is_null;
+    }
+    return compare_values(type, a, b) == 0;
+}
+
+static void group_table_free(GroupTable *table)
+{
+    for (int i = 0; i < table->num_groups; i++)
+    {
+        free((char *)table->keys[i].data);
+    }
+    free(table->keys);
+    free(table->hashes);
+    free(table->positions);
+    free(table->accumulators);
+    free(table->slots);
+    memset(table, 0, sizeof(GroupTable));
+}
+
+// Double the slots of the table and put every group back in them
+static void group_table_grow(GroupTable *table)
+{
+    free(table->slots);
+    table->num_slots = table->num_slots > 0 ? table->num_slots * 2 : 64;
+    table->slots = calloc(table->num_slots, sizeof(int));
+    if (table->slots == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int g = 0; g < table->num_groups; g++)
+    {
+        int slot = (int)(table->hashes[g] & (table->num_slots - 1));
+        while (table->slots[slot] != 0)
+        {
+            slot = (slot + 1) & (table->num_slots - 1);
+        }
+        table->slots[slot] = g + 1;
+    }
+}
+
+// Group of a key, added with empty accumulators if it is new; position is
+// where its first row is
+static int group_find(QueryState *state, int type, const Value *key, unsigned long long hash, long long position)
+{
+    GroupTable *table = &state->groups;
+    if (2 * (table->num_groups + 1) > table->num_slots)
+    {
+        group_table_grow(table);
+    }
+    int slot = (int)(hash & (table->num_slots - 1));
+    for (; table->slots[slot] != 0; slot = (slot + 1) & (table->num_slots - 1))
+    {
+        int g = table->slots[slot] - 1;
+        if (table->hashes[g] == hash && group_equal(type, &table->keys[g], key))
+        {
+            return g;
+        }
+    }
+    if (table->num_groups == table->capacity)
+    {
+        table->capacity = table->capacity > 0 ? table->capacity * 2 : 64;
+        table->keys = realloc(table->keys, table->capacity * sizeof(Value));
+        table->hashes = realloc(table->hashes, table->capacity * sizeof(unsigned long long));
+        table->positions = realloc(table->positions, table->capacity * sizeof(long long));
+        table->accumulators = realloc(table->accumulators, (size_t)table->capacity * state->num_items * sizeof(Accumulator));
+        if (table->keys == NULL || table->hashes == NULL || table->positions == NULL || table->accumulators == NULL)
+        {
+            printf("Error: Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    int g = table->num_groups++;
+    Value *copy = &table->keys[g];
+    *copy = *key;
+    if (key->data != NULL)
+    {
+        char *bytes = malloc(key->length > 0 ? key->length : 1);
+        if (bytes == NULL)
+        {
+            printf("Error: Memory allocation failed\n");
+            exit(1);
+        }
+        memcpy(bytes, key->data, key->length);
+        copy->data = bytes;
+    }
+    table->hashes[g] = hash;
+    table->positions[g] = position;
+    for (int i = 0; i < state->num_items; i++)
+    {
+        table->accumulators[(size_t)g * state->num_items + i] = accumulator_init(state->stmt->items[i].aggregate);
+    }
+    table->slots[slot] = g + 1;
+    return g;
+}
+
+// Fold the selected rows of the batch into the query's aggregates
+static void accumulate_batch(QueryState *state, const Batch *batch)
+{
+    const Statement *stmt = state->stmt;
+    if (stmt->group_column == NO_COLUMN)
+    {
+        for (int i = 0; i < stmt->num_items; i++)
+        {
+            const QueryItem *item = &stmt->items[i];
+            if (item->aggregate != AGG_NONE)
+            {
+                accumulate_vector(item->aggregate, batch, item->column == NO_COLUMN ? NULL : batch_vector(batch, item->column), &state->totals[i]);
+            }
+        }
+        return;
+    }
+
+    // Find every selected row's group first, then update one aggregate at a time
+    const ColumnVector *key_vector = batch_vector(batch, stmt->group_column);
+    for (int row = 0; row < batch->count; row++)
+    {
+        state->group_of[row] = -1;
+        if (batch->selected[row])
+        {
+            Value key = vector_value(batch, key_vector, row);
+            state->group_of[row] = group_find(state, key_vector->type, &key, group_hash(key_vector->type, &key), state->position + row);
+        }
+    }
+    for (int i = 0; i < stmt->num_items; i++)
+    {
+        const QueryItem *item = &stmt->items[i];
+        if (item->aggregate == AGG_NONE)
+        {
+            continue;
+        }
+        const ColumnVector *vector = item->column == NO_COLUMN ? NULL : batch_vector(batch, item->column);
+        Accumulator *accumulators = state->groups.accumulators + i;
+        for (int row = 0; row < batch->count; row++)
+        {
+            int g = state->group_of[row];
+            if (g >= 0 && (vector == NULL || !vector->nulls[row]))
+            {
+                accumulate_value(item->aggregate, &accumulators[(size_t)g * state->num_items],
+                                 vector != NULL ? vector->int64[row] : 0, vector != NULL ? vector->real[row] : 0);
+            }
+        }
+    }
+}
+
+// Value of an item of an aggregate query for a group (key is the group's
+// GROUP BY value)
+static Value aggregate_value(const Statement *stmt, const Schema *schema, int item, const Accumulator *acc, const Value *key)
+{
+    const QueryItem *query_item = &stmt->items[item];
+    Value value = {0};
+    if (query_item->aggregate == AGG_NONE)
+    {
+        return *key;
+    }
+    if (query_item->aggregate == AGG_COUNT)
+    {
+        value.int64 = acc->count;
+        return value;
+    }
+    int type = column_type(schema, query_item->column);
+    value.is_null = acc->count == 0;
+    if (query_item->aggregate == AGG_AVG)
+    {
+        value.real = acc->count == 0 ? 0 : (type == COL_INT64 ? (double)acc->int64 : acc->real) / acc->count;
+    }
+    else
+    {
+        value.int64 = value.is_null ? 0 : acc->int64;
+        value.real = value.is_null ? 0 : acc->real;
+    }
+    return value;
+}
+
+// Pass the selected rows of the batch to visit, with the values of the
+// query's items; returns 0 once visit asks to stop
+static int visit_batch(const Statement *stmt, const Batch *batch, int (*visit)(void *arg, int id, const Value *values), void *arg, int *count)
+{
+    Value values[MAX_QUERY_ITEMS];
+    for (int row = 0; row < batch->count; row++)
+    {
+        if (!batch->selected[row])
+        {
+            continue;
+        }
+        for (int i = 0; i < stmt->num_items; i++)
+        {
+            values[i] = vector_value(batch, batch_vector(batch, stmt->items[i].column), row);
+        }
+        (*count)++;
+        if (!visit(arg, batch->ids[row], values))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Pass each group of an aggregate query to visit (a single row without GROUP
+// BY), with id 0 and the values of the query's items; returns how many
+static int visit_groups(QueryState *state, const Schema *schema, int (*visit)(void *arg, int id, const Value *values), void *arg)
+{
+    const Statement *stmt = state->stmt;
+    Value values[MAX_QUERY_ITEMS];
+    Value no_key = {1};
+    int num_groups = stmt->group_column == NO_COLUMN ? 1 : state->groups.num_groups;
+    const Accumulator *all = stmt->group_column == NO_COLUMN ? state->totals : state->groups.accumulators;
+    for (size_t i = 0; i < (size_t)num_groups * state->num_items; i++)
+    {
+        if (all[i].overflow)
+        {
+            printf("Error: Integer overflow in SUM\n");
+            return -1;
+        }
+    }
+    for (int n = 0; n < num_groups; n++)
+    {
+        int g = state->order != NULL ? state->order[n] : n;
+        const Accumulator *accumulators = stmt->group_column == NO_COLUMN ? state->totals : state->groups.accumulators + (size_t)g * state->num_items;
+        const Value *key = stmt->group_column == NO_COLUMN ? &no_key : &state->groups.keys[g];
+        for (int i = 0; i < stmt->num_items; i++)
+        {
+            values[i] = aggregate_value(stmt, schema, i, &accumulators[i], key);
+        }
+        if (!visit(arg, 0, values))
+        {
+            return n + 1;
+        }
+    }
+    return num_groups;
+}
+
+static QueryState *query_state_create(const Statement *stmt)
+{
+    QueryState *state = calloc(1, sizeof(QueryState));
+    if (state == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    state->stmt = stmt;
+    state->num_items = stmt->num_items;
+    for (int i = 0; i < stmt->num_items; i++)
+    {
+        state->totals[i] = accumulator_init(stmt->items[i].aggregate);
+    }
+    return state;
+}
+
+static void query_state_free(QueryState *state)
+{
+    group_table_free(&state->groups);
+    free(state->order);
+    free(state);
+}
+
+// Fold a partial accumulator of the same aggregate into acc: its sum,
+// minimum or maximum goes in like one more value, and the counts add up
+static void merge_accumulator(int aggregate, Accumulator *acc, const Accumulator *part)
+{
+    long long count = acc->count + part->count;
+    accumulate_value(aggregate, acc, part->int64, part->real);
+    acc->count = count;
+    acc->overflow |= part->overflow;
+}
+
+// Fold the aggregates one thread of a parallel query computed into state
+static void merge_query_state(QueryState *state, const QueryState *part, int key_type)
+{
+    const Statement *stmt = state->stmt;
+    if (stmt->group_column == NO_COLUMN)
+    {
+        for (int i = 0; i < stmt->num_items; i++)
+        {
+            merge_accumulator(stmt->items[i].aggregate, &state->totals[i], &part->totals[i]);
+        }
+        return;
+    }
+    const GroupTable *groups = &part->groups;
+    for (int g = 0; g < groups->num_groups; g++)
+    {
+        int into = group_find(state, key_type, &groups->keys[g], groups->hashes[g], groups->positions[g]);
+        long long *position = &state->groups.positions[into];
+        *position = groups->positions[g] < *position ? groups->positions[g] : *position;
+        for (int i = 0; i < stmt->num_items; i++)
+        {
+            merge_accumulator(stmt->items[i].aggregate, &state->groups.accumulators[(size_t)into * state->num_items + i],
+                              &groups->accumulators[(size_t)g * state->num_items + i]);
+        }
+    }
+}
+
+static int compare_group_positions(const void *a, const void *b, void *arg)
+{
+    const long long *positions = arg;
+    long long position1 = positions[*(const int *)a];
+    long long position2 = positions[*(const int *)b];
+    return (position1 > position2) - (position1 < position2);
+}
+
+// Order the groups by where their first row is, as a serial scan sees them
+static void order_groups(QueryState *state)
+{
+    GroupTable *groups = &state->groups;
+    state->order = malloc((groups->num_groups > 0 ? groups->num_groups : 1) * sizeof(int));
+    if (state->order == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int g = 0; g < groups->num_groups; g++)
+    {
+        state->order[g] = g;
+    }
+    qsort_r(state->order, groups->num_groups, sizeof(int), compare_group_positions, groups->positions);
+}
+
+// An aggregate query split across threads. The table's pages are listed in
+// chain order and handed out MORSEL_PAGES at a time to whichever thread asks
+// next, so a thread that finishes early takes more; each thread filters and
+// aggregates its pages into a state of its own.
+typedef struct
+{
+    Database *db;
+    const Statement *stmt;
+    Table *table;             // The calling thread's current table
+    int *pages;               // Data pages of the table, in chain order
+    int num_pages;
+    int next_page;            // Index in pages of the next morsel
+    pthread_mutex_t latch;    // Guards next_page
+    int num_threads;
+    QueryState **states;      // One per thread
+} ParallelQuery;
+
+// Data pages of the current table in chain order; sets *count
+static int *table_pages(Database *db, int *count)
+{
+    Table *table = thread_table(db);
+    int capacity = table->num_pages > 0 ? table->num_pages : 1;
+    int *pages = malloc(capacity * sizeof(int));
+    if (pages == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    *count = 0;
+    for (int page_no = table->first_data_page; page_no != 0;)
+    {
+        if (*count == capacity)
+        {
+            capacity *= 2;
+            pages = realloc(pages, capacity * sizeof(int));
+            if (pages == NULL)
+            {
+                printf("Error: Memory allocation failed\n");
+                exit(1);
+            }
+        }
+        pages[(*count)++] = page_no;
+        const char *page = pool_view(db, page_offset(page_no));
+        page_no = ((const DataPageHeader *)page)->next_page;
+        pool_release_view(db, page);
+    }
+    return pages;
+}
+
+// Index in the page list of the next morsel (num_pages once all are taken)
+static int take_morsel(ParallelQuery *query)
+{
+    pthread_mutex_lock(&query->latch);
+    int first = query->next_page;
+    query->next_page = first + MORSEL_PAGES < query->num_pages ? first + MORSEL_PAGES : query->num_pages;
+    pthread_mutex_unlock(&query->latch);
+    return first;
+}
+
+// One thread's share of a parallel query: scan morsels until none are left.
+// Runs under the database lock its caller holds, so it takes none itself.
+static void run_morsels(void *arg, int thread)
+{
+    ParallelQuery *query = arg;
+    if (thread >= query->num_threads)
+    {
+        return;
+    }
+    set_thread_table(query->db, query->table); // The caller's table, not this thread's own choice
+    const Schema *schema = &query->table->schema;
+    QueryState *state = query->states[thread];
+    Batch *batch = batch_create(query->stmt, schema);
+    int first;
+    while ((first = take_morsel(query)) < query->num_pages)
+    {
+        int last = first + MORSEL_PAGES < query->num_pages ? first + MORSEL_PAGES : query->num_pages;
+        Scan scan;
+        scan_open_pages(query->db, &scan, query->pages[first], last < query->num_pages ? query->pages[last] : 0);
+        state->position = (long long)first << 32;
+        while (batch_fill(batch, schema, &scan) > 0)
+        {
+            filter_batch(query->stmt, batch);
+            accumulate_batch(state, batch);
+            state->position += batch->count;
+        }
+    }
+    batch_free(batch);
+}
+
+// Compute the aggregates of a query into state with the database's worker
+// threads. Returns 0, leaving state as it was, when the query would not gain
+// from them: the table is too small to split, or another query has them.
+static int run_parallel_query(Database *db, const Statement *stmt, QueryState *state)
+{
+    int threads = db->workers != NULL ? db->workers->num_threads + 1 : 1;
+    threads = threads < db->pool->capacity / 2 ? threads : db->pool->capacity / 2; // Each thread pins up to two frames
+    int morsels = (thread_table(db)->num_pages + MORSEL_PAGES - 1) / MORSEL_PAGES;
+    threads = threads < morsels ? threads : morsels;
+    if (threads < 2)
+    {
+        return 0;
+    }
+    ParallelQuery query = {db, stmt, thread_table(db)};
+    query.pages = table_pages(db, &query.num_pages);
+    query.num_threads = threads;
+    query.states = malloc(threads * sizeof(QueryState *));
+    if (query.states == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        query.states[t] = query_state_create(stmt);
+    }
+    pthread_mutex_init(&query.latch, NULL);
+    map_advise(db, MADV_SEQUENTIAL);
+    int ran = workers_run(db->workers, run_morsels, &query);
+    map_advise(db, MADV_RANDOM);
+    pthread_mutex_destroy(&query.latch);
+    int key_type = stmt->group_column == NO_COLUMN ? COL_INT64 : column_type(&thread_table(db)->schema, stmt->group_column);
+    for (int t = 0; t < threads; t++)
+    {
+        if (ran)
+        {
+            merge_query_state(state, query.states[t], key_type);
+        }
+        query_state_free(query.states[t]);
+    }
+    if (ran && stmt->group_column != NO_COLUMN)
+    {
+        order_groups(state);
+    }
+    if (ran)
+    {
+        pthread_mutex_lock(&db->statements->latch);
+        db->statements->parallel_queries++;
+        pthread_mutex_unlock(&db->statements->latch);
+    }
+    free(query.states);
+    free(query.pages);
+    return ran;
+}
+
+// Run a SELECT <list> over the current table. Rows are pulled from the data
+// pages BATCH_ROWS at a time and stored by column, holding only the columns
+// the query reads; each condition is then checked for the whole batch with
+// one loop over its column, and each aggregate folds in the selected rows
+// with another. GROUP BY keeps one set of aggregates per value in a hash
+// table. Without aggregates, visit gets every selected row with the values
+// of the items; with them, it gets one row per group, in the order the
+// groups were first seen. Aggregate queries over larger tables run on the
+// database's worker threads too (see run_parallel_query); rows still reach
+// visit on the calling thread only. Returns the number of rows passed to
+// visit, or -1 if an INT64 SUM or AVG overflowed.
+static int run_query(Database *db, const Statement *stmt, int (*visit)(void *arg, int id, const Value *values), void *arg)
+{
+    const Schema *schema = &thread_table(db)->schema;
+    QueryState *state = query_state_create(stmt);
+    int count = 0;
+    if (!stmt->aggregated || !run_parallel_query(db, stmt, state))
+    {
+        Batch *batch = batch_create(stmt, schema);
+        int more = 1;
+        Scan scan;
+        scan_open(db, &scan);
+        while (more && batch_fill(batch, schema, &scan) > 0)
+        {
+            filter_batch(stmt, batch);
+            if (stmt->aggregated)
+            {
+                accumulate_batch(state, batch);
+                state->position += batch->count;
+            }
+            else
+            {
+                more = visit_batch(stmt, batch, visit, arg, &count);
+            }
+        }
+        scan_close(&scan);
+        batch_free(batch);
+    }
+    if (stmt->aggregated)
+    {
+        count = visit_groups(state, schema, visit, arg);
+    }
+    query_state_free(state);
+    return count;
+}
+
+// Run the body of execute_statement under the database lock
+static int execute_locked(Statement *stmt, int (*visit)(void *arg, int id, const Value *values), void *arg)
+{
+    Database *db = stmt->db;
+    if (thread_table(db)->table_id != stmt->table_id || db->statements->version != stmt->version)
+    {
+        printf("Error: Statement was prepared for another table (or before its table was rolled back)\n");
+        return -1;
+    }
+    int id = 0;
+    if (stmt->kind != STMT_SELECT_ALL && stmt->kind != STMT_SELECT_WHERE && stmt->kind != STMT_SELECT_LIST)
+    {
+        const Value *value = operand_value(stmt, 0);
+        if (value->is_null || value->int64 <= 0 || value->int64 > INT_MAX)
+        {
+            printf("Error: ID must be a positive integer (got %lld)\n", value->int64);
+            return -1;
+        }
+        id = (int)value->int64;
+    }
+    RowVisitor visitor = {&thread_table(db)->schema, visit != NULL ? visit : visit_all, arg};
+    if (stmt->kind == STMT_INSERT || stmt->kind == STMT_UPDATE)
+    {
+        Value values[MAX_COLUMNS];
+        for (int i = 0; i < thread_table(db)->schema.num_columns; i++)
+        {
+            values[i] = *operand_value(stmt, 1 + i);
+        }
+        return stmt->kind == STMT_INSERT ? insert_values(db, id, values) : update_values(db, id, values);
+    }
+    if (stmt->kind == STMT_DELETE)
+    {
+        return delete_row(db, id);
+    }
+    if (stmt->kind == STMT_SELECT_ID)
+    {
+        RecordId rid;
+        int count = 0;
+        if (btree_search(db, id, &rid))
+        {
+            visit_record(db, rid, -1, NULL, NULL, decode_row, &visitor, &count);
+        }
+        return count;
+    }
+    if (stmt->kind == STMT_SELECT_LIST)
+    {
+        for (int i = 0; i < stmt->num_predicates; i++)
+        {
+            if (operand_value(stmt, stmt->predicates[i].operand)->is_null)
+            {
+                printf("Error: NULL never matches a WHERE condition\n");
+                return -1;
+            }
+        }
+        return run_query(db, stmt, visitor.visit, arg);
+    }
+    if (stmt->kind == STMT_SELECT_WHERE)
+    {
+        const Value *low = operand_value(stmt, 0);
+        const Value *high = operand_value(stmt, 1);
+        if (low->is_null || high->is_null)
+        {
+            printf("Error: NULL never matches a WHERE condition\n");
+            return -1;
+        }
+        return where_each(db, stmt->column, low, high, decode_row, &visitor);
+    }
+    return select_each(db, visitor.visit, arg);
+}
+
+// Run a prepared statement with its current bindings. SELECTs call visit
+// (if not NULL) with each row, decoded in place and valid during the call,
+// until it returns 0; for SELECT <list> the values are those of its items,
+// and aggregate rows have id 0. Returns the number of rows selected, inserted, updated
+// or deleted (0 if there was no such row or the write was rejected), 1 for
+// BEGIN, COMMIT and ROLLBACK that succeed, or -1 if the statement cannot run:
+// a parameter is unbound, the current table is not the one it was prepared
+// for, or an INT64 SUM or AVG does not fit in 64 bits.
+int execute_statement(Statement *stmt, int (*visit)(void *arg, int id, const Value *values), void *arg)
+{
+    for (int i = 0; i < stmt->num_params; i++)
+    {
+        if (!stmt->bound[i])
+        {
+            printf("Error: Parameter %d is not bound\n", i + 1);
+            return -1;
+        }
+    }
+    switch (stmt->kind)
+    {
+    case STMT_BEGIN:
+        return begin_txn(stmt->db);
+    case STMT_COMMIT:
+        return commit_txn(stmt->db);
+    case STMT_ROLLBACK:
+        return rollback_txn(stmt->db);
+    default:
+        break;
+    }
+    int write = stmt->kind == STMT_INSERT || stmt->kind == STMT_UPDATE || stmt->kind == STMT_DELETE;
+    db_lock(stmt->db, write);
+    int result = execute_locked(stmt, visit, arg);
+    db_unlock(stmt->db);
+    return result;
+}
+
+void free_statement(Statement *stmt)
+{
+    free(stmt);
+}
+
+// Plan cache counters
+void get_statement_stats(Database *db, StatementStats *stats)
+{
+    StatementCache *cache = db->statements;
+    pthread_mutex_lock(&cache->latch);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->parallel_queries = cache->parallel_queries;
+    pthread_mutex_unlock(&cache->latch);
+}
+
+#define MAX_MESSAGE_BYTES (1 << 20) // Longer requests close the connection
+#define MAX_PENDING_OUTPUT (4 << 20) // Stop reading a client that does not read its responses
+#define MAX_EVENTS 64
+
+// Growable byte buffer
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+// A client of run_server, on a list of every open connection
+typedef struct Connection
+{
+    int fd;
+    Buffer in;         // Received bytes not yet served
+    Buffer out;        // Responses not yet sent
+    size_t sent;       // Bytes of out already written
+    int eof;           // The client closed its end
+    unsigned int mask; // epoll events currently asked for
+    struct Connection *prev, *next;
+} Connection;
+
+static int stop_pipe[2] = {-1, -1};
+
+static void buffer_reserve(Buffer *buffer, size_t extra)
+{
+    if (buffer->length + extra <= buffer->capacity)
+    {
+        return;
+    }
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < buffer->length + extra)
+    {
+        capacity *= 2;
+    }
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL)
+    {
+        printf("Error: Memory allocation failed\n");
+        exit(1);
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+}
+
+static void buffer_put(Buffer *buffer, const void *data, size_t length)
+{
+    buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void buffer_put_u32(Buffer *buffer, unsigned int value)
+{
+    value = htonl(value);
+    buffer_put(buffer, &value, sizeof(value));
+}
+
+static unsigned int get_u32(const char *data)
+{
+    unsigned int value;
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
 
-    // Now insert into the appropriate node
-    off_t current_offset = db->root_offset;
-    while (1)
+// Open a listening socket for run_server on "unix:<path>" or "<ipv4>:<port>"
+// (port 0 picks a free one). Returns the socket, or -1 on error.
+int server_listen(const char *address)
+{
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0)
     {
-        read_node(db, current_offset, &root);
-        if (root.is_leaf)
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) == 0 || strlen(address + 5) >= sizeof(addr.sun_path))
         {
-            // Insert into leaf
-            int i;
-            for (i = root.num_keys; i > 0 && root.data.leaf.entries[i - 1].id > id; i--)
-            {
-                root.data.leaf.entries[i] = root.data.leaf.entries[i - 1];
-            }
-            root.data.leaf.entries[i].id = id;
-            root.data.leaf.entries[i].address = address;
-            root.num_keys++;
-            write_node(db, current_offset, &root);
-            break;
+            printf("Error: Invalid socket path %s\n", address + 5);
+            return -1;
         }
-        else
+        strcpy(addr.sun_path, address + 5);
+        unlink(addr.sun_path); // Left behind by an earlier server
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
         {
-            // Find the child to descend into
-            int i;
-            for (i = 0; i < root.num_keys; i++)
+            printf("Error: Could not bind %s\n", address);
+            if (fd != -1)
             {
-                if (id < root.data.internal.keys[i])
-                {
-                    break;
-                }
+                close(fd);
             }
-            current_offset = root.data.internal.children[i];
-            // Check if child needs splitting (simplified, recurse if needed)
+            return -1;
         }
     }
-
-    // Update root_offset in file
-    fseek(db->file, 0, SEEK_SET);
-    fwrite(&db->root_offset, sizeof(off_t), 1, db->file);
-}
-
-// Delete from the B-Tree (simplified, no rebalancing)
-void btree_delete(Database *db, int id)
-{
-    BTreeNode node;
-    off_t current_offset = db->root_offset;
-    off_t parent_offset = -1;
-    int child_index = -1;
-
-    while (1)
+    else
     {
-        read_node(db, current_offset, &node);
-        if (node.is_leaf)
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        char host[INET_ADDRSTRLEN];
+        const char *colon = strrchr(address, ':');
+        int port;
+        if (colon == NULL || colon - address >= (long)sizeof(host) || sscanf(colon + 1, "%d", &port) != 1 || port < 0 || port > 65535)
         {
-            // Delete from leaf
-            int i;
-            for (i = 0; i < node.num_keys; i++)
-            {
-                if (node.data.leaf.entries[i].id == id)
-                {
-                    break;
-                }
-            }
-            if (i == node.num_keys)
-            {
-                return; // Not found
-            }
-            // Shift entries
-            for (int j = i; j < node.num_keys - 1; j++)
-            {
-                node.data.leaf.entries[j] = node.data.leaf.entries[j + 1];
-            }
-            node.num_keys--;
-            write_node(db, current_offset, &node);
-            break;
+            printf("Error: Invalid address %s. Use <ipv4>:<port> or unix:<path>\n", address);
+            return -1;
         }
-        else
+        memcpy(host, address, colon - address);
+        host[colon - address] = '\0';
+        if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+        {
+            printf("Error: Invalid address %s. Use <ipv4>:<port> or unix:<path>\n", address);
+            return -1;
+        }
+        addr.sin_port = htons((unsigned short)port);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int on = 1;
+        if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
         {
-            // Find child to descend into
-            int i;
-            for (i = 0; i < node.num_keys; i++)
+            printf("Error: Could not bind %s\n", address);
+            if (fd != -1)
             {
-                if (id < node.data.internal.keys[i])
-                {
-                    break;
-                }
+                close(fd);
             }
-            parent_offset = current_offset;
-            child_index = i;
-            current_offset = node.data.internal.children[i];
+            return -1;
         }
     }
+    if (listen(fd, SOMAXCONN) != 0)
+    {
+        printf("Error: Could not listen on %s\n", address);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    // Update parent key if necessary (simplified)
-    if (parent_offset != -1 && node.num_keys > 0)
+// Make run_server return; safe to call from a signal handler
+void stop_server(void)
+{
+    if (stop_pipe[1] != -1)
     {
-        BTreeNode parent;
-        read_node(db, parent_offset, &parent);
-        parent.data.internal.keys[child_index] = node.data.leaf.entries[0].id;
-        write_node(db, parent_offset, &parent);
+        char byte = 0;
+        ssize_t n = write(stop_pipe[1], &byte, 1);
+        (void)n;
     }
 }
 
-// Initialize the database
-Database init_db(const char *filename)
+// Append the rows with ids low..high to a RANGE response, in id order
+static void serve_range(Database *db, int low, int high, Buffer *out, Buffer *name)
 {
-    Database db;
-    db.file = fopen(filename, "r+");
-    if (db.file == NULL)
+    size_t count_at = out->length;
+    unsigned int count = 0;
+    buffer_put_u32(out, 0);
+    if (!db_read_lock(db))
     {
-        db.file = fopen(filename, "w+");
-        if (db.file == NULL)
-        {
-            perror("Error: Could not create file\n");
-            exit(1);
-        }
-        fclose(db.file);
-        db.file = fopen(filename, "r+");
-        if (db.file == NULL)
+        return;
+    }
+    Cursor cursor;
+    for (int ok = cursor_seek(db, &cursor, low); ok && cursor.id <= high; ok = cursor_next(&cursor))
+    {
+        int id;
+        int length = read_row(db, &cursor_table(&cursor)->schema, cursor.rid, &id, name->data, (int)name->capacity);
+        if ((size_t)length >= name->capacity)
         {
-            perror("Error: Could not reopen file\n");
-            exit(1);
+            buffer_reserve(name, length + 1);
+            read_row(db, &cursor_table(&cursor)->schema, cursor.rid, &id, name->data, (int)name->capacity);
         }
-        // Initialize B-Tree with an empty root node
-        db.root_offset = 8; // First page after root_offset
-        BTreeNode root = {0};
-        root.is_leaf = 1;
-        write_node(&db, db.root_offset, &root);
-        fseek(db.file, 0, SEEK_SET);
-        fwrite(&db.root_offset, sizeof(off_t), 1, db.file);
+        buffer_put_u32(out, (unsigned int)id);
+        buffer_put_u32(out, (unsigned int)length);
+        buffer_put(out, name->data, length);
+        count++;
     }
-    else
+    count = htonl(count);
+    memcpy(out->data + count_at, &count, sizeof(count));
+    db_unlock(db);
+}
+
+// Run one request and append its response to out. name is scratch space.
+static void serve_request(Database *db, const char *body, size_t length, Buffer *out, Buffer *name)
+{
+    size_t start = out->length;
+    buffer_put_u32(out, 0); // Length, filled in below
+    char status = STATUS_BAD_REQUEST;
+    int op = length >= 5 ? (unsigned char)body[0] : 0;
+    int id = length >= 5 ? (int)get_u32(body + 1) : 0;
+    size_t name_length = length >= 5 ? length - 5 : 0;
+    size_t status_at = out->length;
+    buffer_put(out, &status, 1);
+
+    if ((op == OP_INSERT || op == OP_UPDATE) && memchr(body + 5, '\0', name_length) == NULL)
     {
-        // Read root_offset
-        fseek(db.file, 0, SEEK_SET);
-        fread(&db.root_offset, sizeof(off_t), 1, db.file);
+        name->length = 0;
+        buffer_put(name, body + 5, name_length);
+        buffer_put(name, "", 1);
+        int done = op == OP_INSERT ? insert_row(db, id, name->data) : update_row(db, id, name->data);
+        status = done ? STATUS_OK : STATUS_FAILED;
     }
-    printf("File opened successfully at %p\n", (void *)db.file);
-
-    db.max_pages = MAX_PAGES;
-    db.pages = malloc(db.max_pages * sizeof(void *)); // 10 * 8 bytes
-    if (db.pages == NULL)
+    else if (op == OP_SELECT && length == 5)
     {
-        perror("Error: Could not allocate pages array\n");
-        fclose(db.file);
-        exit(1);
+        buffer_reserve(name, 256);
+        int found = select_name(db, id, name->data, (int)name->capacity);
+        if (found >= (int)name->capacity)
+        {
+            buffer_reserve(name, found + 1);
+            found = select_name(db, id, name->data, (int)name->capacity);
+        }
+        status = found >= 0 ? STATUS_OK : STATUS_FAILED;
+        if (found >= 0)
+        {
+            buffer_put_u32(out, (unsigned int)id);
+            buffer_put(out, name->data, found);
+        }
     }
-    db.num_pages = 0;
-    for (int i = 0; i < MAX_PAGES; i++)
+    else if (op == OP_DELETE && length == 5)
     {
-        db.page_dirty[i] = 0;
+        status = delete_row(db, id) ? STATUS_OK : STATUS_FAILED;
     }
-
-    // read data pages
-    fseek(db.file, DATA_START_OFFSET, SEEK_SET);
-    void *temp_buffer = malloc(PAGE_SIZE);
-    if (temp_buffer == NULL)
+    else if (op == OP_RANGE && length == 9)
     {
-        perror("Error: Could not allocate temp buffer\n");
-        free(db.pages);
-        fclose(db.file);
-        exit(1);
+        buffer_reserve(name, 256);
+        serve_range(db, id, (int)get_u32(body + 5), out, name);
+        status = STATUS_OK;
     }
+    out->data[status_at] = status;
+    unsigned int body_length = htonl((unsigned int)(out->length - start - 4));
+    memcpy(out->data + start, &body_length, sizeof(body_length));
+}
 
-    while (1)
+// Serve every complete request a client has sent. The first write opens a
+// transaction that runs to the end of the batch, so a pipelined batch of
+// writes shares one WAL commit; a batch of reads takes no write lock at all.
+// Responses are only sent once the commit is done. If it fails, every
+// response from the first write on becomes a bare STATUS_FAILED, since what
+// they report never reached the log. Returns 0 if the client sent an
+// oversized message.
+static int serve_requests(Database *db, Connection *connection, Buffer *name)
+{
+    Buffer *in = &connection->in;
+    Buffer *out = &connection->out;
+    size_t offset = 0, txn_output = 0;
+    int batch = 0, txn_responses = 0, valid = 1;
+    while (in->length - offset >= 4 && out->length - connection->sent < MAX_PENDING_OUTPUT)
     {
-        size_t bytesRead = fread(temp_buffer, 1, PAGE_SIZE, db.file);
-        if (bytesRead == 0)
-            break;
-        if (bytesRead < PAGE_SIZE && !feof(db.file))
+        size_t length = get_u32(in->data + offset);
+        if (length > MAX_MESSAGE_BYTES)
         {
-            printf("Error: Partial read, only %zu bytes read\n", bytesRead);
-            free(temp_buffer);
-            free(db.pages);
-            fclose(db.file);
-            exit(1);
+            valid = 0;
+            break;
         }
-        printf("Read %zu bytes from file for page %d\n", bytesRead, db.num_pages);
-
-        void *page = malloc(PAGE_SIZE);
-        if (page == NULL)
+        if (in->length - offset - 4 < length)
         {
-            perror("Error: Could not allocate page\n");
-            free(temp_buffer);
-            free(db.pages);
-            fclose(db.file);
-            exit(1);
+            break;
         }
-        memcpy(page, temp_buffer, PAGE_SIZE);
-        db.pages[db.num_pages] = page;
-        db.num_pages++;
-
-        if (db.num_pages >= db.max_pages)
+        int op = length >= 5 ? (unsigned char)in->data[offset + 4] : 0;
+        if (!batch && (op == OP_INSERT || op == OP_UPDATE || op == OP_DELETE))
         {
-            printf("Warning: Maximum pages reached\n");
-            break;
+            batch = begin_txn(db);
+            txn_output = out->length;
         }
+        serve_request(db, in->data + offset + 4, length, out, name);
+        txn_responses += batch;
+        offset += 4 + length;
     }
-    free(temp_buffer);
-
-    if (db.num_pages == 0)
+    if (batch && !commit_txn(db))
     {
-        void *page = malloc(PAGE_SIZE);
-        if (page == NULL)
+        out->length = txn_output;
+        for (int i = 0; i < txn_responses; i++)
         {
-            perror("Error: Could not allocate first page\n");
-            free(db.pages);
-            fclose(db.file);
-            exit(1);
+            char status = STATUS_FAILED;
+            buffer_put_u32(out, 1);
+            buffer_put(out, &status, 1);
         }
-        memset(page, 0, PAGE_SIZE); // Initialize the first page to zero
-        db.pages[0] = page;
-        db.num_pages = 1;
-        printf("Allocated first page\n");
     }
-    printf("Loaded %d pages\n", db.num_pages);
-    return db;
+    memmove(in->data, in->data + offset, in->length - offset);
+    in->length -= offset;
+    return valid;
 }
 
-// Write the buffer to the disk file
-void write_buffer(Database *db)
+// Read what the client has sent; returns 0 if the connection failed
+static int read_input(Connection *connection)
 {
-    // Write root_offset
-    fseek(db->file, 0, SEEK_SET);
-    fwrite(&db->root_offset, sizeof(off_t), 1, db->file);
-
-    // Write data pages (only dirty ones)
-    fseek(db->file, DATA_START_OFFSET, SEEK_SET);
-    for (int i = 0; i < db->num_pages; i++)
+    while (connection->in.length < 2 * MAX_MESSAGE_BYTES)
     {
-        fseek(db->file, DATA_START_OFFSET + (off_t)i * PAGE_SIZE, SEEK_SET);
-        size_t bytesWritten = fwrite(db->pages[i], 1, PAGE_SIZE, db->file);
-        if (bytesWritten != PAGE_SIZE)
+        buffer_reserve(&connection->in, 65536);
+        ssize_t n = read(connection->fd, connection->in.data + connection->in.length, connection->in.capacity - connection->in.length);
+        if (n > 0)
         {
-            printf("Error: Failed to write page %d, wrote %zu bytes\n", i, bytesWritten);
-            exit(1);
+            connection->in.length += n;
         }
-        db->page_dirty[i] = 0; // Reset dirty flag after writing
-    }
-    // printf("Wrote %d pages to file\n", db->num_pages);
-    fflush(db->file); // ensure data is written to disk
-}
-
-// Insert a row (returns 1 if inserted, 0 if failed due to duplicate ID)
-int insert_row(Database *db, int id, const char *name)
-{
-    if (id <= 0)
-    {
-        printf("Error: ID must be a positive integer (got %d)\n", id);
-        return 0;
-    }
-
-    // Check for duplicate ID
-    off_t address;
-    btree_search(db, id, &address);
-    if (address != -1)
-    {
-        printf("Error: Row with id=%d already exists\n", id);
-        return 0;
-    }
-
-    int current_page = db->num_pages - 1;
-    int *page_num_rows = (int *)db->pages[current_page]; // Pointer to the number of rows in the page
-    if (*page_num_rows >= MAX_ROWS)
-    {
-        if (db->num_pages >= db->max_pages)
+        else if (n == 0)
         {
-            printf("Error: Maximum pages reached, cannot insert more rows\n");
-            return 0;
+            connection->eof = 1;
+            return 1;
         }
-        void *new_page = malloc(PAGE_SIZE);
-        if (new_page == NULL)
+        else
         {
-            printf("Error: Could not allocate new page\n");
-            return 0;
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
         }
-        memset(new_page, 0, PAGE_SIZE); // Initialize the new page to zero
-        db->pages[db->num_pages] = new_page;
-        db->num_pages++;
-        current_page = db->num_pages - 1;
-        page_num_rows = (int *)db->pages[current_page]; // Update pointer to the new page
-        printf("Allocated new page %d\n", current_page);
     }
-
-    struct Row new_row;
-    new_row.id = id;
-    strncpy(new_row.name, name, 59);
-    new_row.name[59] = '\0';
-
-    size_t offset = sizeof(int) + (*page_num_rows * sizeof(struct Row));
-    memcpy((char *)db->pages[current_page] + offset, &new_row, sizeof(struct Row));
-    printf("Inserted row at offset %zu in page %d: id=%d, name=%s\n", offset, current_page, new_row.id, new_row.name);
-
-    (*page_num_rows)++;
-    int updated_num_rows = *page_num_rows;
-    memcpy(db->pages[current_page], &updated_num_rows, sizeof(int));
-
-    // Compute the row's address in the file
-    off_t row_address = DATA_START_OFFSET + (off_t)current_page * PAGE_SIZE + offset;
-
-    // Insert into B-Tree
-    btree_insert(db, id, row_address);
-
-    db->page_dirty[current_page] = 1;
-    write_buffer(db);
     return 1;
 }
 
-// select all rows, returns count of non-deleted rows
-int select_rows(Database *db, struct Row *rows, int max_rows)
+// Send as much of the pending output as the socket takes; returns 0 if the
+// connection failed
+static int write_output(Connection *connection)
 {
-    int count = 0;
-    for (int page = 0; page < db->num_pages && count < max_rows; page++)
+    Buffer *out = &connection->out;
+    while (connection->sent < out->length)
     {
-        int *page_num_rows = (int *)db->pages[page]; // Pointer to the number of rows in the page
-        for (int i = 0; i < *page_num_rows && count < max_rows; i++)
+        ssize_t n = send(connection->fd, out->data + connection->sent, out->length - connection->sent, MSG_NOSIGNAL);
+        if (n < 0)
         {
-            size_t offset = sizeof(int) + (i * sizeof(struct Row));
-            struct Row temp_row;
-            memcpy(&temp_row, (char *)db->pages[page] + offset, sizeof(struct Row));
-            if (temp_row.id != 0) // Check if row is not deleted
-            {
-                rows[count++] = temp_row;
-            }
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
         }
+        connection->sent += n;
     }
-    return count;
+    out->length = 0;
+    connection->sent = 0;
+    return 1;
 }
 
-// Select a row by ID (returns 1 if found, 0 if not)
-int select_by_id(Database *db, int id, struct Row *row)
+static void close_connection(int epoll_fd, Connection **connections, Connection *connection)
 {
-    if (id <= 0)
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    if (connection->prev != NULL)
     {
-        printf("Error: ID must be a positive integer (got %d)\n", id);
-        return 0;
+        connection->prev->next = connection->next;
     }
-
-    off_t address;
-    btree_search(db, id, &address);
-    if (address == -1)
+    else
     {
-        printf("Error: Row with id=%d not found\n", id);
-        return 0;
+        *connections = connection->next;
     }
-
-    fseek(db->file, address, SEEK_SET);
-    size_t bytes_read = fread(row, sizeof(struct Row), 1, db->file);
-    if (bytes_read != 1)
+    if (connection->next != NULL)
     {
-        printf("Error: Failed to read row at address %lld\n", (long long)address);
-        return 0;
+        connection->next->prev = connection->prev;
     }
-    return 1;
+    free(connection->in.data);
+    free(connection->out.data);
+    free(connection);
 }
 
-// update a row
-int update_row(Database *db, int id, const char *name)
+// Serve clients on a socket from server_listen until stop_server is called.
+// One epoll loop shares the database and its buffer pool among all clients.
+void run_server(Database *db, int listen_fd)
 {
-    if (id <= 0)
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1 || pipe2(stop_pipe, O_NONBLOCK) != 0)
     {
-        printf("Error: ID must be a positive integer (got %d)\n", id);
-        return 0;
-    }
-
-    off_t address;
-    btree_search(db, id, &address);
-    if (address == -1)
-    {
-        printf("Error: Row with id=%d not found\n", id);
-        return 0;
-    }
-
-    struct Row row;
-    fseek(db->file, address, SEEK_SET);
-    size_t bytes_read = fread(&row, sizeof(struct Row), 1, db->file);
-    if (bytes_read != 1)
-    {
-        printf("Error: Failed to read row at address %lld\n", (long long)address);
-        return 0;
+        perror("Error: Could not start the server\n");
+        exit(1);
     }
-    strncpy(row.name, name, 59);
-    row.name[59] = '\0';
-    fseek(db->file, address, SEEK_SET);
-    fwrite(&row, sizeof(struct Row), 1, db->file);
-
-    // update in memory pages
-    for (int page = 0; page < db->num_pages; page++)
+    // data.ptr is the Connection; NULL marks the listening socket and the stop pipe
+    struct epoll_event event = {EPOLLIN, {.ptr = NULL}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_pipe[0], &event);
+    Connection *connections = NULL;
+    Buffer name = {0};
+    struct epoll_event events[MAX_EVENTS];
+    int running = 1;
+    while (running)
     {
-        int *page_num_rows = (int *)db->pages[page];
-        for (int i = 0; i < *page_num_rows; i++)
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
         {
-            size_t offset = sizeof(int) + (i * sizeof(struct Row));
-            off_t computed_address = DATA_START_OFFSET + (off_t)page * PAGE_SIZE + offset;
-
-            if (computed_address == address)
+            perror("Error: epoll_wait failed\n");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            Connection *connection = events[i].data.ptr;
+            if (connection == NULL)
             {
-                memcpy((char *)db->pages[page] + offset, &row, sizeof(struct Row));
-                db->page_dirty[page] = 1;
-                break;
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) != -1)
+                {
+                    int on = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Fails harmlessly on Unix sockets
+                    connection = calloc(1, sizeof(Connection));
+                    if (connection == NULL)
+                    {
+                        printf("Error: Memory allocation failed\n");
+                        exit(1);
+                    }
+                    connection->fd = fd;
+                    connection->mask = EPOLLIN;
+                    connection->next = connections;
+                    if (connections != NULL)
+                    {
+                        connections->prev = connection;
+                    }
+                    connections = connection;
+                    struct epoll_event client = {EPOLLIN, {.ptr = connection}};
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &client);
+                }
+                char byte;
+                running = read(stop_pipe[0], &byte, 1) != 1;
+                continue;
+            }
+            int open = 1;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                open = read_input(connection);
+            }
+            open = open && serve_requests(db, connection, &name) && write_output(connection);
+            if (open && connection->eof && connection->out.length == 0)
+            {
+                open = 0; // Every request the client sent has been answered
+            }
+            if (!open)
+            {
+                close_connection(epoll_fd, &connections, connection);
+                continue;
+            }
+            // Wait for room to send, and read only while the client keeps up
+            unsigned int mask = (connection->out.length > 0 ? EPOLLOUT : 0) |
+                                (!connection->eof && connection->out.length - connection->sent < MAX_PENDING_OUTPUT ? EPOLLIN : 0);
+            if (mask != connection->mask)
+            {
+                struct epoll_event client = {mask, {.ptr = connection}};
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &client);
+                connection->mask = mask;
             }
         }
     }
-    printf("Updated row at address %lld: id=%d, new name=%s\n", (long long)address, id, name);
-    write_buffer(db);
+    while (connections != NULL)
+    {
+        close_connection(epoll_fd, &connections, connections);
+    }
+    free(name.data);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    stop_pipe[0] = stop_pipe[1] = -1;
+    close(epoll_fd);
+}
+
+// SELECT <id> callback printing "Row: id=.., <column>=.."
+static int print_one_row(void *arg, int id, const Value *values)
+{
+    printf("Row: ");
+    print_values(arg, id, values);
     return 1;
 }
 
-// Delete a row
-int delete_row(Database *db, int id)
+// SELECT <list> callback printing "Row <n>: [id=.., ]<item>=.., ..."
+static int print_query_row(void *arg, int id, const Value *values)
 {
-    if (id <= 0)
+    RowPrinter *printer = arg;
+    const Statement *stmt = printer->stmt;
+    printf("Row %d: ", printer->printed++);
+    int has_id = 0;
+    for (int i = 0; i < stmt->num_items; i++)
     {
-        printf("Error: ID must be a positive integer (got %d)\n", id);
-        return 0;
+        has_id |= stmt->items[i].column == -1;
     }
-
-    off_t address;
-    btree_search(db, id, &address);
-    if (address == -1)
+    if (!stmt->aggregated && !has_id)
     {
-        printf("Error: Row with id=%d not found\n", id);
-        return 0;
+        printf("id=%d, ", id);
     }
-
-    // Delete from B-Tree
-    btree_delete(db, id);
-
-    // Delete from data pages
-    int found = 0;
-    for (int page = 0; page < db->num_pages; page++)
+    for (int i = 0; i < stmt->num_items; i++)
     {
-        int *page_num_rows = (int *)db->pages[page];
-        for (int i = 0; i < *page_num_rows; i++)
+        const QueryItem *item = &stmt->items[i];
+        const char *name = item->column == NO_COLUMN ? "*" : item->column < 0 ? "id" : printer->schema->columns[item->column].name;
+        int type = item->aggregate == AGG_COUNT ? COL_INT64 : item->aggregate == AGG_AVG ? COL_DOUBLE : column_type(printer->schema, item->column);
+        if (item->aggregate == AGG_NONE)
         {
-            struct Row row;
-            size_t offset = sizeof(int) + (i * sizeof(struct Row));
-            off_t computed_address = DATA_START_OFFSET + (off_t)page * PAGE_SIZE + offset;
-            if (computed_address == address)
-            {
-                found = 1;
-                // Shift all subsequent rows left to fill the gap
-                for (int j = i; j < *page_num_rows - 1; j++)
-                {
-                    size_t current_offset = sizeof(int) + (j * sizeof(struct Row));
-                    size_t next_offset = sizeof(int) + ((j + 1) * sizeof(struct Row));
-                    memcpy((char *)db->pages[page] + current_offset,
-                           (char *)db->pages[page] + next_offset,
-                           sizeof(struct Row));
-                }
-                // Clear the last slot after shifting
-                size_t last_offset = sizeof(int) + ((*page_num_rows - 1) * sizeof(struct Row));
-                memset((char *)db->pages[page] + last_offset, 0, sizeof(struct Row));
-                (*page_num_rows)--;
-
-                int updated_num_rows = *page_num_rows;
-                memcpy(db->pages[page], &updated_num_rows, sizeof(int));
-
-                // handle empty pages
-                if (*page_num_rows == 0)
-                {
-                    free(db->pages[page]);
-                    for (int k = page; k < db->num_pages - 1; k++)
-                    {
-                        db->pages[k] = db->pages[k + 1];
-                    }
-                    db->pages[db->num_pages - 1] = NULL;
-                    db->num_pages--;
-                    if (db->num_pages == 0)
-                    {
-                        void *new_page = malloc(PAGE_SIZE);
-                        if (new_page == NULL)
-                        {
-                            perror("Error: Could not allocate initial page\n");
-                            free(db->pages);
-                            fclose(db->file);
-                            exit(1);
-                        }
-                        memset(new_page, 0, PAGE_SIZE);
-                        db->pages[0] = new_page;
-                        db->num_pages = 1;
-                        printf("Allocated initial page after all pages removed\n");
-                    }
-                }
-                db->page_dirty[page] = 1;
-                break;
-            }
+            printf("%s%s=", i > 0 ? ", " : "", name);
         }
-        if (found)
-            break;
+        else
+        {
+            printf("%s%s(%s)=", i > 0 ? ", " : "", aggregate_names[item->aggregate], name);
+        }
+        print_value(type, &values[i]);
     }
-    if (found)
-        write_buffer(db);
-
-    return found;
+    printf("\n");
+    return 1;
 }
 
-// cleanup function
-void close_db(Database *db)
+// Execute a statement typed at the REPL and print what it did
+static void run_statement(Statement *stmt)
 {
-    for (int i = 0; i < db->num_pages; i++)
+    if (stmt->num_params > 0)
+    {
+        printf("Error: ? parameters need bind_value; type the values instead\n");
+        return;
+    }
+    const Schema *schema = &thread_table(stmt->db)->schema;
+    int id = stmt->num_operands > 0 ? (int)stmt->operands[0].value.int64 : 0;
+    RowPrinter printer = {schema, 0, stmt};
+    int (*print)(void *, int, const Value *) = stmt->kind == STMT_SELECT_LIST ? print_query_row : print_row;
+    int count = execute_statement(stmt, stmt->kind == STMT_SELECT_ID ? print_one_row : print,
+                                  stmt->kind == STMT_SELECT_ID ? (void *)schema : (void *)&printer);
+    if (count < 0)
+    {
+        return;
+    }
+    switch (stmt->kind)
     {
-        free(db->pages[i]);
+    case STMT_INSERT:
+    case STMT_UPDATE:
+        if (count > 0)
+        {
+            Value values[MAX_COLUMNS];
+            for (int i = 0; i < schema->num_columns; i++)
+            {
+                values[i] = stmt->operands[1 + i].value;
+            }
+            printf(stmt->kind == STMT_INSERT ? "Inserted row: " : "Updated row: ");
+            print_values(schema, id, values);
+        }
+        break;
+    case STMT_DELETE:
+        if (count > 0)
+        {
+            printf("Deleted row with id=%d\n", id);
+        }
+        else
+        {
+            printf("Row with id=%d not found\n", id);
+        }
+        break;
+    case STMT_SELECT_ID:
+        if (count == 0)
+        {
+            printf("Row with id=%d not found\n", id);
+        }
+        break;
+    case STMT_SELECT_WHERE:
+    case STMT_SELECT_LIST:
+        if (count == 0)
+        {
+            printf("No matching rows\n");
+        }
+        break;
+    case STMT_SELECT_ALL:
+        if (count == 0)
+        {
+            printf("No rows to display\n");
+        }
+        break;
+    default:
+        if (count > 0)
+        {
+            printf(stmt->kind == STMT_BEGIN    ? "Transaction started\n"
+                   : stmt->kind == STMT_COMMIT ? "Transaction committed\n"
+                                               : "Transaction rolled back\n");
+        }
+        break;
     }
-    free(db->pages);
-    fclose(db->file);
 }
 
-// REPL loop (unchanged)
+// REPL loop
 void run_repl(Database *db)
 {
     // print instructions
     printf("Welcome to the database REPL!\n");
     printf("Available Commands:\n");
-    printf("  INSERT <id> <name>      - Insert a new row\n");
+    printf("  CREATE TABLE <name> (<column> <type>, ...)\n");
+    printf("                          - Create a table (INT64, DOUBLE, TEXT, BLOB columns) and use it\n");
+    printf("  USE <table>             - Run the commands below on another table\n");
+    printf("  TABLES                  - List the tables\n");
+    printf("  CREATE INDEX <name> ON <table> (<column>)\n");
+    printf("                          - Index a column for SELECT WHERE\n");
+    printf("  INSERT <id> <name>      - Insert a new row (one value per column, NULL for none,\n");
+    printf("                            'quoted' for text with spaces)\n");
     printf("  SELECT <id>             - Select a row by ID\n");
     printf("  SELECT                  - Select all rows\n");
-    printf("  UPDATE <id> <new_name>  - Update a row by ID\n");
+    printf("  SELECT WHERE <column> = <value> | BETWEEN <low> AND <high>\n");
+    printf("                          - Select the rows whose column (or id) matches\n");
+    printf("  SELECT <item>, ... [WHERE <column> <op> <value> AND ...] [GROUP BY <column>]\n");
+    printf("                          - Filter, project and aggregate: items are columns, *, COUNT(*),\n");
+    printf("                            COUNT/SUM/MIN/MAX/AVG(<column>); ops are = != < <= > >= BETWEEN\n");
+    printf("  UPDATE <id> <new_name>  - Update a row by ID (one value per column)\n");
     printf("  DELETE <id>             - Delete a row by ID\n");
+    printf("  .import <file> [fill]   - Bulk load id,value,... lines into an empty table\n");
+    printf("  BEGIN                   - Start a transaction\n");
+    printf("  COMMIT                  - Commit the open transaction\n");
+    printf("  ROLLBACK                - Undo the open transaction\n");
     printf("  exit                    - Exit the REPL\n");
-    char input[100];
+    char input[PAGE_SIZE + 32]; // Room for a name of up to PAGE_SIZE - 1 bytes
     while (1)
     {
         printf("db>");
@@ -736,110 +8028,74 @@ void run_repl(Database *db)
         input[strcspn(input, "\n")] = 0; // Remove newline character
 
         // Evaluate & Print part of REPL loop --------
-        if (strncmp(input, "INSERT", 6) == 0)
+        if (strncmp(input, "CREATE INDEX", 12) == 0)
         {
-            int id;
-            char name[60];
-            struct Row row;
-            if (sscanf(input, "INSERT %d %59s", &id, name) != 2)
+            char name[MAX_NAME_LENGTH], table[MAX_NAME_LENGTH], column[MAX_NAME_LENGTH];
+            char close = 0;
+            if (sscanf(input, "CREATE INDEX %31s ON %31s (%31[^) ]%c", name, table, column, &close) != 4 || close != ')')
             {
-                printf("Error: Invalid INSERT format. Use: INSERT <id> <name>\n");
+                printf("Error: Invalid CREATE INDEX format. Use: CREATE INDEX <name> ON <table> (<column>)\n");
                 continue;
             }
-            if (id <= 0)
+            create_index(db, name, table, column);
+        }
+        else if (strncmp(input, "CREATE", 6) == 0)
+        {
+            char name[MAX_NAME_LENGTH];
+            Column columns[MAX_COLUMNS];
+            int count = parse_create_table(input, name, columns);
+            if (count < 0)
             {
-                printf("Error: ID must be a positive integer (got %d)\n", id);
+                printf("Error: Invalid CREATE format. Use: CREATE TABLE <name> (<column> <type>, ...)\n");
                 continue;
             }
-
-            if (insert_row(db, id, name))
+            if (create_table(db, name, columns, count))
             {
-                printf("Inserted row: id=%d, name=%s\n", id, name);
+                use_table(db, name);
             }
         }
-        else if (strncmp(input, "SELECT", 6) == 0)
+        else if (strncmp(input, "USE", 3) == 0)
         {
-            int id;
-            char trailing[100];
-            if (sscanf(input, "SELECT %d %s", &id, trailing) == 2)
+            char name[MAX_NAME_LENGTH];
+            if (sscanf(input, "USE %31s", name) != 1)
             {
-                printf("Error: Invalid SELECT format. Use: SELECT <id> or SELECT\n");
+                printf("Error: Invalid USE format. Use: USE <table>\n");
                 continue;
             }
-            if (sscanf(input, "SELECT %d", &id) == 1)
+            if (use_table(db, name))
             {
-                if (id <= 0)
-                {
-                    printf("Error: ID must be a positive integer (got %d)\n", id);
-                    continue;
-                }
-                struct Row row;
-                if (select_by_id(db, id, &row))
-                {
-                    printf("Row: id=%d, name=%s\n", row.id, row.name);
-                }
-                else
-                {
-                    printf("Row with id=%d not found\n", id);
-                }
+                printf("Using table %s\n", name);
             }
-            else
+        }
+        else if (strcmp(input, "TABLES") == 0)
+        {
+            for (int i = 1; i < db->num_tables; i++)
             {
-                struct Row rows[MAX_ROWS];
-                int count = select_rows(db, rows, MAX_ROWS);
-                if (count == 0)
+                const Schema *schema = &db->tables[i]->schema;
+                printf("%s%s (", db->tables[i] == thread_table(db) ? "* " : "  ", schema->name);
+                for (int c = 0; c < schema->num_columns; c++)
                 {
-                    printf("No rows to display\n");
+                    static const char *types[] = {"INT64", "DOUBLE", "TEXT", "BLOB"};
+                    printf("%s%s %s", c > 0 ? ", " : "", schema->columns[c].name, types[schema->columns[c].type]);
                 }
-                else
+                printf(")\n");
+                for (int x = 0; x < db->tables[i]->num_indexes; x++)
                 {
-                    for (int i = 0; i < count; i++)
-                    {
-                        printf("Row %d: id=%d, name=%s\n", i, rows[i].id, rows[i].name);
-                    }
+                    const SecondaryIndex *index = &db->tables[i]->indexes[x];
+                    printf("    index %s (%s)\n", index->name, schema->columns[index->column].name);
                 }
             }
         }
-        else if (strncmp(input, "UPDATE", 6) == 0)
-        {
-            int id;
-            char name[60];
-            if (sscanf(input, "UPDATE %d %59s", &id, name) != 2)
-            {
-                printf("Error: Invalid UPDATE format. Use: UPDATE <id> <new_name>\n");
-                continue;
-            }
-            if (id <= 0)
-            {
-                printf("Error: ID must be a positive integer (got %d)\n", id);
-                continue;
-            }
-            if (update_row(db, id, name))
-            {
-                printf("Updated row: id=%d, new name=%s\n", id, name);
-            }
-        }
-        else if (strncmp(input, "DELETE", 6) == 0)
+        else if (strncmp(input, ".import", 7) == 0)
         {
-            int id;
-            if (sscanf(input, "DELETE %d", &id) != 1)
-            {
-                printf("Error: Invalid DELETE format. Use: DELETE <id>\n");
-                continue;
-            }
-            if (id <= 0)
+            char path[256];
+            int fill = DEFAULT_FILL_PERCENT;
+            if (sscanf(input, ".import %255s %d", path, &fill) < 1)
             {
-                printf("Error: ID must be a positive integer (got %d)\n", id);
+                printf("Error: Invalid .import format. Use: .import <file.csv> [fill percent]\n");
                 continue;
             }
-            if (!delete_row(db, id))
-            {
-                printf("Row with id=%d not found\n", id);
-            }
-            else
-            {
-                printf("Deleted row with id=%d\n", id);
-            }
+            import_csv(db, path, fill);
         }
         else if (strncmp(input, "exit", 4) == 0)
         {
@@ -847,7 +8103,14 @@ void run_repl(Database *db)
         }
         else
         {
-            printf("You entered: %s\n", input);
+            // Row and transaction statements go through the statement cache,
+            // so a line typed again is not parsed again
+            Statement *stmt = prepare_statement(db, input);
+            if (stmt != NULL)
+            {
+                run_statement(stmt);
+                free_statement(stmt);
+            }
         }
     }
 }
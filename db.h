@@ -0,0 +1,332 @@
+#ifndef DB_H
+#define DB_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+// Public interface of db.c: the types its callers share with it and the
+// functions they call. test_db.c, bench_db.c and server.c include it rather
+// than keeping their own copies of the structures.
+
+#define PAGE_SIZE 4096     // Bytes per file page
+#define MAX_COLUMNS 32     // Columns per table, besides the id key
+#define MAX_NAME_LENGTH 32 // Table and column names, including the NUL
+#define MAX_INDEXES 8      // Secondary indexes per table
+
+// Row as returned by select_rows and select_by_id. name is the table's first
+// TEXT column; it holds the first 59 bytes and select_name returns all of it.
+struct Row
+{
+    int id;
+    char name[60];
+};
+
+// Column types of CREATE TABLE
+typedef enum
+{
+    COL_INT64,  // 8-byte signed integer
+    COL_DOUBLE, // 8-byte float
+    COL_TEXT,   // Variable-length string
+    COL_BLOB    // Variable-length bytes
+} ColumnType;
+
+typedef struct
+{
+    char name[MAX_NAME_LENGTH];
+    int type; // ColumnType
+} Column;
+
+// One column of a row, as passed to insert_values and returned by select_values
+typedef struct
+{
+    int is_null;
+    long long int64;  // COL_INT64
+    double real;      // COL_DOUBLE
+    const char *data; // COL_TEXT/COL_BLOB bytes, not NUL-terminated
+    int length;       // Bytes at data
+} Value;
+
+// Table schema, stored on the catalog page. Every table is keyed by its int
+// id; columns holds the rest. A record is laid out as a null bitmap, then one
+// fixed slot per column (the 8-byte value of an INT64 or DOUBLE, the 4-byte
+// end offset of a TEXT or BLOB in the tail), then the tail of variable-length
+// bytes. The last variable-length column ends where the record does, so it
+// needs no slot. Any column decodes without touching the others.
+typedef struct Schema
+{
+    char name[MAX_NAME_LENGTH];
+    int num_columns;
+    Column columns[MAX_COLUMNS];
+    // Layout derived from the columns by schema_layout
+    int offsets[MAX_COLUMNS];  // Offset of each column's slot (-1 = none)
+    int prev_end[MAX_COLUMNS]; // TEXT/BLOB: slot of the previous one's end (-1 = tail start)
+    int tail_start;            // Bitmap plus slots
+    int last_varlen;           // Last TEXT/BLOB column (-1 = none)
+    int name_column;           // First TEXT column, used by the Row API (-1 = none)
+} Schema;
+
+// Secondary index on one column of a table, stored in the table's catalog row
+typedef struct
+{
+    char name[MAX_NAME_LENGTH];
+    int column;        // Indexed column
+    off_t root_offset; // Root node of the index's B+Tree
+} SecondaryIndex;
+
+// A table: the B-Tree indexing its ids, its chain of data pages and its
+// schema. Table 0 is the catalog, which holds one row per other table; its
+// own root and page chain are kept in the file header.
+typedef struct
+{
+    int table_id;        // Key of the table's catalog row (0 = the catalog)
+    int num_pages;       // Number of data pages in the table
+    off_t root_offset;   // File offset of the root node
+    int first_data_page; // First data page of the table
+    int last_data_page;  // Last data page of the table
+    int fsm_hint;        // Page the next free-space search starts at (in memory only)
+    int dirty;           // Root or page chain changed since the catalog row was written
+    Schema schema;
+    int num_indexes;
+    SecondaryIndex indexes[MAX_INDEXES];
+} Table;
+
+// Record identifier: the data page and slot holding a row
+typedef struct
+{
+    unsigned int page;   // 4 bytes
+    unsigned short slot; // 2 bytes (+2 padding)
+} RecordId;              // 8 bytes
+
+// Buffer pool counters reported by get_pool_stats
+typedef struct
+{
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;
+    long mapped;
+} PoolStats;
+
+// WAL counters reported by get_wal_stats
+typedef struct
+{
+    long commits;       // Transactions committed
+    long syncs;         // fsync calls on the WAL
+    long checkpoints;   // WAL contents copied into the database file
+    int frames;         // Frames currently in the WAL
+    long pages_written; // Page images appended to the WAL
+    long write_calls;   // Write syscalls issued on the WAL
+} WalStats;
+
+typedef struct BufferPool BufferPool;
+typedef struct Wal Wal;
+typedef struct StatementCache StatementCache;
+typedef struct Statement Statement;
+typedef struct WorkerPool WorkerPool;
+
+// Counters of the statement cache reported by get_statement_stats
+typedef struct
+{
+    long hits;             // prepare_statement calls served by a cached plan
+    long misses;           // Statements parsed and compiled
+    long parallel_queries; // SELECT <list> queries split across worker threads
+} StatementStats;
+
+// Options for init_db_with_options; zero fields take the defaults
+typedef struct
+{
+    int pool_pages;       // Number of frames in the buffer pool
+    int group_commit;     // Commits per WAL fsync (1 = every commit is durable on return)
+    int checkpoint_pages; // WAL frames that trigger a checkpoint
+    int use_mmap;         // Serve clean pages for reads straight from a read-only mapping
+    int scan_threads;     // Threads an aggregate query scans with (default: one per CPU; 1 = no parallel scans;
+                          // at most pool_pages / 2, as each pins up to two frames)
+} DbOptions;
+
+// A database handle. Threads may share one (see db_read_lock in db.c). The
+// table that row operations act on is per thread, not per handle: use_table
+// changes it for the calling thread only, and a thread that never called it
+// gets the first table. current_table returns it.
+typedef struct
+{
+    int fd;                     // Database file, read and written with positioned I/O
+    long handle_id;             // Tells this handle apart from every other one opened
+    long catalog_version;       // Changes whenever tables is rebuilt
+    BufferPool *pool;           // Page table: resident B-Tree nodes and data pages
+    Wal *wal;                   // Write-ahead log for the database file
+    int in_txn;                 // Nonzero between begin_txn and commit_txn/rollback_txn
+    int use_mmap;               // Reads may use the mapping below
+    char *map;                  // Read-only mapping of the database file (NULL until mapped)
+    size_t map_size;            // Bytes mapped
+    int page_count;             // Pages in the file, including the header page
+    int freelist_head;          // First free page (0 = freelist empty)
+    int free_pages;             // Number of pages on the freelist
+    Table **tables;             // Every table, loaded from the catalog; tables[0] is the catalog
+    int num_tables;
+    pthread_rwlock_t *lock;     // Many readers or one writer (see db_read_lock)
+    StatementCache *statements; // Plans compiled by prepare_statement
+    WorkerPool *workers;        // Threads that help run parallel scans (NULL = none)
+} Database;
+
+typedef enum
+{
+    CURSOR_ON_ROW,       // id and rid describe the current row
+    CURSOR_BEFORE_FIRST, // Stepped back past the first row
+    CURSOR_AFTER_LAST    // Stepped past the last row
+} CursorState;
+
+// Position in a table's rows in id order. A cursor stays usable across
+// writes and rollbacks: if its entry moved it finds its place again by id.
+typedef struct
+{
+    Database *db;
+    int table_id; // Table whose B-Tree the cursor walks
+    off_t leaf;   // B-Tree leaf of the current entry
+    int index;    // Entry within that leaf
+    int state;    // CursorState
+    int id;       // Current row's id
+    RecordId rid; // Current row's record ID
+} Cursor;
+
+// Read-only view of the database as of one commit. Its pages come from the
+// WAL frames committed before it or from the database file, which cannot
+// change while a snapshot is open because checkpoints wait for it to close.
+// Reading through a snapshot takes no database lock, so writers never wait
+// for snapshot readers.
+typedef struct
+{
+    Database *db;
+    off_t wal_end; // Frames committed before this WAL offset are visible
+} Snapshot;
+
+// Pull-based scan over a table's rows in storage order. The current row is
+// decoded straight from its page frame, which stays pinned until the scan
+// moves past it; values returned for a row are valid until the next call.
+// An open scan holds the database's read lock, so other threads cannot
+// write until it ends, and writes from its own thread fail with an error.
+// A thread holding one database's lock cannot call into another database.
+// A scan of a snapshot (scan_open_snapshot) holds no lock and sees no later
+// writes.
+typedef struct
+{
+    Database *db;
+    Table *table;
+    int page_no;                  // Page being read (0 = done)
+    const char *page;             // Its frame, or NULL before it is read
+    int slot;                     // Next slot of the page to read
+    int id;                       // Current row's id
+    const unsigned char *record;  // Current row's record
+    int length;                   // Its length in bytes
+    unsigned char *spill;         // Record copy of an overflowing row, or NULL
+    int locked;                   // Holds the database's read lock
+    const Snapshot *snapshot;     // Snapshot read from, or NULL for the current state
+    char *buffer;                 // Snapshot scans: copy of the page being read
+    int stop_page;                // Page at which the scan ends early (0 = the end of the chain)
+} Scan;
+
+// In-node key search kernels, chosen at runtime by set_search_kernel
+typedef enum
+{
+    SEARCH_AUTO,   // Best kernel the CPU supports
+    SEARCH_LINEAR, // Scan keys one by one
+    SEARCH_BINARY, // Branch-free binary search
+    SEARCH_SSE2,   // Vectorized scan, 4 keys per compare
+    SEARCH_AVX2    // Vectorized scan, 8 keys per compare
+} SearchKernel;
+
+SearchKernel set_search_kernel(SearchKernel kernel);
+
+// Database functions
+Database init_db(const char *filename);
+Database init_db_with_options(const char *filename, const DbOptions *options);
+void write_buffer(Database *db);
+int insert_row(Database *db, int id, const char *name);
+int select_rows(Database *db, struct Row *rows, int max_rows);
+int select_by_id(Database *db, int id, struct Row *row);
+int select_name(Database *db, int id, char *name, int size);
+int delete_row(Database *db, int id);
+void close_db(Database *db);
+int update_row(Database *db, int id, const char *name);
+int create_table(Database *db, const char *name, const Column *columns, int num_columns);
+int use_table(Database *db, const char *name);
+Table *current_table(Database *db);
+int create_index(Database *db, const char *name, const char *table, const char *column);
+int select_where(Database *db, const char *column, const Value *low, const Value *high, struct Row *rows, int max_rows);
+int insert_values(Database *db, int id, const Value *values);
+int bulk_load(Database *db, int count, const int *ids, const Value *values, int fill_percent);
+int import_csv(Database *db, const char *path, int fill_percent);
+int update_values(Database *db, int id, const Value *values);
+int select_values(Database *db, int id, Value *values, char *buf, int size);
+int cursor_seek(Database *db, Cursor *cursor, int id);
+int cursor_next(Cursor *cursor);
+int cursor_prev(Cursor *cursor);
+int cursor_row(Cursor *cursor, struct Row *row);
+void scan_open(Database *db, Scan *scan);
+int scan_next(Scan *scan);
+void scan_column(const Scan *scan, int column, Value *value);
+void scan_close(Scan *scan);
+int select_each(Database *db, int (*visit)(void *arg, int id, const Value *values), void *arg);
+int select_column(Database *db, int id, int column, Value *value, char *buf, int size);
+
+// Snapshot functions
+void snapshot_open(Database *db, Snapshot *snapshot);
+void snapshot_close(Snapshot *snapshot);
+int scan_open_snapshot(Snapshot *snapshot, const char *table, Scan *scan);
+
+// Prepared statement functions
+Statement *prepare_statement(Database *db, const char *sql);
+int bind_value(Statement *stmt, int index, const Value *value);
+int execute_statement(Statement *stmt, int (*visit)(void *arg, int id, const Value *values), void *arg);
+void free_statement(Statement *stmt);
+void get_statement_stats(Database *db, StatementStats *stats);
+
+// Server functions
+int server_listen(const char *address);
+void run_server(Database *db, int listen_fd);
+void stop_server(void);
+
+// Transaction functions
+int begin_txn(Database *db);
+int commit_txn(Database *db);
+int rollback_txn(Database *db);
+
+// Counters
+void get_pool_stats(Database *db, PoolStats *stats);
+void get_wal_stats(Database *db, WalStats *stats);
+
+// Data page functions
+void *get_page(Database *db, int page_no);
+void *append_page(Database *db);
+void release_page(Database *db, void *page, int dirty);
+
+// B-Tree functions
+int btree_search(Database *db, int id, RecordId *rid);
+void btree_insert(Database *db, int id, RecordId rid);
+int btree_height(Database *db);
+void btree_delete(Database *db, int id);
+
+// Binary protocol of run_server. Every message is a 4-byte big-endian length
+// of its body, then the body. A request body is an opcode byte and a 4-byte
+// big-endian id; INSERT and UPDATE add the name, which runs to the end of
+// the message, and RANGE adds the high id:
+//   INSERT id name | SELECT id | UPDATE id name | DELETE id | RANGE low high
+// A response body is a status byte; SELECT adds the id and name, and RANGE
+// a row count and then id, 4-byte name length and name for each row.
+// Clients may pipeline requests: responses come back in request order.
+enum
+{
+    OP_INSERT = 1,
+    OP_SELECT,
+    OP_UPDATE,
+    OP_DELETE,
+    OP_RANGE
+};
+
+enum
+{
+    STATUS_OK,
+    STATUS_FAILED,     // No such row, or the write was rejected (e.g. duplicate id)
+    STATUS_BAD_REQUEST // Unknown opcode or malformed body
+};
+
+#endif
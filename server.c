@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "db.h"
+
+// Network server: one process owns the database file and its buffer pool,
+// and any number of clients reach it over TCP or a Unix socket with the
+// binary protocol described in db.h.
+// Build: gcc -O2 -o server db.c server.c
+// Run:   ./server mydb.db 127.0.0.1:7070   or   ./server mydb.db unix:/tmp/smalldb.sock
+
+static void on_signal(int signal)
+{
+    (void)signal;
+    stop_server();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <database file> <ipv4>:<port> | unix:<path> [pool pages]\n", argv[0]);
+        return 1;
+    }
+    DbOptions options = {argc > 3 ? atoi(argv[3]) : 0};
+    int listen_fd = server_listen(argv[2]);
+    if (listen_fd == -1)
+    {
+        return 1;
+    }
+    Database db = init_db_with_options(argv[1], &options);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    printf("Listening on %s\n", argv[2]);
+    fflush(stdout);
+    run_server(&db, listen_fd);
+    close(listen_fd);
+    close_db(&db);
+    printf("File closed successfully\n");
+    return 0;
+}
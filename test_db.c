@@ -1,38 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <assert.h>
 
-// Include the database functions (in a real project, you'd use a header file)
-#define PAGE_SIZE 4096
-#define MAX_ROWS ((PAGE_SIZE - sizeof(int)) / sizeof(struct Row))
-#define MAX_PAGES 10
-
-struct Row
-{
-    int id;
-    char name[60];
-};
+#include "db.h"
 
-typedef struct
-{
-    FILE *file;
-    void **pages;
-    int num_pages;
-    int max_pages;
-    off_t root_offset;
-    int page_dirty[MAX_PAGES];
-} Database;
-
-// Function prototypes
-Database init_db(const char *filename);
-void write_buffer(Database *db);
-int insert_row(Database *db, int id, const char *name);
-int select_rows(Database *db, struct Row *rows, int max_rows);
-int select_by_id(Database *db, int id, struct Row *row);
-int delete_row(Database *db, int id);
-void close_db(Database *db);
-int update_row(Database *db, int id, const char *name);
+#define MAX_ROWS ((PAGE_SIZE - 20) / (sizeof(struct Row) + 4)) // Batch size: a page of 64-byte rows
+#define MAX_PAGES 10
 
 // Test logging with colors
 #define GREEN "\033[32m"
@@ -57,6 +41,26 @@ void log_test(int test_num, const char *message, int passed)
     }
 }
 
+// Insert rows named "Name<id>" from first_id on until the table spans pages
+// data pages; returns the ID of the first row on the last page, or 0 if an
+// insert fails. Row sizes vary, so tests fill pages instead of counting rows.
+int fill_pages(Database *db, int first_id, int pages)
+{
+    for (int id = first_id;; id++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", id);
+        if (!insert_row(db, id, name))
+        {
+            return 0;
+        }
+        if (current_table(db)->num_pages >= pages)
+        {
+            return id;
+        }
+    }
+}
+
 // Test insert, select, delete
 void test_insert_select_delete()
 {
@@ -73,37 +77,35 @@ void test_insert_select_delete()
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
     log_test(2, "Should have 1 row after insert", inserted == 1 && count == 1 && rows[0].id == 1 && strcmp(rows[0].name, "Alice") == 0);
 
-    // Test 3: Insert rows to fill first page (63 rows)
-    for (int i = 2; i <= MAX_ROWS; i++)
+    // Test 3: Insert rows until the first page is full and a second is started
+    int last_id = fill_pages(&db, 2, 2);
+    if (last_id == 0)
     {
-        char name[60];
-        snprintf(name, 60, "Name%d", i);
-        inserted = insert_row(&db, i, name);
-        if (!inserted)
-        {
-            log_test(3, "Should insert up to 63 rows", 0);
-            close_db(&db);
-            return;
-        }
+        log_test(3, "Should insert rows until a second page is started", 0);
+        close_db(&db);
+        return;
     }
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    log_test(3, "Should have 63 rows after filling first page", count == MAX_ROWS);
+    log_test(3, "Should have every row after filling the first page", count == last_id && current_table(&db)->num_pages == 2 && rows[last_id - 1].id == last_id);
 
-    // Test 4: Insert row to trigger new page
-    inserted = insert_row(&db, 64, "NewPage");
+    // Test 4: The next row goes on the new page, next to the one that started it
+    inserted = insert_row(&db, last_id + 1, "NewPage");
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    log_test(4, "Should have 64 rows after new page", inserted == 1 && count == MAX_ROWS + 1 && rows[MAX_ROWS].id == 64 && strcmp(rows[MAX_ROWS].name, "NewPage") == 0);
+    RecordId started_rid, new_rid;
+    int found = btree_search(&db, last_id, &started_rid) && btree_search(&db, last_id + 1, &new_rid);
+    int new_page = started_rid.page != (unsigned)current_table(&db)->first_data_page && new_rid.page == started_rid.page;
+    log_test(4, "Should put a row on the new page", inserted == 1 && found == 1 && new_page == 1 && count == last_id + 1 && current_table(&db)->num_pages == 2 && rows[last_id].id == last_id + 1 && strcmp(rows[last_id].name, "NewPage") == 0);
 
     // Test 5: Delete a row and select
     int deleted = delete_row(&db, 1);
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    log_test(5, "Should have 63 rows after delete", deleted == 1 && count == MAX_ROWS);
+    log_test(5, "Should have one row fewer after delete", deleted == 1 && count == last_id);
 
     // Test 6: Persistence after restart
     close_db(&db);
     db = init_db("test.db");
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    log_test(6, "Should have 63 rows after restart", count == MAX_ROWS);
+    log_test(6, "Should keep both pages and their rows after restart", count == last_id && current_table(&db)->num_pages == 2);
 
     close_db(&db);
     remove("test.db"); // Ensure clean state for next suite
@@ -208,10 +210,10 @@ void test_invalid_inputs()
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
     log_test(19, "Should not insert duplicate ID 1", inserted == 0 && count == 1 && rows[0].id == 1 && strcmp(rows[0].name, "Alice") == 0);
 
-    // Test 20: Fill all pages to test max capacity (629 rows to reach 630 total)
+    // Test 20: Fill all pages to test max capacity (MAX_ROWS * MAX_PAGES rows total)
     int successful_inserts = 0;
     for (int i = 2; i <= MAX_ROWS * MAX_PAGES; i++)
-    { // 2 to 630 = 629 rows
+    {
         char name[60];
         snprintf(name, 60, "Name%d", i);
         inserted = insert_row(&db, i, name);
@@ -228,10 +230,11 @@ void test_invalid_inputs()
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
     log_test(20, "Should insert up to max rows", count == MAX_ROWS * MAX_PAGES && successful_inserts == MAX_ROWS * MAX_PAGES - 1);
 
-    // Test 21: Insert after max rows reached
-    inserted = insert_row(&db, MAX_ROWS * MAX_PAGES + 1, "TooMany");
-    count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    log_test(21, "Should not insert after max rows reached", inserted == 0 && count == MAX_ROWS * MAX_PAGES);
+    // Test 21: Insert past the old 10-page limit
+    int last_id = fill_pages(&db, MAX_ROWS * MAX_PAGES + 1, MAX_PAGES + 1);
+    struct Row row;
+    int found = select_by_id(&db, last_id, &row);
+    log_test(21, "Should insert beyond 10 data pages", last_id != 0 && found == 1 && row.id == last_id && current_table(&db)->num_pages == MAX_PAGES + 1);
 
     close_db(&db);
     remove("test.db"); // Ensure clean state for future runs
@@ -270,6 +273,31 @@ void test_update()
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
     log_test(26, "Should retain updated row after restart", count == 1 && rows[0].id == 1 && strcmp(rows[0].name, "Bob") == 0);
 
+    // Test 27: Rows that grow out of their page move, and the id index points
+    // at their new place without a delete and re-insert
+    int moved_ok = 1;
+    for (int id = 2; id <= 1001; id++)
+    {
+        moved_ok &= insert_row(&db, id, "Short");
+    }
+    int height = btree_height(&db);
+    char long_name[900];
+    memset(long_name, 'g', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+    RecordId before, after;
+    moved_ok &= btree_search(&db, 500, &before);
+    for (int id = 2; id <= 1001; id += 3)
+    {
+        moved_ok &= update_row(&db, id, long_name);
+    }
+    moved_ok &= btree_search(&db, 500, &after);
+    for (int id = 2; id <= 1001; id++)
+    {
+        char name[sizeof(long_name)];
+        moved_ok &= select_name(&db, id, name, sizeof(name)) && strcmp(name, (id - 2) % 3 == 0 ? long_name : "Short") == 0;
+    }
+    log_test(27, "Updates that move a row should repoint its index entry", moved_ok && after.page != before.page && btree_height(&db) == height);
+
     close_db(&db);
     remove("test.db"); // Ensure clean state for next suite
 }
@@ -280,59 +308,2152 @@ void test_compaction()
     remove("test.db");
     Database db = init_db("test.db");
 
-    // Test 27: Insert multiple rows and delete middle one
+    // Test 28: Insert multiple rows and delete middle one
     int inserted = insert_row(&db, 1, "Alice");
     inserted &= insert_row(&db, 2, "Bob");
     inserted &= insert_row(&db, 3, "Charlie");
     struct Row rows[MAX_ROWS * MAX_PAGES];
     int count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    log_test(27, "Should insert 3 rows", inserted == 1 && count == 3 && rows[0].id == 1 && rows[1].id == 2 && rows[2].id == 3);
+    log_test(28, "Should insert 3 rows", inserted == 1 && count == 3 && rows[0].id == 1 && rows[1].id == 2 && rows[2].id == 3);
 
     int deleted = delete_row(&db, 2);
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    log_test(28, "Should compact rows after deleting ID 2", deleted == 1 && count == 2 && rows[0].id == 1 && rows[1].id == 3 && strcmp(rows[0].name, "Alice") == 0 && strcmp(rows[1].name, "Charlie") == 0);
+    log_test(29, "Should compact rows after deleting ID 2", deleted == 1 && count == 2 && rows[0].id == 1 && rows[1].id == 3 && strcmp(rows[0].name, "Alice") == 0 && strcmp(rows[1].name, "Charlie") == 0);
 
-    // Test 29: Fill a page, delete all, verify page removal
-    for (int i = 4; i <= MAX_ROWS + 3; i++)
+    // Test 30: Fill a page, delete all, verify page removal
+    int last_id = fill_pages(&db, 4, 2);
+    if (last_id == 0)
     {
-        char name[60];
-        snprintf(name, 60, "Name%d", i);
-        inserted = insert_row(&db, i, name);
-        if (!inserted)
-        {
-            log_test(29, "Should insert up to 63 rows total", 0);
-            close_db(&db);
-            return;
-        }
+        log_test(30, "Should insert rows until a second page is started", 0);
+        close_db(&db);
+        return;
     }
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    printf("Debug: After inserting IDs 4 to 66, total rows = %d, num_pages = %d\n", count, db.num_pages);
-    int page_0_rows = *(int *)db.pages[0];
-    log_test(29, "Should have 65 rows total, 63 in page 0", count == 65 && page_0_rows == MAX_ROWS);
+    printf("Debug: After inserting IDs 4 to %d, total rows = %d, num_pages = %d\n", last_id, count, current_table(&db)->num_pages);
+    void *page_0 = get_page(&db, current_table(&db)->first_data_page);
+    int page_0_rows = *(int *)page_0;
+    release_page(&db, page_0, 0);
+    log_test(30, "Should fill page 0 and start page 1 with one row", count == last_id - 1 && page_0_rows == count - 1);
 
-    for (int i = 4; i <= MAX_ROWS + 3; i++)
+    for (int i = 4; i <= last_id; i++)
     {
         deleted = delete_row(&db, i);
         if (!deleted)
         {
-            log_test(29, "Should delete all rows", 0);
+            log_test(30, "Should delete all rows", 0);
             close_db(&db);
             return;
         }
     }
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    printf("Debug: After deleting IDs 4 to 66, total rows = %d, num_pages = %d\n", count, db.num_pages);
-    log_test(29, "Should remove empty page and retain 2 rows", count == 2 && db.num_pages == 1);
+    printf("Debug: After deleting IDs 4 to %d, total rows = %d, num_pages = %d\n", last_id, count, current_table(&db)->num_pages);
+    log_test(30, "Should remove empty page and retain 2 rows", count == 2 && current_table(&db)->num_pages == 1);
 
-    // Test 30: Insert after compaction
+    // Test 31: Insert after compaction (the row takes the slot id 2 left behind)
     inserted = insert_row(&db, 4, "David");
     count = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
-    log_test(30, "Should insert new row after compaction", inserted == 1 && count == 3 && rows[2].id == 4 && strcmp(rows[2].name, "David") == 0);
+    log_test(31, "Should insert new row after compaction", inserted == 1 && count == 3 && rows[1].id == 4 && strcmp(rows[1].name, "David") == 0);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test the B-Tree buffer pool
+void test_buffer_pool()
+{
+    remove("test.db");
+    DbOptions options = {2};
+    Database db = init_db_with_options("test.db", &options);
+
+    // Test 32: Repeated lookups are served from the pool (index leaf + data page each)
+    int inserted = insert_row(&db, 1, "Alice");
+    inserted &= insert_row(&db, 2, "Bob");
+    struct Row row;
+    int found = select_by_id(&db, 2, &row); // Warm up: the last insert left a free-space map page cached
+    PoolStats before, after;
+    get_pool_stats(&db, &before);
+    for (int i = 0; i < 100; i++)
+    {
+        found &= select_by_id(&db, 2, &row);
+    }
+    get_pool_stats(&db, &after);
+    log_test(32, "Repeated lookups should hit the buffer pool", inserted == 1 && found == 1 && after.hits - before.hits == 200 && after.misses == before.misses);
+
+    // Test 33: A tiny pool still returns correct rows
+    for (int i = 3; i <= MAX_ROWS * 3; i++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        inserted &= insert_row(&db, i, name);
+    }
+    found = select_by_id(&db, MAX_ROWS * 2, &row);
+    log_test(33, "Lookups should succeed with a 2-frame pool", inserted == 1 && found == 1 && row.id == MAX_ROWS * 2);
+
+    // Test 34: Dirty frames are written back on close
+    close_db(&db);
+    db = init_db_with_options("test.db", &options);
+    found = select_by_id(&db, 1, &row);
+    log_test(34, "Nodes written through the pool should persist", found == 1 && strcmp(row.name, "Alice") == 0);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test on-demand data pages
+void test_paged_storage()
+{
+    remove("test.db");
+    DbOptions options = {2};
+    Database db = init_db_with_options("test.db", &options);
+
+    // Test 35: Data pages spill out of a pool smaller than the table
+    int total = fill_pages(&db, 1, 3);
+    struct Row *rows = malloc(total * sizeof(struct Row));
+    int count = select_rows(&db, rows, total);
+    log_test(35, "Should scan 3 pages through a 2-frame pool", total != 0 && count == total && current_table(&db)->num_pages == 3 && rows[total - 1].id == total);
+
+    // Test 36: Reopening does not read any data page
+    close_db(&db);
+    db = init_db_with_options("test.db", &options);
+    PoolStats stats;
+    get_pool_stats(&db, &stats);
+    log_test(36, "Should open without loading data pages", current_table(&db)->num_pages == 3 && stats.misses == 1); // Only the catalog's page
+
+    // Test 37: Pages are loaded on demand after reopening
+    struct Row row;
+    int found = select_by_id(&db, total - 5, &row);
+    count = select_rows(&db, rows, total);
+    log_test(37, "Should read pages on demand after restart", found == 1 && row.id == total - 5 && count == total);
+
+    free(rows);
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test the persistent page allocator
+void test_page_allocator()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 38: Nodes allocated after a restart do not overwrite live nodes
+    int inserted = 1;
+    for (int i = 1; i <= 200; i++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        inserted &= insert_row(&db, i, name);
+    }
+    close_db(&db);
+    db = init_db("test.db");
+    for (int i = 201; i <= 300; i++) // Splits the root, allocating two nodes
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        inserted &= insert_row(&db, i, name);
+    }
+    close_db(&db);
+    db = init_db("test.db");
+    int found_all = 1;
+    struct Row row;
+    for (int i = 1; i <= 300; i++)
+    {
+        found_all &= select_by_id(&db, i, &row) && row.id == i;
+    }
+    log_test(38, "Should keep every row after allocating across restarts", inserted == 1 && found_all == 1);
+
+    // Test 39: Emptied data pages go to the freelist and are reused
+    close_db(&db);
+    remove("test.db");
+    db = init_db("test.db");
+    int second_page_first_id = fill_pages(&db, 1, 2);
+    int third_page_first_id = fill_pages(&db, second_page_first_id + 1, 3);
+    int pages_before = db.page_count;
+    int deleted = 1;
+    for (int i = third_page_first_id - 1; i >= second_page_first_id; i--) // Last slot first
+    {
+        deleted &= delete_row(&db, i);
+    }
+    int freed = db.free_pages; // The data page, plus any index leaves merged away
+    int refilled = fill_pages(&db, third_page_first_id + 1, 3); // Fills page 3, then needs one more
+    log_test(39, "Should reuse a freed page instead of growing the file", second_page_first_id != 0 && third_page_first_id != 0 && refilled != 0 && deleted == 1 && freed >= 1 && db.free_pages == 0 && db.page_count == pages_before);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test B-Tree growth past two levels
+void test_btree_split()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 40: Insert enough keys, in scrambled order, to need three levels
+    int num_keys = 100000;
+    int inserted = 1;
+    for (int i = 0; i < num_keys; i++)
+    {
+        int id = (int)(((long long)i * 7919) % num_keys) + 1; // 7919 is prime, so this visits every id once
+        char name[60];
+        snprintf(name, 60, "Name%d", id);
+        inserted &= insert_row(&db, id, name);
+    }
+    int height = btree_height(&db);
+    log_test(40, "Should insert 100000 keys into a 3-level tree", inserted == 1 && height == 3);
+
+    // Test 41: Every key is still reachable after reopening
+    close_db(&db);
+    db = init_db("test.db");
+    int found_all = 1;
+    struct Row row;
+    for (int id = 1; id <= num_keys; id++)
+    {
+        found_all &= select_by_id(&db, id, &row) && row.id == id;
+    }
+    log_test(41, "Should find every key after restart", found_all == 1);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Record ID stored for id by the tests that drive the index directly
+static RecordId test_rid(int id)
+{
+    RecordId rid = {(unsigned int)id * 10, (unsigned short)(id % 64)};
+    return rid;
+}
+
+// Check that a lookup found the record ID test_rid stored for id
+static int has_test_rid(int found, RecordId rid, int id)
+{
+    return found && rid.page == test_rid(id).page && rid.slot == test_rid(id).slot;
+}
+
+// Test B-Tree rebalancing on delete (drives the index directly)
+void test_btree_delete()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 42: Deleting most keys in scrambled order shrinks the tree and keeps the rest reachable
+    int num_keys = 100000;
+    for (int id = 1; id <= num_keys; id++)
+    {
+        btree_insert(&db, id, test_rid(id));
+    }
+    int height_before = btree_height(&db);
+    for (int i = 0; i < num_keys; i++)
+    {
+        int id = (int)(((long long)i * 7919) % num_keys) + 1;
+        if (id % 100 != 0) // Keep every 100th key
+        {
+            btree_delete(&db, id);
+        }
+    }
+    int correct = 1;
+    RecordId rid;
+    for (int id = 1; id <= num_keys; id++)
+    {
+        int found = btree_search(&db, id, &rid);
+        correct &= (id % 100 == 0) ? has_test_rid(found, rid, id) : !found;
+    }
+    log_test(42, "Should keep remaining keys and collapse from 3 to 2 levels", correct == 1 && height_before == 3 && btree_height(&db) == 2);
+
+    // Test 43: Deleting everything leaves a single leaf and frees the node pages
+    for (int id = 100; id <= num_keys; id += 100)
+    {
+        btree_delete(&db, id);
+    }
+    int found = btree_search(&db, 100, &rid);
+    int pages_before = db.page_count;
+    log_test(43, "Should collapse to an empty root leaf", !found && btree_height(&db) == 1 && db.free_pages > 0);
+
+    // Test 44: Reinserting reuses the freed pages
+    for (int id = 1; id <= num_keys / 2; id++)
+    {
+        btree_insert(&db, id, test_rid(id));
+    }
+    found = btree_search(&db, num_keys / 2, &rid);
+    log_test(44, "Should reinsert without growing the file", db.page_count == pages_before && has_test_rid(found, rid, num_keys / 2));
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test that every in-node search kernel finds the same keys
+void test_search_kernels()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 45: Kernels agree on present and missing keys
+    for (int id = 2; id <= 20000; id += 2) // Even ids only, so odd ids are misses
+    {
+        btree_insert(&db, id, test_rid(id));
+    }
+    SearchKernel kernels[] = {SEARCH_LINEAR, SEARCH_BINARY, SEARCH_SSE2, SEARCH_AVX2};
+    int correct = 1;
+    for (int k = 0; k < 4; k++)
+    {
+        set_search_kernel(kernels[k]);
+        for (int id = -5; id <= 20005; id++)
+        {
+            RecordId rid;
+            int found = btree_search(&db, id, &rid);
+            correct &= (id > 0 && id <= 20000 && id % 2 == 0) ? has_test_rid(found, rid, id) : !found;
+        }
+    }
+    set_search_kernel(SEARCH_AUTO);
+    log_test(45, "All search kernels should return the same results", correct == 1);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Copy a file byte for byte (used to snapshot a database as a crash would leave it)
+static void copy_file(const char *from, const char *to)
+{
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    char buffer[PAGE_SIZE];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        fwrite(buffer, 1, n, out);
+    }
+    fclose(in);
+    fclose(out);
+}
+
+// Test the write-ahead log
+void test_wal()
+{
+    remove("test.db");
+    remove("test.db-wal");
+    DbOptions options = {0, 8, 100000}; // fsync every 8 commits, no automatic checkpoint
+    Database db = init_db_with_options("test.db", &options);
+
+    // Test 46: Group commit shares one fsync between several commits
+    WalStats before, after;
+    get_wal_stats(&db, &before);
+    int inserted = 1;
+    for (int i = 1; i <= 16; i++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        inserted &= insert_row(&db, i, name);
+    }
+    get_wal_stats(&db, &after);
+    log_test(46, "16 commits should need 2 fsyncs with a group of 8", inserted == 1 && after.commits - before.commits == 16 && after.syncs - before.syncs == 2);
+
+    // Test 47: Committed rows survive a crash (snapshot taken while the db is open)
+    for (int i = 17; i <= MAX_ROWS * 2; i++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        inserted &= insert_row(&db, i, name);
+    }
+    remove("crash.db");
+    remove("crash.db-wal");
+    copy_file("test.db", "crash.db");
+    copy_file("test.db-wal", "crash.db-wal");
+    Database crashed = init_db("crash.db");
+    struct Row row;
+    int found = select_by_id(&crashed, MAX_ROWS * 2, &row);
+    struct Row rows[MAX_ROWS * MAX_PAGES];
+    int count = select_rows(&crashed, rows, MAX_ROWS * MAX_PAGES);
+    log_test(47, "Recovery should replay every committed row", inserted == 1 && found == 1 && row.id == MAX_ROWS * 2 && count == MAX_ROWS * 2);
+    close_db(&crashed);
+
+    // Test 48: A torn frame at the end of the WAL is ignored
+    remove("crash.db");
+    copy_file("test.db", "crash.db");
+    copy_file("test.db-wal", "crash.db-wal");
+    FILE *wal = fopen("crash.db-wal", "ab");
+    char garbage[PAGE_SIZE / 2];
+    memset(garbage, 0x5a, sizeof(garbage));
+    fwrite(garbage, 1, sizeof(garbage), wal);
+    fclose(wal);
+    crashed = init_db("crash.db");
+    count = select_rows(&crashed, rows, MAX_ROWS * MAX_PAGES);
+    WalStats stats;
+    get_wal_stats(&crashed, &stats);
+    log_test(48, "Recovery should stop at a torn frame and keep committed rows", count == MAX_ROWS * 2 && stats.frames == 0);
+    close_db(&crashed);
+    remove("crash.db");
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test explicit transactions
+void test_transactions()
+{
+    remove("test.db");
+    DbOptions options = {4}; // Small pool so transactions spill pages to the WAL
+    Database db = init_db_with_options("test.db", &options);
+
+    // Test 49: A transaction commits many rows with one WAL commit and fsync
+    WalStats before, after;
+    get_wal_stats(&db, &before);
+    int ok = begin_txn(&db);
+    for (int i = 1; i <= 500; i++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        ok &= insert_row(&db, i, name);
+    }
+    ok &= commit_txn(&db);
+    get_wal_stats(&db, &after);
+    struct Row rows[1000];
+    int count = select_rows(&db, rows, 1000);
+    log_test(49, "A transaction should commit 500 rows with one fsync", ok == 1 && count == 500 && after.commits - before.commits == 1 && after.syncs - before.syncs == 1);
+
+    // Test 50: Rollback restores the prior page images
+    ok = begin_txn(&db);
+    for (int i = 501; i <= 700; i++)
+    {
+        ok &= insert_row(&db, i, "Temp");
+    }
+    ok &= update_row(&db, 10, "Changed");
+    ok &= rollback_txn(&db);
+    struct Row row;
+    int found = select_by_id(&db, 10, &row);
+    int gone = !select_by_id(&db, 600, &row) && select_rows(&db, rows, 1000) == 500;
+    select_by_id(&db, 10, &row);
+    log_test(50, "Rollback should undo inserts and updates", ok == 1 && found == 1 && gone && strcmp(row.name, "Name10") == 0);
+
+    // Test 51: The database stays consistent after a rollback and reopen
+    ok = insert_row(&db, 1000, "After");
+    ok &= !commit_txn(&db); // No transaction is open
+    close_db(&db);
+    db = init_db_with_options("test.db", &options);
+    count = select_rows(&db, rows, 1000);
+    found = select_by_id(&db, 1000, &row);
+    log_test(51, "Rows written after a rollback should persist", ok == 1 && count == 501 && found == 1);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test that commits write only modified pages
+void test_dirty_writes()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 52: An UPDATE logs only the modified data page and the header page
+    int inserted = 1;
+    for (int i = 1; i <= MAX_ROWS * 5; i++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        inserted &= insert_row(&db, i, name);
+    }
+    WalStats before, after;
+    get_wal_stats(&db, &before);
+    int updated = update_row(&db, MAX_ROWS * 3, "Changed");
+    get_wal_stats(&db, &after);
+    log_test(52, "An update on a 5-page table should write 2 pages", inserted == 1 && updated == 1 && after.pages_written - before.pages_written == 2);
+
+    // Test 53: The record ID locates the row without visiting other data pages
+    PoolStats pool_before, pool_after;
+    get_pool_stats(&db, &pool_before);
+    updated = update_row(&db, 2, "Found"); // Same length as "Name2", so the free-space map is untouched
+    get_pool_stats(&db, &pool_after);
+    long fetches = (pool_after.hits + pool_after.misses) - (pool_before.hits + pool_before.misses);
+    log_test(53, "An update should fetch only the index path and one data page", updated == 1 && fetches == btree_height(&db) + 1);
+
+    // Test 54: A transaction's dirty pages go out with one vectored write
+    get_wal_stats(&db, &before);
+    int ok = begin_txn(&db);
+    for (int i = MAX_ROWS * 5 + 1; i <= MAX_ROWS * 10; i++)
+    {
+        ok &= insert_row(&db, i, "Batch");
+    }
+    ok &= commit_txn(&db);
+    get_wal_stats(&db, &after);
+    log_test(54, "A multi-page commit should need one write for its pages", ok == 1 && after.pages_written - before.pages_written > 5 && after.write_calls - before.write_calls == 2);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test the memory-mapped read path
+void test_mmap_reads()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+    int inserted = 1;
+    for (int i = 1; i <= MAX_ROWS * 5; i++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        inserted &= insert_row(&db, i, name);
+    }
+    close_db(&db);
+
+    // Test 55: Lookups on a checkpointed file are served from the mapping
+    DbOptions options = {0, 0, 16, 1}; // Checkpoint often so new pages reach the mapped file
+    db = init_db_with_options("test.db", &options);
+    PoolStats before, after;
+    get_pool_stats(&db, &before);
+    int correct = 1;
+    struct Row row;
+    for (int i = 1; i <= MAX_ROWS * 5; i++)
+    {
+        correct &= select_by_id(&db, i, &row) && row.id == i;
+    }
+    get_pool_stats(&db, &after);
+    log_test(55, "mmap lookups should not copy pages into the pool", inserted == 1 && correct == 1 && after.misses == before.misses && after.mapped - before.mapped >= MAX_ROWS * 5 * 2);
+
+    // Test 56: The mapping follows the file as it grows
+    for (int i = MAX_ROWS * 5 + 1; i <= MAX_ROWS * 10; i++)
+    {
+        inserted &= insert_row(&db, i, "Grown");
+    }
+    correct = select_by_id(&db, MAX_ROWS * 10, &row) && strcmp(row.name, "Grown") == 0;
+    struct Row rows[MAX_ROWS * 10];
+    int count = select_rows(&db, rows, MAX_ROWS * 10);
+    close_db(&db);
+    db = init_db_with_options("test.db", &options);
+    int reopened = select_rows(&db, rows, MAX_ROWS * 10);
+    log_test(56, "mmap reads should see rows added after the file grew", inserted == 1 && correct == 1 && count == MAX_ROWS * 10 && reopened == MAX_ROWS * 10 && db.map_size >= (size_t)db.page_count * PAGE_SIZE);
 
     close_db(&db);
     remove("test.db"); // Ensure clean state for next suite
 }
 
+// Test slotted data pages
+void test_slotted_pages()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 57: Deleting a row leaves every other row at its record ID
+    int inserted = 1;
+    for (int i = 1; i <= 10; i++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        inserted &= insert_row(&db, i, name);
+    }
+    int deleted = delete_row(&db, 3);
+    int correct = 1;
+    struct Row row;
+    for (int i = 1; i <= 10; i++)
+    {
+        char name[60];
+        snprintf(name, 60, "Name%d", i);
+        int found = select_by_id(&db, i, &row);
+        correct &= (i == 3) ? !found : found && row.id == i && strcmp(row.name, name) == 0;
+    }
+    log_test(57, "Lookups should return the right row after a delete", inserted == 1 && deleted == 1 && correct == 1);
+
+    // Test 58: Inserts reuse the holes left by deletes instead of growing the table
+    for (int i = 11; i <= MAX_ROWS * 2; i++)
+    {
+        inserted &= insert_row(&db, i, "Fill");
+    }
+    int pages_before = current_table(&db)->num_pages;
+    int file_pages_before = db.page_count;
+    for (int i = 20; i < 40; i += 2) // Holes in the middle of the first page
+    {
+        deleted &= delete_row(&db, i);
+    }
+    for (int i = 1000; i < 1010; i++) // Only fits once the first page is compacted
+    {
+        inserted &= insert_row(&db, i, "Hole");
+    }
+    correct = select_by_id(&db, 1005, &row) && strcmp(row.name, "Hole") == 0;
+    log_test(58, "Inserts should fill holes without new pages", inserted == 1 && deleted == 1 && correct == 1 && current_table(&db)->num_pages == pages_before && db.page_count == file_pages_before);
+
+    // Test 59: Rows survive lazy compaction of a fragmented page and a restart
+    close_db(&db);
+    db = init_db("test.db");
+    struct Row rows[MAX_ROWS * 3];
+    int count = select_rows(&db, rows, MAX_ROWS * 3);
+    correct = 1;
+    for (int i = 11; i <= MAX_ROWS * 2; i++)
+    {
+        int found = select_by_id(&db, i, &row);
+        correct &= (i >= 20 && i < 40 && i % 2 == 0) ? !found : found && row.id == i;
+    }
+    log_test(59, "Rows should keep their contents after compaction and restart", correct == 1 && count == MAX_ROWS * 2 - 1);
+
+    // Test 60: An insert takes the slot of a deleted row rather than growing
+    // the slot directory, so churn leaves the directory the same size
+    RecordId old_rid, new_rid;
+    int found = btree_search(&db, 15, &old_rid);
+    deleted = delete_row(&db, 15);
+    inserted = insert_row(&db, 2000, "Churn");
+    found &= btree_search(&db, 2000, &new_rid);
+    int churn_ok = 1;
+    for (int i = 0; i < 100; i++)
+    {
+        churn_ok &= delete_row(&db, 2000 + i) && insert_row(&db, 2001 + i, "Churn");
+    }
+    RecordId last_rid;
+    found &= btree_search(&db, 2100, &last_rid);
+    log_test(60, "Inserts should reuse tombstoned slots", found && deleted && inserted && churn_ok && new_rid.page == old_rid.page && new_rid.slot == old_rid.slot && last_rid.page == old_rid.page && last_rid.slot == old_rid.slot);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test variable-length rows and overflow pages
+void test_overflow_rows()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 61: Long names round-trip in full, inline and through overflow pages
+    char medium[200], large[10000], name[10001];
+    memset(medium, 'm', sizeof(medium) - 1);
+    medium[sizeof(medium) - 1] = '\0';
+    memset(large, 'L', sizeof(large) - 1);
+    large[sizeof(large) - 1] = '\0';
+    int inserted = insert_row(&db, 1, "Short");
+    inserted &= insert_row(&db, 2, medium);
+    inserted &= insert_row(&db, 3, large);
+    close_db(&db);
+    db = init_db("test.db");
+    int correct = select_name(&db, 2, name, sizeof(name)) == (int)strlen(medium) && strcmp(name, medium) == 0;
+    correct &= select_name(&db, 3, name, sizeof(name)) == (int)strlen(large) && strcmp(name, large) == 0;
+    correct &= select_name(&db, 3, name, 8) == (int)strlen(large) && strcmp(name, "LLLLLLL") == 0; // Truncated copy
+    struct Row row;
+    correct &= select_by_id(&db, 3, &row) && strlen(row.name) == sizeof(row.name) - 1; // 59-byte preview
+    correct &= select_name(&db, 99, name, sizeof(name)) == -1;
+    log_test(61, "Long names should survive a restart in full", inserted == 1 && correct == 1);
+
+    // Test 62: Overflow pages are freed when their row shrinks or is deleted
+    int file_pages = db.page_count;
+    int free_before = db.free_pages;
+    int updated = update_row(&db, 3, "Small");
+    int freed_by_update = db.free_pages - free_before;
+    updated &= update_row(&db, 2, large); // Reuses the freed chain
+    int deleted = delete_row(&db, 2);
+    correct = select_name(&db, 3, name, sizeof(name)) == 5 && strcmp(name, "Small") == 0;
+    log_test(62, "Shrinking or deleting a long row should free its overflow pages", updated == 1 && deleted == 1 && correct == 1 && freed_by_update == 3 && db.free_pages == free_before + 3 && db.page_count == file_pages);
+
+    // Test 63: A row that outgrows its full page moves and stays reachable
+    int next_page_id = fill_pages(&db, 10, 2);
+    updated = update_row(&db, 10, medium);
+    correct = select_name(&db, 10, name, sizeof(name)) == (int)strlen(medium) && strcmp(name, medium) == 0;
+    correct &= select_by_id(&db, 11, &row) && strcmp(row.name, "Name11") == 0;
+    log_test(63, "A grown row should move to a page with room", next_page_id != 0 && updated == 1 && correct == 1);
+    close_db(&db);
+
+    // Test 64: Short rows pack far more densely than fixed 64-byte rows
+    remove("test.db");
+    db = init_db("test.db");
+    int first_page_rows = fill_pages(&db, 1, 2) - 1;
+    log_test(64, "A page should hold over four times as many short rows", first_page_rows >= 4 * (int)MAX_ROWS);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test typed multi-column tables
+void test_schemas()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 65: CREATE TABLE checks its definition and that the name is free
+    Column columns[] = {{"qty", COL_INT64}, {"price", COL_DOUBLE}, {"title", COL_TEXT}, {"image", COL_BLOB}, {"note", COL_TEXT}};
+    Column duplicate[] = {{"a", COL_INT64}, {"a", COL_TEXT}};
+    Column reserved[] = {{"id", COL_INT64}};
+    int rejected = !create_table(&db, "items", duplicate, 2) && !create_table(&db, "items", reserved, 1) && !create_table(&db, "items", columns, 0);
+    rejected &= !create_table(&db, "main", columns, 5) && !use_table(&db, "items");
+    int created = create_table(&db, "items", columns, 5);
+    int used = use_table(&db, "items");
+    log_test(65, "CREATE TABLE should reject bad definitions and taken names", rejected == 1 && created == 1 && used == 1);
+
+    // Test 66: Every type and NULL round-trips through a restart
+    Value values[5] = {{0, -42}, {0, 0, 2.5}, {0, 0, 0, "Widget", 6}, {0, 0, 0, "\x00\xff\x01", 3}, {1}};
+    int inserted = insert_values(&db, 7, values);
+    values[0].int64 = 1LL << 40;
+    values[2].data = "Gadget";
+    inserted &= insert_values(&db, 8, values);
+    close_db(&db);
+    db = init_db("test.db");
+    use_table(&db, "items");
+    Value out[5];
+    char buf[64];
+    int found = select_values(&db, 7, out, buf, sizeof(buf));
+    int correct = found && out[0].int64 == -42 && out[1].real == 2.5 && out[2].length == 6 && memcmp(out[2].data, "Widget", 6) == 0;
+    correct &= out[3].length == 3 && memcmp(out[3].data, "\x00\xff\x01", 3) == 0 && out[4].is_null && !out[0].is_null;
+    correct &= select_values(&db, 8, out, buf, sizeof(buf)) && out[0].int64 == 1LL << 40 && memcmp(out[2].data, "Gadget", 6) == 0;
+    log_test(66, "Typed values should survive a restart", inserted == 1 && correct == 1);
+
+    // Test 67: One column decodes on its own; the Row API maps name to the first TEXT column
+    Value qty;
+    found = select_column(&db, 8, 0, &qty, NULL, 0); // An INT64 needs no buffer
+    correct = found && qty.int64 == 1LL << 40;
+    correct &= !select_values(&db, 8, out, buf, 4); // The TEXT and BLOB bytes do not fit
+    struct Row row;
+    inserted = insert_row(&db, 9, "Named");
+    correct &= select_by_id(&db, 7, &row) && strcmp(row.name, "Widget") == 0;
+    correct &= select_values(&db, 9, out, buf, sizeof(buf)) && out[0].is_null && out[4].is_null && memcmp(out[2].data, "Named", 5) == 0;
+    log_test(67, "Single columns and the Row API should read typed rows", inserted == 1 && correct == 1);
+
+    // Test 68: update_row keeps the other columns and update_values replaces them all
+    int updated = update_row(&db, 7, "Renamed");
+    correct = select_values(&db, 7, out, buf, sizeof(buf)) && out[0].int64 == -42 && out[1].real == 2.5 && memcmp(out[2].data, "Renamed", 7) == 0 && out[3].length == 3;
+    Value nulls[5] = {{1}, {1}, {1}, {1}, {1}};
+    updated &= update_values(&db, 8, nulls);
+    correct &= select_values(&db, 8, out, buf, sizeof(buf)) && out[0].is_null && out[2].is_null && out[3].is_null;
+    log_test(68, "Updates should rewrite typed rows", updated == 1 && correct == 1);
+
+    // Test 69: Numbers that are empty or out of range are refused, not stored as 0 or clamped
+    const char *bad_numbers[] = {"INSERT 10 '' 1.5 t NULL NULL", "INSERT 11 99999999999999999999 1.5 t NULL NULL", "INSERT 12 1 '' t NULL NULL", "INSERT 13 1 1e999 t NULL NULL", "INSERT '' 1 1.5 t NULL NULL"};
+    rejected = 1;
+    for (int i = 0; i < (int)(sizeof(bad_numbers) / sizeof(bad_numbers[0])); i++)
+    {
+        rejected &= prepare_statement(&db, bad_numbers[i]) == NULL;
+    }
+    Statement *good = prepare_statement(&db, "INSERT 14 -9223372036854775808 1e300 t NULL NULL");
+    inserted = good != NULL && execute_statement(good, NULL, NULL) == 1;
+    correct = select_values(&db, 14, out, buf, sizeof(buf)) && out[0].int64 == LLONG_MIN && out[1].real == 1e300;
+    for (int id = 10; id <= 13; id++)
+    {
+        correct &= !select_values(&db, id, out, buf, sizeof(buf));
+    }
+    free_statement(good);
+    log_test(69, "Empty and out-of-range numbers should be refused", rejected == 1 && inserted == 1 && correct == 1);
+
+    // Test 70: A rolled-back CREATE TABLE leaves the old schema in place
+    close_db(&db);
+    remove("test.db");
+    db = init_db("test.db");
+    begin_txn(&db);
+    created = create_table(&db, "items", columns, 5);
+    used = use_table(&db, "items");
+    rollback_txn(&db);
+    inserted = insert_row(&db, 1, "Plain");
+    correct = select_values(&db, 1, out, buf, sizeof(buf)) && out[0].length == 5 && memcmp(out[0].data, "Plain", 5) == 0;
+    log_test(70, "Rolling back CREATE TABLE should drop the table", created == 1 && used == 1 && !use_table(&db, "items") && inserted == 1 && correct == 1);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test several tables in one file
+void test_multiple_tables()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 71: Dozens of tables keep their own rows, even under the same ids
+    Column columns[] = {{"label", COL_TEXT}};
+    int ok = 1;
+    for (int t = 0; t < 30; t++)
+    {
+        char table[32], name[60];
+        snprintf(table, sizeof(table), "table%d", t);
+        snprintf(name, sizeof(name), "Row of %s", table);
+        ok &= create_table(&db, table, columns, 1) && use_table(&db, table) && insert_row(&db, 1, name);
+    }
+    int pages = db.page_count;
+    close_db(&db);
+    db = init_db("test.db");
+    struct Row row;
+    for (int t = 0; t < 30; t++)
+    {
+        char table[32], name[60];
+        snprintf(table, sizeof(table), "table%d", t);
+        snprintf(name, sizeof(name), "Row of %s", table);
+        ok &= use_table(&db, table) && select_by_id(&db, 1, &row) && strcmp(row.name, name) == 0;
+    }
+    use_table(&db, "main");
+    ok &= !select_by_id(&db, 1, &row);
+    log_test(71, "30 tables should share one file and keep their rows", ok == 1 && db.num_tables == 32 && db.page_count == pages);
+
+    // Test 72: A transaction over several tables commits with one fsync
+    WalStats before, after;
+    get_wal_stats(&db, &before);
+    ok = begin_txn(&db);
+    for (int t = 0; t < 5; t++)
+    {
+        char table[32];
+        snprintf(table, sizeof(table), "table%d", t);
+        ok &= use_table(&db, table) && insert_row(&db, 2, "Batch");
+    }
+    ok &= commit_txn(&db);
+    get_wal_stats(&db, &after);
+    log_test(72, "A commit touching 5 tables should sync once", ok == 1 && after.commits - before.commits == 1 && after.syncs - before.syncs == 1);
+
+    // Test 73: Free space in one table's pages is never used by another
+    use_table(&db, "main");
+    int last_id = fill_pages(&db, 1, 2);
+    int deleted = 1;
+    for (int i = 2; i < last_id; i += 2)
+    {
+        deleted &= delete_row(&db, i);
+    }
+    use_table(&db, "table0");
+    int inserted = 1;
+    for (int i = 100; i < 200; i++)
+    {
+        inserted &= insert_row(&db, i, "Elsewhere");
+    }
+    struct Row rows[MAX_ROWS * MAX_PAGES];
+    int other_rows = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
+    use_table(&db, "main");
+    int main_rows = select_rows(&db, rows, MAX_ROWS * MAX_PAGES);
+    int mixed = 0;
+    for (int i = 0; i < main_rows; i++)
+    {
+        mixed |= strcmp(rows[i].name, "Elsewhere") == 0;
+    }
+    log_test(73, "Tables should not share data pages", last_id != 0 && deleted == 1 && inserted == 1 && other_rows == 102 && main_rows == last_id - (last_id - 1) / 2 && mixed == 0);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+static int compare_row_ids(const void *a, const void *b)
+{
+    return ((const struct Row *)a)->id - ((const struct Row *)b)->id;
+}
+
+// Whether two result sets hold the same rows, in any order
+static int same_rows(struct Row *a, int count_a, struct Row *b, int count_b)
+{
+    qsort(a, count_a, sizeof(struct Row), compare_row_ids);
+    qsort(b, count_b, sizeof(struct Row), compare_row_ids);
+    for (int i = 0; i < count_a && count_a == count_b; i++)
+    {
+        if (a[i].id != b[i].id || strcmp(a[i].name, b[i].name) != 0)
+        {
+            return 0;
+        }
+    }
+    return count_a == count_b;
+}
+
+// Test secondary indexes on non-key columns
+void test_secondary_indexes()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+    Column columns[] = {{"name", COL_TEXT}, {"age", COL_INT64}, {"score", COL_DOUBLE}};
+    create_table(&db, "people", columns, 3);
+    use_table(&db, "people");
+    int inserted = begin_txn(&db);
+    for (int i = 1; i <= 3000; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "member_%04d", i);
+        Value values[3] = {{0, 0, 0, name, (int)strlen(name)}, {0, i % 50}, {i % 7 == 0, 0, (i - 1000) * 0.5}};
+        inserted &= insert_values(&db, i, values);
+    }
+    inserted &= commit_txn(&db);
+
+    // Test 74: An index returns the same rows as a scan
+    static struct Row scan_equal[3000], scan_range[3000], index_equal[3000], index_range[3000];
+    Value age = {0, 7}, low = {0, 10}, high = {0, 12};
+    int scan_equal_count = select_where(&db, "age", &age, &age, scan_equal, 3000);
+    int scan_range_count = select_where(&db, "age", &low, &high, scan_range, 3000);
+    int created = create_index(&db, "by_age", "people", "age");
+    int index_equal_count = select_where(&db, "age", &age, &age, index_equal, 3000);
+    int index_range_count = select_where(&db, "age", &low, &high, index_range, 3000);
+    int ok = scan_equal_count == 60 && scan_range_count == 180;
+    ok &= same_rows(scan_equal, scan_equal_count, index_equal, index_equal_count) && same_rows(scan_range, scan_range_count, index_range, index_range_count);
+    int rejected = !create_index(&db, "by_age", "people", "name") && !create_index(&db, "other", "people", "missing");
+    rejected &= !create_index(&db, "other", "nowhere", "age") && select_where(&db, "missing", &age, &age, index_equal, 3000) == 0;
+    log_test(74, "Indexed and scanned SELECT WHERE should agree", inserted == 1 && created == 1 && ok == 1 && rejected == 1);
+
+    // Test 75: An indexed lookup reads a few pages instead of the whole table
+    close_db(&db);
+    db = init_db("test.db");
+    use_table(&db, "people");
+    struct Row *rows = index_equal;
+    PoolStats before, after;
+    Value name = {0, 0, 0, "member_0042", 11};
+    get_pool_stats(&db, &before);
+    int scan_count = select_where(&db, "name", &name, &name, rows, 3000);
+    get_pool_stats(&db, &after);
+    long scan_reads = (after.hits + after.misses + after.mapped) - (before.hits + before.misses + before.mapped);
+    created = create_index(&db, "by_name", "people", "name");
+    get_pool_stats(&db, &before);
+    int count = select_where(&db, "name", &name, &name, rows, 3000);
+    get_pool_stats(&db, &after);
+    long indexed_reads = (after.hits + after.misses + after.mapped) - (before.hits + before.misses + before.mapped);
+    log_test(75, "An index lookup should read far fewer pages than a scan", created == 1 && scan_count == 1 && count == 1 && rows[0].id == 42 && indexed_reads * 4 < scan_reads);
+
+    // Test 76: Updates and deletes keep the index current across a restart
+    Value values[3] = {{0, 0, 0, "moved", 5}, {0, 999}, {1}};
+    int changed = update_values(&db, 42, values) && delete_row(&db, 92) && update_row(&db, 142, "renamed");
+    close_db(&db);
+    db = init_db("test.db");
+    use_table(&db, "people");
+    Value one = {0, 42}, moved = {0, 999};
+    count = select_where(&db, "age", &one, &one, rows, 3000);
+    int found_renamed = 0, found_deleted = 0, found_moved = 0;
+    for (int i = 0; i < count; i++)
+    {
+        found_renamed |= rows[i].id == 142 && strcmp(rows[i].name, "renamed") == 0;
+        found_deleted |= rows[i].id == 92;
+        found_moved |= rows[i].id == 42;
+    }
+    int moved_count = select_where(&db, "age", &moved, &moved, scan_equal, 3000);
+    log_test(76, "The index should follow updates and deletes", changed == 1 && count == 58 && found_renamed && !found_deleted && !found_moved && moved_count == 1 && scan_equal[0].id == 42);
+
+    // Test 77: TEXT keys sharing a prefix and DOUBLE ranges with NULLs and negatives
+    created = create_index(&db, "by_score", "people", "score");
+    Value first = {0, 0, 0, "member_0100", 11}, last = {0, 0, 0, "member_0109", 11};
+    count = select_where(&db, "name", &first, &last, rows, 3000);
+    int exact = select_where(&db, "name", &name, &name, scan_equal, 3000) == 0; // Row 42 was renamed
+    Value long_name = {0, 0, 0, "member_with_a_long_shared_prefix_2", 34};
+    exact &= insert_row(&db, 5001, "member_with_a_long_shared_prefix_1") && insert_row(&db, 5002, long_name.data);
+    exact &= select_where(&db, "name", &long_name, &long_name, scan_equal, 3000) == 1 && scan_equal[0].id == 5002;
+    Value low_score = {0, 0, -2.0}, high_score = {0, 0, 1.0};
+    int scores = select_where(&db, "score", &low_score, &high_score, scan_equal, 3000);
+    ok = count == 10 && rows[0].id == 100 && rows[9].id == 109 && exact;
+    for (int i = 1; i < scores; i++)
+    {
+        ok &= scan_equal[i - 1].id < scan_equal[i].id; // Score order is id order here
+    }
+    log_test(77, "Prefix keys and DOUBLE ranges should match exactly", created == 1 && ok == 1 && scores == 6);
+
+    // Test 78: Deleting every row merges the index leaves away, so their
+    // pages return to the freelist and a full-range lookup no longer walks
+    // a chain of empty leaves
+    int deleted = begin_txn(&db);
+    for (int i = 1; i <= 3000; i++)
+    {
+        deleted &= delete_row(&db, i) || i == 92;
+    }
+    deleted &= delete_row(&db, 5001) && delete_row(&db, 5002) && commit_txn(&db);
+    Value youngest = {0, LLONG_MIN}, oldest = {0, LLONG_MAX};
+    get_pool_stats(&db, &before);
+    count = select_where(&db, "age", &youngest, &oldest, rows, 3000);
+    get_pool_stats(&db, &after);
+    indexed_reads = (after.hits + after.misses + after.mapped) - (before.hits + before.misses + before.mapped);
+    int used_pages = db.page_count - 1 - db.free_pages;
+    printf("Debug: After deleting every row, %d pages in use, %ld reads for an empty range\n", used_pages, indexed_reads);
+    log_test(78, "Emptied index leaves should be merged and freed", deleted == 1 && count == 0 && indexed_reads <= 2 && used_pages <= 16);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test ordered access through the B-Tree leaves
+void test_cursors()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 79: A cursor walks every id in order both ways, after splits and merges
+    int inserted = begin_txn(&db);
+    for (int i = 0; i < 5000; i++)
+    {
+        int id = (i * 7919) % 5000 + 1; // Every id once, out of order
+        inserted &= insert_row(&db, id, "Ranged");
+    }
+    for (int id = 1; id <= 5000; id++)
+    {
+        if (id % 3 != 0 && id > 1000 && id <= 4000)
+        {
+            inserted &= delete_row(&db, id); // Merges leaves in the middle
+        }
+    }
+    inserted &= commit_txn(&db);
+    Cursor cursor;
+    int last = 0, steps = 0, ordered = 1;
+    for (int found = cursor_seek(&db, &cursor, 0); found; found = cursor_next(&cursor), steps++)
+    {
+        ordered &= cursor.id > last && (cursor.id % 3 == 0 || cursor.id <= 1000 || cursor.id > 4000);
+        last = cursor.id;
+    }
+    int forward = steps;
+    ordered &= last == 5000 && !cursor_next(&cursor); // Stays past the end
+    last = 5001;
+    steps = 0;
+    for (int found = cursor_prev(&cursor); found; found = cursor_prev(&cursor), steps++)
+    {
+        ordered &= cursor.id < last && (cursor.id % 3 == 0 || cursor.id <= 1000 || cursor.id > 4000);
+        last = cursor.id;
+    }
+    ordered &= steps == forward && !cursor_prev(&cursor) && cursor_next(&cursor) && cursor.id == 1;
+    log_test(79, "A cursor should visit every row in id order both ways", inserted == 1 && forward == 3000 && ordered == 1);
+
+    // Test 80: A page of 100 ids reads O(log n + k) pages, not the table
+    Column columns[] = {{"name", COL_TEXT}};
+    inserted = create_table(&db, "ordered", columns, 1) && use_table(&db, "ordered") && begin_txn(&db);
+    for (int id = 1; id <= 20000; id++)
+    {
+        inserted &= insert_row(&db, id, "Ranged");
+    }
+    inserted &= commit_txn(&db);
+    close_db(&db);
+    db = init_db("test.db");
+    use_table(&db, "ordered");
+    PoolStats before, after;
+    struct Row rows[200];
+    Value low = {0, 14500}, high = {0, 14599};
+    get_pool_stats(&db, &before);
+    int count = select_where(&db, "id", &low, &high, rows, 200);
+    get_pool_stats(&db, &after);
+    int in_order = count == 100;
+    for (int i = 0; i < count; i++)
+    {
+        in_order &= rows[i].id == 14500 + i && strcmp(rows[i].name, "Ranged") == 0;
+    }
+    long reads = after.misses - before.misses;
+    log_test(80, "An id range should read only the pages it covers", inserted == 1 && in_order == 1 && reads <= 6 && current_table(&db)->num_pages > 10 * reads);
+    use_table(&db, "main");
+
+    // Test 81: A cursor keeps its place while rows around it change
+    int found = cursor_seek(&db, &cursor, 2500);
+    int place = found && cursor.id == 2502; // 2500 and 2501 were deleted
+    place &= delete_row(&db, 2502) && insert_row(&db, 2503, "Inserted");
+    struct Row row;
+    place &= !cursor_row(&cursor, &row) && cursor_next(&cursor) && cursor.id == 2503 && cursor_row(&cursor, &row) && strcmp(row.name, "Inserted") == 0;
+    for (int id = 2504; id < 2800; id++)
+    {
+        place &= id % 3 == 0 || insert_row(&db, id, "Split"); // Splits the leaf under the cursor
+    }
+    place &= cursor_next(&cursor) && cursor.id == 2504 && cursor_prev(&cursor) && cursor.id == 2503;
+    place &= update_row(&db, 2503, "Updated") && cursor_row(&cursor, &row) && strcmp(row.name, "Updated") == 0;
+    low.int64 = 6000;
+    high.int64 = 7000;
+    place &= !cursor_seek(&db, &cursor, 6000) && cursor_prev(&cursor) && cursor.id == 5000 && select_where(&db, "id", &low, &high, rows, 200) == 0;
+    log_test(81, "A cursor should stay in place across inserts and deletes", place == 1);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// select_each callback: sums ids and stops after arg[1] rows (0 = never)
+static int sum_ids(void *arg, int id, const Value *values)
+{
+    long *state = arg;
+    state[0] += id;
+    state[2]++;
+    return state[1] == 0 || state[2] < state[1];
+}
+
+// Test streaming scans
+void test_scans()
+{
+    remove("test.db");
+    DbOptions options = {4}; // Fewer frames than the table has pages
+    Database db = init_db_with_options("test.db", &options);
+
+    // Test 82: A scan streams every row, overflow rows included, through a 4-frame pool
+    int last_id = fill_pages(&db, 1, 3 * MAX_PAGES);
+    static char long_name[3 * PAGE_SIZE];
+    memset(long_name, 'x', sizeof(long_name) - 1);
+    int inserted = last_id != 0 && insert_row(&db, last_id + 1, long_name) && delete_row(&db, 2);
+    Scan scan;
+    long count = 0, id_sum = 0, names_ok = 1;
+    scan_open(&db, &scan);
+    while (scan_next(&scan))
+    {
+        Value name;
+        scan_column(&scan, 0, &name);
+        char expected[60];
+        snprintf(expected, sizeof(expected), "Name%d", scan.id);
+        names_ok &= scan.id == last_id + 1 ? name.length == (int)strlen(long_name) : name.length == (int)strlen(expected) && memcmp(name.data, expected, name.length) == 0;
+        id_sum += scan.id;
+        count++;
+    }
+    scan_close(&scan);
+    long expected_sum = (long)(last_id + 1) * (last_id + 2) / 2 - 2;
+    log_test(82, "A scan should stream every row with constant memory", inserted == 1 && count == last_id && id_sum == expected_sum && names_ok == 1 && last_id > (int)MAX_ROWS);
+
+    // Test 83: Stopping early releases the page, and callbacks see the same rows
+    int stopped = 1;
+    for (int i = 0; i < 20; i++)
+    {
+        scan_open(&db, &scan);
+        stopped &= scan_next(&scan) && scan_next(&scan);
+        scan_close(&scan); // Would leave every frame pinned without the close
+    }
+    struct Row row;
+    stopped &= select_by_id(&db, last_id, &row) && select_by_id(&db, 1, &row) && select_by_id(&db, last_id / 2, &row);
+    long all[3] = {0, 0, 0}, first[3] = {0, 10, 0};
+    int visited = select_each(&db, sum_ids, all);
+    int visited_first = select_each(&db, sum_ids, first);
+    log_test(83, "select_each should visit every row or stop when asked", stopped == 1 && visited == last_id && all[0] == expected_sum && visited_first == 10 && first[2] == 10);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Test building tables with bulk_load and import_csv
+void test_bulk_load()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+
+    // Test 84: 50000 shuffled rows load into full pages and a valid tree
+    int count = 50000;
+    int *ids = malloc(count * sizeof(int));
+    Value *values = calloc(count, sizeof(Value));
+    static char names[50000][12];
+    for (int i = 0; i < count; i++)
+    {
+        ids[i] = (int)((i * 7919L) % count) + 1;
+        snprintf(names[i], sizeof(names[i]), "Bulk%d", ids[i]);
+        values[i].data = names[i];
+        values[i].length = (int)strlen(names[i]);
+    }
+    int loaded = bulk_load(&db, count, ids, values, 100);
+    int full_pages = current_table(&db)->num_pages;
+    close_db(&db);
+    db = init_db("test.db");
+    Cursor cursor;
+    int walked = 0, ordered = 1;
+    for (int found = cursor_seek(&db, &cursor, 0); found; found = cursor_next(&cursor))
+    {
+        ordered &= cursor.id == ++walked;
+    }
+    struct Row row;
+    int found = select_by_id(&db, 31337, &row) && strcmp(row.name, "Bulk31337") == 0;
+    int changed = 1;
+    for (int id = 1; id <= 2000; id++)
+    {
+        changed &= delete_row(&db, id * 20); // Merges and borrows across bulk-built nodes
+    }
+    changed &= insert_row(&db, 60000, "After") && insert_row(&db, 20, "Again");
+    walked = 0;
+    for (int ok = cursor_seek(&db, &cursor, 0); ok; ok = cursor_next(&cursor))
+    {
+        walked++;
+    }
+    log_test(84, "bulk_load should build packed pages and a valid B-Tree", loaded == 1 && ordered == 1 && found == 1 && changed == 1 && walked == count - 2000 + 2 && full_pages <= count / 200); // Over 200 short rows per page
+
+    // Test 85: Bad input is rejected; a CSV loads typed values at the requested fill
+    int rejected = !bulk_load(&db, count, ids, values, 100); // The table has rows
+    Column columns[] = {{"name", COL_TEXT}, {"qty", COL_INT64}, {"price", COL_DOUBLE}};
+    create_table(&db, "loose", columns, 1);
+    create_table(&db, "typed", columns, 3);
+    use_table(&db, "loose");
+    ids[1] = ids[0];
+    rejected &= !bulk_load(&db, count, ids, values, 100) && !bulk_load(&db, 10, ids + 2, values, 40);
+    ids[1] = (int)((1 * 7919L) % count) + 1;
+    int half = bulk_load(&db, count, ids, values, 50);
+    half &= current_table(&db)->num_pages > full_pages * 19 / 10;
+    FILE *csv = fopen("test.csv", "w");
+    fprintf(csv, "3,Gamma,30,3.5\n1,Alpha,NULL,1.25\n\n2,Beta,20,NULL\n");
+    fclose(csv);
+    use_table(&db, "typed");
+    int imported = import_csv(&db, "test.csv", 90);
+    Value out[3];
+    char buf[64];
+    imported &= select_values(&db, 1, out, buf, sizeof(buf)) && out[1].is_null && out[2].real == 1.25 && memcmp(out[0].data, "Alpha", 5) == 0;
+    imported &= select_values(&db, 3, out, buf, sizeof(buf)) && out[1].int64 == 30 && out[2].real == 3.5;
+    csv = fopen("test.csv", "w");
+    fprintf(csv, "1,Alpha,1,1\n2,Beta,two,2\n");
+    fclose(csv);
+    create_table(&db, "empty", columns, 3);
+    use_table(&db, "empty");
+    rejected &= !import_csv(&db, "test.csv", 90) && !select_by_id(&db, 1, &row) && !import_csv(&db, "missing.csv", 90);
+    log_test(85, "Bulk loads should reject bad input and honour the fill factor", rejected == 1 && half == 1 && imported == 1);
+
+    // Test 86: The last nodes of a level are never left below the minimum.
+    // 306 rows at 90% once made two 153-entry leaves, and 93530 rows two
+    // internal nodes of 154 and 153 children; a delete then merged at once.
+    int edges[] = {306, 93530};
+    int *edge_ids = malloc(edges[1] * sizeof(int));
+    Value *edge_values = calloc(edges[1], sizeof(Value));
+    int filled = 1;
+    for (int i = 0; i < 2; i++)
+    {
+        char name[20];
+        snprintf(name, sizeof(name), "edge%d", i);
+        create_table(&db, name, columns, 1);
+        use_table(&db, name);
+        for (int id = 1; id <= edges[i]; id++)
+        {
+            edge_ids[id - 1] = id;
+        }
+        filled &= bulk_load(&db, edges[i], edge_ids, edge_values, 90) && btree_height(&db) == i + 1;
+        int free_pages = db.free_pages;
+        filled &= delete_row(&db, 1) && delete_row(&db, edges[i]) && db.free_pages == free_pages; // No merge
+        walked = 0;
+        for (int ok = cursor_seek(&db, &cursor, 0); ok; ok = cursor_next(&cursor))
+        {
+            walked++;
+        }
+        filled &= walked == edges[i] - 2 && btree_height(&db) == i + 1;
+    }
+    free(edge_ids);
+    free(edge_values);
+    log_test(86, "Bulk-built nodes should all hold at least the minimum", filled == 1);
+
+    // Test 87: Secondary indexes are built with the table, NULLs left out,
+    // and stay searchable through deletes that merge their nodes
+    create_table(&db, "indexed", columns, 3);
+    create_index(&db, "by_qty", "indexed", "qty");
+    create_index(&db, "by_label", "indexed", "name");
+    use_table(&db, "indexed");
+    int indexed_rows = 40000;
+    Value *rows = calloc((size_t)indexed_rows * 3, sizeof(Value));
+    static char labels[40000][12];
+    for (int i = 0; i < indexed_rows; i++)
+    {
+        int id = (int)((i * 7919L) % indexed_rows) + 1;
+        ids[i] = id;
+        snprintf(labels[i], sizeof(labels[i]), "L%d", id);
+        rows[i * 3] = (Value){0, 0, 0, labels[i], (int)strlen(labels[i])};
+        rows[i * 3 + 1] = (Value){id % 10 == 0, id % 100};
+        rows[i * 3 + 2].is_null = 1;
+    }
+    static struct Row matches[40000];
+    Value qty = {0, 37}, label = {0, 0, 0, "L31337", 6};
+    int indexed = bulk_load(&db, indexed_rows, ids, rows, 70);
+    indexed &= select_where(&db, "qty", &qty, &qty, matches, 40000) == 400 && select_where(&db, "qty", &(Value){0, 40}, &(Value){0, 40}, matches, 40000) == 0;
+    indexed &= select_where(&db, "name", &label, &label, matches, 40000) == 1 && matches[0].id == 31337;
+    for (int id = 1; id <= indexed_rows; id++)
+    {
+        indexed &= id % 4 == 0 || delete_row(&db, id);
+    }
+    int kept = select_where(&db, "qty", &(Value){0, 36}, &(Value){0, 36}, matches, 40000);
+    for (int i = 0; i < kept; i++)
+    {
+        indexed &= matches[i].id % 100 == 36 && (i == 0 || matches[i - 1].id < matches[i].id);
+    }
+    indexed &= kept == 400 && select_where(&db, "qty", &qty, &qty, matches, 40000) == 0;
+    indexed &= select_where(&db, "name", &label, &label, matches, 40000) == 0;
+    free(rows);
+    log_test(87, "bulk_load should build secondary indexes that stay usable", indexed == 1);
+    use_table(&db, "empty");
+
+    // Test 88: Empty numeric fields are errors, and a CSV can come through a pipe
+    const char *empty_fields[] = {"1,Alpha,,1\n", "1,Alpha,1,\n"};
+    rejected = 1;
+    for (int i = 0; i < 2; i++)
+    {
+        csv = fopen("test.csv", "w");
+        fputs(empty_fields[i], csv);
+        fclose(csv);
+        rejected &= !import_csv(&db, "test.csv", 90) && !select_by_id(&db, 1, &row);
+    }
+    remove("test.csv");
+    int piped = mkfifo("test.csv", 0600) == 0;
+    pid_t writer = piped ? fork() : -1;
+    if (writer == 0)
+    {
+        csv = fopen("test.csv", "w");
+        fputs("2,Beta,20,2.5\n1,Alpha,10,1.5\n", csv);
+        fclose(csv);
+        _exit(0);
+    }
+    piped &= writer > 0 && import_csv(&db, "test.csv", 90) && waitpid(writer, NULL, 0) == writer;
+    piped &= select_values(&db, 2, out, buf, sizeof(buf)) && out[1].int64 == 20 && out[2].real == 2.5;
+    log_test(88, "CSV imports should refuse empty numbers and read from a pipe", rejected == 1 && piped == 1);
+
+    free(ids);
+    free(values);
+    remove("test.csv");
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Work of one thread in the concurrency tests
+typedef struct
+{
+    Database *db;
+    int first_id; // Rows first_id..last_id are read (or written)
+    int last_id;
+    unsigned int seed;
+    int found;    // Lookups that returned the expected row, or rows written
+    int errors;
+    int done;
+} Worker;
+
+// Random lookups, each checked against its name, plus short cursor walks
+static void *run_lookups(void *arg)
+{
+    Worker *worker = arg;
+    for (int i = 0; i < 20000; i++)
+    {
+        int id = worker->first_id + rand_r(&worker->seed) % (worker->last_id - worker->first_id + 1);
+        struct Row row;
+        char expected[60];
+        snprintf(expected, sizeof(expected), "Name%d", id);
+        if (select_by_id(worker->db, id, &row) && row.id == id && strcmp(row.name, expected) == 0)
+        {
+            worker->found++;
+        }
+        else
+        {
+            worker->errors++;
+        }
+        if (i % 500 == 0)
+        {
+            Cursor cursor;
+            int previous = 0;
+            for (int ok = cursor_seek(worker->db, &cursor, id); ok && previous < id + 50; ok = cursor_next(&cursor))
+            {
+                worker->errors += cursor.id <= previous;
+                previous = cursor.id;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Appends rows in transactions of 500
+static void *run_inserts(void *arg)
+{
+    Worker *worker = arg;
+    for (int id = worker->first_id; id <= worker->last_id; id++)
+    {
+        if ((id - worker->first_id) % 500 == 0)
+        {
+            begin_txn(worker->db);
+        }
+        char name[60];
+        snprintf(name, sizeof(name), "Name%d", id);
+        worker->found += insert_row(worker->db, id, name);
+        if ((id - worker->first_id) % 500 == 499 || id == worker->last_id)
+        {
+            commit_txn(worker->db);
+        }
+    }
+    return NULL;
+}
+
+static void *run_one_lookup(void *arg)
+{
+    Worker *worker = arg;
+    struct Row row;
+    worker->found = select_by_id(worker->db, worker->first_id, &row);
+    __atomic_store_n(&worker->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Switches to the side table and writes a row there
+static void *run_side_insert(void *arg)
+{
+    Worker *worker = arg;
+    worker->found = use_table(worker->db, "side") && insert_row(worker->db, worker->first_id, "Side");
+    worker->errors = strcmp(current_table(worker->db)->schema.name, "side") != 0;
+    return NULL;
+}
+
+void test_concurrency()
+{
+    remove("test.db");
+    DbOptions options = {64}; // Smaller than the table, so readers also evict
+    Database db = init_db_with_options("test.db", &options);
+    int rows = 20000;
+    begin_txn(&db);
+    for (int id = 1; id <= rows; id++)
+    {
+        char name[60];
+        snprintf(name, sizeof(name), "Name%d", id);
+        insert_row(&db, id, name);
+    }
+    commit_txn(&db);
+
+    // Test 89: Lookup threads share one handle with a writer
+    enum { READERS = 4 };
+    pthread_t threads[READERS + 1];
+    Worker workers[READERS + 1];
+    for (int i = 0; i < READERS; i++)
+    {
+        workers[i] = (Worker){&db, 1, rows, 17 + i, 0, 0, 0};
+        pthread_create(&threads[i], NULL, run_lookups, &workers[i]);
+    }
+    workers[READERS] = (Worker){&db, rows + 1, rows + 5000, 0, 0, 0, 0};
+    pthread_create(&threads[READERS], NULL, run_inserts, &workers[READERS]);
+    int found = 0, errors = 0;
+    for (int i = 0; i <= READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        found += workers[i].found;
+        errors += workers[i].errors;
+    }
+    struct Row row;
+    int written = select_by_id(&db, rows + 5000, &row) && select_by_id(&db, rows + 1, &row);
+    log_test(89, "Concurrent lookups should see every row while a writer inserts", errors == 0 && found == READERS * 20000 + 5000 && written == 1);
+
+    // Test 90: A reader waits for an open transaction and then sees its row
+    begin_txn(&db);
+    insert_row(&db, rows + 5001, "Late");
+    Worker reader = {&db, rows + 5001, rows + 5001, 0, 0, 0, 0};
+    pthread_create(&threads[0], NULL, run_one_lookup, &reader);
+    usleep(100000);
+    int waited = !__atomic_load_n(&reader.done, __ATOMIC_ACQUIRE);
+    commit_txn(&db);
+    pthread_join(threads[0], NULL);
+    log_test(90, "Readers should wait for a transaction to commit", waited == 1 && reader.found == 1);
+
+    // Test 91: A thread reading through its own scan cannot write, and
+    // cannot use a second database until it lets go of the first
+    remove("other.db");
+    Database other = init_db("other.db");
+    Scan scan;
+    scan_open(&db, &scan);
+    int refused = !insert_row(&db, rows + 6000, "Inside") && !delete_row(&db, 1) && !begin_txn(&db);
+    refused &= !insert_row(&other, 1, "Other") && !select_by_id(&other, 1, &row);
+    refused &= select_by_id(&db, 1, &row) && scan_next(&scan); // Reads still work
+    scan_close(&scan);
+    int allowed = !select_by_id(&db, rows + 6000, &row) && select_by_id(&db, 1, &row) && insert_row(&other, 1, "Other") && insert_row(&db, rows + 6000, "After");
+    close_db(&other);
+    remove("other.db");
+    log_test(91, "Writes inside a scan and calls on a second database should be refused", refused == 1 && allowed == 1);
+
+    // Test 92: use_table only moves the calling thread
+    Column columns[] = {{"name", COL_TEXT}};
+    create_table(&db, "side", columns, 1);
+    Worker side = {&db, 1, 1, 0, 0, 0, 0};
+    pthread_create(&threads[0], NULL, run_side_insert, &side);
+    pthread_join(threads[0], NULL);
+    int unmoved = strcmp(current_table(&db)->schema.name, "main") == 0 && select_by_id(&db, 1, &row) && strcmp(row.name, "Name1") == 0;
+    use_table(&db, "side");
+    int written_there = select_by_id(&db, 1, &row) && strcmp(row.name, "Side") == 0;
+    log_test(92, "Each thread should keep its own current table", side.found == 1 && side.errors == 0 && unmoved == 1 && written_there == 1);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Rewrites every row's name while a snapshot scan is paused
+static void *run_renames(void *arg)
+{
+    Worker *worker = arg;
+    for (int id = worker->first_id; id <= worker->last_id; id++)
+    {
+        char name[60];
+        snprintf(name, sizeof(name), "New%d", id);
+        worker->found += update_row(worker->db, id, name);
+    }
+    return NULL;
+}
+
+void test_snapshots()
+{
+    remove("test.db");
+    DbOptions options = {16, 0, 64}; // Checkpoint every 64 WAL frames
+    Database db = init_db_with_options("test.db", &options);
+    int rows = 300;
+    static char long_name[2 * PAGE_SIZE];
+    memset(long_name, 'y', sizeof(long_name) - 1);
+    begin_txn(&db);
+    for (int id = 1; id <= rows; id++)
+    {
+        char name[60];
+        snprintf(name, sizeof(name), "Name%d", id);
+        insert_row(&db, id, id == 7 ? long_name : name);
+    }
+    commit_txn(&db);
+
+    // Test 93: A snapshot scan holds no lock and sees none of the writes made
+    // while it runs, from this thread or another
+    WalStats before, after;
+    get_wal_stats(&db, &before);
+    Snapshot snapshot;
+    snapshot_open(&db, &snapshot);
+    Scan scan;
+    int opened = scan_open_snapshot(&snapshot, "main", &scan);
+    long count = 0, id_sum = 0, names_ok = 1;
+    for (int step = 0; opened && scan_next(&scan); step++)
+    {
+        if (step == 50)
+        {
+            // Would wait forever for a locked scan
+            pthread_t writer;
+            Worker renames = {&db, 1, rows, 0, 0, 0, 0};
+            pthread_create(&writer, NULL, run_renames, &renames);
+            pthread_join(writer, NULL);
+            names_ok &= renames.found == rows;
+            for (int id = 1; id <= rows; id += 3)
+            {
+                delete_row(&db, id);
+            }
+            for (int id = rows + 1; id <= rows + 100; id++)
+            {
+                insert_row(&db, id, "Extra");
+            }
+        }
+        Value name;
+        scan_column(&scan, 0, &name);
+        char expected[60];
+        snprintf(expected, sizeof(expected), "Name%d", scan.id);
+        names_ok &= scan.id == 7 ? name.length == (int)strlen(long_name) : name.length == (int)strlen(expected) && memcmp(name.data, expected, name.length) == 0;
+        id_sum += scan.id;
+        count++;
+    }
+    scan_close(&scan);
+    get_wal_stats(&db, &after);
+    struct Row row;
+    int current = select_by_id(&db, 2, &row) && strcmp(row.name, "New2") == 0 && !select_by_id(&db, 1, &row);
+    log_test(93, "A snapshot scan should see only the rows committed before it", opened == 1 && count == rows && id_sum == (long)rows * (rows + 1) / 2 && names_ok == 1 && current == 1 && after.checkpoints == before.checkpoints && after.frames > 64);
+
+    // Test 94: Old versions are dropped by the first checkpoint once no snapshot needs them
+    snapshot_close(&snapshot);
+    insert_row(&db, rows + 101, "Last");
+    get_wal_stats(&db, &after);
+    Snapshot fresh;
+    snapshot_open(&db, &fresh);
+    int fresh_count = 0, fresh_ok = scan_open_snapshot(&fresh, "main", &scan);
+    while (fresh_ok && scan_next(&scan))
+    {
+        fresh_count++;
+    }
+    scan_close(&scan);
+    int missing = scan_open_snapshot(&fresh, "nowhere", &scan);
+    snapshot_close(&fresh);
+    log_test(94, "Closing the last snapshot should let the WAL be checkpointed", after.checkpoints > before.checkpoints && after.frames < 64 && fresh_count == rows - 100 + 101 && missing == 0);
+
+    close_db(&db);
+    remove("test.db"); // Ensure clean state for next suite
+}
+
+// Append a request in the server's wire format; a negative high is left out
+static void put_request(char *buffer, int *length, int op, int id, int high, const char *name)
+{
+    unsigned int body = 5 + (high >= 0 ? 4 : 0) + (name != NULL ? strlen(name) : 0);
+    unsigned int fields[] = {htonl(body), htonl((unsigned int)id), htonl((unsigned int)high)};
+    memcpy(buffer + *length, &fields[0], 4);
+    buffer[*length + 4] = (char)op;
+    memcpy(buffer + *length + 5, &fields[1], 4);
+    *length += 9;
+    if (high >= 0)
+    {
+        memcpy(buffer + *length, &fields[2], 4);
+        *length += 4;
+    }
+    if (name != NULL)
+    {
+        memcpy(buffer + *length, name, strlen(name));
+        *length += strlen(name);
+    }
+}
+
+static int read_all(int fd, void *data, size_t length)
+{
+    for (size_t done = 0; done < length;)
+    {
+        ssize_t n = read(fd, (char *)data + done, length - done);
+        if (n <= 0)
+        {
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+// Read one response body into body; returns its length (-1 on error)
+static int read_response(int fd, char *body, int size)
+{
+    unsigned int length;
+    if (!read_all(fd, &length, 4) || (int)ntohl(length) > size || !read_all(fd, body, ntohl(length)))
+    {
+        return -1;
+    }
+    return (int)ntohl(length);
+}
+
+static unsigned int body_u32(const char *body, int at)
+{
+    unsigned int value;
+    memcpy(&value, body + at, 4);
+    return ntohl(value);
+}
+
+static void stop_on_signal(int signal)
+{
+    (void)signal;
+    stop_server();
+}
+
+// Fork a server for test.db on listen_fd; the child exits 0 once it has
+// stopped on SIGTERM and closed the database
+static pid_t start_server(int listen_fd)
+{
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            _exit(1);
+        }
+        signal(SIGTERM, stop_on_signal);
+        Database db = init_db("test.db");
+        run_server(&db, listen_fd);
+        close_db(&db);
+        _exit(0);
+    }
+    close(listen_fd);
+    return child;
+}
+
+static int stop_child(pid_t child)
+{
+    int status;
+    kill(child, SIGTERM);
+    return waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void test_server()
+{
+    remove("test.db");
+    remove("test.sock");
+
+    // Test 95: Pipelined requests over TCP loopback are answered in order
+    int listen_fd = server_listen("127.0.0.1:0");
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    getsockname(listen_fd, (struct sockaddr *)&addr, &addr_length);
+    pid_t server = start_server(listen_fd);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int connected = connect(fd, (struct sockaddr *)&addr, addr_length) == 0;
+    static char requests[16384];
+    int length = 0;
+    for (int id = 1; id <= 100; id++)
+    {
+        char name[60];
+        snprintf(name, sizeof(name), "Net%d", id);
+        put_request(requests, &length, OP_INSERT, id, -1, name);
+    }
+    put_request(requests, &length, OP_INSERT, 5, -1, "Again");
+    put_request(requests, &length, OP_SELECT, 50, -1, NULL);
+    put_request(requests, &length, OP_UPDATE, 50, -1, "Changed");
+    put_request(requests, &length, OP_SELECT, 50, -1, NULL);
+    put_request(requests, &length, OP_DELETE, 10, -1, NULL);
+    put_request(requests, &length, OP_SELECT, 10, -1, NULL);
+    put_request(requests, &length, OP_RANGE, 8, 12, NULL);
+    put_request(requests, &length, 99, 1, -1, NULL);
+    int sent = write(fd, requests, length) == length;
+    char body[4096];
+    int inserted = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        inserted += read_response(fd, body, sizeof(body)) == 1 && body[0] == STATUS_OK;
+    }
+    int duplicate = read_response(fd, body, sizeof(body)) == 1 && body[0] == STATUS_FAILED;
+    int selected = read_response(fd, body, sizeof(body)) == 10 && body[0] == STATUS_OK && body_u32(body, 1) == 50 && memcmp(body + 5, "Net50", 5) == 0;
+    int updated = read_response(fd, body, sizeof(body)) == 1 && body[0] == STATUS_OK;
+    updated &= read_response(fd, body, sizeof(body)) == 12 && memcmp(body + 5, "Changed", 7) == 0;
+    int deleted = read_response(fd, body, sizeof(body)) == 1 && body[0] == STATUS_OK;
+    deleted &= read_response(fd, body, sizeof(body)) == 1 && body[0] == STATUS_FAILED;
+    int range = read_response(fd, body, sizeof(body)) > 5 && body[0] == STATUS_OK && body_u32(body, 1) == 4;
+    int expected_ids[] = {8, 9, 11, 12};
+    for (int i = 0, at = 5; range && i < 4; i++)
+    {
+        char name[60];
+        int name_length = snprintf(name, sizeof(name), "Net%d", expected_ids[i]);
+        range = body_u32(body, at) == (unsigned int)expected_ids[i] && body_u32(body, at + 4) == (unsigned int)name_length && memcmp(body + at + 8, name, name_length) == 0;
+        at += 8 + name_length;
+    }
+    int rejected = read_response(fd, body, sizeof(body)) == 1 && body[0] == STATUS_BAD_REQUEST;
+    close(fd);
+    log_test(95, "The server should answer pipelined requests in order", connected && sent && inserted == 100 && duplicate && selected && updated && deleted && range && rejected);
+
+    // Test 96: Clients of a Unix socket server share one database, which the
+    // server closes cleanly when stopped
+    int stopped = stop_child(server);
+    server = start_server(server_listen("unix:test.sock"));
+    struct sockaddr_un unix_addr = {0};
+    unix_addr.sun_family = AF_UNIX;
+    strcpy(unix_addr.sun_path, "test.sock");
+    int first = socket(AF_UNIX, SOCK_STREAM, 0), second = socket(AF_UNIX, SOCK_STREAM, 0);
+    connected = connect(first, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) == 0 && connect(second, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) == 0;
+    length = 0;
+    put_request(requests, &length, OP_INSERT, 1000, -1, "Shared");
+    int shared = write(first, requests, length) == length && read_response(first, body, sizeof(body)) == 1 && body[0] == STATUS_OK;
+    length = 0;
+    put_request(requests, &length, OP_SELECT, 1000, -1, NULL);
+    put_request(requests, &length, OP_SELECT, 50, -1, NULL);
+    shared &= write(second, requests, length) == length && read_response(second, body, sizeof(body)) == 11 && memcmp(body + 5, "Shared", 6) == 0;
+    shared &= read_response(second, body, sizeof(body)) == 12 && memcmp(body + 5, "Changed", 7) == 0;
+    close(first);
+    close(second);
+    stopped &= stop_child(server);
+    Database db = init_db("test.db");
+    char name[60];
+    int durable = select_name(&db, 1000, name, sizeof(name)) == 6 && strcmp(name, "Shared") == 0;
+    close_db(&db);
+    log_test(96, "Clients should share one database that the server closes cleanly", connected && shared && stopped && durable);
+
+    remove("test.db"); // Ensure clean state for next suite
+    remove("test.sock");
+}
+
+// Rows seen by execute_statement: how many, and the sum of their ids and ages
+typedef struct
+{
+    int rows;
+    long id_sum;
+    long age_sum;
+    int names_ok;
+} RowTally;
+
+static int tally_row(void *arg, int id, const Value *values)
+{
+    RowTally *tally = arg;
+    char expected[32];
+    snprintf(expected, sizeof(expected), "P%d", id);
+    tally->rows++;
+    tally->id_sum += id;
+    tally->age_sum += values[1].int64;
+    tally->names_ok &= values[0].length == (int)strlen(expected) && memcmp(values[0].data, expected, values[0].length) == 0;
+    return 1;
+}
+
+void test_prepared_statements()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+    Column columns[] = {{"name", COL_TEXT}, {"age", COL_INT64}};
+    create_table(&db, "people", columns, 2);
+    use_table(&db, "people");
+    int rows = 500;
+
+    // Test 97: One prepared statement per kind, bound and executed many times
+    Statement *insert = prepare_statement(&db, "INSERT ? ? ?");
+    Statement *select = prepare_statement(&db, "select ?");
+    Statement *range = prepare_statement(&db, "SELECT WHERE age BETWEEN ? AND ?");
+    Statement *update = prepare_statement(&db, "UPDATE ? ? 7");
+    Statement *remove_row = prepare_statement(&db, "DELETE ?");
+    int inserted = 0;
+    for (int id = 1; id <= rows; id++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "P%d", id);
+        Value key = {0, id}, text = {0, 0, 0, name, (int)strlen(name)}, age = {0, id % 50};
+        bind_value(insert, 1, &key);
+        bind_value(insert, 2, &text);
+        bind_value(insert, 3, &age);
+        inserted += execute_statement(insert, NULL, NULL);
+    }
+    RowTally found = {0, 0, 0, 1};
+    for (int id = 1; id <= rows + 10; id++)
+    {
+        Value key = {0, id};
+        bind_value(select, 1, &key);
+        execute_statement(select, tally_row, &found);
+    }
+    RowTally between = {0, 0, 0, 1};
+    Value low = {0, 10}, high = {0, 19};
+    bind_value(range, 1, &low);
+    bind_value(range, 2, &high);
+    int range_count = execute_statement(range, tally_row, &between);
+    int changed = 0;
+    for (int id = 1; id <= 100; id++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "P%d", id);
+        Value key = {0, id}, text = {0, 0, 0, name, (int)strlen(name)};
+        bind_value(update, 1, &key);
+        bind_value(update, 2, &text);
+        changed += execute_statement(update, NULL, NULL);
+        bind_value(remove_row, 1, &key);
+        changed += id > 50 && execute_statement(remove_row, NULL, NULL);
+    }
+    RowTally after = {0, 0, 0, 1};
+    Statement *all = prepare_statement(&db, "SELECT");
+    int all_count = execute_statement(all, tally_row, &after);
+    long expected_ages = 50 * 7;
+    for (int id = 101; id <= rows; id++)
+    {
+        expected_ages += id % 50;
+    }
+    log_test(97, "Prepared statements should run many times with different bound values", inserted == rows && found.rows == rows && found.id_sum == (long)rows * (rows + 1) / 2 && found.names_ok && range_count == 100 && between.rows == 100 && between.age_sum == 10 * (10 + 19) * 10 / 2 && between.names_ok && changed == 150 && all_count == rows - 50 && after.age_sum == expected_ages && after.names_ok);
+    free_statement(insert);
+    free_statement(select);
+    free_statement(range);
+    free_statement(update);
+    free_statement(remove_row);
+    free_statement(all);
+
+    // Test 98: Statement text is parsed once per table, and statements that
+    // cannot run are refused
+    StatementStats before, stats;
+    get_statement_stats(&db, &before);
+    Statement *first = prepare_statement(&db, "SELECT WHERE name = 'P200'");
+    Statement *second = prepare_statement(&db, "SELECT WHERE name = 'P200'");
+    get_statement_stats(&db, &stats);
+    RowTally quoted = {0, 0, 0, 1};
+    int cached = stats.hits == before.hits + 1 && stats.misses == before.misses + 1 && execute_statement(first, tally_row, &quoted) == 1 && execute_statement(second, tally_row, &quoted) == 1 && quoted.id_sum == 400;
+    Statement *escaped = prepare_statement(&db, "INSERT 900 'it''s a name' NULL");
+    char name[60];
+    cached &= escaped != NULL && execute_statement(escaped, NULL, NULL) == 1 && select_name(&db, 900, name, sizeof(name)) && strcmp(name, "it's a name") == 0;
+
+    Statement *unbound = prepare_statement(&db, "SELECT ?");
+    int refused = execute_statement(unbound, NULL, NULL) == -1;
+    Column other_columns[] = {{"amount", COL_DOUBLE}};
+    create_table(&db, "other", other_columns, 1);
+    use_table(&db, "other");
+    refused &= execute_statement(first, NULL, NULL) == -1;
+    Statement *other = prepare_statement(&db, "SELECT WHERE name = 'P200'"); // No such column here
+    refused &= other == NULL;
+    begin_txn(&db);
+    create_table(&db, "gone", columns, 2);
+    use_table(&db, "gone");
+    Statement *stale = prepare_statement(&db, "INSERT 1 a 1");
+    rollback_txn(&db);
+    create_table(&db, "reused", other_columns, 1); // Takes the rolled-back table's id
+    use_table(&db, "reused");
+    refused &= stale != NULL && execute_statement(stale, NULL, NULL) == -1 && prepare_statement(&db, "INSERT 1 a 1") == NULL;
+    const char *malformed[] = {"", "FOO 1", "INSERT", "INSERT 0 1.5", "INSERT 1 'open", "INSERT 1 2 3", "SELECT 1 2", "SELECT WHERE", "SELECT WHERE amount < 1", "SELECT WHERE amount = NULL", "DELETE x", "BEGIN now"};
+    for (int i = 0; i < (int)(sizeof(malformed) / sizeof(malformed[0])); i++)
+    {
+        refused &= prepare_statement(&db, malformed[i]) == NULL;
+    }
+    log_test(98, "Statements should be parsed once and refused when they cannot run", cached && refused);
+    free_statement(first);
+    free_statement(second);
+    free_statement(escaped);
+    free_statement(unbound);
+    free_statement(stale);
+    close_db(&db);
+}
+
+// Query rows seen by a visitor: values of the first two items, and when to stop
+typedef struct
+{
+    int rows;
+    int limit;    // Stop after this many rows (0 = never)
+    long id_sum;
+    long long qty_sum;
+    long name_bytes;
+} QueryTally;
+
+static int tally_query_row(void *arg, int id, const Value *values)
+{
+    QueryTally *tally = arg;
+    tally->rows++;
+    tally->id_sum += id;
+    tally->name_bytes += values[0].length;
+    tally->qty_sum += values[1].is_null ? 0 : values[1].int64;
+    return tally->limit == 0 || tally->rows < tally->limit;
+}
+
+// Groups seen by a visitor of "SELECT dept, COUNT(*), SUM(qty), MAX(qty) ... GROUP BY dept"
+typedef struct
+{
+    int groups;
+    int null_groups;
+    long long counts[8]; // By dept d0..d6, then NULL
+    long long sums[8];
+    long long maxes[8];
+} GroupTally;
+
+static int tally_group(void *arg, int id, const Value *values)
+{
+    GroupTally *tally = arg;
+    int dept = values[0].is_null ? 7 : values[0].data[1] - '0';
+    tally->groups++;
+    tally->null_groups += values[0].is_null;
+    tally->counts[dept] = values[1].int64;
+    tally->sums[dept] = values[2].int64;
+    tally->maxes[dept] = values[3].is_null ? -1 : values[3].int64;
+    return id == 0;
+}
+
+// Copy the single row of an aggregate query without GROUP BY
+static int copy_totals(void *arg, int id, const Value *values)
+{
+    memcpy(arg, values, 6 * sizeof(Value));
+    return id == 0;
+}
+
+// Rows of the query test table: qty is NULL for every tenth id and dept
+// for every thirteenth, and every 1000th name overflows its page
+static void query_row(int id, char *name, int size, Value *values)
+{
+    static char long_name[2 * PAGE_SIZE];
+    static char depts[7][4] = {"d0", "d1", "d2", "d3", "d4", "d5", "d6"};
+    memset(long_name, 'q', sizeof(long_name) - 1);
+    snprintf(name, size, "N%d", id);
+    memset(values, 0, 4 * sizeof(Value));
+    values[0].data = id % 1000 == 0 ? long_name : name;
+    values[0].length = (int)strlen(values[0].data);
+    values[1].is_null = id % 10 == 0;
+    values[1].int64 = id % 97;
+    values[2].real = id * 0.5;
+    values[3].is_null = id % 13 == 0;
+    values[3].data = depts[id % 7];
+    values[3].length = 2;
+}
+
+void test_queries()
+{
+    remove("test.db");
+    Database db = init_db("test.db");
+    Column columns[] = {{"name", COL_TEXT}, {"qty", COL_INT64}, {"price", COL_DOUBLE}, {"dept", COL_TEXT}};
+    create_table(&db, "orders", columns, 4);
+    use_table(&db, "orders");
+    int rows = 5000;
+    begin_txn(&db);
+    for (int id = 1; id <= rows; id++)
+    {
+        char name[32];
+        Value values[4];
+        query_row(id, name, sizeof(name), values);
+        insert_values(&db, id, values);
+    }
+    commit_txn(&db);
+
+    // Test 99: Conditions on any column select the same rows as a check of
+    // every row, across many batches, and projections return only the
+    // selected columns
+    Statement *filter = prepare_statement(&db, "SELECT name, qty WHERE qty BETWEEN ? AND ? AND dept = ? AND price < 2400");
+    Value low = {0, 20}, high = {0, 40}, dept = {0, 0, 0, "d3", 2};
+    bind_value(filter, 1, &low);
+    bind_value(filter, 2, &high);
+    bind_value(filter, 3, &dept);
+    QueryTally found = {0};
+    int count = execute_statement(filter, tally_query_row, &found);
+    QueryTally expected = {0};
+    for (int id = 1; id <= rows; id++)
+    {
+        char name[32];
+        Value values[4];
+        query_row(id, name, sizeof(name), values);
+        if (!values[1].is_null && values[1].int64 >= 20 && values[1].int64 <= 40 && !values[3].is_null && id % 7 == 3 && values[2].real < 2400)
+        {
+            expected.rows++;
+            expected.id_sum += id;
+            expected.qty_sum += values[1].int64;
+            expected.name_bytes += values[0].length;
+        }
+    }
+    QueryTally stopped = {0, 10};
+    Statement *all = prepare_statement(&db, "SELECT name, qty WHERE id >= 1");
+    int stopped_count = execute_statement(all, tally_query_row, &stopped);
+    QueryTally long_names = {0};
+    Statement *by_name = prepare_statement(&db, "SELECT name, id WHERE name > 'q'"); // Only the long names sort after 'q'
+    execute_statement(by_name, tally_query_row, &long_names);
+    log_test(99, "SELECT <list> should filter on any column and project the selected columns", count == expected.rows && found.rows == expected.rows && found.id_sum == expected.id_sum && found.qty_sum == expected.qty_sum && found.name_bytes == expected.name_bytes && expected.rows > 20 && stopped_count == 10 && stopped.rows == 10 && long_names.rows == rows / 1000 && long_names.name_bytes == (long)(rows / 1000) * (2 * PAGE_SIZE - 1));
+    free_statement(filter);
+    free_statement(all);
+    free_statement(by_name);
+
+    // Test 100: Aggregates, with and without GROUP BY, match ones computed
+    // row by row; NULLs are skipped, and form a group of their own
+    Statement *totals = prepare_statement(&db, "SELECT COUNT(*), COUNT(qty), SUM(qty), MIN(price), MAX(qty), AVG(qty) WHERE price > ?");
+    Value price = {0, 0, 1000.0};
+    bind_value(totals, 1, &price);
+    Value result[6];
+    int total_rows = execute_statement(totals, copy_totals, result);
+    Statement *grouped = prepare_statement(&db, "SELECT dept, COUNT(*), SUM(qty), MAX(qty) GROUP BY dept");
+    GroupTally groups = {0};
+    int group_count = execute_statement(grouped, tally_group, &groups);
+    long long all_rows = 0, counted = 0, sum = 0, max = 0;
+    double min_price = 1e18;
+    GroupTally expected_groups = {0};
+    for (int id = 1; id <= rows; id++)
+    {
+        char name[32];
+        Value values[4];
+        query_row(id, name, sizeof(name), values);
+        int g = values[3].is_null ? 7 : id % 7;
+        expected_groups.counts[g]++;
+        expected_groups.sums[g] += values[1].is_null ? 0 : values[1].int64;
+        if (!values[1].is_null && values[1].int64 > expected_groups.maxes[g])
+        {
+            expected_groups.maxes[g] = values[1].int64;
+        }
+        if (values[2].real > 1000.0)
+        {
+            all_rows++;
+            counted += !values[1].is_null;
+            sum += values[1].is_null ? 0 : values[1].int64;
+            max = !values[1].is_null && values[1].int64 > max ? values[1].int64 : max;
+            min_price = values[2].real < min_price ? values[2].real : min_price;
+        }
+    }
+    int totals_ok = result[0].int64 == all_rows && result[1].int64 == counted && result[2].int64 == sum && result[3].real == min_price && result[4].int64 == max && result[5].real == (double)sum / counted;
+    Statement *none = prepare_statement(&db, "SELECT COUNT(*), SUM(qty) WHERE qty > 1000");
+    Value empty[6];
+    int empty_count = execute_statement(none, copy_totals, empty);
+    for (int g = 0; g < 8; g++)
+    {
+        totals_ok &= groups.counts[g] == expected_groups.counts[g] && groups.sums[g] == expected_groups.sums[g] && groups.maxes[g] == expected_groups.maxes[g];
+    }
+    log_test(100, "Aggregates and GROUP BY should match row-by-row results", total_rows == 1 && totals_ok && group_count == 8 && groups.groups == 8 && groups.null_groups == 1 && empty_count == 1 && empty[0].int64 == 0 && empty[1].is_null);
+    free_statement(totals);
+    free_statement(grouped);
+    free_statement(none);
+
+    // Test 101: A SUM that does not fit in 64 bits fails the query instead of
+    // wrapping, while huge values that cancel out still sum exactly
+    Column big_columns[] = {{"g", COL_INT64}, {"v", COL_INT64}};
+    create_table(&db, "big", big_columns, 2);
+    use_table(&db, "big");
+    long long big_values[][2] = {{1, 1LL << 62}, {1, -(1LL << 62)}, {1, 5}, {2, LLONG_MAX}, {2, 1}};
+    for (int i = 0; i < 5; i++)
+    {
+        Value values[2] = {{0, big_values[i][0]}, {0, big_values[i][1]}};
+        insert_values(&db, i + 1, values);
+    }
+    Statement *sum_one = prepare_statement(&db, "SELECT SUM(v) WHERE g = 1");
+    Statement *sum_all = prepare_statement(&db, "SELECT g, SUM(v) GROUP BY g");
+    Value one[6];
+    int one_count = execute_statement(sum_one, copy_totals, one);
+    int all_count = execute_statement(sum_all, NULL, NULL);
+    log_test(101, "SUM should report an overflow as an error", one_count == 1 && one[0].int64 == 5 && all_count == -1);
+    free_statement(sum_one);
+    free_statement(sum_all);
+    close_db(&db);
+}
+
+// Rows of "SELECT dept, COUNT(*), SUM(qty), MIN(price), AVG(qty) ... GROUP BY dept",
+// in the order they arrive
+typedef struct
+{
+    int rows;
+    char depts[8][4];
+    Value values[8][5];
+} GroupRows;
+
+static int keep_group(void *arg, int id, const Value *values)
+{
+    GroupRows *groups = arg;
+    if (groups->rows < 8)
+    {
+        memcpy(groups->values[groups->rows], values, 5 * sizeof(Value));
+        snprintf(groups->depts[groups->rows], 4, "%.*s", values[0].is_null ? 0 : values[0].length, values[0].data);
+        groups->values[groups->rows][0].data = NULL;
+    }
+    groups->rows++;
+    return id == 0;
+}
+
+static int same_groups(const GroupRows *a, const GroupRows *b)
+{
+    int same = a->rows == b->rows && a->rows <= 8;
+    for (int g = 0; same && g < a->rows; g++)
+    {
+        same = strcmp(a->depts[g], b->depts[g]) == 0 && a->values[g][0].is_null == b->values[g][0].is_null;
+        for (int i = 1; same && i < 5; i++)
+        {
+            same = a->values[g][i].is_null == b->values[g][i].is_null && a->values[g][i].int64 == b->values[g][i].int64 && a->values[g][i].real == b->values[g][i].real;
+        }
+    }
+    return same;
+}
+
+// Checks that the groups of "SELECT block, COUNT(*) ... GROUP BY block" arrive
+// in block order, where block is id / 1000
+typedef struct
+{
+    int rows;
+    int errors;
+} BlockTally;
+
+static int tally_block(void *arg, int id, const Value *values)
+{
+    BlockTally *tally = arg;
+    long long expected_count = tally->rows == 0 ? 999 : 1000;
+    tally->errors += values[0].int64 != tally->rows || values[1].int64 != expected_count;
+    tally->rows++;
+    return id == 0;
+}
+
+// Totals and groups of the parallel scan test's queries
+typedef struct
+{
+    Database *db;
+    Value totals[6];
+    GroupRows groups;
+} ParallelResults;
+
+static void *run_query_pair(void *arg)
+{
+    ParallelResults *results = arg;
+    use_table(results->db, "orders"); // The current table is per thread
+    Statement *totals = prepare_statement(results->db, "SELECT COUNT(*), COUNT(qty), SUM(qty), MIN(price), MAX(price), AVG(qty) WHERE qty > ? AND dept != 'd3'");
+    Statement *grouped = prepare_statement(results->db, "SELECT dept, COUNT(*), SUM(qty), MIN(price), AVG(qty) WHERE price < 9000 GROUP BY dept");
+    Value threshold = {0, 20};
+    bind_value(totals, 1, &threshold);
+    memset(&results->groups, 0, sizeof(GroupRows));
+    execute_statement(totals, copy_totals, results->totals);
+    execute_statement(grouped, keep_group, &results->groups);
+    free_statement(totals);
+    free_statement(grouped);
+    return NULL;
+}
+
+void test_parallel_scans()
+{
+    remove("test.db");
+    DbOptions serial = {256, 0, 0, 0, 1};
+    Database db = init_db_with_options("test.db", &serial);
+    Column columns[] = {{"name", COL_TEXT}, {"qty", COL_INT64}, {"price", COL_DOUBLE}, {"dept", COL_TEXT}};
+    create_table(&db, "orders", columns, 4);
+    use_table(&db, "orders");
+    int rows = 20000;
+    begin_txn(&db);
+    for (int id = 1; id <= rows; id++)
+    {
+        char name[32];
+        Value values[4];
+        query_row(id, name, sizeof(name), values);
+        insert_values(&db, id, values);
+    }
+    commit_txn(&db);
+    Column block = {"block", COL_INT64};
+    create_table(&db, "blocks", &block, 1);
+    use_table(&db, "blocks");
+    begin_txn(&db);
+    for (int id = 1; id < 100000; id++)
+    {
+        Value value = {0, id / 1000};
+        insert_values(&db, id, &value);
+    }
+    commit_txn(&db);
+    use_table(&db, "orders");
+    ParallelResults expected = {&db};
+    run_query_pair(&expected);
+    StatementStats serial_stats;
+    get_statement_stats(&db, &serial_stats);
+    close_db(&db);
+
+    // Test 102: Aggregates computed by worker threads, each over its own
+    // morsels of pages, should merge to the serial scan's results
+    DbOptions parallel = {256, 0, 0, 0, 4};
+    db = init_db_with_options("test.db", &parallel);
+    use_table(&db, "orders");
+    ParallelResults results = {&db};
+    run_query_pair(&results);
+    StatementStats stats;
+    get_statement_stats(&db, &stats);
+    int totals_ok = expected.totals[0].int64 > 0 && expected.totals[2].int64 > 0;
+    for (int i = 0; i < 6; i++)
+    {
+        totals_ok &= results.totals[i].is_null == expected.totals[i].is_null && results.totals[i].int64 == expected.totals[i].int64 && results.totals[i].real == expected.totals[i].real;
+    }
+    log_test(102, "Parallel aggregates should match a serial scan", serial_stats.parallel_queries == 0 && stats.parallel_queries == 2 && totals_ok);
+
+    // Test 103: GROUP BY across threads should return the same groups in the
+    // order a serial scan first sees them, also when two queries run at once
+    // and one of them finds the workers busy
+    int groups_ok = expected.groups.rows == 8 && same_groups(&results.groups, &expected.groups);
+    use_table(&db, "blocks");
+    Statement *blocks = prepare_statement(&db, "SELECT block, COUNT(*) GROUP BY block");
+    BlockTally tally = {0, 0};
+    int block_count = execute_statement(blocks, tally_block, &tally);
+    free_statement(blocks);
+    use_table(&db, "orders");
+    ParallelResults concurrent[2] = {{&db}, {&db}};
+    pthread_t threads[2];
+    for (int t = 0; t < 2; t++)
+    {
+        pthread_create(&threads[t], NULL, run_query_pair, &concurrent[t]);
+    }
+    for (int t = 0; t < 2; t++)
+    {
+        pthread_join(threads[t], NULL);
+        groups_ok &= same_groups(&concurrent[t].groups, &expected.groups) && concurrent[t].totals[0].int64 == expected.totals[0].int64 && concurrent[t].totals[2].int64 == expected.totals[2].int64;
+    }
+    log_test(103, "Parallel GROUP BY should keep the serial group order", groups_ok && block_count == 100 && tally.rows == 100 && tally.errors == 0);
+    close_db(&db);
+}
+
 int main()
 {
     total_tests = 0;
@@ -343,6 +2464,30 @@ int main()
     test_invalid_inputs();
     test_update();
     test_compaction();
+    test_buffer_pool();
+    test_paged_storage();
+    test_page_allocator();
+    test_btree_split();
+    test_btree_delete();
+    test_search_kernels();
+    test_wal();
+    test_transactions();
+    test_dirty_writes();
+    test_mmap_reads();
+    test_slotted_pages();
+    test_overflow_rows();
+    test_schemas();
+    test_multiple_tables();
+    test_secondary_indexes();
+    test_cursors();
+    test_scans();
+    test_bulk_load();
+    test_concurrency();
+    test_snapshots();
+    test_server();
+    test_prepared_statements();
+    test_queries();
+    test_parallel_scans();
     printf("%s%d/%d tests passed!%s\n", PURPLE, passed_tests, total_tests, RESET);
     return 0;
 }
\ No newline at end of file